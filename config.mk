@@ -96,6 +96,10 @@ WITH_SHARED_LIBRARIES:=yes
 # Build with epoll support.
 WITH_EPOLL:=yes
 
+# Build the broker with support for checking passwords on a pool of worker
+# threads, see the auth_threads option.
+WITH_AUTH_THREADS:=yes
+
 # Build with bundled uthash.h
 WITH_BUNDLED_DEPS:=yes
 
@@ -305,6 +309,11 @@ ifeq ($(WITH_EPOLL),yes)
 	endif
 endif
 
+ifeq ($(WITH_AUTH_THREADS),yes)
+	BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_AUTH_THREADS
+	BROKER_LDADD:=$(BROKER_LDADD) -lpthread
+endif
+
 ifeq ($(WITH_BUNDLED_DEPS),yes)
 	BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -Ideps
 endif
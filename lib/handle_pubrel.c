@@ -87,7 +87,13 @@ int handle__pubrel(struct mosquitto_db *db, struct mosquitto *mosq)
 		return rc;
 	}
 
+#ifdef WITH_PERSISTENCE
+	/* Releasing the message has queued it for the subscribers, which must
+	 * be in the journal before the publisher is told it is done. */
+	rc = persist__journal_ack(db, mosq, CMD_PUBCOMP, mid, 0);
+#else
 	rc = send__pubcomp(mosq, mid);
+#endif
 	if(rc) return rc;
 #else
 	UNUSED(db);
@@ -332,6 +332,8 @@ bool mosquitto_want_write(struct mosquitto *mosq)
 const char *mosquitto_strerror(int mosq_errno)
 {
 	switch(mosq_errno){
+		case MOSQ_ERR_AUTH_PENDING:
+			return "Authentication in progress.";
 		case MOSQ_ERR_AUTH_CONTINUE:
 			return "Continue with authentication.";
 		case MOSQ_ERR_NO_SUBSCRIBERS:
@@ -112,6 +112,7 @@ enum mosquitto_client_state {
 	mosq_cs_disused = 19, /* client that has been added to the disused list to be freed */
 	mosq_cs_authenticating = 20, /* Client has sent CONNECT but is still undergoing extended authentication */
 	mosq_cs_reauthenticating = 21, /* Client is undergoing reauthentication and shouldn't do anything else until complete */
+	mosq_cs_auth_pending = 22, /* Client has sent CONNECT and its password check has been left pending */
 };
 
 enum mosquitto__protocol {
@@ -193,6 +194,7 @@ struct mosquitto_msg_data{
 	unsigned long msg_bytes12;
 	int msg_count;
 	int msg_count12;
+	struct mosquitto_client_msg *acl_check_last; /* Last queued message still to be ACL checked after a session resume */
 #else
 	struct mosquitto_message_all *inflight;
 	int queue_len;
@@ -273,11 +275,32 @@ struct mosquitto {
 #ifdef WITH_BROKER
 	bool removed_from_by_id; /* True if removed from by_id hash */
 	bool is_dropping;
+	bool is_backlogged; /* Outgoing queue overflowed under publisher_flow_control */
+	bool is_flow_paused; /* Not being read from because of publisher_flow_control */
+	bool is_flow_expired; /* Backlogged for too long, so messages are dropped until the queue drains */
+	time_t flow_backlog_time; /* When is_backlogged was set */
+	struct mosquitto *flow_backlog_prev, *flow_backlog_next; /* In db->flow_backlogged */
+	struct mosquitto__flow_link *flow_waiting; /* Backlogged clients this client is paused for */
+	struct mosquitto__flow_link *flow_paused; /* Clients paused because of this client */
+	int durable_ack_count; /* Acknowledgements waiting for the journal to be synced */
+	/* Where the messages of this session are in the last snapshot, so an
+	 * unchanged session can be copied from there on the next save. Only valid
+	 * while persist_msgs_generation matches that snapshot. */
+	uint64_t persist_msgs_offset;
+	uint32_t persist_msgs_length;
+	uint32_t persist_msgs_count;
+	unsigned int persist_msgs_generation;
+	unsigned int acl_generation;
+	unsigned int acl_list_generation; /* db->acl_generation when acl_list and acl_patterns were found */
 	bool is_bridge;
 	struct mosquitto__bridge *bridge;
 	struct mosquitto_msg_data msgs_in;
 	struct mosquitto_msg_data msgs_out;
 	struct mosquitto__acl_user *acl_list;
+	struct mosquitto__acl_trie *acl_patterns; /* Pattern ACLs expanded for this client */
+	struct mosquitto__acl_cache *acl_cache;
+	struct mosquitto__auth_job *auth_job; /* Check left pending, reads are paused until it completes */
+	struct mosquitto__auth_job *auth_resolved; /* Completed check, while its PUBLISH is handled again */
 	struct mosquitto__listener *listener;
 	struct mosquitto__packet *out_packet_last;
 	struct mosquitto__subhier **subs;
@@ -0,0 +1,679 @@
+/*
+Copyright (c) 2019 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* Checks that are left pending while a client waits.
+ *
+ * Hashing a password is slow on purpose, and done on the main loop it holds
+ * up every other client while a burst of clients connect. With auth_threads
+ * set, mosquitto_unpwd_check_default() hands the digest to a pool of worker
+ * threads. Version 5 auth plugins can likewise leave a password check, or the
+ * ACL check for a PUBLISH, pending and complete it later from any thread with
+ * mosquitto_auth_pending_complete(). The CONNECT or PUBLISH is parked in the
+ * job and reads from the client are paused until the result comes back.
+ *
+ * Other threads only call job->check() or complete a job and write job->rc.
+ * They must not touch the context, log, or use mosquitto__malloc() or
+ * mosquitto__free(), none of which are thread safe in the broker. Finished
+ * jobs are put on a done list and the main loop is woken through a pipe,
+ * which is polled alongside the client sockets.
+ *
+ * Plugins are handed a number rather than the job itself, and completing it
+ * looks the job up under the pool lock. A handle that has already been
+ * completed, or whose job has been freed, is rejected instead of being used
+ * after it is freed. A job that has timed out, or whose client has gone, is
+ * freed if the plugin has still not completed it AUTH_POOL_RECLAIM_DELAY
+ * seconds later. */
+
+#include "config.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifdef WITH_AUTH_THREADS
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <pthread.h>
+#  include <signal.h>
+#  include <unistd.h>
+#endif
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "packet_mosq.h"
+#include "tls_mosq.h"
+
+#ifdef WITH_AUTH_THREADS
+/* The broker is built with dummypthread.h, which turns the pthread calls in
+ * the code shared with the library into nothing. The pool needs real ones. */
+#  undef pthread_create
+#  undef pthread_join
+#  undef pthread_mutex_init
+#  undef pthread_mutex_destroy
+#  undef pthread_mutex_lock
+#  undef pthread_mutex_unlock
+
+#define AUTH_POOL_RECLAIM_DELAY 60
+
+struct mosquitto__auth_pool{
+	pthread_t *threads;
+	int thread_count;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct mosquitto__auth_job *queue_head;
+	struct mosquitto__auth_job *queue_tail;
+	struct mosquitto__auth_job *done_head;
+	struct mosquitto__auth_job *done_tail;
+	struct mosquitto__auth_job *pending; /* Outstanding jobs, main thread only */
+	struct mosquitto__auth_job *by_handle;
+	uintptr_t last_handle;
+	int wake_pipe[2];
+	bool stop;
+};
+
+
+/* Must be called with the pool locked. */
+static void auth_pool__push_done(struct mosquitto__auth_pool *pool, struct mosquitto__auth_job *job)
+{
+	char wake = 0;
+
+	job->next = NULL;
+	job->completed = true;
+	if(pool->done_tail){
+		pool->done_tail->next = job;
+	}else{
+		pool->done_head = job;
+		/* Only needed when the list was empty, the main loop takes the
+		 * whole list at once. A full pipe means a wake up is already
+		 * pending, so the result can be ignored. */
+		if(write(pool->wake_pipe[1], &wake, 1)){
+		}
+	}
+	pool->done_tail = job;
+}
+
+
+static void *auth_pool__worker(void *userdata)
+{
+	struct mosquitto__auth_pool *pool = userdata;
+	struct mosquitto__auth_job *job;
+
+	pthread_mutex_lock(&pool->mutex);
+	while(1){
+		while(!pool->stop && !pool->queue_head){
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		if(pool->stop) break;
+
+		job = pool->queue_head;
+		pool->queue_head = job->next;
+		if(!pool->queue_head) pool->queue_tail = NULL;
+		pthread_mutex_unlock(&pool->mutex);
+
+		job->rc = job->check(job);
+
+		pthread_mutex_lock(&pool->mutex);
+		auth_pool__push_done(pool, job);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+
+static void auth_pool__untrack(struct mosquitto__auth_pool *pool, struct mosquitto__auth_job *job)
+{
+	if(!job->pending) return;
+
+	if(job->pending_prev){
+		job->pending_prev->pending_next = job->pending_next;
+	}else{
+		pool->pending = job->pending_next;
+	}
+	if(job->pending_next){
+		job->pending_next->pending_prev = job->pending_prev;
+	}
+	job->pending_prev = NULL;
+	job->pending_next = NULL;
+	job->pending = false;
+}
+
+
+static void auth_pool__release(struct mosquitto__auth_pool *pool, struct mosquitto__auth_job *job)
+{
+	auth_pool__untrack(pool, job);
+	if(job->context){
+		job->context->auth_job = NULL;
+	}
+	auth_pool__job_free(job);
+}
+
+
+static void auth_pool__list_free(struct mosquitto__auth_pool *pool, struct mosquitto__auth_job *job)
+{
+	struct mosquitto__auth_job *next;
+
+	while(job){
+		next = job->next;
+		auth_pool__release(pool, job);
+		job = next;
+	}
+}
+
+
+int auth_pool__init(struct mosquitto_db *db)
+{
+	struct mosquitto__auth_pool *pool;
+	sigset_t sigblock, origsig;
+	int i;
+
+	/* The pool is always created so plugins can complete checks, the
+	 * worker threads are only started for auth_threads. */
+	pool = mosquitto__calloc(1, sizeof(struct mosquitto__auth_pool));
+	if(!pool) return MOSQ_ERR_NOMEM;
+
+	if(pipe(pool->wake_pipe)){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create auth thread pool: %s.", strerror(errno));
+		mosquitto__free(pool);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	for(i=0; i<2; i++){
+		fcntl(pool->wake_pipe[i], F_SETFL, fcntl(pool->wake_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(pool->wake_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	db->auth_pool = pool;
+
+	if(db->config->auth_threads < 1) return MOSQ_ERR_SUCCESS;
+
+	pool->threads = mosquitto__calloc(db->config->auth_threads, sizeof(pthread_t));
+	if(!pool->threads){
+		auth_pool__cleanup(db);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	/* Signals must only be handled by the main loop, so the workers start
+	 * with them all blocked. */
+	sigfillset(&sigblock);
+	pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+	for(i=0; i<db->config->auth_threads; i++){
+		if(pthread_create(&pool->threads[i], NULL, auth_pool__worker, pool)){
+			break;
+		}
+		pool->thread_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+	if(pool->thread_count < db->config->auth_threads){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start auth thread.");
+		auth_pool__cleanup(db);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	log__printf(NULL, MOSQ_LOG_INFO, "Checking passwords on %d auth threads.", pool->thread_count);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void auth_pool__cleanup(struct mosquitto_db *db)
+{
+	struct mosquitto__auth_pool *pool = db->auth_pool;
+	int i;
+
+	if(!pool) return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for(i=0; i<pool->thread_count; i++){
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	auth_pool__list_free(pool, pool->queue_head);
+	auth_pool__list_free(pool, pool->done_head);
+	/* Anything left is waiting on a plugin that has been unloaded. */
+	while(pool->pending){
+		auth_pool__release(pool, pool->pending);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	close(pool->wake_pipe[0]);
+	close(pool->wake_pipe[1]);
+	mosquitto__free(pool->threads);
+	mosquitto__free(pool);
+	db->auth_pool = NULL;
+}
+
+
+int auth_pool__thread_count(struct mosquitto_db *db)
+{
+	if(db->auth_pool){
+		return db->auth_pool->thread_count;
+	}else{
+		return 0;
+	}
+}
+
+
+struct mosquitto__auth_job *auth_pool__job_new(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto__auth_job *job;
+
+	if(!db->auth_pool) return NULL;
+
+	job = mosquitto__calloc(1, sizeof(struct mosquitto__auth_job));
+	if(!job) return NULL;
+	job->context = context;
+
+	pthread_mutex_lock(&db->auth_pool->mutex);
+	do{
+		db->auth_pool->last_handle++;
+	}while(db->auth_pool->last_handle == 0);
+	job->handle = db->auth_pool->last_handle;
+	HASH_ADD(hh_handle, db->auth_pool->by_handle, handle, sizeof(uintptr_t), job);
+	pthread_mutex_unlock(&db->auth_pool->mutex);
+
+	return job;
+}
+
+
+/* Stop the handle of a job from being completed, and return whether it
+ * already has been. */
+static bool auth_pool__forget(struct mosquitto__auth_job *job)
+{
+	struct mosquitto__auth_pool *pool = mosquitto__get_db()->auth_pool;
+	bool completed;
+
+	if(!pool) return job->completed;
+
+	pthread_mutex_lock(&pool->mutex);
+	if(job->handle){
+		HASH_DELETE(hh_handle, pool->by_handle, job);
+		job->handle = 0;
+	}
+	completed = job->completed;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return completed;
+}
+
+
+void auth_pool__job_abandon(struct mosquitto__auth_job *job)
+{
+	if(!job) return;
+
+	if(auth_pool__forget(job)){
+		/* Already on the done list, auth_pool__handle_results() frees it. */
+		job->context = NULL;
+	}else{
+		auth_pool__job_free(job);
+	}
+}
+
+
+int auth_pool__queue(struct mosquitto_db *db, struct mosquitto__auth_job *job)
+{
+	struct mosquitto__auth_pool *pool = db->auth_pool;
+
+	if(!pool || pool->thread_count < 1) return MOSQ_ERR_NOT_SUPPORTED;
+
+	job->next = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	if(pool->queue_tail){
+		pool->queue_tail->next = job;
+	}else{
+		pool->queue_head = job;
+	}
+	pool->queue_tail = job;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mosquitto_auth_pending_complete(struct mosquitto_auth_pending *handle, int result)
+{
+	struct mosquitto__auth_job *job;
+	struct mosquitto__auth_pool *pool = mosquitto__get_db()->auth_pool;
+	uintptr_t id = (uintptr_t)handle;
+
+	if(!id || !pool) return MOSQ_ERR_INVAL;
+
+	pthread_mutex_lock(&pool->mutex);
+	HASH_FIND(hh_handle, pool->by_handle, &id, sizeof(uintptr_t), job);
+	if(!job || job->completed){
+		pthread_mutex_unlock(&pool->mutex);
+		return MOSQ_ERR_INVAL;
+	}
+	job->rc = result;
+	auth_pool__push_done(pool, job);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void auth_pool__track(struct mosquitto_db *db, struct mosquitto__auth_job *job)
+{
+	struct mosquitto__auth_pool *pool = db->auth_pool;
+
+	if(!pool || job->pending) return;
+
+	if(db->config->auth_check_timeout > 0){
+		job->deadline = time(NULL) + db->config->auth_check_timeout;
+	}else{
+		job->deadline = 0;
+	}
+	job->pending_prev = NULL;
+	job->pending_next = pool->pending;
+	if(pool->pending){
+		pool->pending->pending_prev = job;
+	}
+	pool->pending = job;
+	job->pending = true;
+}
+
+
+void auth_pool__park_packet(struct mosquitto *context)
+{
+	struct mosquitto__auth_job *job = context->auth_job;
+
+	if(!job) return;
+
+	memcpy(&job->packet, &context->in_packet, sizeof(struct mosquitto__packet));
+	job->packet.pos = 0;
+	memset(&context->in_packet, 0, sizeof(struct mosquitto__packet));
+}
+
+
+/* Handle a parked PUBLISH again, with the result of its ACL check. */
+static int auth_pool__resume_publish(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__auth_job *job, int result)
+{
+	int rc;
+
+	if(context->state != mosq_cs_active) return MOSQ_ERR_SUCCESS;
+
+	/* As with a synchronous check, a check that every plugin deferred is a
+	 * denial. */
+	if(result == MOSQ_ERR_PLUGIN_DEFER || result == MOSQ_ERR_AUTH){
+		result = MOSQ_ERR_ACL_DENIED;
+	}
+	job->result = result;
+
+	memcpy(&context->in_packet, &job->packet, sizeof(struct mosquitto__packet));
+	memset(&job->packet, 0, sizeof(struct mosquitto__packet));
+	context->auth_resolved = job;
+	rc = handle__packet(db, context);
+	context->auth_resolved = NULL;
+	packet__cleanup(&context->in_packet);
+
+	return rc;
+}
+
+
+/* Apply the result of a job that context was waiting for, then handle
+ * anything else the client has sent in the meantime. */
+static void auth_pool__resolve(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__auth_job *job, int result)
+{
+	int rc;
+
+	context->auth_job = NULL;
+	job->context = NULL;
+
+	if(job->access == MOSQ_ACL_WRITE){
+		rc = auth_pool__resume_publish(db, context, job, result);
+	}else{
+		rc = connect__auth_result(db, context, job, result);
+	}
+	/* Packets that TLS has already buffered won't make the socket readable
+	 * again. */
+	while(rc == MOSQ_ERR_SUCCESS && context->state == mosq_cs_active
+			&& !context->auth_job && SSL_DATA_PENDING(context)){
+
+		rc = packet__read(db, context);
+	}
+	if(rc){
+		do_disconnect(db, context, rc);
+	}
+}
+
+
+void auth_pool__handle_results(struct mosquitto_db *db)
+{
+	struct mosquitto__auth_pool *pool = db->auth_pool;
+	struct mosquitto__auth_job *job, *next;
+	char buf[64];
+
+	if(!pool) return;
+
+	while(read(pool->wake_pipe[0], buf, sizeof(buf)) > 0){
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	job = pool->done_head;
+	pool->done_head = NULL;
+	pool->done_tail = NULL;
+	pthread_mutex_unlock(&pool->mutex);
+
+	while(job){
+		next = job->next;
+		auth_pool__untrack(pool, job);
+		if(job->context){
+			auth_pool__resolve(db, job->context, job, job->rc);
+		}
+		auth_pool__job_free(job);
+		job = next;
+	}
+}
+
+
+void auth_pool__check_timeouts(struct mosquitto_db *db, time_t now)
+{
+	struct mosquitto__auth_pool *pool = db->auth_pool;
+	struct mosquitto__auth_job *job, *next;
+
+	if(!pool) return;
+
+	for(job=pool->pending; job; job=next){
+		next = job->pending_next;
+		/* Deadlines are in whole seconds, so only expire once the deadline
+		 * has passed to always allow at least the full timeout. */
+		if(!job->deadline || job->deadline >= now) continue;
+
+		if(!job->context){
+			/* Given up on by the client, and not completed since. */
+			if(!job->check && !auth_pool__forget(job)){
+				auth_pool__untrack(pool, job);
+				auth_pool__job_free(job);
+			}
+			continue;
+		}
+
+		if(job->context->id){
+			log__printf(NULL, MOSQ_LOG_NOTICE, "Auth check for client %s timed out.", job->context->id);
+		}else{
+			log__printf(NULL, MOSQ_LOG_NOTICE, "Auth check for client on %s timed out.", job->context->address);
+		}
+		/* The job stays tracked until it is completed, a worker thread or
+		 * plugin may still be using it. A worker always finishes the job, a
+		 * plugin gets a while longer before the job is freed. */
+		if(job->access == MOSQ_ACL_WRITE){
+			auth_pool__resolve(db, job->context, job, MOSQ_ERR_ACL_DENIED);
+		}else{
+			auth_pool__resolve(db, job->context, job, MOSQ_ERR_UNKNOWN);
+		}
+		if(job->check){
+			job->deadline = 0;
+		}else{
+			job->deadline = now + AUTH_POOL_RECLAIM_DELAY;
+		}
+	}
+}
+
+
+int auth_pool__wake_fd(struct mosquitto_db *db)
+{
+	if(db->auth_pool){
+		return db->auth_pool->wake_pipe[0];
+	}else{
+		return -1;
+	}
+}
+
+
+void auth_pool__context_cleanup(struct mosquitto *context)
+{
+	struct mosquitto__auth_job *job = context->auth_job;
+
+	if(job){
+		job->context = NULL;
+		if(job->check){
+			job->deadline = 0;
+		}else{
+			job->deadline = time(NULL) + AUTH_POOL_RECLAIM_DELAY;
+		}
+		context->auth_job = NULL;
+	}
+}
+
+#else
+
+int auth_pool__init(struct mosquitto_db *db)
+{
+	if(db->config->auth_threads > 0){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: auth_threads is not supported by this build, checking passwords on the main thread.");
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void auth_pool__cleanup(struct mosquitto_db *db)
+{
+	UNUSED(db);
+}
+
+
+int auth_pool__thread_count(struct mosquitto_db *db)
+{
+	UNUSED(db);
+
+	return 0;
+}
+
+
+struct mosquitto__auth_job *auth_pool__job_new(struct mosquitto_db *db, struct mosquitto *context)
+{
+	UNUSED(db);
+	UNUSED(context);
+
+	return NULL;
+}
+
+
+int auth_pool__queue(struct mosquitto_db *db, struct mosquitto__auth_job *job)
+{
+	UNUSED(db);
+	UNUSED(job);
+
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+
+int mosquitto_auth_pending_complete(struct mosquitto_auth_pending *handle, int result)
+{
+	UNUSED(handle);
+	UNUSED(result);
+
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+
+void auth_pool__track(struct mosquitto_db *db, struct mosquitto__auth_job *job)
+{
+	UNUSED(db);
+	UNUSED(job);
+}
+
+
+void auth_pool__park_packet(struct mosquitto *context)
+{
+	UNUSED(context);
+}
+
+
+void auth_pool__handle_results(struct mosquitto_db *db)
+{
+	UNUSED(db);
+}
+
+
+void auth_pool__check_timeouts(struct mosquitto_db *db, time_t now)
+{
+	UNUSED(db);
+	UNUSED(now);
+}
+
+
+int auth_pool__wake_fd(struct mosquitto_db *db)
+{
+	UNUSED(db);
+
+	return -1;
+}
+
+
+void auth_pool__context_cleanup(struct mosquitto *context)
+{
+	UNUSED(context);
+}
+
+
+void auth_pool__job_abandon(struct mosquitto__auth_job *job)
+{
+	auth_pool__job_free(job);
+}
+
+#endif
+
+
+void auth_pool__job_free(struct mosquitto__auth_job *job)
+{
+	if(!job) return;
+
+#ifdef WITH_AUTH_THREADS
+	auth_pool__forget(job);
+#endif
+
+	if(job->password){
+		memset(job->password, 0, strlen(job->password));
+		mosquitto__free(job->password);
+	}
+	mosquitto__free(job->salt);
+	mosquitto__free(job->client_id);
+	mosquitto__free(job->auth_data);
+	mosquitto__free(job->topic);
+	packet__cleanup(&job->packet);
+	if(job->will){
+		mosquitto_property_free_all(&job->will->properties);
+		mosquitto__free(job->will->msg.payload);
+		mosquitto__free(job->will->msg.topic);
+		mosquitto__free(job->will);
+	}
+	mosquitto__free(job);
+}
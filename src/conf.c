@@ -165,7 +165,9 @@ static void config__init_reload(struct mosquitto_db *db, struct mosquitto__confi
 		config->listeners[i].security_options.auto_id_prefix_len = 0;
 	}
 
+	config->acl_cache_size = 0;
 	config->allow_duplicate_messages = false;
+	config->auth_check_timeout = 30;
 
 	mosquitto__free(config->security_options.acl_file);
 	config->security_options.acl_file = NULL;
@@ -219,11 +221,16 @@ static void config__init_reload(struct mosquitto_db *db, struct mosquitto__confi
 	config->max_packet_size = 0;
 	config->max_inflight_messages = 20;
 	config->persistence = false;
+	config->persistence_background = false;
+	config->persistence_lazy_retained = false;
 	mosquitto__free(config->persistence_location);
 	config->persistence_location = NULL;
 	mosquitto__free(config->persistence_file);
 	config->persistence_file = NULL;
+	config->persistence_journal = false;
 	config->persistent_client_expiration = 0;
+	config->publisher_flow_control = false;
+	config->publisher_flow_control_timeout = 60;
 	config->queue_qos0_messages = false;
 	config->retain_available = true;
 	config->set_tcp_nodelay = false;
@@ -465,6 +472,7 @@ int config__parse_args(struct mosquitto_db *db, struct mosquitto__config *config
 			|| config->default_listener.port
 			|| config->default_listener.max_connections != -1
 			|| config->default_listener.maximum_qos != 2
+			|| config->default_listener.durability != mosq_dur_none
 			|| config->default_listener.mount_point
 			|| config->default_listener.protocol != mp_mqtt
 			|| config->default_listener.socket_domain
@@ -507,6 +515,7 @@ int config__parse_args(struct mosquitto_db *db, struct mosquitto__config *config
 		config->listeners[config->listener_count-1].use_username_as_clientid = config->default_listener.use_username_as_clientid;
 		config->listeners[config->listener_count-1].maximum_qos = config->default_listener.maximum_qos;
 		config->listeners[config->listener_count-1].max_topic_alias = config->default_listener.max_topic_alias;
+		config->listeners[config->listener_count-1].durability = config->default_listener.durability;
 #ifdef WITH_TLS
 		config->listeners[config->listener_count-1].tls_version = config->default_listener.tls_version;
 		config->listeners[config->listener_count-1].tls_engine = config->default_listener.tls_engine;
@@ -563,7 +572,9 @@ void config__copy(struct mosquitto__config *src, struct mosquitto__config *dest)
 	dest->security_options.psk_file = src->security_options.psk_file;
 
 
+	dest->acl_cache_size = src->acl_cache_size;
 	dest->allow_duplicate_messages = src->allow_duplicate_messages;
+	dest->auth_check_timeout = src->auth_check_timeout;
 
 
 	dest->autosave_interval = src->autosave_interval;
@@ -587,6 +598,8 @@ void config__copy(struct mosquitto__config *src, struct mosquitto__config *dest)
 	dest->message_size_limit = src->message_size_limit;
 
 	dest->persistence = src->persistence;
+	dest->persistence_background = src->persistence_background;
+	dest->persistence_lazy_retained = src->persistence_lazy_retained;
 
 	mosquitto__free(dest->persistence_location);
 	dest->persistence_location = src->persistence_location;
@@ -597,9 +610,12 @@ void config__copy(struct mosquitto__config *src, struct mosquitto__config *dest)
 	mosquitto__free(dest->persistence_filepath);
 	dest->persistence_filepath = src->persistence_filepath;
 
+	dest->persistence_journal = src->persistence_journal;
 	dest->persistent_client_expiration = src->persistent_client_expiration;
 
 
+	dest->publisher_flow_control = src->publisher_flow_control;
+	dest->publisher_flow_control_timeout = src->publisher_flow_control_timeout;
 	dest->queue_qos0_messages = src->queue_qos0_messages;
 	dest->sys_interval = src->sys_interval;
 	dest->upgrade_outgoing_qos = src->upgrade_outgoing_qos;
@@ -810,7 +826,10 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 			}
 			token = strtok_r((*buf), " ", &saveptr);
 			if(token){
-				if(!strcmp(token, "acl_file")){
+				if(!strcmp(token, "acl_cache_size")){
+					if(conf__parse_int(&token, "acl_cache_size", &config->acl_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->acl_cache_size < 0) config->acl_cache_size = 0;
+				}else if(!strcmp(token, "acl_file")){
 					conf__set_cur_security_options(config, cur_listener, &cur_security_options);
 					if(reload){
 						mosquitto__free(cur_security_options->acl_file);
@@ -880,6 +899,9 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 				}else if(!strcmp(token, "allow_zero_length_clientid")){
 					conf__set_cur_security_options(config, cur_listener, &cur_security_options);
 					if(conf__parse_bool(&token, "allow_zero_length_clientid", &cur_security_options->allow_zero_length_clientid, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "auth_check_timeout")){
+					if(conf__parse_int(&token, "auth_check_timeout", &config->auth_check_timeout, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->auth_check_timeout < 0) config->auth_check_timeout = 0;
 				}else if(!strncmp(token, "auth_opt_", 9)){
 					if(reload) continue; // Auth plugin not currently valid for reloading.
 					if(!cur_auth_plugin_config){
@@ -946,6 +968,10 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 						return MOSQ_ERR_INVAL;
 					}
 					if(conf__parse_bool(&token, "auth_plugin_deny_special_chars", &cur_auth_plugin_config->deny_special_chars, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "auth_threads")){
+					if(reload) continue; // Thread pool is only started once.
+					if(conf__parse_int(&token, "auth_threads", &config->auth_threads, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->auth_threads < 0) config->auth_threads = 0;
 				}else if(!strcmp(token, "auto_id_prefix")){
 					conf__set_cur_security_options(config, cur_listener, &cur_security_options);
 					if(conf__parse_string(&token, "auto_id_prefix", &cur_security_options->auto_id_prefix, saveptr)) return MOSQ_ERR_INVAL;
@@ -1717,8 +1743,32 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 					}
 				}else if(!strcmp(token, "persistence") || !strcmp(token, "retained_persistence")){
 					if(conf__parse_bool(&token, token, &config->persistence, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_background")){
+					if(conf__parse_bool(&token, "persistence_background", &config->persistence_background, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_durability")){
+					if(reload) continue; // Listeners not valid for reloading.
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "none")){
+							cur_listener->durability = mosq_dur_none;
+						}else if(!strcmp(token, "periodic")){
+							cur_listener->durability = mosq_dur_periodic;
+						}else if(!strcmp(token, "group-commit")){
+							cur_listener->durability = mosq_dur_group_commit;
+						}else{
+							log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid persistence_durability value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty persistence_durability value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "persistence_file")){
 					if(conf__parse_string(&token, "persistence_file", &config->persistence_file, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_journal")){
+					if(conf__parse_bool(&token, "persistence_journal", &config->persistence_journal, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_lazy_retained")){
+					if(conf__parse_bool(&token, "persistence_lazy_retained", &config->persistence_lazy_retained, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_location")){
 					if(conf__parse_string(&token, "persistence_location", &config->persistence_location, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistent_client_expiration")){
@@ -1809,6 +1859,11 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS/TLS-PSK support not available.");
 #endif
+				}else if(!strcmp(token, "publisher_flow_control")){
+					if(conf__parse_bool(&token, token, &config->publisher_flow_control, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "publisher_flow_control_timeout")){
+					if(conf__parse_int(&token, "publisher_flow_control_timeout", &config->publisher_flow_control_timeout, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->publisher_flow_control_timeout < 0) config->publisher_flow_control_timeout = 0;
 				}else if(!strcmp(token, "queue_qos0_messages")){
 					if(conf__parse_bool(&token, token, &config->queue_qos0_messages, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "require_certificate")){
@@ -2293,6 +2348,17 @@ static int config__check(struct mosquitto__config *config)
 	}
 #endif
 
+#ifdef WITH_PERSISTENCE
+	if(!config->persistence || !config->persistence_journal){
+		for(i=0; i<config->listener_count; i++){
+			if(config->listeners[i].durability != mosq_dur_none){
+				log__printf(NULL, MOSQ_LOG_WARNING, "Warning: persistence_durability has no effect unless persistence and persistence_journal are enabled.");
+				break;
+			}
+		}
+	}
+#endif
+
 	/* Default to auto_id_prefix = 'auto-' if none set. */
 	if(config->per_listener_settings){
 		for(i=0; i<config->listener_count; i++){
@@ -52,6 +52,7 @@ struct mosquitto *context__init(struct mosquitto_db *db, mosq_sock_t sock)
 	context->password = NULL;
 	context->listener = NULL;
 	context->acl_list = NULL;
+	context->acl_patterns = NULL;
 
 	/* is_bridge records whether this client is a bridge or not. This could be
 	 * done by looking at context->bridge for bridges that we create ourself,
@@ -139,6 +140,7 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
 #endif
 
 	alias__free_all(context);
+	auth_pool__context_cleanup(context);
 
 	mosquitto__free(context->auth_method);
 	context->auth_method = NULL;
@@ -149,6 +151,10 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
 	mosquitto__free(context->password);
 	context->password = NULL;
 
+	db__flow_context_remove(db, context);
+#ifdef WITH_PERSISTENCE
+	persist__journal_ack_remove(db, context);
+#endif
 	net__socket_close(db, context);
 	if(do_free || context->clean_start){
 		sub__clean_session(db, context);
@@ -159,6 +165,7 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
 	context->address = NULL;
 
 	context__send_will(db, context);
+	acl__cache_free(context);
 
 	if(context->id){
 		context__remove_from_by_id(db, context);
@@ -188,6 +195,7 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
 	}
 #endif
 	if(do_free){
+		acl__context_cleanup(context);
 		mosquitto__free(context);
 	}
 }
@@ -226,7 +234,12 @@ void context__send_will(struct mosquitto_db *db, struct mosquitto *ctxt)
 
 void context__disconnect(struct mosquitto_db *db, struct mosquitto *context)
 {
+	db__flow_context_remove(db, context);
+#ifdef WITH_PERSISTENCE
+	persist__journal_ack_remove(db, context);
+#endif
 	net__socket_close(db, context);
+	auth_pool__context_cleanup(context);
 
 	context__send_will(db, context);
 	if(context->session_expiry_interval == 0){
@@ -243,6 +256,9 @@ void context__disconnect(struct mosquitto_db *db, struct mosquitto *context)
 		}
 	}else{
 		session_expiry__add(db, context);
+#ifdef WITH_PERSISTENCE
+		persist__journal_client(db, context);
+#endif
 	}
 	mosquitto__set_state(context, mosq_cs_disconnected);
 }
@@ -253,6 +269,9 @@ void context__add_to_disused(struct mosquitto_db *db, struct mosquitto *context)
 
 	mosquitto__set_state(context, mosq_cs_disused);
 
+#ifdef WITH_PERSISTENCE
+	persist__journal_client_delete(db, context);
+#endif
 	if(context->id){
 		context__remove_from_by_id(db, context);
 		mosquitto__free(context->id);
@@ -304,6 +323,9 @@ void context__free_disused(struct mosquitto_db *db)
 void context__remove_from_by_id(struct mosquitto_db *db, struct mosquitto *context)
 {
 	if(context->removed_from_by_id == false && context->id){
+		if(db->security_apply.next == context){
+			db->security_apply.next = context->hh_id.next;
+		}
 		HASH_DELETE(hh_id, db->contexts_by_id, context);
 		context->removed_from_by_id = true;
 	}
@@ -18,10 +18,13 @@ Contributors:
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <utlist.h>
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "property_mosq.h"
 #include "send_mosq.h"
 #include "sys_tree.h"
 #include "time_mosq.h"
@@ -108,6 +111,211 @@ static bool db__ready_for_queue(struct mosquitto *context, int qos, struct mosqu
 }
 
 
+/* ========================================
+ * Publisher flow control
+ * ========================================
+ *
+ * If publisher_flow_control is enabled, a connected client whose outgoing
+ * queue is full is marked as backlogged instead of having messages dropped.
+ * Any client that publishes a message which reaches a backlogged client then
+ * stops being read from. The paused client is linked to each backlogged
+ * client its messages reached, and is resumed once all of those have moved
+ * their queued messages into flight, so a backlog on one topic doesn't hold
+ * up publishers on others. A client that stays backlogged for longer than
+ * publisher_flow_control_timeout has the clients paused because of it
+ * resumed, and has messages dropped as usual until its queue drains, so a
+ * client that stops acknowledging can't stall publishers indefinitely.
+ * Offline clients are not considered, otherwise a single abandoned session
+ * could stop publishers until it expired.
+ */
+
+/* A client paused because its messages reached a backlogged client. */
+struct mosquitto__flow_link{
+	struct mosquitto *source;
+	struct mosquitto *backlogged;
+	struct mosquitto__flow_link *source_prev, *source_next; /* In source->flow_waiting */
+	struct mosquitto__flow_link *backlog_prev, *backlog_next; /* In backlogged->flow_paused */
+};
+
+
+static void db__flow_link_remove(struct mosquitto__flow_link *link, time_t now)
+{
+	struct mosquitto *source = link->source;
+
+	DL_DELETE2(source->flow_waiting, link, source_prev, source_next);
+	DL_DELETE2(link->backlogged->flow_paused, link, backlog_prev, backlog_next);
+	mosquitto__free(link);
+
+	if(source->flow_waiting == NULL){
+		source->is_flow_paused = false;
+		/* Nothing was read from the client whilst it was paused, so don't
+		 * count that time against its keepalive. */
+		source->last_msg_in = now;
+	}
+}
+
+
+/* Resume the clients that were paused because of context. */
+static void db__flow_resume(struct mosquitto *context)
+{
+	struct mosquitto__flow_link *link, *link_tmp;
+	time_t now;
+
+	if(context->flow_paused == NULL) return;
+
+	now = mosquitto_time();
+	DL_FOREACH_SAFE2(context->flow_paused, link, link_tmp, backlog_next){
+		db__flow_link_remove(link, now);
+	}
+}
+
+
+/* Stop waiting for the backlogged clients that context was paused for. */
+static void db__flow_unpause(struct mosquitto *context)
+{
+	struct mosquitto__flow_link *link, *link_tmp;
+	time_t now;
+
+	if(context->flow_waiting == NULL) return;
+
+	now = mosquitto_time();
+	DL_FOREACH_SAFE2(context->flow_waiting, link, link_tmp, source_next){
+		db__flow_link_remove(link, now);
+	}
+}
+
+
+static void db__flow_backlog_set(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto **hits_new;
+	int size_new;
+
+	if(context->is_backlogged == false){
+		context->is_backlogged = true;
+		context->flow_backlog_time = mosquitto_time();
+		DL_APPEND2(db->flow_backlogged, context, flow_backlog_prev, flow_backlog_next);
+		log__printf(NULL, MOSQ_LOG_NOTICE,
+				"Outgoing queue for client %s is full, applying flow control to publishers.",
+				context->id);
+	}
+	/* A backlogged client must keep being read from, otherwise its
+	 * acknowledgements would never arrive and the queue never drain. */
+	db__flow_unpause(context);
+
+	if(db->flow_hit_count == db->flow_hit_size){
+		size_new = db->flow_hit_size ? db->flow_hit_size*2 : 16;
+		hits_new = mosquitto__realloc(db->flow_hits, size_new*sizeof(struct mosquitto *));
+		/* Out of memory only means the publisher isn't paused. */
+		if(!hits_new) return;
+		db->flow_hits = hits_new;
+		db->flow_hit_size = size_new;
+	}
+	db->flow_hits[db->flow_hit_count] = context;
+	db->flow_hit_count++;
+}
+
+
+static void db__flow_backlog_clear(struct mosquitto_db *db, struct mosquitto *context)
+{
+	context->is_backlogged = false;
+	DL_DELETE2(db->flow_backlogged, context, flow_backlog_prev, flow_backlog_next);
+	db__flow_resume(context);
+}
+
+
+static void db__flow_backlog_check(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(context->msgs_out.queued == NULL){
+		if(context->is_backlogged){
+			db__flow_backlog_clear(db, context);
+		}
+		context->is_flow_expired = false;
+	}
+}
+
+
+/* Called after a message from context has been delivered to subscribers, to
+ * stop reading from context if any of those subscribers were backlogged. */
+void db__flow_source_check(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto__flow_link *link;
+	struct mosquitto *backlogged;
+	int i;
+
+	if(db->flow_hit_count == 0){
+		return;
+	}
+
+	if(context->sock != INVALID_SOCKET && context->is_backlogged == false){
+		for(i=0; i<db->flow_hit_count; i++){
+			backlogged = db->flow_hits[i];
+			if(backlogged == context || backlogged->is_backlogged == false){
+				continue;
+			}
+			DL_FOREACH2(context->flow_waiting, link, source_next){
+				if(link->backlogged == backlogged) break;
+			}
+			if(link) continue;
+
+			link = mosquitto__calloc(1, sizeof(struct mosquitto__flow_link));
+			if(!link) continue;
+			link->source = context;
+			link->backlogged = backlogged;
+			DL_APPEND2(context->flow_waiting, link, source_prev, source_next);
+			DL_APPEND2(backlogged->flow_paused, link, backlog_prev, backlog_next);
+			context->is_flow_paused = true;
+		}
+	}
+	db->flow_hit_count = 0;
+}
+
+
+void db__flow_context_remove(struct mosquitto_db *db, struct mosquitto *context)
+{
+	int i;
+
+	db__flow_unpause(context);
+	if(context->is_backlogged){
+		db__flow_backlog_clear(db, context);
+	}
+	context->is_flow_expired = false;
+
+	for(i=0; i<db->flow_hit_count; i++){
+		if(db->flow_hits[i] == context){
+			db->flow_hits[i] = db->flow_hits[db->flow_hit_count-1];
+			db->flow_hit_count--;
+			i--;
+		}
+	}
+}
+
+
+void db__flow_check_timeouts(struct mosquitto_db *db)
+{
+	struct mosquitto *context, *ctxt_tmp;
+	time_t now;
+
+	if(db->flow_backlogged == NULL || db->config->publisher_flow_control_timeout <= 0){
+		return;
+	}
+
+	now = mosquitto_time();
+	/* The list is oldest first, so stop at the first that hasn't expired.
+	 * Times are in whole seconds, so only expire once the timeout has fully
+	 * passed. */
+	DL_FOREACH_SAFE2(db->flow_backlogged, context, ctxt_tmp, flow_backlog_next){
+		if(now - context->flow_backlog_time <= db->config->publisher_flow_control_timeout){
+			break;
+		}
+		log__printf(NULL, MOSQ_LOG_NOTICE,
+				"Outgoing queue for client %s has been full for too long, no longer applying flow control for it.",
+				context->id);
+		context->is_flow_expired = true;
+		db__flow_backlog_clear(db, context);
+	}
+}
+
+
 int db__open(struct mosquitto__config *config, struct mosquitto_db *db)
 {
 	struct mosquitto__subhier *subhier;
@@ -172,10 +380,54 @@ int db__close(struct mosquitto_db *db)
 	subhier_clean(db, &db->subs);
 	db__msg_store_clean(db);
 
+	mosquitto__free(db->send_batch.leaves);
+	mosquitto__free(db->send_batch.clients);
+	mosquitto__free(db->send_batch.results);
+	memset(&db->send_batch, 0, sizeof(struct mosquitto__send_batch));
+	mosquitto__free(db->flow_hits);
+	db->flow_hits = NULL;
+	db->flow_hit_count = 0;
+	db->flow_hit_size = 0;
+
 	return MOSQ_ERR_SUCCESS;
 }
 
 
+/* Return the interned copy of topic, creating it if needed, with its
+ * reference count incremented. */
+struct mosquitto__topic_ref *db__topic_ref_get(struct mosquitto_db *db, const char *topic)
+{
+	struct mosquitto__topic_ref *ref;
+	size_t len;
+
+	len = strlen(topic);
+	HASH_FIND(hh, db->topic_refs, topic, len, ref);
+	if(!ref){
+		ref = mosquitto__malloc(sizeof(struct mosquitto__topic_ref) + len + 1);
+		if(!ref) return NULL;
+		ref->topic = (char *)&ref[1];
+		memcpy(ref->topic, topic, len+1);
+		ref->ref_count = 0;
+		HASH_ADD_KEYPTR(hh, db->topic_refs, ref->topic, len, ref);
+	}
+	ref->ref_count++;
+	return ref;
+}
+
+
+void db__topic_ref_dec(struct mosquitto_db *db, struct mosquitto__topic_ref **ref)
+{
+	if(!(*ref)) return;
+
+	(*ref)->ref_count--;
+	if((*ref)->ref_count == 0){
+		HASH_DELETE(hh, db->topic_refs, *ref);
+		mosquitto__free(*ref);
+	}
+	*ref = NULL;
+}
+
+
 void db__msg_store_add(struct mosquitto_db *db, struct mosquitto_msg_store *store)
 {
 	store->next = db->msg_store;
@@ -205,17 +457,26 @@ void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *s
 	db->msg_store_count--;
 	db->msg_store_bytes -= store->payloadlen;
 
-	mosquitto__free(store->source_id);
-	mosquitto__free(store->source_username);
 	if(store->dest_ids){
 		for(i=0; i<store->dest_id_count; i++){
 			mosquitto__free(store->dest_ids[i]);
 		}
 		mosquitto__free(store->dest_ids);
 	}
-	mosquitto__free(store->topic);
 	mosquitto_property_free_all(&store->properties);
-	UHPA_FREE_PAYLOAD(store);
+	db__topic_ref_dec(db, &store->topic_ref);
+	if(!store->inline_data){
+		mosquitto__free(store->source_id);
+		mosquitto__free(store->source_username);
+		if(!store->payload_mapped){
+			UHPA_FREE_PAYLOAD(store);
+		}
+	}
+#ifdef WITH_PERSISTENCE
+	if(store->payload_mapped){
+		persist__payload_map_release();
+	}
+#endif
 	mosquitto__free(store);
 }
 
@@ -262,12 +523,26 @@ void db__msg_store_compact(struct mosquitto_db *db)
 }
 
 
-static void db__message_remove(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
+/* The messages of context no longer match what the last snapshot holds for
+ * it, so they must be written out in full next time. */
+static void db__messages_changed(struct mosquitto *context)
+{
+#ifdef WITH_PERSISTENCE
+	context->persist_msgs_generation = 0;
+#endif
+}
+
+
+static void db__message_remove(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
 {
 	if(!msg_data || !item){
 		return;
 	}
 
+#ifdef WITH_PERSISTENCE
+	persist__journal_client_msg_delete(db, context, item);
+#endif
+	db__messages_changed(context);
 	DL_DELETE(msg_data->inflight, item);
 	if(item->store){
 		msg_data->msg_count--;
@@ -284,16 +559,46 @@ static void db__message_remove(struct mosquitto_db *db, struct mosquitto_msg_dat
 }
 
 
-void db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data)
+static int db__message_acl_check(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	if(msg->direction != mosq_md_out){
+		return MOSQ_ERR_SUCCESS;
+	}
+	return mosquitto_acl_check(db, context, msg->store->topic,
+			msg->store->payloadlen, UHPA_ACCESS(msg->store->payload, msg->store->payloadlen),
+			msg->store->qos, msg->store->retain, MOSQ_ACL_READ);
+}
+
+
+/* Move the first queued message into flight. Returns MOSQ_ERR_ACL_DENIED if
+ * the message turned out to be no longer allowed through ACL and has been
+ * removed instead. */
+int db__message_dequeue_first(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_data *msg_data)
 {
 	struct mosquitto_client_msg *msg;
 
 	msg = msg_data->queued;
 	DL_DELETE(msg_data->queued, msg);
 	DL_APPEND(msg_data->inflight, msg);
+	db__messages_changed(context);
+
+	if(msg_data->acl_check_last){
+		if(msg == msg_data->acl_check_last){
+			msg_data->acl_check_last = NULL;
+		}
+		if(db__message_acl_check(db, context, msg) != MOSQ_ERR_SUCCESS){
+			db__message_remove(db, context, msg_data, msg);
+			return MOSQ_ERR_ACL_DENIED;
+		}
+	}
+#ifdef WITH_PERSISTENCE
+	/* The caller has already given the message its in flight state. */
+	persist__journal_client_msg_update(db, context, msg);
+#endif
 	if(msg_data->inflight_quota > 0){
 		msg_data->inflight_quota--;
 	}
+	return MOSQ_ERR_SUCCESS;
 }
 
 
@@ -313,7 +618,7 @@ int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *conte
 				return MOSQ_ERR_PROTOCOL;
 			}
 			msg_index--;
-			db__message_remove(db, &context->msgs_out, tail);
+			db__message_remove(db, context, &context->msgs_out, tail);
 		}
 	}
 
@@ -322,7 +627,6 @@ int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *conte
 			break;
 		}
 
-		msg_index++;
 		tail->timestamp = mosquitto_time();
 		switch(tail->qos){
 			case 0:
@@ -335,13 +639,16 @@ int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *conte
 				tail->state = mosq_ms_publish_qos2;
 				break;
 		}
-		db__message_dequeue_first(context, &context->msgs_out);
+		if(db__message_dequeue_first(db, context, &context->msgs_out) == MOSQ_ERR_SUCCESS){
+			msg_index++;
+		}
 	}
+	db__flow_backlog_check(db, context);
 
 	return MOSQ_ERR_SUCCESS;
 }
 
-int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties)
+int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, uint32_t subscription_identifier)
 {
 	struct mosquitto_client_msg *msg;
 	struct mosquitto_msg_data *msg_data;
@@ -374,7 +681,6 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 		for(i=0; i<stored->dest_id_count; i++){
 			if(!strcmp(stored->dest_ids[i], context->id)){
 				/* We have already sent this message to this client. */
-				mosquitto_property_free_all(&properties);
 				return MOSQ_ERR_SUCCESS;
 			}
 		}
@@ -383,11 +689,9 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 		/* Client is not connected only queue messages with QoS>0. */
 		if(qos == 0 && !db->config->queue_qos0_messages){
 			if(!context->bridge){
-				mosquitto_property_free_all(&properties);
 				return 2;
 			}else{
 				if(context->bridge->start_type != bst_lazy){
-					mosquitto_property_free_all(&properties);
 					return 2;
 				}
 			}
@@ -412,13 +716,19 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 				if(qos == 2){
 					state = mosq_ms_wait_for_pubrel;
 				}else{
-					mosquitto_property_free_all(&properties);
 					return 1;
 				}
 			}
 		}else if(db__ready_for_queue(context, qos, msg_data)){
 			state = mosq_ms_queued;
 			rc = 2;
+		}else if(dir == mosq_md_out && db->config->publisher_flow_control
+				&& context->is_flow_expired == false){
+			/* Queue is full, but rather than dropping the message we keep
+			 * it and push back on whoever published it. */
+			db__flow_backlog_set(db, context);
+			state = mosq_ms_queued;
+			rc = 2;
 		}else{
 			/* Dropping message due to full queue. */
 			if(context->is_dropping == false){
@@ -428,7 +738,6 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 						context->id);
 			}
 			G_MSGS_DROPPED_INC();
-			mosquitto_property_free_all(&properties);
 			return 2;
 		}
 	}else{
@@ -442,7 +751,6 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 						"Outgoing messages are being dropped for client %s.",
 						context->id);
 			}
-			mosquitto_property_free_all(&properties);
 			return 2;
 		}
 	}
@@ -471,7 +779,8 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 		msg->qos = qos;
 	}
 	msg->retain = retain;
-	msg->properties = properties;
+	msg->properties = NULL;
+	msg->subscription_identifier = subscription_identifier;
 
 	if(state == mosq_ms_queued){
 		DL_APPEND(msg_data->queued, msg);
@@ -480,10 +789,14 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 	}
 	msg_data->msg_count++;
 	msg_data->msg_bytes+= msg->store->payloadlen;
-	if(qos > 0){
+	if(msg->qos > 0){
 		msg_data->msg_count12++;
 		msg_data->msg_bytes12 += msg->store->payloadlen;
 	}
+#ifdef WITH_PERSISTENCE
+	persist__journal_client_msg(db, context, msg);
+#endif
+	db__messages_changed(context);
 
 	if(db->config->allow_duplicate_messages == false && dir == mosq_md_out && retain == false){
 		/* Record which client ids this message has been sent to so we can avoid duplicates.
@@ -528,7 +841,7 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 #endif
 }
 
-int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos)
+int db__message_update_outgoing(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos)
 {
 	struct mosquitto_client_msg *tail;
 
@@ -539,6 +852,10 @@ int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mo
 			}
 			tail->state = state;
 			tail->timestamp = mosquitto_time();
+#ifdef WITH_PERSISTENCE
+			persist__journal_client_msg_update(db, context, tail);
+#endif
+			db__messages_changed(context);
 			return MOSQ_ERR_SUCCESS;
 		}
 	}
@@ -564,6 +881,7 @@ int db__messages_delete(struct mosquitto_db *db, struct mosquitto *context)
 {
 	if(!context) return MOSQ_ERR_INVAL;
 
+	db__messages_changed(context);
 	db__messages_delete_list(db, &context->msgs_in.inflight);
 	db__messages_delete_list(db, &context->msgs_in.queued);
 	db__messages_delete_list(db, &context->msgs_out.inflight);
@@ -578,6 +896,7 @@ int db__messages_delete(struct mosquitto_db *db, struct mosquitto *context)
 	context->msgs_out.msg_bytes12 = 0;
 	context->msgs_out.msg_count = 0;
 	context->msgs_out.msg_count12 = 0;
+	context->msgs_out.acl_check_last = NULL;
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -626,47 +945,127 @@ int db__messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context,
 	}
 	if(db__message_store(db, context, 0, topic_heap, qos, payloadlen, &payload_uhpa, retain, &stored, message_expiry_interval, local_properties, 0, origin)) return 1;
 
-	return sub__messages_queue(db, source_id, topic_heap, qos, retain, &stored);
+	return sub__messages_queue(db, source_id, stored->topic, qos, retain, &stored);
+}
+
+/* Copy the strings and payload of a new message into the space following its
+ * mosquitto_msg_store. The payload is only copied if it is not already held in
+ * the uhpa array. */
+static void db__msg_store_inline(struct mosquitto_msg_store *temp, const char *source_id, size_t source_id_len, const char *source_username, size_t source_username_len, uint32_t payloadlen, mosquitto__payload_uhpa *payload, bool payload_heap)
+{
+	char *inline_ptr;
+
+	inline_ptr = (char *)&temp[1];
+
+	temp->source_id = inline_ptr;
+	memcpy(inline_ptr, source_id, source_id_len);
+	inline_ptr += source_id_len;
+
+	if(source_username){
+		temp->source_username = inline_ptr;
+		memcpy(inline_ptr, source_username, source_username_len);
+		inline_ptr += source_username_len;
+	}
+	if(payload_heap){
+		memcpy(inline_ptr, payload->ptr, payloadlen);
+		temp->payload.ptr = inline_ptr;
+	}else if(payloadlen){
+		UHPA_MOVE(temp->payload, *payload, payloadlen);
+	}
+	temp->inline_data = true;
 }
 
+
 /* This function requires topic to be allocated on the heap. Once called, it owns topic and will free it on error. Likewise payload and properties. */
 int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, uint16_t source_mid, char *topic, int qos, uint32_t payloadlen, mosquitto__payload_uhpa *payload, int retain, struct mosquitto_msg_store **stored, uint32_t message_expiry_interval, mosquitto_property *properties, dbid_t store_id, enum mosquitto_msg_origin origin)
 {
 	struct mosquitto_msg_store *temp = NULL;
+	const char *source_id;
+	const char *source_username = NULL;
+	size_t source_id_len, source_username_len = 0;
+	size_t inline_len;
+	bool payload_heap;
 	int rc = MOSQ_ERR_SUCCESS;
 
 	assert(db);
 	assert(stored);
 
-	temp = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store));
-	if(!temp){
-		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		rc = MOSQ_ERR_NOMEM;
-		goto error;
+	if(source && source->id){
+		source_id = source->id;
+	}else{
+		source_id = "";
 	}
+	source_id_len = strlen(source_id) + 1;
+	if(source && source->username){
+		source_username = source->username;
+		source_username_len = strlen(source_username) + 1;
+	}
+	/* Is the payload held outside of the uhpa array? */
+	payload_heap = payloadlen > 0 && (void *)UHPA_ACCESS(*payload, payloadlen) != (void *)payload->array;
 
-	temp->topic = NULL;
-	temp->payload.ptr = NULL;
+	inline_len = source_id_len + source_username_len;
+	if(payload_heap){
+		inline_len += payloadlen;
+	}
 
-	temp->ref_count = 0;
-	if(source && source->id){
-		temp->source_id = mosquitto__strdup(source->id);
+	if(inline_len <= MOSQ_MSG_STORE_INLINE_SIZE){
+		temp = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store) + inline_len);
+		if(!temp){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			rc = MOSQ_ERR_NOMEM;
+			goto error;
+		}
+		db__msg_store_inline(temp, source_id, source_id_len,
+				source_username, source_username_len,
+				payloadlen, payload, payload_heap);
+
+		if(payload_heap){
+			UHPA_FREE(*payload, payloadlen);
+		}
 	}else{
-		temp->source_id = mosquitto__strdup("");
-	}
-	if(!temp->source_id){
-		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		rc = MOSQ_ERR_NOMEM;
-		goto error;
+		temp = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store));
+		if(!temp){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			rc = MOSQ_ERR_NOMEM;
+			goto error;
+		}
+
+		temp->payload.ptr = NULL;
+
+		temp->source_id = mosquitto__strdup(source_id);
+		if(!temp->source_id){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			rc = MOSQ_ERR_NOMEM;
+			goto error;
+		}
+
+		if(source_username){
+			temp->source_username = mosquitto__strdup(source_username);
+			if(!temp->source_username){
+				rc = MOSQ_ERR_NOMEM;
+				goto error;
+			}
+		}
+		if(payloadlen){
+			UHPA_MOVE(temp->payload, *payload, payloadlen);
+		}else{
+			temp->payload.ptr = NULL;
+		}
 	}
 
-	if(source && source->username){
-		temp->source_username = mosquitto__strdup(source->username);
-		if(!temp->source_username){
+	if(topic){
+		temp->topic_ref = db__topic_ref_get(db, topic);
+		if(!temp->topic_ref){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			rc = MOSQ_ERR_NOMEM;
 			goto error;
 		}
+		temp->topic = temp->topic_ref->topic;
+		mosquitto__free(topic);
+		topic = NULL;
 	}
+
+	temp->ref_count = 0;
 	if(source){
 		temp->source_listener = source->listener;
 	}
@@ -674,16 +1073,9 @@ int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, u
 	temp->mid = 0;
 	temp->qos = qos;
 	temp->retain = retain;
-	temp->topic = topic;
-	topic = NULL;
 	temp->payloadlen = payloadlen;
 	temp->properties = properties;
 	temp->origin = origin;
-	if(payloadlen){
-		UHPA_MOVE(temp->payload, *payload, payloadlen);
-	}else{
-		temp->payload.ptr = NULL;
-	}
 	if(message_expiry_interval > 0){
 		temp->message_expiry_time = time(NULL) + message_expiry_interval;
 	}else{
@@ -708,9 +1100,11 @@ int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, u
 error:
 	mosquitto__free(topic);
 	if(temp){
-		mosquitto__free(temp->source_id);
-		mosquitto__free(temp->source_username);
-		mosquitto__free(temp->topic);
+		if(!temp->inline_data){
+			mosquitto__free(temp->source_id);
+			mosquitto__free(temp->source_username);
+			UHPA_FREE(temp->payload, payloadlen);
+		}
 		mosquitto__free(temp);
 	}
 	mosquitto_property_free_all(&properties);
@@ -743,23 +1137,22 @@ int db__message_store_find(struct mosquitto *context, uint16_t mid, struct mosqu
 }
 
 /* Called on reconnect to set outgoing messages to a sensible state and force a
- * retry, and to set incoming messages to expect an appropriate retry. */
+ * retry, and to set incoming messages to expect an appropriate retry.
+ *
+ * The message counts are kept up to date as messages are added and removed,
+ * so only the in-flight messages need visiting here. Queued messages are moved
+ * into flight until the limits are reached; the rest are left for
+ * db__message_write(), so a session with a long queue costs no more to resume
+ * than one with a short queue. */
 int db__message_reconnect_reset_outgoing(struct mosquitto_db *db, struct mosquitto *context)
 {
 	struct mosquitto_client_msg *msg, *tmp;
 
-	context->msgs_out.msg_bytes = 0;
-	context->msgs_out.msg_bytes12 = 0;
-	context->msgs_out.msg_count = 0;
-	context->msgs_out.msg_count12 = 0;
 	context->msgs_out.inflight_quota = context->msgs_out.inflight_maximum;
+	db__messages_changed(context);
 
 	DL_FOREACH_SAFE(context->msgs_out.inflight, msg, tmp){
-		context->msgs_out.msg_count++;
-		context->msgs_out.msg_bytes += msg->store->payloadlen;
 		if(msg->qos > 0){
-			context->msgs_out.msg_count12++;
-			context->msgs_out.msg_bytes12 += msg->store->payloadlen;
 			util__decrement_receive_quota(context);
 		}
 
@@ -786,26 +1179,21 @@ int db__message_reconnect_reset_outgoing(struct mosquitto_db *db, struct mosquit
 	 * will be sent out of order.
 	 */
 	DL_FOREACH_SAFE(context->msgs_out.queued, msg, tmp){
-		context->msgs_out.msg_count++;
-		context->msgs_out.msg_bytes += msg->store->payloadlen;
-		if(msg->qos > 0){
-			context->msgs_out.msg_count12++;
-			context->msgs_out.msg_bytes12 += msg->store->payloadlen;
+		if(!db__ready_for_flight(&context->msgs_out, msg->qos)){
+			break;
 		}
-		if(db__ready_for_flight(&context->msgs_out, msg->qos)){
-			switch(msg->qos){
-				case 0:
-					msg->state = mosq_ms_publish_qos0;
-					break;
-				case 1:
-					msg->state = mosq_ms_publish_qos1;
-					break;
-				case 2:
-					msg->state = mosq_ms_publish_qos2;
-					break;
-			}
-			db__message_dequeue_first(context, &context->msgs_out);
+		switch(msg->qos){
+			case 0:
+				msg->state = mosq_ms_publish_qos0;
+				break;
+			case 1:
+				msg->state = mosq_ms_publish_qos1;
+				break;
+			case 2:
+				msg->state = mosq_ms_publish_qos2;
+				break;
 		}
+		db__message_dequeue_first(db, context, &context->msgs_out);
 	}
 
 	return MOSQ_ERR_SUCCESS;
@@ -817,25 +1205,17 @@ int db__message_reconnect_reset_incoming(struct mosquitto_db *db, struct mosquit
 {
 	struct mosquitto_client_msg *msg, *tmp;
 
-	context->msgs_in.msg_bytes = 0;
-	context->msgs_in.msg_bytes12 = 0;
-	context->msgs_in.msg_count = 0;
-	context->msgs_in.msg_count12 = 0;
 	context->msgs_in.inflight_quota = context->msgs_in.inflight_maximum;
 
 	DL_FOREACH_SAFE(context->msgs_in.inflight, msg, tmp){
-		context->msgs_in.msg_count++;
-		context->msgs_in.msg_bytes += msg->store->payloadlen;
 		if(msg->qos > 0){
-			context->msgs_in.msg_count12++;
-			context->msgs_in.msg_bytes12 += msg->store->payloadlen;
 			util__decrement_receive_quota(context);
 		}
 
 		if(msg->qos != 2){
 			/* Anything <QoS 2 can be completely retried by the client at
 			 * no harm. */
-			db__message_remove(db, &context->msgs_in, msg);
+			db__message_remove(db, context, &context->msgs_in, msg);
 		}else{
 			/* Message state can be preserved here because it should match
 			 * whatever the client has got. */
@@ -849,26 +1229,21 @@ int db__message_reconnect_reset_incoming(struct mosquitto_db *db, struct mosquit
 	 * will be sent out of order.
 	 */
 	DL_FOREACH_SAFE(context->msgs_in.queued, msg, tmp){
-		context->msgs_in.msg_count++;
-		context->msgs_in.msg_bytes += msg->store->payloadlen;
-		if(msg->qos > 0){
-			context->msgs_in.msg_count12++;
-			context->msgs_in.msg_bytes12 += msg->store->payloadlen;
+		if(!db__ready_for_flight(&context->msgs_in, msg->qos)){
+			break;
 		}
-		if(db__ready_for_flight(&context->msgs_in, msg->qos)){
-			switch(msg->qos){
-				case 0:
-					msg->state = mosq_ms_publish_qos0;
-					break;
-				case 1:
-					msg->state = mosq_ms_publish_qos1;
-					break;
-				case 2:
-					msg->state = mosq_ms_publish_qos2;
-					break;
-			}
-			db__message_dequeue_first(context, &context->msgs_in);
+		switch(msg->qos){
+			case 0:
+				msg->state = mosq_ms_publish_qos0;
+				break;
+			case 1:
+				msg->state = mosq_ms_publish_qos1;
+				break;
+			case 2:
+				msg->state = mosq_ms_publish_qos2;
+				break;
 		}
+		db__message_dequeue_first(db, context, &context->msgs_in);
 	}
 
 	return MOSQ_ERR_SUCCESS;
@@ -885,6 +1260,24 @@ int db__message_reconnect_reset(struct mosquitto_db *db, struct mosquitto *conte
 }
 
 
+/* Remove any in-flight messages that are no longer allowed through ACL,
+ * assuming a possible change of username. Queued messages, of which there may
+ * be very many, are checked as they are moved into flight instead. */
+void db__message_reconnect_acl_check(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto_client_msg *msg, *tmp;
+
+	DL_FOREACH_SAFE(context->msgs_out.inflight, msg, tmp){
+		if(db__message_acl_check(db, context, msg) != MOSQ_ERR_SUCCESS){
+			db__message_remove(db, context, &context->msgs_out, msg);
+		}
+	}
+	if(context->msgs_out.queued){
+		context->msgs_out.acl_check_last = context->msgs_out.queued->prev;
+	}
+}
+
+
 int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid)
 {
 	struct mosquitto_client_msg *tail, *tmp;
@@ -912,12 +1305,13 @@ int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *cont
 			 * keep resending it. That means we don't send it to other
 			 * clients. */
 			if(!topic){
-				db__message_remove(db, &context->msgs_in, tail);
+				db__message_remove(db, context, &context->msgs_in, tail);
 				deleted = true;
 			}else{
 				rc = sub__messages_queue(db, source_id, topic, 2, retain, &tail->store);
+				db__flow_source_check(db, context);
 				if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_NO_SUBSCRIBERS){
-					db__message_remove(db, &context->msgs_in, tail);
+					db__message_remove(db, context, &context->msgs_in, tail);
 					deleted = true;
 				}else{
 					return 1;
@@ -937,7 +1331,7 @@ int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *cont
 		if(tail->qos == 2){
 			send__pubrec(context, tail->mid, 0);
 			tail->state = mosq_ms_wait_for_pubrel;
-			db__message_dequeue_first(context, &context->msgs_in);
+			db__message_dequeue_first(db, context, &context->msgs_in);
 		}
 	}
 	if(deleted){
@@ -947,6 +1341,27 @@ int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *cont
 	}
 }
 
+/* Return the properties to be sent with msg. The subscription identifier is
+ * kept as a plain value rather than as a property list, so that delivering a
+ * message to a subscriber with an identifier needs no allocation. It is put
+ * in front of any other properties here, using subid_prop as storage, so
+ * subid_prop must live as long as the returned list is used. */
+mosquitto_property *db__message_properties(struct mosquitto_client_msg *msg, mosquitto_property *subid_prop)
+{
+	if(msg->subscription_identifier == 0){
+		return msg->properties;
+	}
+
+	memset(subid_prop, 0, sizeof(mosquitto_property));
+	subid_prop->next = msg->properties;
+	subid_prop->value.varint = msg->subscription_identifier;
+	subid_prop->identifier = MQTT_PROP_SUBSCRIPTION_IDENTIFIER;
+	subid_prop->client_generated = false;
+
+	return subid_prop;
+}
+
+
 int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 {
 	int rc;
@@ -960,6 +1375,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 	const void *payload;
 	int msg_count = 0;
 	mosquitto_property *cmsg_props = NULL, *store_props = NULL;
+	mosquitto_property subid_prop;
 	time_t now = 0;
 	uint32_t expiry_interval;
 
@@ -981,7 +1397,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 			}
 			if(now > tail->store->message_expiry_time){
 				/* Message is expired, must not send. */
-				db__message_remove(db, &context->msgs_in, tail);
+				db__message_remove(db, context, &context->msgs_in, tail);
 				continue;
 			}else{
 				expiry_interval = tail->store->message_expiry_time - now;
@@ -1002,6 +1418,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 				rc = send__pubrec(context, mid, 0);
 				if(!rc){
 					tail->state = mosq_ms_wait_for_pubrel;
+					db__messages_changed(context);
 				}else{
 					return rc;
 				}
@@ -1011,6 +1428,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 				rc = send__pubcomp(context, mid);
 				if(!rc){
 					tail->state = mosq_ms_wait_for_pubrel;
+					db__messages_changed(context);
 				}else{
 					return rc;
 				}
@@ -1039,7 +1457,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 			}
 			if(now > tail->store->message_expiry_time){
 				/* Message is expired, must not send. */
-				db__message_remove(db, &context->msgs_out, tail);
+				db__message_remove(db, context, &context->msgs_out, tail);
 				continue;
 			}else{
 				expiry_interval = tail->store->message_expiry_time - now;
@@ -1052,14 +1470,14 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 		qos = tail->qos;
 		payloadlen = tail->store->payloadlen;
 		payload = UHPA_ACCESS_PAYLOAD(tail->store);
-		cmsg_props = tail->properties;
+		cmsg_props = db__message_properties(tail, &subid_prop);
 		store_props = tail->store->properties;
 
 		switch(tail->state){
 			case mosq_ms_publish_qos0:
 				rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
 				if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_OVERSIZE_PACKET){
-					db__message_remove(db, &context->msgs_out, tail);
+					db__message_remove(db, context, &context->msgs_out, tail);
 				}else{
 					return rc;
 				}
@@ -1071,8 +1489,9 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 					tail->timestamp = mosquitto_time();
 					tail->dup = 1; /* Any retry attempts are a duplicate. */
 					tail->state = mosq_ms_wait_for_puback;
+					db__messages_changed(context);
 				}else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
-					db__message_remove(db, &context->msgs_out, tail);
+					db__message_remove(db, context, &context->msgs_out, tail);
 				}else{
 					return rc;
 				}
@@ -1084,8 +1503,9 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 					tail->timestamp = mosquitto_time();
 					tail->dup = 1; /* Any retry attempts are a duplicate. */
 					tail->state = mosq_ms_wait_for_pubrec;
+					db__messages_changed(context);
 				}else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
-					db__message_remove(db, &context->msgs_out, tail);
+					db__message_remove(db, context, &context->msgs_out, tail);
 				}else{
 					return rc;
 				}
@@ -1095,6 +1515,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 				rc = send__pubrel(context, mid);
 				if(!rc){
 					tail->state = mosq_ms_wait_for_pubcomp;
+					db__messages_changed(context);
 				}else{
 					return rc;
 				}
@@ -1121,7 +1542,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 
 		if(tail->qos == 2){
 			tail->state = mosq_ms_send_pubrec;
-			db__message_dequeue_first(context, &context->msgs_in);
+			db__message_dequeue_first(db, context, &context->msgs_in);
 			rc = send__pubrec(context, tail->mid, 0);
 			if(!rc){
 				tail->state = mosq_ms_wait_for_pubrel;
@@ -1149,8 +1570,9 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 				tail->state = mosq_ms_publish_qos2;
 				break;
 		}
-		db__message_dequeue_first(context, &context->msgs_out);
+		db__message_dequeue_first(db, context, &context->msgs_out);
 	}
+	db__flow_backlog_check(db, context);
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -0,0 +1,614 @@
+/*
+Copyright (c) 2019 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* Offline compaction of a persistence file.
+ *
+ * The file is read a chunk at a time. Only the fixed part of each chunk is
+ * looked at to decide whether to keep it, kept chunks are copied unchanged,
+ * and the result is written as a version 6 file with a fresh index. Memory
+ * use is a few bytes per stored message plus the ids of dropped clients. */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mosquitto_broker_internal.h>
+#include <memory_mosq.h>
+#include <persist.h>
+
+#define mosquitto__malloc(A) malloc((A))
+#define mosquitto__free(A) free((A))
+#define _mosquitto_malloc(A) malloc((A))
+#define _mosquitto_free(A) free((A))
+#include <uthash.h>
+
+const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o',' ','d','b'};
+
+struct compact_store
+{
+	dbid_t store_id;
+	uint8_t expired;
+	uint8_t referenced;
+};
+
+struct compact_client
+{
+	UT_hash_handle hh;
+	char *id;
+};
+
+struct compact_stats
+{
+	long kept[DB_CHUNK_CLIENT+1];
+	long dropped[DB_CHUNK_CLIENT+1];
+	long stores_expired;
+	long stores_unreferenced;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+};
+
+static struct compact_store *stores = NULL;
+static long store_count = 0;
+static long store_size = 0;
+static struct compact_client *dropped_clients = NULL;
+static uint8_t *chunk_buf = NULL;
+static uint32_t chunk_buf_size = 0;
+static struct compact_stats stats;
+static time_t now;
+
+
+static int store__cmp(const void *a, const void *b)
+{
+	const struct compact_store *s1 = a, *s2 = b;
+
+	if(s1->store_id < s2->store_id) return -1;
+	if(s1->store_id > s2->store_id) return 1;
+	return 0;
+}
+
+
+static int store__add(dbid_t store_id, bool expired)
+{
+	struct compact_store *tmp;
+
+	if(store_count == store_size){
+		store_size = store_size ? store_size*2 : 1024;
+		tmp = realloc(stores, store_size*sizeof(struct compact_store));
+		if(!tmp) return MOSQ_ERR_NOMEM;
+		stores = tmp;
+	}
+	stores[store_count].store_id = store_id;
+	stores[store_count].expired = expired;
+	stores[store_count].referenced = 0;
+	store_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static struct compact_store *store__find(dbid_t store_id)
+{
+	struct compact_store key;
+
+	key.store_id = store_id;
+	return bsearch(&key, stores, store_count, sizeof(struct compact_store), store__cmp);
+}
+
+
+static int client__drop(const uint8_t *id, uint16_t id_len)
+{
+	struct compact_client *client;
+
+	HASH_FIND(hh, dropped_clients, id, id_len, client);
+	if(client) return MOSQ_ERR_SUCCESS;
+
+	client = calloc(1, sizeof(struct compact_client));
+	if(!client) return MOSQ_ERR_NOMEM;
+	client->id = malloc(id_len+1);
+	if(!client->id){
+		free(client);
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(client->id, id, id_len);
+	client->id[id_len] = '\0';
+	HASH_ADD_KEYPTR(hh, dropped_clients, client->id, id_len, client);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static bool client__dropped(const uint8_t *id, uint16_t id_len)
+{
+	struct compact_client *client;
+
+	HASH_FIND(hh, dropped_clients, id, id_len, client);
+	return client != NULL;
+}
+
+
+/* Read the next chunk header. Returns 1 at the end of the file. */
+static int chunk__next(FILE *fptr, uint32_t *chunk, uint32_t *length)
+{
+	struct PF_header header;
+	size_t rlen;
+
+	rlen = fread(&header, 1, sizeof(struct PF_header), fptr);
+	if(rlen == 0 && feof(fptr)) return 1;
+	if(rlen != sizeof(struct PF_header)) return -1;
+
+	*chunk = ntohl(header.chunk);
+	*length = ntohl(header.length);
+	if(*chunk == DB_CHUNK_RETAIN){
+		/* Some writers left the length of retain chunks as zero. */
+		*length = sizeof(struct PF_retain);
+	}
+	return 0;
+}
+
+
+static int chunk__read(FILE *fptr, uint32_t length)
+{
+	uint8_t *tmp;
+
+	if(length > chunk_buf_size){
+		tmp = realloc(chunk_buf, length);
+		if(!tmp) return MOSQ_ERR_NOMEM;
+		chunk_buf = tmp;
+		chunk_buf_size = length;
+	}
+	if(length && fread(chunk_buf, 1, length, fptr) != length){
+		return MOSQ_ERR_INVAL;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int chunk__skip(FILE *fptr, uint32_t length)
+{
+	if(length && fseek(fptr, length, SEEK_CUR)) return MOSQ_ERR_INVAL;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int chunk__write(FILE *fptr, uint32_t chunk, uint32_t length)
+{
+	struct PF_header header;
+
+	header.chunk = htonl(chunk);
+	header.length = htonl(length);
+	write_e(fptr, &header, sizeof(struct PF_header));
+	write_e(fptr, chunk_buf, length);
+	stats.bytes_out += sizeof(struct PF_header) + length;
+	return MOSQ_ERR_SUCCESS;
+error:
+	return MOSQ_ERR_ERRNO;
+}
+
+
+static bool client_msg__keep(uint32_t length, struct compact_store **store)
+{
+	struct PF_client_msg F;
+
+	if(length < sizeof(struct PF_client_msg)) return false;
+	memcpy(&F, chunk_buf, sizeof(struct PF_client_msg));
+	if(sizeof(struct PF_client_msg) + ntohs(F.id_len) > length) return false;
+
+	if(client__dropped(chunk_buf+sizeof(struct PF_client_msg), ntohs(F.id_len))){
+		return false;
+	}
+	*store = store__find(F.store_id);
+	return *store && !(*store)->expired;
+}
+
+
+static bool retain__keep(struct compact_store **store)
+{
+	struct PF_retain F;
+
+	memcpy(&F, chunk_buf, sizeof(struct PF_retain));
+	*store = store__find(F.store_id);
+	return *store && !(*store)->expired;
+}
+
+
+static bool sub__keep(uint32_t length)
+{
+	struct PF_sub F;
+	uint16_t id_len, topic_len;
+
+	if(length < sizeof(struct PF_sub)) return false;
+	memcpy(&F, chunk_buf, sizeof(struct PF_sub));
+	id_len = ntohs(F.id_len);
+	topic_len = ntohs(F.topic_len);
+	if(id_len == 0 || topic_len == 0) return false;
+	if(sizeof(struct PF_sub) + id_len + topic_len > length) return false;
+
+	return !client__dropped(chunk_buf+sizeof(struct PF_sub), id_len);
+}
+
+
+/* First pass: note every stored message and whether it has expired, and
+ * every client whose session has expired. */
+static int compact__scan_stores_clients(FILE *fptr, struct PF_cfg *cfg)
+{
+	uint32_t chunk, length;
+	struct PF_msg_store store;
+	struct PF_client client;
+	int rc;
+
+	while((rc = chunk__next(fptr, &chunk, &length)) == 0){
+		stats.bytes_in += sizeof(struct PF_header) + length;
+		switch(chunk){
+			case DB_CHUNK_CFG:
+				if(length != sizeof(struct PF_cfg) || chunk__read(fptr, length)) return 1;
+				memcpy(cfg, chunk_buf, sizeof(struct PF_cfg));
+				if(cfg->dbid_size != sizeof(dbid_t)){
+					fprintf(stderr, "Error: Incompatible database configuration (dbid size is %d bytes, expected %ld).\n",
+							cfg->dbid_size, (long)sizeof(dbid_t));
+					return 1;
+				}
+				break;
+
+			case DB_CHUNK_MSG_STORE:
+				if(length < sizeof(struct PF_msg_store)) return 1;
+				if(fread(&store, 1, sizeof(struct PF_msg_store), fptr) != sizeof(struct PF_msg_store)) return 1;
+				if(store__add(store.store_id, store.expiry_time > 0 && store.expiry_time < now)) return 1;
+				if(chunk__skip(fptr, length - sizeof(struct PF_msg_store))) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT:
+				if(length < sizeof(struct PF_client) || chunk__read(fptr, length)) return 1;
+				memcpy(&client, chunk_buf, sizeof(struct PF_client));
+				if(sizeof(struct PF_client) + ntohs(client.id_len) > length) return 1;
+				/* The broker sets the expiry time when a client disconnects,
+				 * already limited by persistent_client_expiration. Clients
+				 * that were connected when the file was saved have none. */
+				if(client.session_expiry_time > 0 && client.session_expiry_time < now){
+					if(client__drop(chunk_buf+sizeof(struct PF_client), ntohs(client.id_len))) return 1;
+				}
+				break;
+
+			case DB_CHUNK_CLIENT_MSG:
+			case DB_CHUNK_RETAIN:
+			case DB_CHUNK_SUB:
+			case DB_CHUNK_INDEX:
+				if(chunk__skip(fptr, length)) return 1;
+				break;
+
+			default:
+				fprintf(stderr, "Error: Unexpected chunk type %u in persistent database.\n", chunk);
+				return 1;
+		}
+	}
+	if(rc < 0) return 1;
+
+	qsort(stores, store_count, sizeof(struct compact_store), store__cmp);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Second pass: mark the stored messages that a kept client message or
+ * retained message still refers to. */
+static int compact__scan_refs(FILE *fptr)
+{
+	uint32_t chunk, length;
+	struct compact_store *store;
+	int rc;
+
+	while((rc = chunk__next(fptr, &chunk, &length)) == 0){
+		if(chunk == DB_CHUNK_CLIENT_MSG || chunk == DB_CHUNK_RETAIN){
+			if(chunk__read(fptr, length)) return 1;
+			store = NULL;
+			if(chunk == DB_CHUNK_CLIENT_MSG){
+				if(client_msg__keep(length, &store)) store->referenced = 1;
+			}else{
+				if(retain__keep(&store)) store->referenced = 1;
+			}
+		}else{
+			if(chunk__skip(fptr, length)) return 1;
+		}
+	}
+	return rc < 0;
+}
+
+
+/* Copy the kept chunks of a single type to the output. */
+static int compact__write_section(FILE *in, long data_start, FILE *out, struct PF_index_entry *entry)
+{
+	uint32_t chunk, length;
+	struct compact_store *store;
+	struct PF_msg_store F;
+	struct PF_client client;
+	long offset;
+	bool keep;
+	int rc;
+
+	offset = ftell(out);
+	if(offset < 0 || fseek(in, data_start, SEEK_SET)) return 1;
+	entry->offset = (uint64_t)offset;
+	entry->count = 0;
+
+	while((rc = chunk__next(in, &chunk, &length)) == 0){
+		if(chunk != entry->chunk){
+			if(chunk__skip(in, length)) return 1;
+			continue;
+		}
+		if(chunk__read(in, length)) return 1;
+
+		switch(chunk){
+			case DB_CHUNK_MSG_STORE:
+				memcpy(&F, chunk_buf, sizeof(struct PF_msg_store));
+				store = store__find(F.store_id);
+				keep = store && !store->expired && store->referenced;
+				if(store && !keep){
+					if(store->expired){
+						stats.stores_expired++;
+					}else{
+						stats.stores_unreferenced++;
+					}
+				}
+				break;
+			case DB_CHUNK_CLIENT:
+				memcpy(&client, chunk_buf, sizeof(struct PF_client));
+				keep = !client__dropped(chunk_buf+sizeof(struct PF_client), ntohs(client.id_len));
+				break;
+			case DB_CHUNK_CLIENT_MSG:
+				keep = client_msg__keep(length, &store);
+				break;
+			case DB_CHUNK_RETAIN:
+				keep = retain__keep(&store);
+				break;
+			case DB_CHUNK_SUB:
+				keep = sub__keep(length);
+				break;
+			default:
+				keep = false;
+				break;
+		}
+		if(keep){
+			if(chunk__write(out, chunk, length)) return 1;
+			entry->count++;
+			stats.kept[chunk]++;
+		}else{
+			stats.dropped[chunk]++;
+		}
+	}
+	if(rc < 0) return 1;
+
+	offset = ftell(out);
+	if(offset < 0) return 1;
+	entry->length = (uint64_t)offset - entry->offset;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int compact__write(FILE *in, long data_start, FILE *out, struct PF_cfg *cfg)
+{
+	uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
+	uint32_t crc = 0;
+	struct PF_header header;
+	struct PF_index_entry index[5];
+	struct PF_index_entry entry;
+	long index_offset;
+	uint64_t offset;
+	int i;
+
+	write_e(out, magic, 15);
+	write_e(out, &crc, sizeof(uint32_t));
+	write_e(out, &db_version_w, sizeof(uint32_t));
+
+	header.chunk = htonl(DB_CHUNK_CFG);
+	header.length = htonl(sizeof(struct PF_cfg));
+	write_e(out, &header, sizeof(struct PF_header));
+	write_e(out, cfg, sizeof(struct PF_cfg));
+
+	/* Same section order as the broker writes. */
+	index[0].chunk = DB_CHUNK_MSG_STORE;
+	index[1].chunk = DB_CHUNK_CLIENT;
+	index[2].chunk = DB_CHUNK_CLIENT_MSG;
+	index[3].chunk = DB_CHUNK_RETAIN;
+	index[4].chunk = DB_CHUNK_SUB;
+	for(i=0; i<5; i++){
+		if(compact__write_section(in, data_start, out, &index[i])) return 1;
+	}
+
+	index_offset = ftell(out);
+	if(index_offset < 0) return 1;
+	header.chunk = htonl(DB_CHUNK_INDEX);
+	header.length = htonl(sizeof(struct PF_index_entry)*5 + sizeof(uint64_t));
+	write_e(out, &header, sizeof(struct PF_header));
+	for(i=0; i<5; i++){
+		entry.chunk = htonl(index[i].chunk);
+		entry.count = htonl(index[i].count);
+		entry.offset = index[i].offset;
+		entry.length = index[i].length;
+		write_e(out, &entry, sizeof(struct PF_index_entry));
+	}
+	offset = (uint64_t)index_offset;
+	write_e(out, &offset, sizeof(uint64_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+
+static void print_stats(void)
+{
+	printf("Stored messages: %ld kept, %ld dropped (%ld expired, %ld unreferenced)\n",
+			stats.kept[DB_CHUNK_MSG_STORE], stats.dropped[DB_CHUNK_MSG_STORE],
+			stats.stores_expired, stats.stores_unreferenced);
+	printf("Clients: %ld kept, %ld dropped\n",
+			stats.kept[DB_CHUNK_CLIENT], stats.dropped[DB_CHUNK_CLIENT]);
+	printf("Client messages: %ld kept, %ld dropped\n",
+			stats.kept[DB_CHUNK_CLIENT_MSG], stats.dropped[DB_CHUNK_CLIENT_MSG]);
+	printf("Retained messages: %ld kept, %ld dropped\n",
+			stats.kept[DB_CHUNK_RETAIN], stats.dropped[DB_CHUNK_RETAIN]);
+	printf("Subscriptions: %ld kept, %ld dropped\n",
+			stats.kept[DB_CHUNK_SUB], stats.dropped[DB_CHUNK_SUB]);
+	printf("Size: %" PRIu64 " bytes, was %" PRIu64 " bytes\n",
+			stats.bytes_out, stats.bytes_in);
+}
+
+
+static void cleanup(void)
+{
+	struct compact_client *client, *client_tmp;
+
+	HASH_ITER(hh, dropped_clients, client, client_tmp){
+		HASH_DELETE(hh, dropped_clients, client);
+		free(client->id);
+		free(client);
+	}
+	free(stores);
+	stores = NULL;
+	free(chunk_buf);
+	chunk_buf = NULL;
+}
+
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: db_compact [-q] <mosquitto db filename> <output filename>\n");
+	fprintf(stderr, "The output filename may be the same as the input filename.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *in = NULL, *out = NULL;
+	char header[15];
+	char *infile = NULL, *outfile = NULL, *tmpfile = NULL;
+	uint32_t i32temp, db_version;
+	struct PF_cfg cfg;
+	struct stat st;
+	long data_start;
+	int quiet = 0;
+	int rc = 1;
+	int i, len;
+
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "-q")){
+			quiet = 1;
+		}else if(argv[i][0] != '-' && !infile){
+			infile = argv[i];
+		}else if(argv[i][0] != '-' && !outfile){
+			outfile = argv[i];
+		}else{
+			print_usage();
+			return 1;
+		}
+	}
+	if(!infile || !outfile){
+		print_usage();
+		return 1;
+	}
+
+	now = time(NULL);
+	memset(&stats, 0, sizeof(struct compact_stats));
+	memset(&cfg, 0, sizeof(struct PF_cfg));
+	cfg.dbid_size = sizeof(dbid_t);
+
+	in = fopen(infile, "rb");
+	if(!in){
+		fprintf(stderr, "Error: Unable to open %s: %s.\n", infile, strerror(errno));
+		return 1;
+	}
+	if(fread(header, 1, 15, in) != 15 || memcmp(header, magic, 15)
+			|| fread(&i32temp, 1, sizeof(uint32_t), in) != sizeof(uint32_t)
+			|| fread(&i32temp, 1, sizeof(uint32_t), in) != sizeof(uint32_t)){
+
+		fprintf(stderr, "Error: Unrecognised file format.\n");
+		goto cleanup;
+	}
+	db_version = ntohl(i32temp);
+	if(db_version < 5 || db_version > MOSQ_DB_VERSION){
+		fprintf(stderr, "Error: Unsupported persistent database format version %d.\n", db_version);
+		if(db_version < 5){
+			fprintf(stderr, "Start and stop the broker with this file to upgrade it first.\n");
+		}
+		goto cleanup;
+	}
+	data_start = ftell(in);
+	stats.bytes_in = data_start;
+
+	if(compact__scan_stores_clients(in, &cfg)
+			|| fseek(in, data_start, SEEK_SET)
+			|| compact__scan_refs(in)){
+
+		fprintf(stderr, "Error: Unable to read %s, file is truncated or corrupt.\n", infile);
+		goto cleanup;
+	}
+
+	/* Write to a new file and rename it over the output, so the output can be
+	 * the input file and is never left half written. */
+	len = strlen(outfile) + 5;
+	tmpfile = malloc(len);
+	if(!tmpfile){
+		fprintf(stderr, "Error: Out of memory.\n");
+		goto cleanup;
+	}
+	snprintf(tmpfile, len, "%s.new", outfile);
+	unlink(tmpfile);
+	out = fopen(tmpfile, "wb");
+	if(!out){
+		fprintf(stderr, "Error: Unable to open %s: %s.\n", tmpfile, strerror(errno));
+		goto cleanup;
+	}
+	/* Keep the owner and permissions of the input, so a broker that could
+	 * read the original can read the compacted file. */
+	if(!fstat(fileno(in), &st)){
+		if(fchown(fileno(out), st.st_uid, st.st_gid) && errno != EPERM){
+			fprintf(stderr, "Warning: Unable to set owner of %s: %s.\n", tmpfile, strerror(errno));
+		}
+		if(fchmod(fileno(out), st.st_mode & 0777)){
+			fprintf(stderr, "Warning: Unable to set permissions of %s: %s.\n", tmpfile, strerror(errno));
+		}
+	}
+	stats.bytes_out = data_start;
+	if(compact__write(in, data_start, out, &cfg)){
+		fprintf(stderr, "Error: Unable to write %s: %s.\n", tmpfile, strerror(errno));
+		goto cleanup;
+	}
+	stats.bytes_out += sizeof(struct PF_header) + sizeof(struct PF_cfg)
+		+ sizeof(struct PF_header) + sizeof(struct PF_index_entry)*5 + sizeof(uint64_t);
+
+	if(fflush(out) || fsync(fileno(out)) || fclose(out)){
+		out = NULL;
+		fprintf(stderr, "Error: Unable to write %s: %s.\n", tmpfile, strerror(errno));
+		goto cleanup;
+	}
+	out = NULL;
+	if(rename(tmpfile, outfile)){
+		fprintf(stderr, "Error: Unable to rename %s to %s: %s.\n", tmpfile, outfile, strerror(errno));
+		goto cleanup;
+	}
+	if(!quiet) print_stats();
+	rc = 0;
+
+cleanup:
+	if(out){
+		fclose(out);
+		unlink(tmpfile);
+	}
+	if(in) fclose(in);
+	free(tmpfile);
+	cleanup();
+	return rc;
+}
@@ -35,6 +35,9 @@ Contributors:
 #define _mosquitto_free(A) free((A))
 #include <uthash.h>
 
+#define SUMMARY_SIZE_BUCKETS 33
+#define SUMMARY_TOP_DEFAULT 10
+
 const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o',' ','d','b'};
 
 struct client_chunk
@@ -59,6 +62,8 @@ struct db_sub
 	char *client_id;
 	char *topic;
 	uint8_t qos;
+	uint8_t options;
+	uint32_t identifier;
 };
 
 struct db_client
@@ -66,6 +71,8 @@ struct db_client
 	char *client_id;
 	uint16_t last_mid;
 	time_t disconnect_t;
+	int64_t session_expiry_time;
+	uint32_t session_expiry_interval;
 };
 
 struct db_client_msg
@@ -79,6 +86,7 @@ struct db_client_msg
 struct db_msg
 {
 	dbid_t store_id;
+	int64_t expiry_time;
 	uint32_t payloadlen;
 	uint16_t source_mid, mid;
 	uint8_t qos, retain;
@@ -89,14 +97,52 @@ struct db_msg
 	uint16_t source_port;
 };
 
+/* What --summary keeps for each stored message. Topics and payloads are not
+ * kept, so memory use is a small fixed amount per message however large the
+ * messages are. */
+struct summary_store
+{
+	dbid_t store_id;
+	uint32_t payloadlen;
+	uint16_t refs;
+	uint8_t retained;
+};
+
+struct summary_top
+{
+	char *topic;
+	uint32_t bytes;
+};
+
+enum summary_format{
+	sf_json = 0,
+	sf_csv = 1
+};
+
 static uint32_t db_version;
 static int stats = 0;
 static int client_stats = 0;
+static int summary = 0;
 static int do_print = 1;
+static enum summary_format summary_format = sf_json;
 
 struct client_chunk *clients_by_id = NULL;
 struct msg_store_chunk *msgs_by_id = NULL;
 
+static struct summary_store *summary_stores = NULL;
+static long summary_store_count = 0;
+static long summary_store_size = 0;
+static bool summary_stores_sorted = true;
+static long summary_size_count[SUMMARY_SIZE_BUCKETS];
+static uint64_t summary_size_bytes[SUMMARY_SIZE_BUCKETS];
+static char *summary_client_id = NULL;
+static long summary_client_messages = 0;
+static uint64_t summary_client_bytes = 0;
+static int summary_client_rows = 0;
+static struct summary_top *summary_top = NULL;
+static int summary_top_count = 0;
+static int summary_top_size = SUMMARY_TOP_DEFAULT;
+
 static void
 free__db_sub(struct db_sub *sub)
 {
@@ -120,6 +166,7 @@ static void
 free__db_msg(struct db_msg *msg)
 {
 	free(msg->source_id);
+	free(msg->source_username);
 	free(msg->topic);
 	free(msg->payload);
 }
@@ -131,7 +178,12 @@ print_db_client(struct db_client *client, int length)
 	printf("\tLength: %d\n", length);
 	printf("\tClient ID: %s\n", client->client_id);
 	printf("\tLast MID: %d\n", client->last_mid);
-	printf("\tDisconnect time: %ld\n", client->disconnect_t);
+	if(db_version >= 5){
+		printf("\tSession expiry time: %" PRId64 "\n", client->session_expiry_time);
+		printf("\tSession expiry interval: %u\n", client->session_expiry_interval);
+	}else{
+		printf("\tDisconnect time: %ld\n", client->disconnect_t);
+	}
 }
 
 static void
@@ -157,6 +209,10 @@ print_db_sub(struct db_sub *sub, int length)
 	printf("\tClient ID: %s\n", sub->client_id);
 	printf("\tTopic: %s\n", sub->topic);
 	printf("\tQoS: %d\n", sub->qos);
+	if(db_version >= 5){
+		printf("\tSubscription options: %d\n", sub->options);
+		printf("\tSubscription identifier: %u\n", sub->identifier);
+	}
 }
 
 static void
@@ -173,6 +229,9 @@ print_db_msg(struct db_msg *msg, int length)
 	printf("\tTopic: %s\n", msg->topic);
 	printf("\tQoS: %d\n", msg->qos);
 	printf("\tRetain: %d\n", msg->retain);
+	if(db_version >= 5){
+		printf("\tExpiry Time: %" PRId64 "\n", msg->expiry_time);
+	}
 	printf("\tPayload Length: %d\n", msg->payloadlen);
 
 	bool binary = false;
@@ -185,30 +244,22 @@ print_db_msg(struct db_msg *msg, int length)
 }
 
 
-int persist__read_string(FILE *db_fptr, char **str)
+static int dump__read_string_len(FILE *db_fptr, char **str, uint16_t len)
 {
-	uint16_t i16temp;
-	uint16_t slen;
 	char *s = NULL;
 
-	if(fread(&i16temp, 1, sizeof(uint16_t), db_fptr) != sizeof(uint16_t)){
-		return MOSQ_ERR_INVAL;
-	}
-
-	slen = ntohs(i16temp);
-	if(slen){
-		s = mosquitto__malloc(slen+1);
+	if(len){
+		s = mosquitto__malloc(len+1);
 		if(!s){
-			fclose(db_fptr);
 			fprintf(stderr, "Error: Out of memory.\n");
 			return MOSQ_ERR_NOMEM;
 		}
-		if(fread(s, 1, slen, db_fptr) != slen){
+		if(fread(s, 1, len, db_fptr) != len){
 			mosquitto__free(s);
-			fprintf(stderr, "Error: %s.\n", strerror(errno));
+			fprintf(stderr, "Error: Persistent database is truncated.\n");
 			return MOSQ_ERR_INVAL;
 		}
-		s[slen] = '\0';
+		s[len] = '\0';
 	}
 
 	*str = s;
@@ -216,19 +267,47 @@ int persist__read_string(FILE *db_fptr, char **str)
 }
 
 
-static int db__client_chunk_restore(struct mosquitto_db *db, FILE *db_fd, struct db_client *client)
+static int dump__read_string(FILE *db_fptr, char **str)
 {
 	uint16_t i16temp;
+
+	if(fread(&i16temp, 1, sizeof(uint16_t), db_fptr) != sizeof(uint16_t)){
+		fprintf(stderr, "Error: Persistent database is truncated.\n");
+		return MOSQ_ERR_INVAL;
+	}
+	return dump__read_string_len(db_fptr, str, ntohs(i16temp));
+}
+
+
+/* Skip over the rest of a chunk, given how much of it has been read. */
+static int dump__skip(FILE *db_fptr, uint32_t length, uint32_t used)
+{
+	if(used > length) return 1;
+	if(used < length && fseek(db_fptr, length - used, SEEK_CUR)) return 1;
+	return 0;
+}
+
+
+static int db__client_chunk_restore(FILE *db_fd, uint32_t length, struct db_client *client)
+{
+	struct PF_client F;
+	uint16_t i16temp;
 	int rc = 0;
-	struct client_chunk *cc;
 
-	rc = persist__read_string(db_fd, &client->client_id);
-	if(rc){
-		fprintf(stderr, "Error: Corrupt persistent database.");
-		fclose(db_fd);
-		return rc;
+	if(db_version >= 5){
+		read_e(db_fd, &F, sizeof(struct PF_client));
+		client->session_expiry_time = F.session_expiry_time;
+		client->session_expiry_interval = ntohl(F.session_expiry_interval);
+		client->last_mid = ntohs(F.last_mid);
+		rc = dump__read_string_len(db_fd, &client->client_id, ntohs(F.id_len));
+		if(rc) return rc;
+		if(dump__skip(db_fd, length, sizeof(struct PF_client) + ntohs(F.id_len))) goto error;
+		return 0;
 	}
 
+	rc = dump__read_string(db_fd, &client->client_id);
+	if(rc) return rc;
+
 	read_e(db_fd, &i16temp, sizeof(uint16_t));
 	client->last_mid = ntohs(i16temp);
 
@@ -238,39 +317,38 @@ static int db__client_chunk_restore(struct mosquitto_db *db, FILE *db_fd, struct
 		read_e(db_fd, &client->disconnect_t, sizeof(time_t));
 	}
 
-	if(client_stats){
-		cc = calloc(1, sizeof(struct client_chunk));
-		if(!cc){
-			errno = ENOMEM;
-			goto error;
-		}
-		cc->id = strdup(client->client_id);
-		HASH_ADD_KEYPTR(hh_id, clients_by_id, cc->id, strlen(cc->id), cc);
-	}
-
-	return rc;
+	return 0;
 error:
-	fprintf(stderr, "Error: %s.", strerror(errno));
-	if(db_fd) fclose(db_fd);
-	free(client->client_id);
+	fprintf(stderr, "Error: Persistent database is truncated.\n");
 	return 1;
 }
 
-static int db__client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fd, uint32_t length, struct db_client_msg *msg)
+static int db__client_msg_chunk_restore(FILE *db_fd, uint32_t length, struct db_client_msg *msg)
 {
+	struct PF_client_msg F;
 	dbid_t i64temp;
 	uint16_t i16temp;
-	struct client_chunk *cc;
-	struct msg_store_chunk *msc;
 	int rc;
 
-	rc = persist__read_string(db_fd, &msg->client_id);
-	if(rc){
-		fprintf(stderr, "Error: Corrupt persistent database.");
-		fclose(db_fd);
-		return rc;
+	if(db_version >= 5){
+		read_e(db_fd, &F, sizeof(struct PF_client_msg));
+		msg->store_id = F.store_id;
+		msg->mid = ntohs(F.mid);
+		msg->qos = F.qos;
+		msg->state = F.state;
+		msg->retain = (F.retain_dup&0xF0)>>4;
+		msg->dup = F.retain_dup&0x0F;
+		msg->direction = F.direction;
+		rc = dump__read_string_len(db_fd, &msg->client_id, ntohs(F.id_len));
+		if(rc) return rc;
+		/* Any properties are skipped. */
+		if(dump__skip(db_fd, length, sizeof(struct PF_client_msg) + ntohs(F.id_len))) goto error;
+		return 0;
 	}
 
+	rc = dump__read_string(db_fd, &msg->client_id);
+	if(rc) return rc;
+
 	read_e(db_fd, &i64temp, sizeof(dbid_t));
 	msg->store_id = i64temp;
 
@@ -283,167 +361,559 @@ static int db__client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fd, ui
 	read_e(db_fd, &msg->state, sizeof(uint8_t));
 	read_e(db_fd, &msg->dup, sizeof(uint8_t));
 
-	if(client_stats){
-		HASH_FIND(hh_id, clients_by_id, msg->client_id, strlen(msg->client_id), cc);
-		if(cc){
-			cc->messages++;
-			cc->message_size += length;
-
-			HASH_FIND(hh, msgs_by_id, &msg->store_id, sizeof(dbid_t), msc);
-			if(msc){
-				cc->message_size += msc->length;
-			}
-		}
-	}
-
 	return 0;
 error:
-	fprintf(stderr, "Error: %s.", strerror(errno));
-	if(db_fd) fclose(db_fd);
-	free(msg->client_id);
+	fprintf(stderr, "Error: Persistent database is truncated.\n");
 	return 1;
 }
 
-static int db__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fd, uint32_t length, struct db_msg *msg)
+/* The payload is only read if want_payload is set, otherwise it is skipped
+ * over. */
+static int db__msg_store_chunk_restore(FILE *db_fd, uint32_t length, struct db_msg *msg, bool want_payload)
 {
+	struct PF_msg_store F;
 	dbid_t i64temp;
 	uint32_t i32temp;
 	uint16_t i16temp;
+	uint32_t used;
 	int rc = 0;
-	struct msg_store_chunk *mcs;
 
-	read_e(db_fd, &i64temp, sizeof(dbid_t));
-	msg->store_id = i64temp;
-
-	rc = persist__read_string(db_fd, &msg->source_id);
-	if(rc){
-		fprintf(stderr, "Error: Corrupt persistent database.");
-		fclose(db_fd);
-		return rc;
-	}
-	if(db_version == 4){
-		rc = persist__read_string(db_fd, &msg->source_username);
-		if(rc){
-			fprintf(stderr, "Error: %s.", strerror(errno));
-			fclose(db_fd);
-			free(msg->source_id);
-			free(msg->topic);
-			free(msg->payload);
-			free(msg->source_id);
-			return 1;
+	if(db_version >= 5){
+		read_e(db_fd, &F, sizeof(struct PF_msg_store));
+		msg->store_id = F.store_id;
+		msg->expiry_time = F.expiry_time;
+		msg->payloadlen = ntohl(F.payloadlen);
+		msg->source_mid = ntohs(F.source_mid);
+		msg->source_port = ntohs(F.source_port);
+		msg->qos = F.qos;
+		msg->retain = F.retain;
+		used = sizeof(struct PF_msg_store) + ntohs(F.source_id_len) + ntohs(F.source_username_len) + ntohs(F.topic_len);
+
+		rc = dump__read_string_len(db_fd, &msg->source_id, ntohs(F.source_id_len));
+		if(rc) return rc;
+		rc = dump__read_string_len(db_fd, &msg->source_username, ntohs(F.source_username_len));
+		if(rc) return rc;
+		rc = dump__read_string_len(db_fd, &msg->topic, ntohs(F.topic_len));
+		if(rc) return rc;
+	}else{
+		read_e(db_fd, &i64temp, sizeof(dbid_t));
+		msg->store_id = i64temp;
+
+		rc = dump__read_string(db_fd, &msg->source_id);
+		if(rc) return rc;
+		if(db_version == 4){
+			rc = dump__read_string(db_fd, &msg->source_username);
+			if(rc) return rc;
+			read_e(db_fd, &i16temp, sizeof(uint16_t));
+			msg->source_port = ntohs(i16temp);
 		}
+
 		read_e(db_fd, &i16temp, sizeof(uint16_t));
-		msg->source_port = ntohs(i16temp);
-	}
+		msg->source_mid = ntohs(i16temp);
 
+		read_e(db_fd, &i16temp, sizeof(uint16_t));
+		msg->mid = ntohs(i16temp);
 
-	read_e(db_fd, &i16temp, sizeof(uint16_t));
-	msg->source_mid = ntohs(i16temp);
+		rc = dump__read_string(db_fd, &msg->topic);
+		if(rc) return rc;
 
-	read_e(db_fd, &i16temp, sizeof(uint16_t));
-	msg->mid = ntohs(i16temp);
+		read_e(db_fd, &msg->qos, sizeof(uint8_t));
+		read_e(db_fd, &msg->retain, sizeof(uint8_t));
 
-	rc = persist__read_string(db_fd, &msg->topic);
-	if(rc){
-		fprintf(stderr, "Error: Corrupt persistent database.");
-		fclose(db_fd);
-		return rc;
+		read_e(db_fd, &i32temp, sizeof(uint32_t));
+		msg->payloadlen = ntohl(i32temp);
+		used = 0;
 	}
 
-	read_e(db_fd, &msg->qos, sizeof(uint8_t));
-	read_e(db_fd, &msg->retain, sizeof(uint8_t));
-	
-	read_e(db_fd, &i32temp, sizeof(uint32_t));
-	msg->payloadlen = ntohl(i32temp);
-
-	if(msg->payloadlen){
-		msg->payload = malloc(msg->payloadlen+1);
+	if(msg->payloadlen && want_payload){
+		msg->payload = calloc(1, msg->payloadlen+1);
 		if(!msg->payload){
-			fclose(db_fd);
-			free(msg->source_id);
-			free(msg->topic);
-			fprintf(stderr, "Error: Out of memory.");
-			return 1;
-		}
-		memset(msg->payload, 0, msg->payloadlen+1);
-		if(fread(msg->payload, 1, msg->payloadlen, db_fd) != msg->payloadlen){
-			fprintf(stderr, "Error: %s.", strerror(errno));
-			fclose(db_fd);
-			free(msg->source_id);
-			free(msg->topic);
-			free(msg->payload);
+			fprintf(stderr, "Error: Out of memory.\n");
 			return 1;
 		}
+		read_e(db_fd, msg->payload, msg->payloadlen);
+	}else if(msg->payloadlen){
+		if(fseek(db_fd, msg->payloadlen, SEEK_CUR)) goto error;
 	}
 
-	if(client_stats){
-		mcs = calloc(1, sizeof(struct msg_store_chunk));
-		if(!mcs){
-			errno = ENOMEM;
-			goto error;
-		}
-		mcs->store_id = msg->store_id;
-		mcs->length = length;
-		HASH_ADD(hh, msgs_by_id, store_id, sizeof(dbid_t), mcs);
+	if(db_version >= 5){
+		/* Any properties are skipped. */
+		if(dump__skip(db_fd, length, used + msg->payloadlen)) goto error;
 	}
 
 	return rc;
 error:
-	fprintf(stderr, "Error: %s.", strerror(errno));
-	if(db_fd) fclose(db_fd);
-	free(msg->source_id);
-	free(msg->topic);
+	fprintf(stderr, "Error: Persistent database is truncated.\n");
 	return 1;
 }
 
-static int db__retain_chunk_restore(struct mosquitto_db *db, FILE *db_fd)
+static int db__retain_chunk_restore(FILE *db_fd, dbid_t *store_id)
 {
-	dbid_t i64temp, store_id;
+	dbid_t i64temp;
 
+	/* The length of retain chunks isn't reliable in older files, but the
+	 * chunk is always just the store id. */
 	if(fread(&i64temp, sizeof(dbid_t), 1, db_fd) != 1){
-		fprintf(stderr, "Error: %s.", strerror(errno));
-		fclose(db_fd);
+		fprintf(stderr, "Error: Persistent database is truncated.\n");
 		return 1;
 	}
-	store_id = i64temp;
-	if(do_print) printf("\tStore ID: %" PRIu64 "\n", store_id);
+	*store_id = i64temp;
 	return 0;
 }
 
-static int db__sub_chunk_restore(struct mosquitto_db *db, FILE *db_fd, uint32_t length, struct db_sub *sub)
+static int db__sub_chunk_restore(FILE *db_fd, uint32_t length, struct db_sub *sub)
 {
+	struct PF_sub F;
 	int rc = 0;
+
+	if(db_version >= 5){
+		read_e(db_fd, &F, sizeof(struct PF_sub));
+		sub->identifier = ntohl(F.identifier);
+		sub->qos = F.qos;
+		sub->options = F.options;
+		rc = dump__read_string_len(db_fd, &sub->client_id, ntohs(F.id_len));
+		if(rc) return rc;
+		rc = dump__read_string_len(db_fd, &sub->topic, ntohs(F.topic_len));
+		if(rc) return rc;
+		if(dump__skip(db_fd, length, sizeof(struct PF_sub) + ntohs(F.id_len) + ntohs(F.topic_len))) goto error;
+		return 0;
+	}
+
+	rc = dump__read_string(db_fd, &sub->client_id);
+	if(rc) return rc;
+
+	rc = dump__read_string(db_fd, &sub->topic);
+	if(rc) return rc;
+
+	read_e(db_fd, &sub->qos, sizeof(uint8_t));
+
+	return rc;
+error:
+	fprintf(stderr, "Error: Persistent database is truncated.\n");
+	return 1;
+}
+
+static int db__index_chunk_print(FILE *db_fd, uint32_t length)
+{
+	struct PF_index_entry entry;
+	uint64_t offset;
+
+	printf("DB_CHUNK_INDEX:\n");
+	printf("\tLength: %d\n", length);
+	if(length < sizeof(uint64_t) || (length - sizeof(uint64_t)) % sizeof(struct PF_index_entry)){
+		fprintf(stderr, "Error: Corrupt persistent database index.\n");
+		return 1;
+	}
+	while(length > sizeof(uint64_t)){
+		read_e(db_fd, &entry, sizeof(struct PF_index_entry));
+		printf("\tSection: chunk %u, count %u, offset %" PRIu64 ", length %" PRIu64 "\n",
+				ntohl(entry.chunk), ntohl(entry.count), entry.offset, entry.length);
+		length -= sizeof(struct PF_index_entry);
+	}
+	read_e(db_fd, &offset, sizeof(uint64_t));
+	printf("\tIndex offset: %" PRIu64 "\n", offset);
+	return 0;
+error:
+	fprintf(stderr, "Error: Persistent database is truncated.\n");
+	return 1;
+}
+
+
+/* ================================================================
+ * --client-stats
+ * ================================================================ */
+
+static int client_stats__client(struct db_client *client)
+{
 	struct client_chunk *cc;
 
-	rc = persist__read_string(db_fd, &sub->client_id);
-	if(rc){
-		fprintf(stderr, "Error: Corrupt persistent database.");
-		fclose(db_fd);
-		return rc;
+	cc = calloc(1, sizeof(struct client_chunk));
+	if(!cc){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
 	}
+	cc->id = strdup(client->client_id);
+	if(!cc->id){
+		free(cc);
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	HASH_ADD_KEYPTR(hh_id, clients_by_id, cc->id, strlen(cc->id), cc);
+	return 0;
+}
+
+static void client_stats__client_msg(struct db_client_msg *msg, uint32_t length)
+{
+	struct client_chunk *cc;
+	struct msg_store_chunk *msc;
+
+	HASH_FIND(hh_id, clients_by_id, msg->client_id, strlen(msg->client_id), cc);
+	if(cc){
+		cc->messages++;
+		cc->message_size += length;
 
-	rc = persist__read_string(db_fd, &sub->topic);
-	if(rc){
-		fprintf(stderr, "Error: Corrupt persistent database.");
-		fclose(db_fd);
-		return rc;
+		HASH_FIND(hh, msgs_by_id, &msg->store_id, sizeof(dbid_t), msc);
+		if(msc){
+			cc->message_size += msc->length;
+		}
 	}
+}
 
-	read_e(db_fd, &sub->qos, sizeof(uint8_t));
+static int client_stats__msg_store(struct db_msg *msg, uint32_t length)
+{
+	struct msg_store_chunk *mcs;
 
-	if(client_stats){
-		HASH_FIND(hh_id, clients_by_id, sub->client_id, strlen(sub->client_id), cc);
-		if(cc){
-			cc->subscriptions++;
-			cc->subscription_size += length;
+	mcs = calloc(1, sizeof(struct msg_store_chunk));
+	if(!mcs){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	mcs->store_id = msg->store_id;
+	mcs->length = length;
+	HASH_ADD(hh, msgs_by_id, store_id, sizeof(dbid_t), mcs);
+	return 0;
+}
+
+static void client_stats__sub(struct db_sub *sub, uint32_t length)
+{
+	struct client_chunk *cc;
+
+	HASH_FIND(hh_id, clients_by_id, sub->client_id, strlen(sub->client_id), cc);
+	if(cc){
+		cc->subscriptions++;
+		cc->subscription_size += length;
+	}
+}
+
+
+/* ================================================================
+ * --summary
+ *
+ * The file is read as a stream. Clients are reported as their queued
+ * messages are read, which works because each client's messages are written
+ * together. The only table kept is a small record for each stored message,
+ * which is needed to size client queues, find retained messages and spot
+ * stores that nothing refers to. The stored messages are read a second time
+ * to find the topics of the largest retained messages.
+ * ================================================================ */
+
+static void summary__print_string(const char *str)
+{
+	const unsigned char *s = (const unsigned char *)str;
+
+	if(summary_format == sf_csv){
+		if(strpbrk(str, ",\"\r\n") == NULL){
+			printf("%s", str);
+			return;
+		}
+		putchar('"');
+		for(; *s; s++){
+			if(*s == '"') putchar('"');
+			putchar(*s);
+		}
+		putchar('"');
+	}else{
+		putchar('"');
+		for(; *s; s++){
+			if(*s == '"' || *s == '\\'){
+				putchar('\\');
+				putchar(*s);
+			}else if(*s < 0x20){
+				printf("\\u%04x", *s);
+			}else{
+				putchar(*s);
+			}
 		}
+		putchar('"');
 	}
+}
 
-	return rc;
-error:
-	fprintf(stderr, "Error: %s.", strerror(errno));
-	if(db_fd >= 0) fclose(db_fd);
-	return 1;
+static int summary__store_cmp(const void *a, const void *b)
+{
+	dbid_t id_a = ((const struct summary_store *)a)->store_id;
+	dbid_t id_b = ((const struct summary_store *)b)->store_id;
+
+	if(id_a < id_b) return -1;
+	if(id_a > id_b) return 1;
+	return 0;
+}
+
+static struct summary_store *summary__store_find(dbid_t store_id)
+{
+	struct summary_store key;
+
+	if(!summary_stores_sorted){
+		qsort(summary_stores, summary_store_count, sizeof(struct summary_store), summary__store_cmp);
+		summary_stores_sorted = true;
+	}
+	key.store_id = store_id;
+	return bsearch(&key, summary_stores, summary_store_count, sizeof(struct summary_store), summary__store_cmp);
+}
+
+static int summary__msg_store(struct db_msg *msg)
+{
+	struct summary_store *stores_new;
+	struct summary_store *store;
+	int bucket;
+	uint32_t len;
+
+	if(summary_store_count == summary_store_size){
+		summary_store_size = summary_store_size ? summary_store_size*2 : 1024;
+		stores_new = realloc(summary_stores, summary_store_size*sizeof(struct summary_store));
+		if(!stores_new){
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+		summary_stores = stores_new;
+	}
+	store = &summary_stores[summary_store_count];
+	memset(store, 0, sizeof(struct summary_store));
+	store->store_id = msg->store_id;
+	store->payloadlen = msg->payloadlen;
+	if(summary_store_count > 0 && store[-1].store_id > store->store_id){
+		summary_stores_sorted = false;
+	}
+	summary_store_count++;
+
+	/* Bucket 0 is empty payloads, bucket n is payloads of 2^(n-1) to
+	 * 2^n - 1 bytes. */
+	bucket = 0;
+	for(len = msg->payloadlen; len; len >>= 1){
+		bucket++;
+	}
+	summary_size_count[bucket]++;
+	summary_size_bytes[bucket] += msg->payloadlen;
+	return 0;
+}
+
+static void summary__client_end(void)
+{
+	if(!summary_client_id) return;
+
+	if(summary_format == sf_csv){
+		printf("client,");
+		summary__print_string(summary_client_id);
+		printf(",%ld,%" PRIu64 "\n", summary_client_messages, summary_client_bytes);
+	}else{
+		printf("%s\n    {\"id\": ", summary_client_rows ? "," : "");
+		summary__print_string(summary_client_id);
+		printf(", \"messages\": %ld, \"bytes\": %" PRIu64 "}", summary_client_messages, summary_client_bytes);
+	}
+	summary_client_rows++;
+	free(summary_client_id);
+	summary_client_id = NULL;
+}
+
+static int summary__client_msg(struct db_client_msg *msg)
+{
+	struct summary_store *store;
+
+	if(!msg->client_id) return 0;
+
+	if(!summary_client_id || strcmp(summary_client_id, msg->client_id)){
+		summary__client_end();
+		summary_client_id = msg->client_id;
+		msg->client_id = NULL;
+		summary_client_messages = 0;
+		summary_client_bytes = 0;
+	}
+	summary_client_messages++;
+
+	store = summary__store_find(msg->store_id);
+	if(store){
+		summary_client_bytes += store->payloadlen;
+		if(store->refs < UINT16_MAX) store->refs++;
+	}
+	return 0;
+}
+
+static void summary__retain(dbid_t store_id)
+{
+	struct summary_store *store;
+
+	store = summary__store_find(store_id);
+	if(store){
+		store->retained = 1;
+	}
+}
+
+/* Keep the largest retained messages in a min-heap, so the smallest of those
+ * kept so far is the one to replace. */
+static void summary__top_sift_down(int i)
+{
+	struct summary_top tmp;
+	int child;
+
+	while((child = 2*i + 1) < summary_top_count){
+		if(child + 1 < summary_top_count && summary_top[child+1].bytes < summary_top[child].bytes){
+			child++;
+		}
+		if(summary_top[i].bytes <= summary_top[child].bytes) break;
+		tmp = summary_top[i];
+		summary_top[i] = summary_top[child];
+		summary_top[child] = tmp;
+		i = child;
+	}
+}
+
+static void summary__top_add(struct db_msg *msg)
+{
+	struct summary_top tmp;
+	int i;
+
+	if(summary_top_size == 0) return;
+
+	if(summary_top_count < summary_top_size){
+		i = summary_top_count++;
+		summary_top[i].topic = msg->topic;
+		summary_top[i].bytes = msg->payloadlen;
+		msg->topic = NULL;
+		while(i > 0 && summary_top[(i-1)/2].bytes > summary_top[i].bytes){
+			tmp = summary_top[i];
+			summary_top[i] = summary_top[(i-1)/2];
+			summary_top[(i-1)/2] = tmp;
+			i = (i-1)/2;
+		}
+	}else if(msg->payloadlen > summary_top[0].bytes){
+		free(summary_top[0].topic);
+		summary_top[0].topic = msg->topic;
+		summary_top[0].bytes = msg->payloadlen;
+		msg->topic = NULL;
+		summary__top_sift_down(0);
+	}
+}
+
+static int summary__top_cmp(const void *a, const void *b)
+{
+	uint32_t bytes_a = ((const struct summary_top *)a)->bytes;
+	uint32_t bytes_b = ((const struct summary_top *)b)->bytes;
+
+	if(bytes_a > bytes_b) return -1;
+	if(bytes_a < bytes_b) return 1;
+	return 0;
+}
+
+/* Second pass over the stored messages, picking out the largest retained
+ * ones now that the retain chunks have all been seen. */
+static int summary__retained_read(FILE *fd, long data_start)
+{
+	struct summary_store *store;
+	struct PF_header header;
+	uint16_t i16temp;
+	uint32_t i32temp, length;
+	uint32_t chunk;
+	int rc;
+
+	if(fseek(fd, data_start, SEEK_SET)) return 1;
+
+	while(1){
+		if(db_version >= 5){
+			if(fread(&header, sizeof(struct PF_header), 1, fd) != 1) break;
+			chunk = ntohl(header.chunk);
+			length = ntohl(header.length);
+		}else{
+			if(fread(&i16temp, sizeof(uint16_t), 1, fd) != 1) break;
+			chunk = ntohs(i16temp);
+			if(fread(&i32temp, sizeof(uint32_t), 1, fd) != 1) return 1;
+			length = ntohl(i32temp);
+		}
+
+		if(chunk == DB_CHUNK_MSG_STORE){
+			struct db_msg msg = {0};
+			rc = db__msg_store_chunk_restore(fd, length, &msg, false);
+			if(rc == 0 && msg.topic){
+				store = summary__store_find(msg.store_id);
+				if(store && store->retained){
+					summary__top_add(&msg);
+				}
+			}
+			free__db_msg(&msg);
+			if(rc) return rc;
+		}else if(fseek(fd, length, SEEK_CUR)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void summary__print(long *counts)
+{
+	const char *names[] = {"cfg", "msg_store", "client_msg", "retain", "sub", "client"};
+	uint64_t max_bytes;
+	long orphan_count = 0;
+	uint64_t orphan_bytes = 0;
+	long i;
+	int j;
+	bool first;
+
+	for(i=0; i<summary_store_count; i++){
+		if(summary_stores[i].refs == 0 && summary_stores[i].retained == 0){
+			orphan_count++;
+			orphan_bytes += summary_stores[i].payloadlen;
+		}
+	}
+	qsort(summary_top, summary_top_count, sizeof(struct summary_top), summary__top_cmp);
+
+	if(summary_format == sf_csv){
+		for(j=0; j<6; j++){
+			printf("chunk,%s,%ld,\n", names[j], counts[j]);
+		}
+		for(j=0; j<SUMMARY_SIZE_BUCKETS; j++){
+			if(summary_size_count[j] == 0) continue;
+			max_bytes = j ? ((uint64_t)1<<j) - 1 : 0;
+			printf("payload_size,%" PRIu64 ",%ld,%" PRIu64 "\n", max_bytes, summary_size_count[j], summary_size_bytes[j]);
+		}
+		for(j=0; j<summary_top_count; j++){
+			printf("retained,");
+			summary__print_string(summary_top[j].topic);
+			printf(",1,%u\n", summary_top[j].bytes);
+		}
+		printf("orphaned,stores,%ld,%" PRIu64 "\n", orphan_count, orphan_bytes);
+		return;
+	}
+
+	printf("\n  ],\n  \"chunks\": {");
+	for(j=0; j<6; j++){
+		printf("%s\"%s\": %ld", j ? ", " : "", names[j], counts[j]);
+	}
+	printf("},\n  \"payload_sizes\": [");
+	first = true;
+	for(j=0; j<SUMMARY_SIZE_BUCKETS; j++){
+		if(summary_size_count[j] == 0) continue;
+		max_bytes = j ? ((uint64_t)1<<j) - 1 : 0;
+		printf("%s\n    {\"max_bytes\": %" PRIu64 ", \"count\": %ld, \"bytes\": %" PRIu64 "}",
+				first ? "" : ",", max_bytes, summary_size_count[j], summary_size_bytes[j]);
+		first = false;
+	}
+	printf("\n  ],\n  \"retained_top\": [");
+	for(j=0; j<summary_top_count; j++){
+		printf("%s\n    {\"topic\": ", j ? "," : "");
+		summary__print_string(summary_top[j].topic);
+		printf(", \"bytes\": %u}", summary_top[j].bytes);
+	}
+	printf("\n  ],\n  \"orphaned_stores\": {\"count\": %ld, \"bytes\": %" PRIu64 "}\n}\n", orphan_count, orphan_bytes);
+}
+
+static void summary__cleanup(void)
+{
+	int i;
+
+	free(summary_client_id);
+	summary_client_id = NULL;
+	for(i=0; i<summary_top_count; i++){
+		free(summary_top[i].topic);
+	}
+	free(summary_top);
+	summary_top = NULL;
+	free(summary_stores);
+	summary_stores = NULL;
+}
+
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: db_dump [--stats | --client-stats] <mosquitto db filename>\n");
+	fprintf(stderr, "       db_dump --summary [--json | --csv] [--top <count>] <mosquitto db filename>\n");
 }
 
 int main(int argc, char *argv[])
@@ -452,38 +922,67 @@ int main(int argc, char *argv[])
 	char header[15];
 	int rc = 0;
 	uint32_t crc;
+	struct PF_cfg cfg;
+	struct PF_header chunk_header;
 	dbid_t i64temp;
+	dbid_t store_id;
 	uint32_t i32temp, length;
-	uint16_t i16temp, chunk;
+	uint32_t chunk;
+	uint16_t i16temp;
 	uint8_t i8temp;
 	ssize_t rlen;
-	struct mosquitto_db db;
-	char *filename;
-	long cfg_count = 0;
-	long msg_store_count = 0;
-	long client_msg_count = 0;
-	long retain_count = 0;
-	long sub_count = 0;
-	long client_count = 0;
+	char *filename = NULL;
+	long counts[6] = {0, 0, 0, 0, 0, 0};
+	long data_start;
 	struct client_chunk *cc, *cc_tmp;
-
-	if(argc == 2){
-		filename = argv[1];
-	}else if(argc == 3 && !strcmp(argv[1], "--stats")){
-		stats = 1;
-		do_print = 0;
-		filename = argv[2];
-	}else if(argc == 3 && !strcmp(argv[1], "--client-stats")){
-		client_stats = 1;
-		do_print = 0;
-		filename = argv[2];
-	}else{
-		fprintf(stderr, "Usage: db_dump [--stats | --client-stats] <mosquitto db filename>\n");
+	struct msg_store_chunk *msc, *msc_tmp;
+	int i;
+
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "--stats")){
+			stats = 1;
+			do_print = 0;
+		}else if(!strcmp(argv[i], "--client-stats")){
+			client_stats = 1;
+			do_print = 0;
+		}else if(!strcmp(argv[i], "--summary")){
+			summary = 1;
+			do_print = 0;
+		}else if(!strcmp(argv[i], "--json")){
+			summary_format = sf_json;
+		}else if(!strcmp(argv[i], "--csv")){
+			summary_format = sf_csv;
+		}else if(!strcmp(argv[i], "--top") && i+1 < argc){
+			summary_top_size = atoi(argv[i+1]);
+			if(summary_top_size < 0){
+				print_usage();
+				return 1;
+			}
+			i++;
+		}else if(i == argc-1 && argv[i][0] != '-'){
+			filename = argv[i];
+		}else{
+			print_usage();
+			return 1;
+		}
+	}
+	if(!filename || stats + client_stats + summary > 1){
+		print_usage();
 		return 1;
 	}
-	memset(&db, 0, sizeof(struct mosquitto_db));
+	if(summary && summary_top_size > 0){
+		summary_top = calloc(summary_top_size, sizeof(struct summary_top));
+		if(!summary_top){
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+	}
+
 	fd = fopen(filename, "rb");
-	if(!fd) return 0;
+	if(!fd){
+		fprintf(stderr, "Error: Unable to open %s: %s.\n", filename, strerror(errno));
+		return 1;
+	}
 	read_e(fd, &header, 15);
 	if(!memcmp(header, magic, 15)){
 		if(do_print) printf("Mosquitto DB dump\n");
@@ -493,19 +992,51 @@ int main(int argc, char *argv[])
 		read_e(fd, &i32temp, sizeof(uint32_t));
 		db_version = ntohl(i32temp);
 		if(do_print) printf("DB version: %d\n", db_version);
+		if(db_version < 2 || db_version > MOSQ_DB_VERSION){
+			fprintf(stderr, "Error: Unsupported persistent database format version %d.\n", db_version);
+			fclose(fd);
+			return 1;
+		}
+		data_start = ftell(fd);
 
-		while(rlen = fread(&i16temp, sizeof(uint16_t), 1, fd), rlen == 1){
-			chunk = ntohs(i16temp);
-			read_e(fd, &i32temp, sizeof(uint32_t));
-			length = ntohl(i32temp);
+		if(summary){
+			if(summary_format == sf_csv){
+				printf("section,name,count,bytes\n");
+			}else{
+				printf("{\n  \"clients\": [");
+			}
+		}
+
+		while(1){
+			if(db_version >= 5){
+				rlen = fread(&chunk_header, sizeof(struct PF_header), 1, fd);
+				if(rlen != 1) break;
+				chunk = ntohl(chunk_header.chunk);
+				length = ntohl(chunk_header.length);
+			}else{
+				rlen = fread(&i16temp, sizeof(uint16_t), 1, fd);
+				if(rlen != 1) break;
+				chunk = ntohs(i16temp);
+				read_e(fd, &i32temp, sizeof(uint32_t));
+				length = ntohl(i32temp);
+			}
 			switch(chunk){
 				case DB_CHUNK_CFG:
-					cfg_count++;
+					counts[0]++;
 					if(do_print) printf("DB_CHUNK_CFG:\n");
 					if(do_print) printf("\tLength: %d\n", length);
-					read_e(fd, &i8temp, sizeof(uint8_t)); // shutdown
-					if(do_print) printf("\tShutdown: %d\n", i8temp);
-					read_e(fd, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
+					if(db_version >= 5){
+						read_e(fd, &cfg, sizeof(struct PF_cfg));
+						if(dump__skip(fd, length, sizeof(struct PF_cfg))) goto error;
+						i8temp = cfg.dbid_size;
+						i64temp = cfg.last_db_id;
+						if(do_print) printf("\tShutdown: %d\n", cfg.shutdown);
+					}else{
+						read_e(fd, &i8temp, sizeof(uint8_t)); // shutdown
+						if(do_print) printf("\tShutdown: %d\n", i8temp);
+						read_e(fd, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
+						read_e(fd, &i64temp, sizeof(dbid_t));
+					}
 					if(do_print) printf("\tDB ID size: %d\n", i8temp);
 					if(i8temp != sizeof(dbid_t)){
 						fprintf(stderr, "Error: Incompatible database configuration (dbid size is %d bytes, expected %ld)",
@@ -513,55 +1044,78 @@ int main(int argc, char *argv[])
 						fclose(fd);
 						return 1;
 					}
-					read_e(fd, &i64temp, sizeof(dbid_t));
 					if(do_print) printf("\tLast DB ID: %ld\n", (long)i64temp);
 					break;
 
 				case DB_CHUNK_MSG_STORE:
-					msg_store_count++;
+					counts[1]++;
 					struct db_msg msg = {0};
-					if(db__msg_store_chunk_restore(&db, fd, length, &msg)) return 1;
-					if(do_print) {
-						print_db_msg(&msg, length);
+					rc = db__msg_store_chunk_restore(fd, length, &msg, do_print);
+					if(rc == 0){
+						if(do_print) print_db_msg(&msg, length);
+						if(client_stats) rc = client_stats__msg_store(&msg, length);
+						if(summary) rc = summary__msg_store(&msg);
 					}
 					free__db_msg(&msg);
+					if(rc) goto cleanup;
 					break;
 
 				case DB_CHUNK_CLIENT_MSG:
-					client_msg_count++;
+					counts[2]++;
 					struct db_client_msg cmsg = {0};
-					if(db__client_msg_chunk_restore(&db, fd, length, &cmsg)) return 1;
-					if(do_print) {
-						print_db_client_msg(&cmsg, length);
+					rc = db__client_msg_chunk_restore(fd, length, &cmsg);
+					if(rc == 0){
+						if(do_print) print_db_client_msg(&cmsg, length);
+						if(client_stats) client_stats__client_msg(&cmsg, length);
+						if(summary) rc = summary__client_msg(&cmsg);
 					}
 					free__db_client_msg(&cmsg);
+					if(rc) goto cleanup;
 					break;
 
 				case DB_CHUNK_RETAIN:
-					retain_count++;
-					if(do_print) printf("DB_CHUNK_RETAIN:\n");
-					if(do_print) printf("\tLength: %d\n", length);
-					if(db__retain_chunk_restore(&db, fd)) return 1;
+					counts[3]++;
+					rc = db__retain_chunk_restore(fd, &store_id);
+					if(rc) goto cleanup;
+					if(do_print){
+						printf("DB_CHUNK_RETAIN:\n");
+						printf("\tLength: %d\n", length);
+						printf("\tStore ID: %" PRIu64 "\n", store_id);
+					}
+					if(summary) summary__retain(store_id);
 					break;
 
 				case DB_CHUNK_SUB:
-					sub_count++;
+					counts[4]++;
 					struct db_sub sub = {0};
-					if(db__sub_chunk_restore(&db, fd, length, &sub)) return 1;
-					if(do_print) {
-						print_db_sub(&sub, length);
+					rc = db__sub_chunk_restore(fd, length, &sub);
+					if(rc == 0){
+						if(do_print) print_db_sub(&sub, length);
+						if(client_stats) client_stats__sub(&sub, length);
 					}
 					free__db_sub(&sub);
+					if(rc) goto cleanup;
 					break;
 
 				case DB_CHUNK_CLIENT:
-					client_count++;
+					counts[5]++;
 					struct db_client client = {0};
-					if(db__client_chunk_restore(&db, fd, &client)) return 1;
-					if(do_print) {
-						print_db_client(&client, length);
+					rc = db__client_chunk_restore(fd, length, &client);
+					if(rc == 0){
+						if(do_print) print_db_client(&client, length);
+						if(client_stats) rc = client_stats__client(&client);
 					}
 					free__db_client(&client);
+					if(rc) goto cleanup;
+					break;
+
+				case DB_CHUNK_INDEX:
+					if(do_print && db_version >= 6){
+						rc = db__index_chunk_print(fd, length);
+						if(rc) goto cleanup;
+					}else{
+						fseek(fd, length, SEEK_CUR);
+					}
 					break;
 
 				default:
@@ -570,35 +1124,57 @@ int main(int argc, char *argv[])
 					break;
 			}
 		}
-		if(rlen < 0) goto error;
+		if(ferror(fd)) goto error;
+
+		if(summary){
+			summary__client_end();
+			rc = summary__retained_read(fd, data_start);
+			if(rc){
+				fprintf(stderr, "Error: Persistent database is truncated.\n");
+				goto cleanup;
+			}
+			summary__print(counts);
+		}
 	}else{
-		fprintf(stderr, "Error: Unrecognised file format.");
-		rc = 1;
+		fprintf(stderr, "Error: Unrecognised file format.\n");
+		goto cleanup;
 	}
 
 	fclose(fd);
 
 	if(stats){
-		printf("DB_CHUNK_CFG:        %ld\n", cfg_count);
-		printf("DB_CHUNK_MSG_STORE:  %ld\n", msg_store_count);
-		printf("DB_CHUNK_CLIENT_MSG: %ld\n", client_msg_count);
-		printf("DB_CHUNK_RETAIN:     %ld\n", retain_count);
-		printf("DB_CHUNK_SUB:        %ld\n", sub_count);
-		printf("DB_CHUNK_CLIENT:     %ld\n", client_count);
+		printf("DB_CHUNK_CFG:        %ld\n", counts[0]);
+		printf("DB_CHUNK_MSG_STORE:  %ld\n", counts[1]);
+		printf("DB_CHUNK_CLIENT_MSG: %ld\n", counts[2]);
+		printf("DB_CHUNK_RETAIN:     %ld\n", counts[3]);
+		printf("DB_CHUNK_SUB:        %ld\n", counts[4]);
+		printf("DB_CHUNK_CLIENT:     %ld\n", counts[5]);
 	}
 
 	if(client_stats){
 		HASH_ITER(hh_id, clients_by_id, cc, cc_tmp){
 			printf("SC: %d SS: %d MC: %d MS: %ld   ", cc->subscriptions, cc->subscription_size, cc->messages, cc->message_size);
 			printf("%s\n", cc->id);
-			free(cc->id);
 		}
 	}
+	rc = 0;
+	goto free_all;
 
-	return rc;
 error:
-	fprintf(stderr, "Error: %s.", strerror(errno));
-	if(fd >= 0) fclose(fd);
-	return 1;
+	fprintf(stderr, "Error: %s.\n", feof(fd) ? "Persistent database is truncated" : strerror(errno));
+cleanup:
+	fclose(fd);
+	rc = 1;
+free_all:
+	HASH_ITER(hh_id, clients_by_id, cc, cc_tmp){
+		HASH_DELETE(hh_id, clients_by_id, cc);
+		free(cc->id);
+		free(cc);
+	}
+	HASH_ITER(hh, msgs_by_id, msc, msc_tmp){
+		HASH_DELETE(hh, msgs_by_id, msc);
+		free(msc);
+	}
+	summary__cleanup();
+	return rc;
 }
-
@@ -79,25 +79,36 @@ static char *client_id_gen(int *idlen, const char *auto_id_prefix, int auto_id_p
 	return client_id;
 }
 
-/* Remove any queued messages that are no longer allowed through ACL,
- * assuming a possible change of username. */
-void connection_check_acl(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg **head)
+/* Does a resumed session need its messages checking against ACL again? Not if
+ * the client has the same username on the same listener and the ACLs have not
+ * been reloaded since, unless a plugin is in use, because a plugin may base its
+ * decision on anything. */
+static bool connect__acl_recheck_needed(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto *found_context)
 {
-	struct mosquitto_client_msg *msg_tail, *tmp;
+	struct mosquitto__security_options *opts;
 
-	DL_FOREACH_SAFE((*head), msg_tail, tmp){
-		if(msg_tail->direction == mosq_md_out){
-			if(mosquitto_acl_check(db, context, msg_tail->store->topic,
-								   msg_tail->store->payloadlen, UHPA_ACCESS(msg_tail->store->payload, msg_tail->store->payloadlen),
-								   msg_tail->store->qos, msg_tail->store->retain, MOSQ_ACL_READ) != MOSQ_ERR_SUCCESS){
+	if(found_context->acl_generation != db->acl_generation
+			|| found_context->listener != context->listener){
 
-				DL_DELETE((*head), msg_tail);
-				db__msg_store_ref_dec(db, &msg_tail->store);
-				mosquitto_property_free_all(&msg_tail->properties);
-				mosquitto__free(msg_tail);
-			}
+		return true;
+	}
+	if(context->username == NULL || found_context->username == NULL){
+		if(context->username != found_context->username){
+			return true;
+		}
+	}else if(strcmp(context->username, found_context->username)){
+		return true;
+	}
+
+	if(db->config->per_listener_settings){
+		if(!context->listener){
+			return true;
 		}
+		opts = &context->listener->security_options;
+	}else{
+		opts = &db->config->security_options;
 	}
+	return opts->auth_plugin_config_count > 0;
 }
 
 
@@ -107,6 +118,8 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 	struct mosquitto__subleaf *leaf;
 	mosquitto_property *connack_props = NULL;
 	uint8_t connect_ack = 0;
+	bool msgs_resumed = false;
+	bool acl_recheck = false;
 	int i;
 	int rc;
 
@@ -139,7 +152,8 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 				memset(&found_context->msgs_in, 0, sizeof(struct mosquitto_msg_data));
 				memset(&found_context->msgs_out, 0, sizeof(struct mosquitto_msg_data));
 
-				db__message_reconnect_reset(db, context);
+				msgs_resumed = true;
+				acl_recheck = connect__acl_recheck_needed(db, context, found_context);
 			}
 			context->subs = found_context->subs;
 			found_context->subs = NULL;
@@ -153,6 +167,7 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 					while(leaf){
 						if(leaf->context == found_context){
 							leaf->context = context;
+							leaf->acl_class = acl_class_unknown;
 						}
 						leaf = leaf->next;
 					}
@@ -160,6 +175,12 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 			}
 		}
 
+#ifdef WITH_PERSISTENCE
+		if(context->clean_start == true || found_context->session_expiry_interval == 0){
+			/* The old session is being discarded rather than resumed. */
+			persist__journal_client_delete(db, found_context);
+		}
+#endif
 		if(context->clean_start == true){
 			sub__clean_session(db, found_context);
 		}
@@ -178,6 +199,7 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 		free(auth_data_out);
 		return rc;
 	}
+	context->acl_generation = db->acl_generation;
 
 	if(db->config->connection_messages == true){
 		if(context->is_bridge){
@@ -213,16 +235,19 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 	context->ping_t = 0;
 	context->is_dropping = false;
 
-	connection_check_acl(db, context, &context->msgs_in.inflight);
-	connection_check_acl(db, context, &context->msgs_in.queued);
-	connection_check_acl(db, context, &context->msgs_out.inflight);
-	connection_check_acl(db, context, &context->msgs_out.queued);
+	if(msgs_resumed){
+		if(acl_recheck){
+			db__message_reconnect_acl_check(db, context);
+		}
+		db__message_reconnect_reset(db, context);
+	}
 
 	HASH_ADD_KEYPTR(hh_id, db->contexts_by_id, context->id, strlen(context->id), context);
 
 #ifdef WITH_PERSISTENCE
 	if(!context->clean_start){
 		db->persistence_changes++;
+		persist__journal_client(db, context);
 	}
 #endif
 	context->maximum_qos = context->listener->maximum_qos;
@@ -360,6 +385,129 @@ error_cleanup:
 
 
 
+/* Everything in CONNECT handling that comes after the username and password
+ * have been accepted. Takes ownership of client_id, will_struct and
+ * auth_data. */
+static int connect__finish(struct mosquitto_db *db, struct mosquitto *context, char *client_id, struct mosquitto_message_all *will_struct, uint8_t clean_start, void *auth_data, uint16_t auth_data_len)
+{
+	void *auth_data_out = NULL;
+	uint16_t auth_data_out_len = 0;
+	int rc;
+
+	if(context->listener->use_username_as_clientid){
+		if(context->username){
+			mosquitto__free(client_id);
+			client_id = mosquitto__strdup(context->username);
+			if(!client_id){
+				rc = MOSQ_ERR_NOMEM;
+				goto connect_finish_error;
+			}
+		}else{
+			if(context->protocol == mosq_p_mqtt5){
+				send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
+			}else{
+				send__connack(db, context, 0, CONNACK_REFUSED_NOT_AUTHORIZED, NULL);
+			}
+			rc = 1;
+			goto connect_finish_error;
+		}
+	}
+	context->clean_start = clean_start;
+	context->id = client_id;
+	context->will = will_struct;
+
+	if(context->auth_method){
+		rc = mosquitto_security_auth_start(db, context, false, auth_data, auth_data_len, &auth_data_out, &auth_data_out_len);
+		mosquitto__free(auth_data);
+		if(rc == MOSQ_ERR_SUCCESS){
+			return connect__on_authorised(db, context, auth_data_out, auth_data_out_len);
+		}else if(rc == MOSQ_ERR_AUTH_CONTINUE){
+			mosquitto__set_state(context, mosq_cs_authenticating);
+			rc = send__auth(db, context, MQTT_RC_CONTINUE_AUTHENTICATION, auth_data_out, auth_data_out_len);
+			free(auth_data_out);
+			return rc;
+		}else{
+			free(auth_data_out);
+			will__clear(context);
+			if(rc == MOSQ_ERR_AUTH){
+				send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
+				mosquitto__free(context->id);
+				context->id = NULL;
+				return MOSQ_ERR_PROTOCOL;
+			}else if(rc == MOSQ_ERR_NOT_SUPPORTED){
+				/* Client has requested extended authentication, but we don't support it. */
+				send__connack(db, context, 0, MQTT_RC_BAD_AUTHENTICATION_METHOD, NULL);
+				mosquitto__free(context->id);
+				context->id = NULL;
+				return MOSQ_ERR_PROTOCOL;
+			}else{
+				mosquitto__free(context->id);
+				context->id = NULL;
+				return rc;
+			}
+		}
+	}else{
+		return connect__on_authorised(db, context, NULL, 0);
+	}
+
+
+connect_finish_error:
+	mosquitto__free(auth_data);
+	mosquitto__free(client_id);
+	if(will_struct){
+		mosquitto_property_free_all(&will_struct->properties);
+		mosquitto__free(will_struct->msg.payload);
+		mosquitto__free(will_struct->msg.topic);
+		mosquitto__free(will_struct);
+	}
+	return rc;
+}
+
+
+int connect__auth_result(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__auth_job *job, int rc)
+{
+	char *client_id;
+	struct mosquitto_message_all *will_struct;
+	void *auth_data;
+
+	if(context->state != mosq_cs_auth_pending){
+		return MOSQ_ERR_SUCCESS;
+	}
+	mosquitto__set_state(context, mosq_cs_new);
+	/* Time spent waiting for the check doesn't count against keepalive. */
+	context->last_msg_in = mosquitto_time();
+
+	switch(rc){
+		case MOSQ_ERR_SUCCESS:
+			client_id = job->client_id;
+			will_struct = job->will;
+			auth_data = job->auth_data;
+			job->client_id = NULL;
+			job->will = NULL;
+			job->auth_data = NULL;
+			return connect__finish(db, context, client_id, will_struct, job->clean_start, auth_data, job->auth_data_len);
+		case MOSQ_ERR_AUTH:
+		case MOSQ_ERR_PLUGIN_DEFER:
+			if(context->protocol == mosq_p_mqtt5){
+				send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
+			}else{
+				send__connack(db, context, 0, CONNACK_REFUSED_NOT_AUTHORIZED, NULL);
+			}
+			context__disconnect(db, context);
+			return 1;
+		default:
+			/* Including a check that timed out. */
+			if(context->protocol == mosq_p_mqtt5){
+				send__connack(db, context, 0, MQTT_RC_SERVER_UNAVAILABLE, NULL);
+			}else{
+				send__connack(db, context, 0, CONNACK_REFUSED_SERVER_UNAVAILABLE, NULL);
+			}
+			context__disconnect(db, context);
+			return 1;
+	}
+}
+
+
 int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
 {
 	char protocol_name[7];
@@ -376,8 +524,6 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
 	mosquitto_property *properties = NULL;
 	void *auth_data = NULL;
 	uint16_t auth_data_len = 0;
-	void *auth_data_out = NULL;
-	uint16_t auth_data_out_len = 0;
 #ifdef WITH_TLS
 	int i;
 	X509 *client_cert = NULL;
@@ -783,6 +929,25 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
 					rc = 1;
 					goto handle_connect_error;
 					break;
+				case MOSQ_ERR_AUTH_PENDING:
+					if(!context->auth_job){
+						context__disconnect(db, context);
+						rc = 1;
+						goto handle_connect_error;
+					}
+					/* The password is being checked by the auth thread
+					 * pool or an auth plugin. Stop reading from the client
+					 * and park the rest of the CONNECT until the result
+					 * comes back. */
+					context->username = username;
+					context->password = password;
+					context->auth_job->client_id = client_id;
+					context->auth_job->will = will_struct;
+					context->auth_job->clean_start = clean_start;
+					context->auth_job->auth_data = auth_data;
+					context->auth_job->auth_data_len = auth_data_len;
+					mosquitto__set_state(context, mosq_cs_auth_pending);
+					return MOSQ_ERR_SUCCESS;
 				default:
 					context__disconnect(db, context);
 					rc = 1;
@@ -810,62 +975,7 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
 	}
 #endif
 
-	if(context->listener->use_username_as_clientid){
-		if(context->username){
-			mosquitto__free(client_id);
-			client_id = mosquitto__strdup(context->username);
-			if(!client_id){
-				rc = MOSQ_ERR_NOMEM;
-				goto handle_connect_error;
-			}
-		}else{
-			if(context->protocol == mosq_p_mqtt5){
-				send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
-			}else{
-				send__connack(db, context, 0, CONNACK_REFUSED_NOT_AUTHORIZED, NULL);
-			}
-			rc = 1;
-			goto handle_connect_error;
-		}
-	}
-	context->clean_start = clean_start;
-	context->id = client_id;
-	context->will = will_struct;
-
-	if(context->auth_method){
-		rc = mosquitto_security_auth_start(db, context, false, auth_data, auth_data_len, &auth_data_out, &auth_data_out_len);
-		mosquitto__free(auth_data);
-		if(rc == MOSQ_ERR_SUCCESS){
-			return connect__on_authorised(db, context, auth_data_out, auth_data_out_len);
-		}else if(rc == MOSQ_ERR_AUTH_CONTINUE){
-			mosquitto__set_state(context, mosq_cs_authenticating);
-			rc = send__auth(db, context, MQTT_RC_CONTINUE_AUTHENTICATION, auth_data_out, auth_data_out_len);
-			free(auth_data_out);
-			return rc;
-		}else{
-			free(auth_data_out);
-			will__clear(context);
-			if(rc == MOSQ_ERR_AUTH){
-				send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
-				mosquitto__free(context->id);
-				context->id = NULL;
-				return MOSQ_ERR_PROTOCOL;
-			}else if(rc == MOSQ_ERR_NOT_SUPPORTED){
-				/* Client has requested extended authentication, but we don't support it. */
-				send__connack(db, context, 0, MQTT_RC_BAD_AUTHENTICATION_METHOD, NULL);
-				mosquitto__free(context->id);
-				context->id = NULL;
-				return MOSQ_ERR_PROTOCOL;
-			}else{
-				mosquitto__free(context->id);
-				context->id = NULL;
-				return rc;
-			}
-		}
-	}else{
-		return connect__on_authorised(db, context, NULL, 0);
-	}
-
+	return connect__finish(db, context, client_id, will_struct, clean_start, auth_data, auth_data_len);
 
 handle_connect_error:
 	mosquitto__free(auth_data);
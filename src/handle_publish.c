@@ -32,6 +32,22 @@ Contributors:
 #include "util_mosq.h"
 
 
+/* Acknowledge an accepted message, which with group-commit durability waits
+ * until the message is safely in the persistence journal. */
+static int handle__publish_ack(struct mosquitto_db *db, struct mosquitto *context, int command, uint16_t mid, uint8_t reason_code)
+{
+#ifdef WITH_PERSISTENCE
+	return persist__journal_ack(db, context, command, mid, reason_code);
+#else
+	if(command == CMD_PUBACK){
+		return send__puback(context, mid, reason_code);
+	}else{
+		return send__pubrec(context, mid, reason_code);
+	}
+#endif
+}
+
+
 int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 {
 	char *topic;
@@ -245,7 +261,11 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 	}
 
 	payloadlen = context->in_packet.remaining_length - context->in_packet.pos;
-	G_PUB_BYTES_RECEIVED_INC(payloadlen);
+	if(!context->auth_resolved){
+		/* Already counted if this is the PUBLISH being handled again after
+		 * a pending ACL check. */
+		G_PUB_BYTES_RECEIVED_INC(payloadlen);
+	}
 	if(context->listener && context->listener->mount_point){
 		len = strlen(context->listener->mount_point) + strlen(topic) + 1;
 		topic_mount = mosquitto__malloc(len+1);
@@ -282,8 +302,16 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 	}
 
 	/* Check for topic access */
-	rc = mosquitto_acl_check(db, context, topic, payloadlen, UHPA_ACCESS(payload, payloadlen), qos, retain, MOSQ_ACL_WRITE);
-	if(rc == MOSQ_ERR_ACL_DENIED){
+	rc = mosquitto_acl_check_publish(db, context, topic, payloadlen, UHPA_ACCESS(payload, payloadlen), qos, retain);
+	if(rc == MOSQ_ERR_AUTH_PENDING){
+		/* An auth plugin will complete the check later. Keep the packet
+		 * to handle again then, reads are paused until it does. */
+		mosquitto__free(topic);
+		UHPA_FREE(payload, payloadlen);
+		mosquitto_property_free_all(&msg_properties);
+		auth_pool__park_packet(context);
+		return MOSQ_ERR_SUCCESS;
+	}else if(rc == MOSQ_ERR_ACL_DENIED){
 		log__printf(NULL, MOSQ_LOG_DEBUG, "Denied PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
 			reason_code = MQTT_RC_NOT_AUTHORIZED;
 		goto process_bad_message;
@@ -305,6 +333,7 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 			return 1;
 		}
 		msg_properties = NULL; /* Now belongs to db__message_store() */
+		topic = stored->topic; /* The original may have been copied and freed */
 	}else{
 		mosquitto__free(topic);
 		topic = stored->topic;
@@ -316,29 +345,31 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 	switch(qos){
 		case 0:
 			rc2 = sub__messages_queue(db, context->id, topic, qos, retain, &stored);
+			db__flow_source_check(db, context);
 			if(rc2 > 0) rc = 1;
 			break;
 		case 1:
 			util__decrement_receive_quota(context);
 			rc2 = sub__messages_queue(db, context->id, topic, qos, retain, &stored);
+			db__flow_source_check(db, context);
 			if(rc2 == MOSQ_ERR_SUCCESS || context->protocol != mosq_p_mqtt5){
-				if(send__puback(context, mid, 0)) rc = 1;
+				if(handle__publish_ack(db, context, CMD_PUBACK, mid, 0)) rc = 1;
 			}else if(rc2 == MOSQ_ERR_NO_SUBSCRIBERS){
-				if(send__puback(context, mid, MQTT_RC_NO_MATCHING_SUBSCRIBERS)) rc = 1;
+				if(handle__publish_ack(db, context, CMD_PUBACK, mid, MQTT_RC_NO_MATCHING_SUBSCRIBERS)) rc = 1;
 			}else{
 				rc = rc2;
 			}
 			break;
 		case 2:
 			if(dup == 0){
-				res = db__message_insert(db, context, mid, mosq_md_in, qos, retain, stored, NULL);
+				res = db__message_insert(db, context, mid, mosq_md_in, qos, retain, stored, 0);
 			}else{
 				res = 0;
 			}
 			/* db__message_insert() returns 2 to indicate dropped message
 			 * due to queue. This isn't an error so don't disconnect them. */
 			if(!res){
-				if(send__pubrec(context, mid, 0)) rc = 1;
+				if(handle__publish_ack(db, context, CMD_PUBREC, mid, 0)) rc = 1;
 			}else if(res == 1){
 				rc = 1;
 			}
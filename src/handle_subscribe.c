@@ -169,6 +169,9 @@ int handle__subscribe(struct mosquitto_db *db, struct mosquitto *context)
 					mosquitto__free(sub);
 					return rc2;
 				}
+#ifdef WITH_PERSISTENCE
+				persist__journal_sub(db, context, sub, qos, subscription_identifier, subscription_options);
+#endif
 				if(context->protocol == mosq_p_mqtt311 || context->protocol == mosq_p_mqtt31){
 					if(rc2 == MOSQ_ERR_SUCCESS || rc2 == MOSQ_ERR_SUB_EXISTS){
 						if(sub__retain_queue(db, context, sub, qos, 0)) rc = 1;
@@ -95,6 +95,11 @@ int handle__unsubscribe(struct mosquitto_db *db, struct mosquitto *context)
 
 		log__printf(NULL, MOSQ_LOG_DEBUG, "\t%s", sub);
 		rc = sub__remove(db, context, sub, db->subs, &reason);
+#ifdef WITH_PERSISTENCE
+		if(rc == MOSQ_ERR_SUCCESS){
+			persist__journal_unsub(db, context, sub);
+		}
+#endif
 		log__printf(NULL, MOSQ_LOG_UNSUBSCRIBE, "%s %s", context->id, sub);
 		mosquitto__free(sub);
 		if(rc) return rc;
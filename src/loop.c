@@ -120,14 +120,17 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 	time_t now = 0;
 	int time_count;
 	int fdcount;
+	int poll_timeout;
 	struct mosquitto *context, *ctxt_tmp;
 #ifndef WIN32
 	sigset_t sigblock, origsig;
 #endif
 	int i;
+	int auth_fd;
 #ifdef WITH_EPOLL
 	int j;
 	struct epoll_event ev, events[MAX_EVENTS];
+	uint32_t events_wanted;
 #else
 	struct pollfd *pollfds = NULL;
 	int pollfd_index;
@@ -167,6 +170,8 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 	}
 #endif
 
+	auth_fd = auth_pool__wake_fd(db);
+
 #ifdef WITH_EPOLL
 	db->epollfd = 0;
 	if ((db->epollfd = epoll_create(MAX_EVENTS)) == -1) {
@@ -185,6 +190,16 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 			return MOSQ_ERR_UNKNOWN;
 		}
 	}
+	if(auth_fd != -1){
+		ev.data.fd = auth_fd;
+		ev.events = EPOLLIN;
+		if (epoll_ctl(db->epollfd, EPOLL_CTL_ADD, auth_fd, &ev) == -1) {
+			log__printf(NULL, MOSQ_LOG_ERR, "Error in epoll initial registering: %s", strerror(errno));
+			(void)close(db->epollfd);
+			db->epollfd = 0;
+			return MOSQ_ERR_UNKNOWN;
+		}
+	}
 #ifdef WITH_BRIDGE
 	HASH_ITER(hh_sock, db->contexts_by_sock, context, ctxt_tmp){
 		if(context->bridge){
@@ -220,6 +235,12 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 			pollfds[pollfd_index].revents = 0;
 			pollfd_index++;
 		}
+		if(auth_fd != -1){
+			pollfds[pollfd_index].fd = auth_fd;
+			pollfds[pollfd_index].events = POLLIN;
+			pollfds[pollfd_index].revents = 0;
+			pollfd_index++;
+		}
 #endif
 
 		time_count = 0;
@@ -277,41 +298,44 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 				}
 #endif
 
-				/* Local bridges never time out in this fashion. */
+				/* Local bridges never time out in this fashion. Clients paused
+				 * by publisher flow control or waiting for a pending auth or
+				 * ACL check can't be read from, so they can't be expected to
+				 * keep their keepalive either. */
 				if(!(context->keepalive)
 						|| context->bridge
+						|| context->is_flow_paused
+						|| context->auth_job
 						|| now - context->last_msg_in <= (time_t)(context->keepalive)*3/2){
 
 					if(db__message_write(db, context) == MOSQ_ERR_SUCCESS){
 #ifdef WITH_EPOLL
+						if(context->is_flow_paused || context->auth_job){
+							events_wanted = 0;
+						}else{
+							events_wanted = EPOLLIN;
+						}
 						if(context->current_out_packet || context->state == mosq_cs_connect_pending || context->ws_want_write){
-							if(!(context->events & EPOLLOUT)) {
-								ev.data.fd = context->sock;
-								ev.events = EPOLLIN | EPOLLOUT;
-								if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
-									if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
-											log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering to EPOLLOUT: %s", strerror(errno));
-									}
-								}
-								context->events = EPOLLIN | EPOLLOUT;
-							}
+							events_wanted |= EPOLLOUT;
 							context->ws_want_write = false;
 						}
-						else{
-							if(context->events & EPOLLOUT) {
-								ev.data.fd = context->sock;
-								ev.events = EPOLLIN;
-								if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
-									if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
-											log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering to EPOLLIN: %s", strerror(errno));
-									}
+						if(context->events != events_wanted){
+							ev.data.fd = context->sock;
+							ev.events = events_wanted;
+							if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
+								if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
+										log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering: %s", strerror(errno));
 								}
-								context->events = EPOLLIN;
 							}
+							context->events = events_wanted;
 						}
 #else
 						pollfds[pollfd_index].fd = context->sock;
-						pollfds[pollfd_index].events = POLLIN;
+						if(context->is_flow_paused || context->auth_job){
+							pollfds[pollfd_index].events = 0;
+						}else{
+							pollfds[pollfd_index].events = POLLIN;
+						}
 						pollfds[pollfd_index].revents = 0;
 						if(context->current_out_packet || context->state == mosq_cs_connect_pending || context->ws_want_write){
 							pollfds[pollfd_index].events |= POLLOUT;
@@ -466,16 +490,19 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 		}
 #endif
 
+		/* Don't wait while clients are still being checked after a reload. */
+		poll_timeout = db->security_apply.next ? 0 : 100;
+
 #ifndef WIN32
 		sigprocmask(SIG_SETMASK, &sigblock, &origsig);
 #ifdef WITH_EPOLL
-		fdcount = epoll_wait(db->epollfd, events, MAX_EVENTS, 100);
+		fdcount = epoll_wait(db->epollfd, events, MAX_EVENTS, poll_timeout);
 #else
-		fdcount = poll(pollfds, pollfd_index, 100);
+		fdcount = poll(pollfds, pollfd_index, poll_timeout);
 #endif
 		sigprocmask(SIG_SETMASK, &origsig, NULL);
 #else
-		fdcount = WSAPoll(pollfds, pollfd_index, 100);
+		fdcount = WSAPoll(pollfds, pollfd_index, poll_timeout);
 #endif
 #ifdef WITH_EPOLL
 		switch(fdcount){
@@ -507,7 +534,7 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 						break;
 					}
 				}
-				if (j == listensock_count) {
+				if (j == listensock_count && events[i].data.fd != auth_fd) {
 					loop_handle_reads_writes(db, events[i].data.fd, events[i].events);
 				}
 			}
@@ -537,10 +564,16 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 			}
 		}
 #endif
+		auth_pool__handle_results(db);
+
 		now = time(NULL);
 		session_expiry__check(db, now);
+		auth_pool__check_timeouts(db, now);
 		will_delay__check(db, now);
+		db__flow_check_timeouts(db);
 #ifdef WITH_PERSISTENCE
+		persist__journal_flush(db);
+		persist__background_check(db);
 		if(db->config->persistence && db->config->autosave_interval){
 			if(db->config->autosave_on_changes){
 				if(db->persistence_changes >= db->config->autosave_interval){
@@ -572,6 +605,7 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 			log__init(db->config);
 			flag_reload = false;
 		}
+		mosquitto_security_apply_continue(db);
 		if(flag_tree_print){
 			sub__tree_print(db->subs, 0);
 			flag_tree_print = false;
@@ -830,7 +864,7 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pol
 					do_disconnect(db, context, rc);
 					continue;
 				}
-			}while(SSL_DATA_PENDING(context));
+			}while(SSL_DATA_PENDING(context) && !context->auth_job);
 		}else{
 #ifdef WITH_EPOLL
 			if(events & (EPOLLERR | EPOLLHUP)){
@@ -287,6 +287,8 @@ int main(int argc, char *argv[])
 	if(rc) return rc;
 	rc = mosquitto_security_init(&int_db, false);
 	if(rc) return rc;
+	rc = auth_pool__init(&int_db);
+	if(rc) return rc;
 
 #ifdef WITH_SYS_TREE
 	sys_tree__init(&int_db);
@@ -336,6 +338,14 @@ int main(int argc, char *argv[])
 	rc = drop_privileges(&config, false);
 	if(rc != MOSQ_ERR_SUCCESS) return rc;
 
+#ifdef WITH_PERSISTENCE
+	if(config.persistence && config.persistence_journal){
+		/* The journal must follow a snapshot of the restored state. This is
+		 * written after dropping privileges so the broker can replace it. */
+		if(persist__backup(&int_db, false)) return 1;
+	}
+#endif
+
 	signal(SIGINT, handle_sigint);
 	signal(SIGTERM, handle_sigint);
 #ifdef SIGHUP
@@ -430,6 +440,8 @@ int main(int argc, char *argv[])
 	}
 
 	mosquitto_security_module_cleanup(&int_db);
+	/* After the plugins, which must have stopped completing checks by now. */
+	auth_pool__cleanup(&int_db);
 
 	if(config.pid_file){
 		remove(config.pid_file);
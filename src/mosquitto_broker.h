@@ -24,6 +24,7 @@ extern "C" {
 #include <stdbool.h>
 
 struct mosquitto;
+struct mosquitto_auth_pending;
 
 enum mosquitto_protocol {
 	mp_mqtt,
@@ -165,6 +166,75 @@ const char *mosquitto_client_username(const struct mosquitto *client);
  */
 int mosquitto_set_username(struct mosquitto *client, const char *username);
 
+
+/* Function: mosquitto_acl_cache_clear
+ *
+ * Discard the access decisions cached for a client when acl_cache_size is
+ * set, and the classification of its subscriptions made with
+ * mosquitto_auth_acl_sub_classify(), so the next checks for that client are
+ * made again. A plugin should call this when the access it would grant has
+ * changed.
+ *
+ * client can be NULL, in which case the decisions for all clients are
+ * discarded.
+ *
+ * Returns:
+ *   MOSQ_ERR_SUCCESS - on success
+ */
+int mosquitto_acl_cache_clear(struct mosquitto *client);
+
+
+/* Function: mosquitto_auth_pending_new
+ *
+ * Leave the check being made for a client pending, so it can be completed
+ * later without holding up the broker. Only for plugins of version 5, and only
+ * from within mosquitto_auth_unpwd_check() for a connecting client, or
+ * mosquitto_auth_acl_check() with MOSQ_ACL_WRITE for a PUBLISH. The check
+ * must then return MOSQ_ERR_AUTH_PENDING.
+ *
+ * The client is not read from until the check is completed with
+ * mosquitto_auth_pending_complete(). If that takes longer than
+ * auth_check_timeout, the connection is refused or the PUBLISH is denied.
+ *
+ * Calling this more than once in the same check returns the same handle. If
+ * the check returns anything other than MOSQ_ERR_AUTH_PENDING the handle is
+ * discarded, and completing it returns MOSQ_ERR_INVAL.
+ *
+ * Returns:
+ *   A handle to pass to mosquitto_auth_pending_complete(), or NULL if this
+ *   check can't be left pending, in which case it must be answered straight
+ *   away.
+ */
+struct mosquitto_auth_pending *mosquitto_auth_pending_new(struct mosquitto *client);
+
+
+/* Function: mosquitto_auth_pending_complete
+ *
+ * Complete a check left pending with mosquitto_auth_pending_new(). May be
+ * called from any thread, including after the check has timed out. Must not be
+ * called after mosquitto_auth_security_cleanup() has returned with reload
+ * false.
+ *
+ * A handle is only completed once. It stays valid until then, except that if
+ * the check has timed out or the client has gone away, the broker stops
+ * waiting for it 60 seconds later. Completing a handle a second time, after
+ * the broker has stopped waiting for it, or after the check returned something
+ * other than MOSQ_ERR_AUTH_PENDING, is safe and returns MOSQ_ERR_INVAL.
+ *
+ * Parameters:
+ *   handle - the handle from mosquitto_auth_pending_new().
+ *   result - what the check would have returned: MOSQ_ERR_SUCCESS,
+ *            MOSQ_ERR_AUTH or MOSQ_ERR_ACL_DENIED, or MOSQ_ERR_PLUGIN_DEFER,
+ *            which is treated as a denial.
+ *
+ * Returns:
+ *   MOSQ_ERR_SUCCESS - on success
+ *   MOSQ_ERR_INVAL - if handle is NULL, has already been completed, or is
+ *                    no longer being waited for
+ *   MOSQ_ERR_NOT_SUPPORTED - if the broker was built without WITH_AUTH_THREADS
+ */
+int mosquitto_auth_pending_complete(struct mosquitto_auth_pending *handle, int result);
+
 #ifdef __cplusplus
 }
 #endif
@@ -143,6 +143,8 @@ typedef int (*FUNC_auth_plugin_unpwd_check_v4)(void *, struct mosquitto *, const
 typedef int (*FUNC_auth_plugin_psk_key_get_v4)(void *, struct mosquitto *, const char *, const char *, char *, int);
 typedef int (*FUNC_auth_plugin_auth_start_v4)(void *, struct mosquitto *, const char *, bool, const void *, uint16_t, void **, uint16_t *);
 typedef int (*FUNC_auth_plugin_auth_continue_v4)(void *, struct mosquitto *, const char *, const void *, uint16_t, void **, uint16_t *);
+typedef int (*FUNC_auth_plugin_acl_sub_classify_v4)(void *, struct mosquitto *, const char *);
+typedef int (*FUNC_auth_plugin_acl_check_batch_v4)(void *, int, struct mosquitto **, int, struct mosquitto_acl_msg *, int *);
 
 typedef int (*FUNC_auth_plugin_init_v3)(void **, struct mosquitto_opt *, int);
 typedef int (*FUNC_auth_plugin_cleanup_v3)(void *, struct mosquitto_opt *, int);
@@ -166,6 +168,12 @@ enum mosquitto_msg_origin{
 	mosq_mo_broker = 1
 };
 
+enum mosquitto__durability{
+	mosq_dur_none = 0,
+	mosq_dur_periodic = 1,
+	mosq_dur_group_commit = 2
+};
+
 struct mosquitto__auth_plugin{
 	void *lib;
 	void *user_data;
@@ -180,6 +188,8 @@ struct mosquitto__auth_plugin{
 	FUNC_auth_plugin_psk_key_get_v4 psk_key_get_v4;
 	FUNC_auth_plugin_auth_start_v4 auth_start_v4;
 	FUNC_auth_plugin_auth_continue_v4 auth_continue_v4;
+	FUNC_auth_plugin_acl_sub_classify_v4 acl_sub_classify_v4;
+	FUNC_auth_plugin_acl_check_batch_v4 acl_check_batch_v4;
 
 	FUNC_auth_plugin_init_v3 plugin_init_v3;
 	FUNC_auth_plugin_cleanup_v3 plugin_cleanup_v3;
@@ -197,6 +207,7 @@ struct mosquitto__auth_plugin{
 	FUNC_auth_plugin_unpwd_check_v2 unpwd_check_v2;
 	FUNC_auth_plugin_psk_key_get_v2 psk_key_get_v2;
 	int version;
+	bool async; /* Version 5 plugin, may leave checks pending */
 };
 
 struct mosquitto__auth_plugin_config
@@ -214,8 +225,15 @@ struct mosquitto__security_options {
 	 * in config__read() with regards whether allow_anonymous
 	 * should be disabled when these options are set.
 	 */
-	struct mosquitto__acl_user *acl_list;
+	struct mosquitto__acl_user *acl_list; /* Hash of users, by username */
+	struct mosquitto__acl_user *acl_anonymous; /* ACLs for clients without a username */
 	struct mosquitto__acl *acl_patterns;
+	/* The db->acl_generation at which the user ACLs and pattern ACLs last
+	 * changed. A client whose ACLs were found before this finds them again
+	 * when next checked. Not options. */
+	unsigned int acl_users_generation;
+	unsigned int acl_patterns_generation;
+	int8_t applied_allow_anonymous; /* allow_anonymous when last applied to connected clients */
 	char *password_file;
 	char *psk_file;
 	char *acl_file;
@@ -242,6 +260,7 @@ struct mosquitto__listener {
 	bool use_username_as_clientid;
 	uint8_t maximum_qos;
 	uint16_t max_topic_alias;
+	enum mosquitto__durability durability;
 #ifdef WITH_TLS
 	char *cafile;
 	char *capath;
@@ -253,6 +272,7 @@ struct mosquitto__listener {
 	char *psk_hint;
 	SSL_CTX *ssl_ctx;
 	char *crlfile;
+	time_t crlfile_mtime;
 	char *tls_version;
 	char *dhparamfile;
 	bool use_identity_as_username;
@@ -267,11 +287,15 @@ struct mosquitto__listener {
 #endif
 	struct mosquitto__security_options security_options;
 	struct mosquitto__unpwd *unpwd;
+	struct mosquitto__pwfile *pwfile;
 	struct mosquitto__unpwd *psk_id;
 };
 
 struct mosquitto__config {
+	int acl_cache_size;
 	bool allow_duplicate_messages;
+	int auth_check_timeout;
+	int auth_threads;
 	int autosave_interval;
 	bool autosave_on_changes;
 	bool check_retain_source;
@@ -293,11 +317,16 @@ struct mosquitto__config {
 	uint32_t max_packet_size;
 	uint32_t message_size_limit;
 	bool persistence;
+	bool persistence_background;
 	char *persistence_location;
 	char *persistence_file;
 	char *persistence_filepath;
+	bool persistence_journal;
+	bool persistence_lazy_retained;
 	time_t persistent_client_expiration;
 	char *pid_file;
+	bool publisher_flow_control;
+	int publisher_flow_control_timeout;
 	bool queue_qos0_messages;
 	bool per_listener_settings;
 	bool retain_available;
@@ -317,6 +346,16 @@ struct mosquitto__config {
 	struct mosquitto__security_options security_options;
 };
 
+/* Whether messages delivered through a subscription need their READ access
+ * checking. Worked out when the first message is delivered, and again after
+ * the ACLs or the client's username change. */
+enum mosquitto__acl_class{
+	acl_class_unknown = 0,
+	acl_class_check = 1,
+	acl_class_allow = 2,
+	acl_class_deny = 3
+};
+
 struct mosquitto__subleaf {
 	struct mosquitto__subleaf *prev;
 	struct mosquitto__subleaf *next;
@@ -325,6 +364,17 @@ struct mosquitto__subleaf {
 	uint8_t qos;
 	bool no_local;
 	bool retain_as_published;
+	uint8_t acl_class;
+	unsigned int acl_generation;
+};
+
+/* Scratch space for the subscribers to one topic whose READ access is checked
+ * in a single batch. */
+struct mosquitto__send_batch{
+	struct mosquitto__subleaf **leaves;
+	struct mosquitto **clients;
+	int *results;
+	int size;
 };
 
 
@@ -351,12 +401,31 @@ struct mosquitto__subhier {
 	uint16_t topic_len;
 };
 
+/* Array of the messages restored from persistence, sorted by db_id. */
 struct mosquitto_msg_store_load{
-	UT_hash_handle hh;
 	dbid_t db_id;
 	struct mosquitto_msg_store *store;
 };
 
+/* An interned topic, shared by every stored message with the same topic. Two
+ * stored messages have the same topic if and only if they have the same
+ * topic_ref. */
+struct mosquitto__topic_ref{
+	UT_hash_handle hh;
+	char *topic;
+	int ref_count;
+};
+
+/* A message whose source id, source username and payload together need no
+ * more than this many bytes is stored in the same allocation as its
+ * mosquitto_msg_store, rather than in up to four separate allocations. This
+ * reduces the number of calls to malloc per message and keeps everything
+ * needed to send a message close together when it is sent to many
+ * subscribers. Larger messages are stored as before. */
+#ifndef MOSQ_MSG_STORE_INLINE_SIZE
+#  define MOSQ_MSG_STORE_INLINE_SIZE 256
+#endif
+
 struct mosquitto_msg_store{
 	struct mosquitto_msg_store *next;
 	struct mosquitto_msg_store *prev;
@@ -367,7 +436,8 @@ struct mosquitto_msg_store{
 	char **dest_ids;
 	int dest_id_count;
 	int ref_count;
-	char* topic;
+	struct mosquitto__topic_ref *topic_ref;
+	char* topic; /* Points at topic_ref->topic */
 	mosquitto_property *properties;
 	mosquitto__payload_uhpa payload;
 	time_t message_expiry_time;
@@ -377,6 +447,9 @@ struct mosquitto_msg_store{
 	uint8_t qos;
 	bool retain;
 	uint8_t origin;
+	bool inline_data; /* source_id, source_username and payload are part of this allocation */
+	bool persisted; /* Written to the persistence file or journal */
+	bool payload_mapped; /* payload points into the mapped persistence file */
 };
 
 struct mosquitto_client_msg{
@@ -385,6 +458,7 @@ struct mosquitto_client_msg{
 	struct mosquitto_msg_store *store;
 	mosquitto_property *properties;
 	time_t timestamp;
+	uint32_t subscription_identifier;
 	uint16_t mid;
 	uint8_t qos;
 	bool retain;
@@ -393,6 +467,9 @@ struct mosquitto_client_msg{
 	bool dup;
 };
 
+/* A compiled password file mapped into memory, see pwfile.h. */
+struct mosquitto__pwfile;
+
 struct mosquitto__unpwd{
 	char *username;
 	char *password;
@@ -412,16 +489,98 @@ struct mosquitto__acl{
 	int ccount;
 };
 
+/* ACL topics compiled into a tree of topic levels. A check walks the tree
+ * once for the topic being checked, rather than matching every ACL in turn.
+ * Literal levels are hashed in children, "+" levels hang off plus, and a
+ * trailing "#" is folded into hash_access of the node it follows. Pattern
+ * ACLs are expanded for each client when it connects and compiled into a
+ * tree of their own, held in context->acl_patterns. */
+struct mosquitto__acl_trie{
+	UT_hash_handle hh;
+	struct mosquitto__acl_trie *children;
+	struct mosquitto__acl_trie *plus;
+	char *level;
+	int level_len;
+	int access;
+	int hash_access;
+};
+
 struct mosquitto__acl_user{
-	struct mosquitto__acl_user *next;
+	UT_hash_handle hh;
 	char *username;
 	struct mosquitto__acl *acl;
+	struct mosquitto__acl_trie *trie;
+};
+
+struct mosquitto__acl_cache_entry{
+	char *topic;
+	uint32_t hash;
+	int access;
+	int rc;
+};
+
+/* Recent access decisions for a client. Direct mapped on a hash of the topic
+ * and access type. The whole cache is discarded when generation no longer
+ * matches db->acl_generation. */
+struct mosquitto__acl_cache{
+	struct mosquitto__acl_cache_entry *entries;
+	int size;
+	unsigned int generation;
+};
+
+/* A check that has been left pending, either a password check passed to the
+ * auth thread pool or a check that a version 5 plugin will complete later.
+ * Other threads only run check() and write rc, next and completed under the
+ * pool lock; everything else belongs to the main thread. The rest of a
+ * CONNECT, or the PUBLISH being checked, is parked here until the result comes
+ * back. Plugins are given handle rather than a pointer to the job, so a handle
+ * that is completed late can be rejected once the job has been freed. */
+struct mosquitto__auth_job{
+	UT_hash_handle hh_handle;
+	uintptr_t handle;
+	struct mosquitto__auth_job *next;
+	struct mosquitto__auth_job *pending_prev; /* Outstanding jobs, main thread only */
+	struct mosquitto__auth_job *pending_next;
+	struct mosquitto *context; /* NULL if the client went away or timed out */
+	int (*check)(struct mosquitto__auth_job *job);
+	char *password;
+	unsigned char *salt;
+	unsigned int salt_len;
+	unsigned char hash[64];
+	unsigned int hash_len;
+	int rc;
+	time_t deadline;
+	bool pending; /* In the outstanding list */
+	bool completed; /* On the done list */
+	int access; /* MOSQ_ACL_WRITE for a PUBLISH check, 0 for a CONNECT */
+	/* CONNECT state */
+	char *client_id;
+	struct mosquitto_message_all *will;
+	void *auth_data;
+	uint16_t auth_data_len;
+	uint8_t clean_start;
+	/* PUBLISH state */
+	char *topic;
+	struct mosquitto__packet packet;
+	int result;
+};
+
+/* Progress of checking clients against the security settings after a reload,
+ * which is spread over several passes of the main loop. Clients are visited in
+ * contexts_by_id order from next. If all is false, only clients whose username
+ * is in changed_users are checked. */
+struct mosquitto__security_apply{
+	struct mosquitto *next;
+	struct mosquitto__unpwd *changed_users;
+	bool all;
+	bool per_listener_settings;
 };
 
 struct mosquitto_db{
 	dbid_t last_db_id;
 	struct mosquitto__subhier *subs;
 	struct mosquitto__unpwd *unpwd;
+	struct mosquitto__pwfile *pwfile;
 	struct mosquitto__unpwd *psk_id;
 	struct mosquitto *contexts_by_id;
 	struct mosquitto *contexts_by_sock;
@@ -432,10 +591,13 @@ struct mosquitto_db{
 	struct clientid__index_hash *clientid_index_hash;
 	struct mosquitto_msg_store *msg_store;
 	struct mosquitto_msg_store_load *msg_store_load;
+	struct mosquitto__topic_ref *topic_refs;
 #ifdef WITH_BRIDGE
 	int bridge_count;
 #endif
 	int msg_store_count;
+	int msg_store_load_count;
+	int msg_store_load_size;
 	unsigned long msg_store_bytes;
 	char *config_file;
 	struct mosquitto__config *config;
@@ -447,7 +609,23 @@ struct mosquitto_db{
 	int retained_count;
 #endif
 	int persistence_changes;
+#ifdef WITH_PERSISTENCE
+	bool persistence_saving;
+	long persistence_save_duration; /* milliseconds */
+	long persistence_restore_duration; /* milliseconds */
+#endif
+	struct mosquitto *flow_backlogged; /* Backlogged clients, oldest first */
+	struct mosquitto **flow_hits; /* Backlogged clients reached by the message being queued */
+	int flow_hit_count;
+	int flow_hit_size;
+	unsigned int acl_generation;
+	unsigned long acl_cache_hits;
+	unsigned long acl_cache_misses;
+	bool acl_check_batch; /* An auth plugin has mosquitto_auth_acl_check_batch() */
+	struct mosquitto__send_batch send_batch;
+	struct mosquitto__security_apply security_apply;
 	struct mosquitto *ll_for_free;
+	struct mosquitto__auth_pool *auth_pool;
 #ifdef WITH_EPOLL
 	int epollfd;
 #endif
@@ -607,17 +785,41 @@ int db__open(struct mosquitto__config *config, struct mosquitto_db *db);
 int db__close(struct mosquitto_db *db);
 #ifdef WITH_PERSISTENCE
 int persist__backup(struct mosquitto_db *db, bool shutdown);
+/* Finish off a background save if it has completed. */
+void persist__background_check(struct mosquitto_db *db);
 int persist__restore(struct mosquitto_db *db);
+/* Journal of changes made since the last persistence snapshot. These do
+ * nothing unless persistence_journal is enabled and a snapshot has been
+ * written. */
+void persist__journal_client(struct mosquitto_db *db, struct mosquitto *context);
+void persist__journal_client_delete(struct mosquitto_db *db, struct mosquitto *context);
+void persist__journal_client_msg(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__journal_client_msg_update(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__journal_client_msg_delete(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__journal_sub(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, uint32_t identifier, int options);
+void persist__journal_unsub(struct mosquitto_db *db, struct mosquitto *context, const char *sub);
+void persist__journal_retain(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+void persist__journal_flush(struct mosquitto_db *db);
+/* Send a PUBACK, PUBREC or PUBCOMP for a message from context, or hold it
+ * until the journal has been synced if its listener uses group-commit
+ * durability. */
+int persist__journal_ack(struct mosquitto_db *db, struct mosquitto *context, int command, uint16_t mid, uint8_t reason_code);
+/* Forget any acknowledgements held for context. */
+void persist__journal_ack_remove(struct mosquitto_db *db, struct mosquitto *context);
+/* Drop a reference to the persistence file mapping held by a retained
+ * payload loaded with persistence_lazy_retained. */
+void persist__payload_map_release(void);
 #endif
 void db__limits_set(unsigned long inflight_bytes, int queued, unsigned long queued_bytes);
 /* Return the number of in-flight messages in count. */
 int db__message_count(int *count);
 int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state expect_state, int qos);
-int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties);
+int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, uint32_t subscription_identifier);
+mosquitto_property *db__message_properties(struct mosquitto_client_msg *msg, mosquitto_property *subid_prop);
 int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid);
-int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos);
+int db__message_update_outgoing(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos);
 int db__message_write(struct mosquitto_db *db, struct mosquitto *context);
-void db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data);
+int db__message_dequeue_first(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_data *msg_data);
 int db__messages_delete(struct mosquitto_db *db, struct mosquitto *context);
 int db__messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, uint32_t message_expiry_interval, mosquitto_property **properties);
 int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, uint16_t source_mid, char *topic, int qos, uint32_t payloadlen, mosquitto__payload_uhpa *payload, int retain, struct mosquitto_msg_store **stored, uint32_t message_expiry_interval, mosquitto_property *properties, dbid_t store_id, enum mosquitto_msg_origin origin);
@@ -628,7 +830,15 @@ void db__msg_store_ref_inc(struct mosquitto_msg_store *store);
 void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store);
 void db__msg_store_clean(struct mosquitto_db *db);
 void db__msg_store_compact(struct mosquitto_db *db);
+struct mosquitto__topic_ref *db__topic_ref_get(struct mosquitto_db *db, const char *topic);
+void db__topic_ref_dec(struct mosquitto_db *db, struct mosquitto__topic_ref **ref);
 int db__message_reconnect_reset(struct mosquitto_db *db, struct mosquitto *context);
+void db__message_reconnect_acl_check(struct mosquitto_db *db, struct mosquitto *context);
+void db__flow_source_check(struct mosquitto_db *db, struct mosquitto *context);
+void db__flow_context_remove(struct mosquitto_db *db, struct mosquitto *context);
+/* Stop applying flow control for clients that have been backlogged for longer
+ * than publisher_flow_control_timeout. */
+void db__flow_check_timeouts(struct mosquitto_db *db);
 void sys_tree__init(struct mosquitto_db *db);
 void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time);
 
@@ -640,6 +850,7 @@ struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent
 int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct mosquitto__subhier *root, uint8_t *reason);
 void sub__tree_print(struct mosquitto__subhier *root, int level);
 int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context);
+void sub__acl_reset(struct mosquitto *context);
 int sub__retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos, uint32_t subscription_identifier);
 int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store **stored);
 
@@ -655,6 +866,8 @@ void context__send_will(struct mosquitto_db *db, struct mosquitto *context);
 void context__remove_from_by_id(struct mosquitto_db *db, struct mosquitto *context);
 
 int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, void *auth_data_out, uint16_t auth_data_out_len);
+/* Finish a CONNECT once its pending password check has completed with rc. */
+int connect__auth_result(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__auth_job *job, int rc);
 
 /* ============================================================
  * Logging functions
@@ -687,26 +900,63 @@ int property__process_disconnect(struct mosquitto *context, mosquitto_property *
  * Security related functions
  * ============================================================ */
 int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context);
+void acl__context_cleanup(struct mosquitto *context);
 int mosquitto_security_module_init(struct mosquitto_db *db);
 int mosquitto_security_module_cleanup(struct mosquitto_db *db);
 
 int mosquitto_security_init(struct mosquitto_db *db, bool reload);
 int mosquitto_security_apply(struct mosquitto_db *db);
+void mosquitto_security_apply_continue(struct mosquitto_db *db);
 int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access);
+int mosquitto_acl_check_publish(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain);
+/* mosquitto_acl_check() with MOSQ_ACL_READ for the same message and count
+ * clients, setting results[i] for clients[i]. */
+int mosquitto_acl_check_read_batch(struct mosquitto_db *db, struct mosquitto **clients, int count, const char *topic, long payloadlen, void* payload, int qos, bool retain, int *results);
+void acl__cache_free(struct mosquitto *context);
+enum mosquitto__acl_class mosquitto_acl_classify(struct mosquitto_db *db, struct mosquitto *context, const char *sub);
 int mosquitto_unpwd_check(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password);
 int mosquitto_psk_key_get(struct mosquitto_db *db, struct mosquitto *context, const char *hint, const char *identity, char *key, int max_key_len);
 
 int mosquitto_security_init_default(struct mosquitto_db *db, bool reload);
 int mosquitto_security_apply_default(struct mosquitto_db *db);
+void mosquitto_security_apply_continue_default(struct mosquitto_db *db);
 int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
+int mosquitto_acl_classify_default(struct mosquitto_db *db, struct mosquitto *context, const char *sub);
 int mosquitto_unpwd_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password);
 int mosquitto_psk_key_get_default(struct mosquitto_db *db, struct mosquitto *context, const char *hint, const char *identity, char *key, int max_key_len);
 
 int mosquitto_security_auth_start(struct mosquitto_db *db, struct mosquitto *context, bool reauth, const void *data_in, uint16_t data_in_len, void **data_out, uint16_t *data_out_len);
 int mosquitto_security_auth_continue(struct mosquitto_db *db, struct mosquitto *context, const void *data_in, uint16_t data_len, void **data_out, uint16_t *data_out_len);
 
+/* ============================================================
+ * Auth thread pool
+ * ============================================================ */
+int auth_pool__init(struct mosquitto_db *db);
+void auth_pool__cleanup(struct mosquitto_db *db);
+int auth_pool__thread_count(struct mosquitto_db *db);
+/* Create a job for a check that context will wait for. */
+struct mosquitto__auth_job *auth_pool__job_new(struct mosquitto_db *db, struct mosquitto *context);
+/* Run job->check() on a worker thread. On success the pool owns job. */
+int auth_pool__queue(struct mosquitto_db *db, struct mosquitto__auth_job *job);
+/* Start the timeout for a job that context->auth_job has been set to. */
+void auth_pool__track(struct mosquitto_db *db, struct mosquitto__auth_job *job);
+/* Move the PUBLISH being handled for context into its pending job. */
+void auth_pool__park_packet(struct mosquitto *context);
+/* Complete any jobs that have finished. Called from the main loop. */
+void auth_pool__handle_results(struct mosquitto_db *db);
+/* Give up on checks that have taken longer than auth_check_timeout. */
+void auth_pool__check_timeouts(struct mosquitto_db *db, time_t now);
+/* Returns the fd that becomes readable when jobs have finished, or -1. */
+int auth_pool__wake_fd(struct mosquitto_db *db);
+/* Detach a pending job from a client that is going away. */
+void auth_pool__context_cleanup(struct mosquitto *context);
+void auth_pool__job_free(struct mosquitto__auth_job *job);
+/* Free a job that a plugin did not leave pending after all, unless the plugin
+ * has already completed it, in which case it is freed with the results. */
+void auth_pool__job_abandon(struct mosquitto__auth_job *job);
+
 /* ============================================================
  * Session expiry
  * ============================================================ */
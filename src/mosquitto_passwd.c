@@ -26,8 +26,10 @@ Contributors:
 #include <stdlib.h>
 #include <string.h>
 
+#include "pwfile.h"
 
 #ifdef WIN32
+#  include <winsock2.h>
 #  include <windows.h>
 #  include <process.h>
 #	ifndef __cplusplus
@@ -43,6 +45,7 @@ Contributors:
 #	include <io.h>
 #	include <windows.h>
 #else
+#  include <arpa/inet.h>
 #  include <stdbool.h>
 #  include <unistd.h>
 #  include <termios.h>
@@ -126,8 +129,10 @@ void print_usage(void)
 	printf("Usage: mosquitto_passwd [-c | -D] passwordfile username\n");
 	printf("       mosquitto_passwd -b passwordfile username password\n");
 	printf("       mosquitto_passwd -U passwordfile\n");
+	printf("       mosquitto_passwd -C passwordfile compiledfile\n");
 	printf(" -b : run in batch mode to allow passing passwords on the command line.\n");
 	printf(" -c : create a new password file. This will overwrite existing files.\n");
+	printf(" -C : compile a hashed password file into a binary file for the broker to map.\n");
 	printf(" -D : delete the username rather than adding/updating its password.\n");
 	printf(" -U : update a plain text password file to use hashed passwords.\n");
 	printf("\nSee https://mosquitto.org/ for more information.\n\n");
@@ -199,6 +204,216 @@ int output_new_password(FILE *fptr, const char *username, const char *password)
 	return 0;
 }
 
+int base64_decode(const char *in, unsigned char *out, unsigned int out_len)
+{
+	BIO *bmem, *b64;
+	int len;
+
+	b64 = BIO_new(BIO_f_base64());
+	bmem = BIO_new_mem_buf((void *)in, strlen(in));
+	if(!b64 || !bmem){
+		BIO_free(b64);
+		BIO_free(bmem);
+		return 1;
+	}
+	BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+	b64 = BIO_push(b64, bmem);
+	len = BIO_read(b64, out, out_len);
+	if(len == (int)out_len){
+		/* Anything left over means the input was too long. */
+		len += BIO_read(b64, out, 1) > 0;
+	}
+	BIO_free_all(b64);
+
+	return len != (int)out_len;
+}
+
+struct compiled_entry{
+	char *username;
+	int line;
+	bool duplicate;
+	uint32_t hash;
+	unsigned char salt[PWFILE_SALT_LEN];
+	unsigned char password[PWFILE_HASH_LEN];
+};
+
+/* Decode a "username:$6$salt$hash" line into an entry. */
+int compile_line(char *buf, int line, struct compiled_entry *entry)
+{
+	char *username, *password, *salt64, *hash64;
+	int len;
+
+	len = strlen(buf);
+	while(len && (buf[len-1] == '\n' || buf[len-1] == '\r')){
+		buf[len-1] = '\0';
+		len--;
+	}
+	username = strtok(buf, ":");
+	password = strtok(NULL, ":");
+	if(!username || !password || strncmp(password, "$6$", 3)){
+		fprintf(stderr, "Error: Missing or unhashed password at line %d, use -U first to hash plain text passwords.\n", line);
+		return 1;
+	}
+	salt64 = strtok(&password[3], "$");
+	hash64 = strtok(NULL, "$");
+	if(!salt64 || !hash64
+			|| base64_decode(salt64, entry->salt, PWFILE_SALT_LEN)
+			|| base64_decode(hash64, entry->password, PWFILE_HASH_LEN)){
+
+		fprintf(stderr, "Error: Invalid password hash for user %s at line %d.\n", username, line);
+		return 1;
+	}
+	entry->username = strdup(username);
+	if(!entry->username){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	entry->line = line;
+	entry->duplicate = false;
+	entry->hash = pwfile__hash(username, strlen(username));
+	return 0;
+}
+
+int write_compiled(FILE *fout, struct compiled_entry *entries, uint32_t entry_count)
+{
+	struct PWF_header header;
+	struct PWF_slot *slots;
+	uint32_t *slot_entries;
+	uint32_t slot_count = 1;
+	uint32_t strings_len = 0;
+	uint32_t unique_count = 0;
+	uint32_t i, pos, len;
+	int rc = 0;
+
+	while(slot_count < entry_count*2){
+		slot_count *= 2;
+	}
+	slots = calloc(slot_count, sizeof(struct PWF_slot));
+	slot_entries = calloc(slot_count, sizeof(uint32_t));
+	if(!slots || !slot_entries){
+		fprintf(stderr, "Error: Out of memory.\n");
+		free(slots);
+		free(slot_entries);
+		return 1;
+	}
+
+	for(i=0; i<entry_count; i++){
+		len = strlen(entries[i].username);
+		pos = entries[i].hash & (slot_count-1);
+		while(slots[pos].username_len){
+			if(!strcmp(entries[slot_entries[pos]].username, entries[i].username)){
+				/* The broker uses the first of any duplicates. */
+				fprintf(stderr, "Warning: Duplicate username %s at line %d, ignoring.\n", entries[i].username, entries[i].line);
+				entries[i].duplicate = true;
+				break;
+			}
+			pos = (pos+1) & (slot_count-1);
+		}
+		if(entries[i].duplicate) continue;
+
+		slot_entries[pos] = i;
+		unique_count++;
+		slots[pos].hash = htonl(entries[i].hash);
+		slots[pos].username_offset = htonl(strings_len);
+		slots[pos].username_len = htonl(len);
+		memcpy(slots[pos].salt, entries[i].salt, PWFILE_SALT_LEN);
+		memcpy(slots[pos].password, entries[i].password, PWFILE_HASH_LEN);
+		strings_len += len;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PWFILE_MAGIC, PWFILE_MAGIC_LEN);
+	header.version = htonl(PWFILE_VERSION);
+	header.entry_count = htonl(unique_count);
+	header.slot_count = htonl(slot_count);
+	header.strings_len = htonl(strings_len);
+
+	if(fwrite(&header, sizeof(header), 1, fout) != 1
+			|| fwrite(slots, sizeof(struct PWF_slot), slot_count, fout) != slot_count){
+		rc = 1;
+	}
+	for(i=0; i<entry_count && rc == 0; i++){
+		if(entries[i].duplicate) continue;
+		len = strlen(entries[i].username);
+		if(fwrite(entries[i].username, 1, len, fout) != len){
+			rc = 1;
+		}
+	}
+	free(slots);
+	free(slot_entries);
+	return rc;
+}
+
+/* Compile a hashed password file into the format described in pwfile.h.
+ * The output is written to a temporary file that is then renamed over the
+ * old one, so a broker that has the old file mapped is not affected. */
+int compile_file(FILE *fptr, const char *output_file)
+{
+	char buf[MAX_BUFFER_LEN];
+	struct compiled_entry *entries = NULL, *new_entries;
+	uint32_t entry_count = 0, entry_max = 0;
+	uint32_t i;
+	char *tmp_file;
+	FILE *fout;
+	int line = 0;
+	int rc = 0;
+
+	while(rc == 0 && !feof(fptr) && fgets(buf, MAX_BUFFER_LEN, fptr)){
+		line++;
+		if(buf[0] == '#' || !strchr(buf, ':')) continue;
+
+		if(entry_count == entry_max){
+			entry_max = entry_max ? entry_max*2 : 64;
+			new_entries = realloc(entries, entry_max*sizeof(struct compiled_entry));
+			if(!new_entries){
+				fprintf(stderr, "Error: Out of memory.\n");
+				rc = 1;
+				break;
+			}
+			entries = new_entries;
+		}
+		rc = compile_line(buf, line, &entries[entry_count]);
+		if(rc == 0){
+			entry_count++;
+		}
+	}
+
+	if(rc == 0){
+		tmp_file = malloc(strlen(output_file)+5);
+		if(!tmp_file){
+			fprintf(stderr, "Error: Out of memory.\n");
+			rc = 1;
+		}else{
+			snprintf(tmp_file, strlen(output_file)+5, "%s.tmp", output_file);
+			fout = fopen(tmp_file, "wb");
+			if(!fout){
+				fprintf(stderr, "Error: Unable to open file %s for writing. %s.\n", tmp_file, strerror(errno));
+				rc = 1;
+			}else{
+				rc = write_compiled(fout, entries, entry_count);
+				if(fclose(fout)) rc = 1;
+#ifdef WIN32
+				if(rc == 0) remove(output_file);
+#endif
+				if(rc == 0 && rename(tmp_file, output_file)){
+					rc = 1;
+				}
+				if(rc){
+					fprintf(stderr, "Error: Unable to write compiled password file %s. %s.\n", output_file, strerror(errno));
+					remove(tmp_file);
+				}
+			}
+			free(tmp_file);
+		}
+	}
+
+	for(i=0; i<entry_count; i++){
+		free(entries[i].username);
+	}
+	free(entries);
+	return rc;
+}
+
 int delete_pwuser(FILE *fptr, FILE *ftmp, const char *username)
 {
 	char buf[MAX_BUFFER_LEN];
@@ -490,6 +705,19 @@ int main(int argc, char *argv[])
 			username = argv[3];
 			password_cmd = argv[4];
 		}
+	}else if(!strcmp(argv[1], "-C")){
+		if(argc != 4){
+			fprintf(stderr, "Error: -C argument given but password file or compiled file missing.\n");
+			return 1;
+		}
+		fptr = fopen(argv[2], "rt");
+		if(!fptr){
+			fprintf(stderr, "Error: Unable to open password file %s. %s.\n", argv[2], strerror(errno));
+			return 1;
+		}
+		rc = compile_file(fptr, argv[3]);
+		fclose(fptr);
+		return rc;
 	}else if(!strcmp(argv[1], "-U")){
 		if(argc != 3){
 			fprintf(stderr, "Error: -U argument given but password file missing.\n");
@@ -21,7 +21,7 @@ Contributors:
 extern "C" {
 #endif
 
-#define MOSQ_AUTH_PLUGIN_VERSION 4
+#define MOSQ_AUTH_PLUGIN_VERSION 5
 
 #define MOSQ_ACL_NONE 0x00
 #define MOSQ_ACL_READ 0x01
@@ -79,6 +79,14 @@ struct mosquitto_acl_msg {
  *   returns MOSQ_ERR_PLUGIN_DEFER then the next plugin runs its check.
  * * If the final plugin returns MOSQ_ERR_PLUGIN_DEFER, then access will be
  *   denied.
+ *
+ * Version 5 has the same functions as version 4. In addition, a check that
+ * needs to wait on something else, such as a request to a remote service, can
+ * be left pending so the broker carries on with other clients in the meantime.
+ * See mosquitto_auth_pending_new() in mosquitto_broker.h. Each pending check
+ * must be completed once with mosquitto_auth_pending_complete(). The broker
+ * stops waiting for a check 60 seconds after it times out or its client goes
+ * away, and rejects a late or repeated completion with MOSQ_ERR_INVAL.
  */
 
 /* =========================================================================
@@ -233,10 +241,71 @@ int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_opt *opts,
  *	MOSQ_ERR_ACL_DENIED if access was not granted.
  *	MOSQ_ERR_UNKNOWN for an application specific error.
  *	MOSQ_ERR_PLUGIN_DEFER if your plugin does not wish to handle this check.
+ *	MOSQ_ERR_AUTH_PENDING if a MOSQ_ACL_WRITE check will be completed later
+ *	with the handle from mosquitto_auth_pending_new(). Messages from the client
+ *	are held back until then.
  */
 int mosquitto_auth_acl_check(void *user_data, int access, struct mosquitto *client, const struct mosquitto_acl_msg *msg);
 
 
+/*
+ * Function: mosquitto_auth_acl_sub_classify
+ *
+ * This function is OPTIONAL. Only include this function in your plugin if
+ * your MOSQ_ACL_READ decisions depend only on the client and the topic.
+ *
+ * Called by the broker before delivering the first message through a
+ * subscription, and again after the configuration is reloaded or the
+ * client's username changes, or <mosquitto_acl_cache_clear> is called. If
+ * <mosquitto_auth_acl_check> would give the same answer for every topic that
+ * matches sub, the broker uses that answer rather than calling
+ * <mosquitto_auth_acl_check> for each message.
+ *
+ * Parameters:
+ *	user_data : the pointer provided in <mosquitto_auth_plugin_init>.
+ *	client :    the client that owns the subscription.
+ *	sub :       the subscription, without any $share/<group>/ prefix.
+ *
+ * Return:
+ *	MOSQ_ERR_SUCCESS if every matching message would be allowed.
+ *	MOSQ_ERR_ACL_DENIED if every matching message would be denied.
+ *	MOSQ_ERR_PLUGIN_DEFER if every matching message would be deferred.
+ *	Any other value if each message must be checked.
+ */
+int mosquitto_auth_acl_sub_classify(void *user_data, struct mosquitto *client, const char *sub);
+
+
+/*
+ * Function: mosquitto_auth_acl_check_batch
+ *
+ * This function is OPTIONAL. Only include this function in your plugin if
+ * checking many clients at once is cheaper than checking them one at a time,
+ * for example if it inspects the payload or asks a remote service.
+ *
+ * Called by the broker in place of <mosquitto_auth_acl_check> when a message
+ * is about to be sent to the subscribers of a topic. Subscribers that the
+ * broker has already decided, such as through
+ * <mosquitto_auth_acl_sub_classify> or an earlier plugin, are not included.
+ * Shared subscriptions and retained messages are still checked with
+ * <mosquitto_auth_acl_check>.
+ *
+ * Parameters:
+ *	user_data :    the pointer provided in <mosquitto_auth_plugin_init>.
+ *	access :       MOSQ_ACL_READ.
+ *	clients :      the clients the message would be sent to.
+ *	client_count : the number of clients.
+ *	msg :          the message, as for <mosquitto_auth_acl_check>.
+ *	results :      set results[i] to the result of the check for clients[i],
+ *	               any of the values <mosquitto_auth_acl_check> can return.
+ *
+ * Return:
+ *	MOSQ_ERR_SUCCESS if results has been set.
+ *	Any other value to have <mosquitto_auth_acl_check> called for each client
+ *	instead.
+ */
+int mosquitto_auth_acl_check_batch(void *user_data, int access, struct mosquitto **clients, int client_count, const struct mosquitto_acl_msg *msg, int *results);
+
+
 /*
  * Function: mosquitto_auth_unpwd_check
  *
@@ -250,6 +319,8 @@ int mosquitto_auth_acl_check(void *user_data, int access, struct mosquitto *clie
  *	MOSQ_ERR_AUTH if authentication failed.
  *	MOSQ_ERR_UNKNOWN for an application specific error.
  *	MOSQ_ERR_PLUGIN_DEFER if your plugin does not wish to handle this check.
+ *	MOSQ_ERR_AUTH_PENDING if the check will be completed later with the handle
+ *	from mosquitto_auth_pending_new().
  */
 int mosquitto_auth_unpwd_check(void *user_data, struct mosquitto *client, const char *username, const char *password);
 
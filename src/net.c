@@ -33,6 +33,7 @@ Contributors:
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #ifdef WITH_WRAP
 #include <tcpd.h>
 #endif
@@ -416,6 +417,7 @@ int net__load_crl_file(struct mosquitto__listener *listener)
 #ifdef WITH_TLS
 	X509_STORE *store;
 	X509_LOOKUP *lookup;
+	struct stat st;
 	int rc;
 
 	store = SSL_CTX_get_cert_store(listener->ssl_ctx);
@@ -432,6 +434,10 @@ int net__load_crl_file(struct mosquitto__listener *listener)
 		return 1;
 	}
 	X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK);
+	/* So a reload only rebuilds the TLS context if the CRL changes. */
+	if(stat(listener->crlfile, &st) == 0){
+		listener->crlfile_mtime = st.st_mtime;
+	}
 #endif
 
 	return MOSQ_ERR_SUCCESS;
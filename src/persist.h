@@ -17,7 +17,7 @@ Contributors:
 #ifndef PERSIST_H
 #define PERSIST_H
 
-#define MOSQ_DB_VERSION 5
+#define MOSQ_DB_VERSION 6
 
 /* DB read/write */
 extern const unsigned char magic[15];
@@ -27,9 +27,17 @@ extern const unsigned char magic[15];
 #define DB_CHUNK_RETAIN 4
 #define DB_CHUNK_SUB 5
 #define DB_CHUNK_CLIENT 6
+/* Chunks that only appear in the journal */
+#define DB_CHUNK_CLIENT_MSG_UPDATE 7
+#define DB_CHUNK_CLIENT_MSG_DELETE 8
+#define DB_CHUNK_UNSUB 9
+#define DB_CHUNK_CLIENT_DELETE 10
+/* Chunk that ends a version 6 or later persistence file */
+#define DB_CHUNK_INDEX 11
 /* End DB read/write */
 
 #define read_e(f, b, c) if(fread(b, 1, c, f) != c){ goto error; }
+#define read_mem_e(r, b, c) if(persist__read_bytes(r, b, c)){ goto error; }
 #define write_e(f, b, c) if(fwrite(b, 1, c, f) != c){ goto error; }
 
 /* COMPATIBILITY NOTES
@@ -103,6 +111,7 @@ struct P_msg_store{
 	struct mosquitto source;
 	char *topic;
 	mosquitto_property *properties;
+	bool payload_mapped;
 };
 
 
@@ -128,30 +137,87 @@ struct P_retain{
 };
 
 
-int persist__read_string_len(FILE *db_fptr, char **str, uint16_t len);
-int persist__read_string(FILE *db_fptr, char **str);
+/* From version 6, a persistence file holds its chunks in sections, one for
+ * each chunk type, in the order message stores, clients, client messages,
+ * retained messages, subscriptions. The file ends with an index chunk, made up
+ * of one PF_index_entry per section followed by the offset of the index chunk
+ * itself, so a reader can find the index from the end of the file and go
+ * directly to each section. The chunks in a section are the same as in
+ * version 5, and readers that don't use the index can still read the file in
+ * order, skipping the index chunk. */
+struct PF_index_entry{
+	uint32_t chunk;
+	uint32_t count;
+	uint64_t offset;
+	uint64_t length;
+};
+
 
-int persist__chunk_header_read_v234(FILE *db_fptr, int *chunk, int *length);
-int persist__chunk_cfg_read_v234(FILE *db_fptr, struct PF_cfg *chunk);
-int persist__chunk_client_read_v234(FILE *db_fptr, struct P_client *chunk, int db_version);
-int persist__chunk_client_msg_read_v234(FILE *db_fptr, struct P_client_msg *chunk);
-int persist__chunk_msg_store_read_v234(FILE *db_fptr, struct P_msg_store *chunk, int db_version);
-int persist__chunk_retain_read_v234(FILE *db_fptr, struct P_retain *chunk);
-int persist__chunk_sub_read_v234(FILE *db_fptr, struct P_sub *chunk);
+/* A persistence file or journal that is being restored. The whole file is
+ * mapped into memory, or read in one go where that isn't possible, and the
+ * chunks are parsed from there. Strings read from a chunk are placed in a
+ * buffer that is reused for every chunk, so they are only valid until the
+ * next chunk is started and must not be freed. */
+struct persist__reader{
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+	char *strings;
+	size_t strings_size;
+	size_t strings_used;
+	bool mapped;
+	bool map_payloads; /* Leave large retained payloads in the mapping */
+};
 
-int persist__chunk_header_read_v5(FILE *db_fptr, int *chunk, int *length);
-int persist__chunk_cfg_read_v5(FILE *db_fptr, struct PF_cfg *chunk);
-int persist__chunk_client_read_v5(FILE *db_fptr, struct P_client *chunk);
-int persist__chunk_client_msg_read_v5(FILE *db_fptr, struct P_client_msg *chunk, uint32_t length);
-int persist__chunk_msg_store_read_v5(FILE *db_fptr, struct P_msg_store *chunk, uint32_t length);
-int persist__chunk_retain_read_v5(FILE *db_fptr, struct P_retain *chunk);
-int persist__chunk_sub_read_v5(FILE *db_fptr, struct P_sub *chunk);
+/* Retained payloads at least this large are left in the mapped persistence
+ * file when persistence_lazy_retained is set. Smaller payloads share their
+ * pages with the surrounding chunks, so there is nothing to gain. */
+#define PERSIST_LAZY_PAYLOAD_MIN 256
+
+
+int persist__reader_init(struct persist__reader *reader, FILE *fptr);
+void persist__reader_cleanup(struct persist__reader *reader);
+int persist__reader_chunk_begin(struct persist__reader *reader, uint32_t length);
+int persist__read_bytes(struct persist__reader *reader, void *buf, size_t len);
+int persist__read_string_len(struct persist__reader *reader, char **str, uint16_t len);
+int persist__read_string(struct persist__reader *reader, char **str);
+
+int persist__chunk_header_read_v234(struct persist__reader *reader, int *chunk, int *length);
+int persist__chunk_cfg_read_v234(struct persist__reader *reader, struct PF_cfg *chunk);
+int persist__chunk_client_read_v234(struct persist__reader *reader, struct P_client *chunk, int db_version);
+int persist__chunk_client_msg_read_v234(struct persist__reader *reader, struct P_client_msg *chunk);
+int persist__chunk_msg_store_read_v234(struct persist__reader *reader, struct P_msg_store *chunk, int db_version);
+int persist__chunk_retain_read_v234(struct persist__reader *reader, struct P_retain *chunk);
+int persist__chunk_sub_read_v234(struct persist__reader *reader, struct P_sub *chunk);
+
+int persist__chunk_header_read_v5(struct persist__reader *reader, int *chunk, int *length);
+int persist__chunk_cfg_read_v5(struct persist__reader *reader, struct PF_cfg *chunk);
+int persist__chunk_client_read_v5(struct persist__reader *reader, struct P_client *chunk);
+int persist__chunk_client_msg_read_v5(struct persist__reader *reader, struct P_client_msg *chunk, uint32_t length);
+int persist__chunk_msg_store_read_v5(struct persist__reader *reader, struct P_msg_store *chunk, uint32_t length);
+int persist__chunk_retain_read_v5(struct persist__reader *reader, struct P_retain *chunk);
+int persist__chunk_sub_read_v5(struct persist__reader *reader, struct P_sub *chunk);
+
+int persist__chunk_index_read_v5(struct persist__reader *reader, uint32_t length, struct PF_index_entry **entries, int *entry_count);
 
 int persist__chunk_cfg_write_v5(FILE *db_fptr, struct PF_cfg *chunk);
 int persist__chunk_client_write_v5(FILE *db_fptr, struct P_client *chunk);
+int persist__chunk_client_delete_write_v5(FILE *db_fptr, struct P_client *chunk);
 int persist__chunk_client_msg_write_v5(FILE *db_fptr, struct P_client_msg *chunk);
+int persist__chunk_client_msg_update_write_v5(FILE *db_fptr, struct P_client_msg *chunk);
+int persist__chunk_client_msg_delete_write_v5(FILE *db_fptr, struct P_client_msg *chunk);
 int persist__chunk_message_store_write_v5(FILE *db_fptr, struct P_msg_store *chunk);
 int persist__chunk_retain_write_v5(FILE *db_fptr, struct P_retain *chunk);
 int persist__chunk_sub_write_v5(FILE *db_fptr, struct P_sub *chunk);
+int persist__chunk_index_write_v5(FILE *db_fptr, struct PF_index_entry *entries, int entry_count, uint64_t offset);
+int persist__chunk_unsub_write_v5(FILE *db_fptr, struct P_sub *chunk);
+
+/* Returns the allocated path of the journal that accompanies the persistence
+ * file, or of the journal that follows it while a background save is
+ * running if next is true. */
+char *persist__journal_path(struct mosquitto_db *db, bool next);
+
+/* Monotonic clock in milliseconds, for timing saves and restores. */
+long persist__time_ms(void);
 
 #endif
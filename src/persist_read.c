@@ -26,6 +26,9 @@ Contributors:
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 #include <sys/stat.h>
 #include <time.h>
 #include <utlist.h>
@@ -38,9 +41,44 @@ Contributors:
 
 static uint32_t db_version;
 
+/* The persistence file mapping, when retained payloads have been left in it
+ * by persistence_lazy_retained. Each of those payloads holds a reference, as
+ * does the reader until the restore is complete. */
+static const uint8_t *payload_map = NULL;
+static size_t payload_map_len = 0;
+static int payload_map_refs = 0;
+
+/* Journal records that change a client message find it by direction, store
+ * id and mid. Searching the client's queues for each one would make replaying
+ * a long queue quadratic, so the messages of a client are indexed the first
+ * time a record refers to one of them, and the index is kept up to date until
+ * that journal has been replayed. */
+struct persist__cmsg_key{
+	struct mosquitto *context;
+	dbid_t store_id;
+	uint16_t mid;
+	uint8_t direction;
+};
+
+struct persist__cmsg_index{
+	UT_hash_handle hh;
+	struct persist__cmsg_key key;
+	struct mosquitto_client_msg *cmsg;
+};
+
+struct persist__indexed_context{
+	UT_hash_handle hh;
+	struct mosquitto *context;
+};
+
+static struct persist__cmsg_index *cmsg_index = NULL;
+static struct persist__indexed_context *indexed_contexts = NULL;
+
 const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o',' ','d','b'};
 
 static int persist__restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos, uint32_t identifier, int options);
+static int persist__cmsg_index_add(struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+static bool persist__cmsg_index_has_context(struct mosquitto *context);
 
 static struct mosquitto *persist__find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t last_mid)
 {
@@ -70,22 +108,169 @@ static struct mosquitto *persist__find_or_add_context(struct mosquitto_db *db, c
 }
 
 
-int persist__read_string_len(FILE *db_fptr, char **str, uint16_t len)
+long persist__time_ms(void)
 {
-	char *s = NULL;
+#ifdef WIN32
+	return (long)GetTickCount64();
+#else
+	struct timespec tp;
 
-	if(len){
-		s = mosquitto__malloc(len+1);
-		if(!s){
-			fclose(db_fptr);
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec*1000 + tp.tv_nsec/1000000;
+#endif
+}
+
+
+/* Map the whole of an open persistence file into memory, or read it in if
+ * mapping isn't available. The file can be closed once this returns. */
+int persist__reader_init(struct persist__reader *reader, FILE *fptr)
+{
+	struct stat st;
+	uint8_t *buf;
+#ifndef WIN32
+	void *map;
+#endif
+
+	memset(reader, 0, sizeof(struct persist__reader));
+
+	if(fstat(fileno(fptr), &st) < 0){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+		return 1;
+	}
+	if(st.st_size == 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if((uint64_t)st.st_size > SIZE_MAX){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is too large to load.");
+		return 1;
+	}
+	reader->len = (size_t)st.st_size;
+
+#ifndef WIN32
+	map = mmap(NULL, reader->len, PROT_READ, MAP_PRIVATE, fileno(fptr), 0);
+	if(map != MAP_FAILED){
+		posix_madvise(map, reader->len, POSIX_MADV_SEQUENTIAL);
+		reader->data = map;
+		reader->mapped = true;
+		return MOSQ_ERR_SUCCESS;
+	}
+#endif
+
+	buf = mosquitto__malloc(reader->len);
+	if(!buf){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	if(fread(buf, 1, reader->len, fptr) != reader->len){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+		mosquitto__free(buf);
+		return 1;
+	}
+	reader->data = buf;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void persist__payload_map_release(void)
+{
+	if(payload_map_refs == 0) return;
+
+	payload_map_refs--;
+	if(payload_map_refs == 0){
+#ifndef WIN32
+		munmap((void *)payload_map, payload_map_len);
+#endif
+		payload_map = NULL;
+		payload_map_len = 0;
+	}
+}
+
+
+void persist__reader_cleanup(struct persist__reader *reader)
+{
+	if(reader->map_payloads){
+		/* The mapping now belongs to the retained payloads that point into
+		 * it. Drop the pages read during the restore so that only the
+		 * payloads that are sent take up memory. */
+		persist__payload_map_release();
+#ifndef WIN32
+		if(payload_map){
+#  ifdef MADV_DONTNEED
+			madvise((void *)payload_map, payload_map_len, MADV_DONTNEED);
+#  endif
+			posix_madvise((void *)payload_map, payload_map_len, POSIX_MADV_RANDOM);
+		}
+#endif
+	}else if(reader->data){
+#ifndef WIN32
+		if(reader->mapped){
+			munmap((void *)reader->data, reader->len);
+		}else
+#endif
+		{
+			mosquitto__free((void *)reader->data);
+		}
+	}
+	mosquitto__free(reader->strings);
+	memset(reader, 0, sizeof(struct persist__reader));
+}
+
+
+/* Make room for all of the strings in the next chunk. The strings in a chunk
+ * can't be longer than the chunk itself, plus one terminator for each, so
+ * the buffer is grown at most once per chunk and pointers into it stay valid
+ * until the next chunk. */
+int persist__reader_chunk_begin(struct persist__reader *reader, uint32_t length)
+{
+	char *strings;
+	size_t size;
+
+	reader->strings_used = 0;
+
+	size = (size_t)length + 4;
+	if(size > reader->strings_size){
+		if(size < 1024){
+			size = 1024;
+		}
+		strings = mosquitto__realloc(reader->strings, size);
+		if(!strings){
 			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
-		if(fread(s, 1, len, db_fptr) != len){
-			mosquitto__free(s);
-			return MOSQ_ERR_NOMEM;
+		reader->strings = strings;
+		reader->strings_size = size;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__read_bytes(struct persist__reader *reader, void *buf, size_t len)
+{
+	if(len > reader->len - reader->pos){
+		return 1;
+	}
+	memcpy(buf, &reader->data[reader->pos], len);
+	reader->pos += len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__read_string_len(struct persist__reader *reader, char **str, uint16_t len)
+{
+	char *s = NULL;
+
+	if(len){
+		if(reader->strings_size - reader->strings_used < (size_t)len+1){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is corrupt, string longer than its chunk.");
+			return 1;
+		}
+		s = &reader->strings[reader->strings_used];
+		if(persist__read_bytes(reader, s, len)){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
+			return 1;
 		}
 		s[len] = '\0';
+		reader->strings_used += (size_t)len+1;
 	}
 
 	*str = s;
@@ -93,17 +278,84 @@ int persist__read_string_len(FILE *db_fptr, char **str, uint16_t len)
 }
 
 
-int persist__read_string(FILE *db_fptr, char **str)
+int persist__read_string(struct persist__reader *reader, char **str)
 {
 	uint16_t i16temp;
 	uint16_t slen;
 
-	if(fread(&i16temp, 1, sizeof(uint16_t), db_fptr) != sizeof(uint16_t)){
+	if(persist__read_bytes(reader, &i16temp, sizeof(uint16_t))){
 		return MOSQ_ERR_INVAL;
 	}
 
 	slen = ntohs(i16temp);
-	return persist__read_string_len(db_fptr, str, slen);
+	return persist__read_string_len(reader, str, slen);
+}
+
+
+static int persist__msg_store_load_reserve(struct mosquitto_db *db, int size)
+{
+	struct mosquitto_msg_store_load *load;
+
+	if(size <= db->msg_store_load_size){
+		return MOSQ_ERR_SUCCESS;
+	}
+	load = mosquitto__realloc(db->msg_store_load, sizeof(struct mosquitto_msg_store_load)*size);
+	if(!load){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	db->msg_store_load = load;
+	db->msg_store_load_size = size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__msg_store_load_add(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	struct mosquitto_msg_store_load *load;
+	int i;
+
+	if(db->msg_store_load_count == db->msg_store_load_size){
+		if(persist__msg_store_load_reserve(db, db->msg_store_load_size ? db->msg_store_load_size*2 : 64)){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	load = db->msg_store_load;
+
+	/* Messages are written in the order they were stored, so this is almost
+	 * always an append. */
+	i = db->msg_store_load_count;
+	while(i > 0 && load[i-1].db_id > stored->db_id){
+		i--;
+	}
+	if(i < db->msg_store_load_count){
+		memmove(&load[i+1], &load[i], sizeof(struct mosquitto_msg_store_load)*(db->msg_store_load_count-i));
+	}
+	load[i].db_id = stored->db_id;
+	load[i].store = stored;
+	db->msg_store_load_count++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static struct mosquitto_msg_store_load *persist__msg_store_load_find(struct mosquitto_db *db, dbid_t db_id)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = db->msg_store_load_count - 1;
+	while(lo <= hi){
+		mid = lo + (hi - lo)/2;
+		if(db->msg_store_load[mid].db_id == db_id){
+			return &db->msg_store_load[mid];
+		}else if(db->msg_store_load[mid].db_id < db_id){
+			lo = mid + 1;
+		}else{
+			hi = mid - 1;
+		}
+	}
+	return NULL;
 }
 
 
@@ -114,7 +366,7 @@ static int persist__client_msg_restore(struct mosquitto_db *db, struct P_client_
 	struct mosquitto *context;
 	struct mosquitto_msg_data *msg_data;
 
-	HASH_FIND(hh, db->msg_store_load, &chunk->F.store_id, sizeof(dbid_t), load);
+	load = persist__msg_store_load_find(db, chunk->F.store_id);
 	if(!load){
 		/* Can't find message - probably expired */
 		return MOSQ_ERR_SUCCESS;
@@ -168,11 +420,14 @@ static int persist__client_msg_restore(struct mosquitto_db *db, struct P_client_
 		msg_data->msg_bytes12 += cmsg->store->payloadlen;
 	}
 
+	if(persist__cmsg_index_has_context(context)){
+		return persist__cmsg_index_add(context, cmsg);
+	}
 	return MOSQ_ERR_SUCCESS;
 }
 
 
-static int persist__client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int persist__client_chunk_restore(struct mosquitto_db *db, struct persist__reader *reader)
 {
 	int rc = 0;
 	struct mosquitto *context;
@@ -180,13 +435,12 @@ static int persist__client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 
 	memset(&chunk, 0, sizeof(struct P_client));
 
-	if(db_version == 5){
-		rc = persist__chunk_client_read_v5(db_fptr, &chunk);
+	if(db_version >= 5){
+		rc = persist__chunk_client_read_v5(reader, &chunk);
 	}else{
-		rc = persist__chunk_client_read_v234(db_fptr, &chunk, db_version);
+		rc = persist__chunk_client_read_v234(reader, &chunk, db_version);
 	}
 	if(rc){
-		fclose(db_fptr);
 		return rc;
 	}
 
@@ -199,55 +453,51 @@ static int persist__client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 		rc = 1;
 	}
 
-	mosquitto__free(chunk.client_id);
-
 	return rc;
 }
 
 
-static int persist__client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length)
+static int persist__client_msg_chunk_restore(struct mosquitto_db *db, struct persist__reader *reader, uint32_t length)
 {
 	struct P_client_msg chunk;
 	int rc;
 
 	memset(&chunk, 0, sizeof(struct P_client_msg));
 
-	if(db_version == 5){
-		rc = persist__chunk_client_msg_read_v5(db_fptr, &chunk, length);
+	if(db_version >= 5){
+		rc = persist__chunk_client_msg_read_v5(reader, &chunk, length);
 	}else{
-		rc = persist__chunk_client_msg_read_v234(db_fptr, &chunk);
+		rc = persist__chunk_client_msg_read_v234(reader, &chunk);
 	}
 	if(rc){
-		fclose(db_fptr);
 		return rc;
 	}
 
 	rc = persist__client_msg_restore(db, &chunk);
-	mosquitto__free(chunk.client_id);
-
 	return rc;
 }
 
 
-static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length)
+static int persist__msg_store_chunk_restore(struct mosquitto_db *db, struct persist__reader *reader, uint32_t length)
 {
 	struct P_msg_store chunk;
 	struct mosquitto_msg_store *stored = NULL;
-	struct mosquitto_msg_store_load *load;
+	mosquitto__payload_uhpa no_payload;
+	char *topic = NULL;
 	int64_t message_expiry_interval64;
 	uint32_t message_expiry_interval;
 	int rc = 0;
 	int i;
 
 	memset(&chunk, 0, sizeof(struct P_msg_store));
+	no_payload.ptr = NULL;
 
-	if(db_version == 5){
-		rc = persist__chunk_msg_store_read_v5(db_fptr, &chunk, length);
+	if(db_version >= 5){
+		rc = persist__chunk_msg_store_read_v5(reader, &chunk, length);
 	}else{
-		rc = persist__chunk_msg_store_read_v234(db_fptr, &chunk, db_version);
+		rc = persist__chunk_msg_store_read_v234(reader, &chunk, db_version);
 	}
 	if(rc){
-		fclose(db_fptr);
 		return rc;
 	}
 
@@ -259,26 +509,14 @@ static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fp
 			}
 		}
 	}
-	load = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store_load));
-	if(!load){
-		fclose(db_fptr);
-		mosquitto__free(chunk.source.id);
-		mosquitto__free(chunk.source.username);
-		mosquitto__free(chunk.topic);
-		UHPA_FREE(chunk.payload, chunk.F.payloadlen);
-		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-
 	if(chunk.F.expiry_time > 0){
 		message_expiry_interval64 = chunk.F.expiry_time - time(NULL);
 		if(message_expiry_interval64 < 0 || message_expiry_interval64 > UINT32_MAX){
 			/* Expired message */
-			mosquitto__free(chunk.source.id);
-			mosquitto__free(chunk.source.username);
-			mosquitto__free(chunk.topic);
-			UHPA_FREE(chunk.payload, chunk.F.payloadlen);
-			mosquitto__free(load);
+			if(!chunk.payload_mapped){
+				UHPA_FREE(chunk.payload, chunk.F.payloadlen);
+			}
+			mosquitto_property_free_all(&chunk.properties);
 			return MOSQ_ERR_SUCCESS;
 		}else{
 			message_expiry_interval = (uint32_t)message_expiry_interval64;
@@ -287,31 +525,54 @@ static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fp
 		message_expiry_interval = 0;
 	}
 
-	rc = db__message_store(db, &chunk.source, chunk.F.source_mid,
-			chunk.topic, chunk.F.qos, chunk.F.payloadlen,
-			&chunk.payload, chunk.F.retain, &stored, message_expiry_interval,
-			chunk.properties, chunk.F.store_id, mosq_mo_client);
+	/* The topic read from the chunk belongs to the reader, but the store
+	 * needs its own copy. */
+	if(chunk.topic){
+		topic = mosquitto__strdup(chunk.topic);
+		if(!topic){
+			if(!chunk.payload_mapped){
+				UHPA_FREE(chunk.payload, chunk.F.payloadlen);
+			}
+			mosquitto_property_free_all(&chunk.properties);
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+	}
 
-	mosquitto__free(chunk.source.id);
-	mosquitto__free(chunk.source.username);
-	chunk.source.id = NULL;
-	chunk.source.username = NULL;
+	if(chunk.payload_mapped){
+		/* The payload stays in the mapped file, so store the message
+		 * without it and point the store at the mapping afterwards. */
+		rc = db__message_store(db, &chunk.source, chunk.F.source_mid,
+				topic, chunk.F.qos, 0,
+				&no_payload, chunk.F.retain, &stored, message_expiry_interval,
+				chunk.properties, chunk.F.store_id, mosq_mo_client);
+		if(rc == MOSQ_ERR_SUCCESS){
+			stored->payload.ptr = chunk.payload.ptr;
+			stored->payloadlen = chunk.F.payloadlen;
+			stored->payload_mapped = true;
+			db->msg_store_bytes += chunk.F.payloadlen;
+			payload_map_refs++;
+		}
+	}else{
+		rc = db__message_store(db, &chunk.source, chunk.F.source_mid,
+				topic, chunk.F.qos, chunk.F.payloadlen,
+				&chunk.payload, chunk.F.retain, &stored, message_expiry_interval,
+				chunk.properties, chunk.F.store_id, mosq_mo_client);
+	}
 
 	if(rc == MOSQ_ERR_SUCCESS){
 		stored->source_listener = chunk.source.listener;
-		load->db_id = stored->db_id;
-		load->store = stored;
-
-		HASH_ADD(hh, db->msg_store_load, db_id, sizeof(dbid_t), load);
-		return MOSQ_ERR_SUCCESS;
+		if(stored->db_id > db->last_db_id){
+			/* Only possible for messages from the journal. */
+			db->last_db_id = stored->db_id;
+		}
+		return persist__msg_store_load_add(db, stored);
 	}else{
-		mosquitto__free(load);
-		fclose(db_fptr);
 		return rc;
 	}
 }
 
-static int persist__retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int persist__retain_chunk_restore(struct mosquitto_db *db, struct persist__reader *reader)
 {
 	struct mosquitto_msg_store_load *load;
 	struct P_retain chunk;
@@ -319,17 +580,16 @@ static int persist__retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 
 	memset(&chunk, 0, sizeof(struct P_retain));
 
-	if(db_version == 5){
-		rc = persist__chunk_retain_read_v5(db_fptr, &chunk);
+	if(db_version >= 5){
+		rc = persist__chunk_retain_read_v5(reader, &chunk);
 	}else{
-		rc = persist__chunk_retain_read_v234(db_fptr, &chunk);
+		rc = persist__chunk_retain_read_v234(reader, &chunk);
 	}
 	if(rc){
-		fclose(db_fptr);
 		return rc;
 	}
 
-	HASH_FIND(hh, db->msg_store_load, &chunk.F.store_id, sizeof(dbid_t), load);
+	load = persist__msg_store_load_find(db, chunk.F.store_id);
 	if(load){
 		sub__messages_queue(db, NULL, load->store->topic, load->store->qos, load->store->retain, &load->store);
 	}else{
@@ -338,54 +598,576 @@ static int persist__retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int persist__sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int persist__sub_chunk_restore(struct mosquitto_db *db, struct persist__reader *reader)
 {
 	struct P_sub chunk;
 	int rc;
 
 	memset(&chunk, 0, sizeof(struct P_sub));
 
-	if(db_version == 5){
-		rc = persist__chunk_sub_read_v5(db_fptr, &chunk);
+	if(db_version >= 5){
+		rc = persist__chunk_sub_read_v5(reader, &chunk);
 	}else{
-		rc = persist__chunk_sub_read_v234(db_fptr, &chunk);
+		rc = persist__chunk_sub_read_v234(reader, &chunk);
 	}
 	if(rc){
-		fclose(db_fptr);
 		return rc;
 	}
 
 	rc = persist__restore_sub(db, chunk.client_id, chunk.topic, chunk.F.qos, chunk.F.identifier, chunk.F.options);
 
-	mosquitto__free(chunk.client_id);
-	mosquitto__free(chunk.topic);
-
 	return rc;
 }
 
 
-int persist__chunk_header_read(FILE *db_fptr, int *chunk, int *length)
+char *persist__journal_path(struct mosquitto_db *db, bool next)
+{
+	char *path;
+	size_t len;
+
+	len = strlen(db->config->persistence_filepath) + strlen(".journal.next") + 1;
+	path = mosquitto__malloc(len);
+	if(path){
+		snprintf(path, len, "%s.journal%s", db->config->persistence_filepath, next?".next":"");
+	}
+	return path;
+}
+
+
+static void persist__cmsg_key_set(struct persist__cmsg_key *key, struct mosquitto *context, int direction, dbid_t store_id, uint16_t mid)
+{
+	/* The whole key is hashed, so any padding must be zero too. */
+	memset(key, 0, sizeof(struct persist__cmsg_key));
+	key->context = context;
+	key->store_id = store_id;
+	key->mid = mid;
+	key->direction = (uint8_t)direction;
+}
+
+
+static int persist__cmsg_index_add(struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	struct persist__cmsg_index *entry;
+
+	entry = mosquitto__calloc(1, sizeof(struct persist__cmsg_index));
+	if(!entry){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	persist__cmsg_key_set(&entry->key, context, cmsg->direction, cmsg->store->db_id, cmsg->mid);
+	entry->cmsg = cmsg;
+	HASH_ADD(hh, cmsg_index, key, sizeof(struct persist__cmsg_key), entry);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__cmsg_index_queue(struct mosquitto *context, struct mosquitto_client_msg *queue)
+{
+	struct mosquitto_client_msg *cmsg;
+
+	DL_FOREACH(queue, cmsg){
+		if(persist__cmsg_index_add(context, cmsg)) return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Index the messages of a client the first time a journal record refers to
+ * one of them. */
+static int persist__cmsg_index_context(struct mosquitto *context)
+{
+	struct persist__indexed_context *indexed;
+
+	HASH_FIND_PTR(indexed_contexts, &context, indexed);
+	if(indexed) return MOSQ_ERR_SUCCESS;
+
+	indexed = mosquitto__calloc(1, sizeof(struct persist__indexed_context));
+	if(!indexed){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	indexed->context = context;
+	HASH_ADD_PTR(indexed_contexts, context, indexed);
+
+	if(persist__cmsg_index_queue(context, context->msgs_in.inflight)
+			|| persist__cmsg_index_queue(context, context->msgs_in.queued)
+			|| persist__cmsg_index_queue(context, context->msgs_out.inflight)
+			|| persist__cmsg_index_queue(context, context->msgs_out.queued)){
+
+		return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static bool persist__cmsg_index_has_context(struct mosquitto *context)
+{
+	struct persist__indexed_context *indexed;
+
+	HASH_FIND_PTR(indexed_contexts, &context, indexed);
+	return indexed != NULL;
+}
+
+
+static struct persist__cmsg_index *persist__cmsg_index_find(struct mosquitto *context, int direction, dbid_t store_id, uint16_t mid)
+{
+	struct persist__cmsg_index *entry;
+	struct persist__cmsg_key key;
+
+	persist__cmsg_key_set(&key, context, direction, store_id, mid);
+	HASH_FIND(hh, cmsg_index, &key, sizeof(struct persist__cmsg_key), entry);
+	return entry;
+}
+
+
+static void persist__cmsg_index_remove_queue(struct mosquitto *context, struct mosquitto_client_msg *queue)
+{
+	struct mosquitto_client_msg *cmsg;
+	struct persist__cmsg_index *entry;
+
+	DL_FOREACH(queue, cmsg){
+		entry = persist__cmsg_index_find(context, cmsg->direction, cmsg->store->db_id, cmsg->mid);
+		if(entry){
+			HASH_DELETE(hh, cmsg_index, entry);
+			mosquitto__free(entry);
+		}
+	}
+}
+
+
+/* Forget a client whose messages are about to be freed. */
+static void persist__cmsg_index_context_remove(struct mosquitto *context)
+{
+	struct persist__indexed_context *indexed;
+
+	HASH_FIND_PTR(indexed_contexts, &context, indexed);
+	if(!indexed) return;
+
+	persist__cmsg_index_remove_queue(context, context->msgs_in.inflight);
+	persist__cmsg_index_remove_queue(context, context->msgs_in.queued);
+	persist__cmsg_index_remove_queue(context, context->msgs_out.inflight);
+	persist__cmsg_index_remove_queue(context, context->msgs_out.queued);
+
+	HASH_DELETE(hh, indexed_contexts, indexed);
+	mosquitto__free(indexed);
+}
+
+
+static void persist__cmsg_index_cleanup(void)
+{
+	struct persist__cmsg_index *entry, *entry_tmp;
+	struct persist__indexed_context *indexed, *indexed_tmp;
+
+	HASH_ITER(hh, cmsg_index, entry, entry_tmp){
+		HASH_DELETE(hh, cmsg_index, entry);
+		mosquitto__free(entry);
+	}
+	HASH_ITER(hh, indexed_contexts, indexed, indexed_tmp){
+		HASH_DELETE(hh, indexed_contexts, indexed);
+		mosquitto__free(indexed);
+	}
+}
+
+
+/* Apply a journal record that updates the state of, or removes, a client
+ * message. */
+static int persist__client_msg_change_chunk_restore(struct mosquitto_db *db, struct persist__reader *reader, uint32_t length, bool delete)
 {
-	if(db_version == 5){
-		return persist__chunk_header_read_v5(db_fptr, chunk, length);
+	struct P_client_msg chunk;
+	struct mosquitto *context;
+	struct mosquitto_msg_data *msg_data;
+	struct mosquitto_client_msg *cmsg;
+	struct persist__cmsg_index *entry;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_client_msg));
+
+	rc = persist__chunk_client_msg_read_v5(reader, &chunk, length);
+	if(rc){
+		return rc;
+	}
+	mosquitto_property_free_all(&chunk.properties);
+
+	HASH_FIND(hh_id, db->contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+	if(!context){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(chunk.F.direction == mosq_md_out){
+		msg_data = &context->msgs_out;
 	}else{
-		return persist__chunk_header_read_v234(db_fptr, chunk, length);
+		msg_data = &context->msgs_in;
+	}
+	if(persist__cmsg_index_context(context)){
+		return MOSQ_ERR_NOMEM;
 	}
+	entry = persist__cmsg_index_find(context, chunk.F.direction, chunk.F.store_id, chunk.F.mid);
+	if(!entry){
+		return MOSQ_ERR_SUCCESS;
+	}
+	cmsg = entry->cmsg;
+
+	if(!delete && (cmsg->state == mosq_ms_queued) == (chunk.F.state == mosq_ms_queued)){
+		cmsg->state = chunk.F.state;
+		cmsg->dup = chunk.F.retain_dup&0x0F;
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(cmsg->state == mosq_ms_queued){
+		DL_DELETE(msg_data->queued, cmsg);
+	}else{
+		DL_DELETE(msg_data->inflight, cmsg);
+	}
+	if(delete){
+		HASH_DELETE(hh, cmsg_index, entry);
+		mosquitto__free(entry);
+
+		msg_data->msg_count--;
+		msg_data->msg_bytes -= cmsg->store->payloadlen;
+		if(cmsg->qos > 0){
+			msg_data->msg_count12--;
+			msg_data->msg_bytes12 -= cmsg->store->payloadlen;
+		}
+		db__msg_store_ref_dec(db, &cmsg->store);
+		mosquitto_property_free_all(&cmsg->properties);
+		mosquitto__free(cmsg);
+	}else{
+		cmsg->state = chunk.F.state;
+		cmsg->dup = chunk.F.retain_dup&0x0F;
+		if(cmsg->state == mosq_ms_queued){
+			DL_APPEND(msg_data->queued, cmsg);
+		}else{
+			DL_APPEND(msg_data->inflight, cmsg);
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
 }
 
 
-int persist__restore(struct mosquitto_db *db)
+static int persist__unsub_chunk_restore(struct mosquitto_db *db, struct persist__reader *reader)
+{
+	struct P_sub chunk;
+	struct mosquitto *context;
+	uint8_t reason;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_sub));
+
+	rc = persist__chunk_sub_read_v5(reader, &chunk);
+	if(rc){
+		return rc;
+	}
+
+	HASH_FIND(hh_id, db->contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+	if(context){
+		sub__remove(db, context, chunk.topic, db->subs, &reason);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__client_delete_chunk_restore(struct mosquitto_db *db, struct persist__reader *reader)
+{
+	struct P_client chunk;
+	struct mosquitto *context;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_client));
+
+	rc = persist__chunk_client_read_v5(reader, &chunk);
+	if(rc){
+		return rc;
+	}
+
+	HASH_FIND(hh_id, db->contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+	if(context){
+		sub__clean_session(db, context);
+		persist__cmsg_index_context_remove(context);
+		db__messages_delete(db, context);
+		context__remove_from_by_id(db, context);
+		context__cleanup(db, context, true);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__chunk_header_read(struct persist__reader *reader, int *chunk, int *length)
+{
+	if(db_version >= 5){
+		return persist__chunk_header_read_v5(reader, chunk, length);
+	}else{
+		return persist__chunk_header_read_v234(reader, chunk, length);
+	}
+}
+
+
+/* Restore the chunks from the current position up to end, which is either
+ * the end of the file or of one section of an indexed file. */
+static int persist__restore_chunks(struct mosquitto_db *db, struct persist__reader *reader, size_t end, bool journal)
+{
+	int chunk, length;
+	struct PF_cfg cfg_chunk;
+
+	while(reader->pos < end && persist__chunk_header_read(reader, &chunk, &length) == MOSQ_ERR_SUCCESS){
+		if(reader->pos > end || (uint32_t)length > end - reader->pos){
+			if(journal){
+				/* The broker stopped part way through writing this record,
+				 * so it is incomplete and must be discarded. */
+				log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistence journal ends with an incomplete record. Ignoring.");
+				break;
+			}else if(end != reader->len){
+				log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is corrupt, chunk overruns its section.");
+				return 1;
+			}
+		}
+		if(persist__reader_chunk_begin(reader, (uint32_t)length)){
+			return 1;
+		}
+		switch(chunk){
+			case DB_CHUNK_CFG:
+				if(db_version >= 5){
+					if(persist__chunk_cfg_read_v5(reader, &cfg_chunk)){
+						return 1;
+					}
+				}else{
+					if(persist__chunk_cfg_read_v234(reader, &cfg_chunk)){
+						return 1;
+					}
+				}
+				if(cfg_chunk.dbid_size != sizeof(dbid_t)){
+					log__printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
+							cfg_chunk.dbid_size, (unsigned long)sizeof(dbid_t));
+					return 1;
+				}
+				db->last_db_id = cfg_chunk.last_db_id;
+				break;
+
+			case DB_CHUNK_MSG_STORE:
+				if(persist__msg_store_chunk_restore(db, reader, length)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT_MSG:
+				if(persist__client_msg_chunk_restore(db, reader, length)) return 1;
+				break;
+
+			case DB_CHUNK_RETAIN:
+				if(persist__retain_chunk_restore(db, reader)) return 1;
+				break;
+
+			case DB_CHUNK_SUB:
+				if(persist__sub_chunk_restore(db, reader)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT:
+				if(persist__client_chunk_restore(db, reader)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT_MSG_UPDATE:
+			case DB_CHUNK_CLIENT_MSG_DELETE:
+				if(!journal) goto unsupported;
+				if(persist__client_msg_change_chunk_restore(db, reader, length, chunk == DB_CHUNK_CLIENT_MSG_DELETE)) return 1;
+				break;
+
+			case DB_CHUNK_UNSUB:
+				if(!journal) goto unsupported;
+				if(persist__unsub_chunk_restore(db, reader)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT_DELETE:
+				if(!journal) goto unsupported;
+				if(persist__client_delete_chunk_restore(db, reader)) return 1;
+				break;
+
+			case DB_CHUNK_INDEX:
+				if(journal || db_version < 6) goto unsupported;
+				/* Only needed when restoring by section. */
+				reader->pos += (uint32_t)length;
+				break;
+
+			default:
+unsupported:
+				log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
+				if((uint32_t)length > end - reader->pos){
+					reader->pos = end;
+				}else{
+					reader->pos += (uint32_t)length;
+				}
+				break;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Find the index at the end of a version 6 file. The reader position is left
+ * unchanged. */
+static int persist__index_load(struct persist__reader *reader, struct PF_index_entry **entries, int *entry_count, size_t *index_offset)
+{
+	uint64_t offset;
+	size_t pos = reader->pos;
+	int chunk, length;
+	int i;
+
+	if(reader->len - pos < sizeof(uint64_t)){
+		return 1;
+	}
+	memcpy(&offset, &reader->data[reader->len - sizeof(uint64_t)], sizeof(uint64_t));
+	if(offset < pos || offset > reader->len - sizeof(struct PF_header)){
+		return 1;
+	}
+
+	reader->pos = (size_t)offset;
+	if(persist__chunk_header_read(reader, &chunk, &length)
+			|| chunk != DB_CHUNK_INDEX
+			|| (uint32_t)length != reader->len - reader->pos
+			|| persist__chunk_index_read_v5(reader, (uint32_t)length, entries, entry_count)){
+
+		reader->pos = pos;
+		return 1;
+	}
+	reader->pos = pos;
+
+	for(i=0; i<*entry_count; i++){
+		if((*entries)[i].offset < pos
+				|| (*entries)[i].offset > offset
+				|| (*entries)[i].length > offset - (*entries)[i].offset){
+
+			mosquitto__free(*entries);
+			*entries = NULL;
+			return 1;
+		}
+	}
+	*index_offset = (size_t)offset;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Restore a version 6 file section by section, in dependency order, using its
+ * index. This also tells us how many messages there are before any are
+ * loaded. Files with a damaged index are read in order instead. */
+static int persist__restore_indexed(struct mosquitto_db *db, struct persist__reader *reader)
+{
+	static const uint32_t order[] = {
+		DB_CHUNK_MSG_STORE, DB_CHUNK_CLIENT, DB_CHUNK_CLIENT_MSG, DB_CHUNK_RETAIN, DB_CHUNK_SUB
+	};
+	struct PF_index_entry *entries = NULL;
+	int entry_count = 0;
+	size_t index_offset, first;
+	size_t i;
+	int j;
+	int rc = 0;
+
+	if(persist__index_load(reader, &entries, &entry_count, &index_offset)){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistent database index is missing or corrupt, reading the whole file.");
+		return persist__restore_chunks(db, reader, reader->len, false);
+	}
+
+	/* Anything ahead of the sections, which is the cfg chunk. */
+	first = index_offset;
+	for(j=0; j<entry_count; j++){
+		if(entries[j].offset < first){
+			first = (size_t)entries[j].offset;
+		}
+	}
+	rc = persist__restore_chunks(db, reader, first, false);
+
+	for(i=0; rc == 0 && i<sizeof(order)/sizeof(order[0]); i++){
+		for(j=0; rc == 0 && j<entry_count; j++){
+			if(entries[j].chunk != order[i]) continue;
+
+			if(entries[j].chunk == DB_CHUNK_MSG_STORE
+					&& entries[j].count <= entries[j].length/sizeof(struct PF_header)){
+
+				rc = persist__msg_store_load_reserve(db, db->msg_store_load_count + entries[j].count);
+				if(rc) break;
+			}
+			reader->pos = (size_t)entries[j].offset;
+			rc = persist__restore_chunks(db, reader, (size_t)(entries[j].offset + entries[j].length), false);
+		}
+	}
+	mosquitto__free(entries);
+
+	return rc;
+}
+
+
+/* Replay the changes made since the snapshot with the given id was written.
+ * A journal that was started for any other snapshot is out of date, because
+ * its changes are already part of the snapshot. The exception is the next
+ * journal, which was started when a background save began and carries on
+ * from the current journal if that save never finished. */
+static int persist__journal_restore(struct mosquitto_db *db, dbid_t snapshot_id, bool next, bool follows_journal, bool *replayed)
 {
 	FILE *fptr;
+	struct persist__reader reader;
+	char *path;
 	char header[15];
-	int rc = 0;
 	uint32_t crc;
 	uint32_t i32temp;
 	int chunk, length;
-	ssize_t rlen;
-	char *err;
-	struct mosquitto_msg_store_load *load, *load_tmp;
 	struct PF_cfg cfg_chunk;
+	int rc;
+
+	*replayed = false;
+
+	path = persist__journal_path(db, next);
+	if(!path) return MOSQ_ERR_NOMEM;
+
+	fptr = mosquitto__fopen(path, "rb", false);
+	mosquitto__free(path);
+	if(fptr == NULL) return MOSQ_ERR_SUCCESS;
+
+	rc = persist__reader_init(&reader, fptr);
+	fclose(fptr);
+	if(rc) return rc;
+
+	if(persist__read_bytes(&reader, &header, 15) || memcmp(header, magic, 15)
+			|| persist__read_bytes(&reader, &crc, sizeof(uint32_t))
+			|| persist__read_bytes(&reader, &i32temp, sizeof(uint32_t))
+			|| ntohl(i32temp) < 5 || ntohl(i32temp) > MOSQ_DB_VERSION){
+
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistence journal is not valid. Ignoring.");
+		persist__reader_cleanup(&reader);
+		return MOSQ_ERR_SUCCESS;
+	}
+	db_version = ntohl(i32temp);
+
+	if(persist__chunk_header_read(&reader, &chunk, &length) || chunk != DB_CHUNK_CFG
+			|| persist__chunk_cfg_read_v5(&reader, &cfg_chunk)){
+
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistence journal is not valid. Ignoring.");
+		persist__reader_cleanup(&reader);
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(cfg_chunk.last_db_id != snapshot_id && !follows_journal){
+		log__printf(NULL, MOSQ_LOG_INFO, "Persistence journal is older than the persistence file. Ignoring.");
+		persist__reader_cleanup(&reader);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Replaying persistence journal.");
+	rc = persist__restore_chunks(db, &reader, reader.len, true);
+	persist__reader_cleanup(&reader);
+	persist__cmsg_index_cleanup();
+	if(rc) return rc;
+
+	*replayed = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__restore(struct mosquitto_db *db)
+{
+	FILE *fptr;
+	struct persist__reader reader;
+	char header[15];
+	int rc = 0;
+	uint32_t crc;
+	uint32_t i32temp;
+	dbid_t snapshot_id;
+	bool replayed;
+	long start;
 
 	assert(db);
 	assert(db->config);
@@ -395,21 +1177,35 @@ int persist__restore(struct mosquitto_db *db)
 	}
 
 	db->msg_store_load = NULL;
+	db->msg_store_load_count = 0;
+	db->msg_store_load_size = 0;
 
 	fptr = mosquitto__fopen(db->config->persistence_filepath, "rb", false);
 	if(fptr == NULL) return MOSQ_ERR_SUCCESS;
-	rlen = fread(&header, 1, 15, fptr);
-	if(rlen == 0){
-		fclose(fptr);
+
+	start = persist__time_ms();
+	rc = persist__reader_init(&reader, fptr);
+	fclose(fptr);
+	if(rc) return 1;
+
+	if(db->config->persistence_lazy_retained && reader.mapped && payload_map == NULL){
+		payload_map = reader.data;
+		payload_map_len = reader.len;
+		payload_map_refs = 1;
+		reader.map_payloads = true;
+	}
+
+	if(reader.len == 0){
 		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistence file is empty.");
 		return 0;
-	}else if(rlen != 15){
+	}
+	if(persist__read_bytes(&reader, &header, 15)){
 		goto error;
 	}
 	if(!memcmp(header, magic, 15)){
 		// Restore DB as normal
-		read_e(fptr, &crc, sizeof(uint32_t));
-		read_e(fptr, &i32temp, sizeof(uint32_t));
+		read_mem_e(&reader, &crc, sizeof(uint32_t));
+		read_mem_e(&reader, &i32temp, sizeof(uint32_t));
 		db_version = ntohl(i32temp);
 		/* IMPORTANT - this is where compatibility checks are made.
 		 * Is your DB change still compatible with previous versions?
@@ -421,76 +1217,50 @@ int persist__restore(struct mosquitto_db *db)
 			}else if(db_version == 2){
 				/* Addition of disconnect_t to client chunk in v3. */
 			}else{
-				fclose(fptr);
+				persist__reader_cleanup(&reader);
 				log__printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version %d (need version %d).", db_version, MOSQ_DB_VERSION);
 				return 1;
 			}
 		}
 
-		while(persist__chunk_header_read(fptr, &chunk, &length) == MOSQ_ERR_SUCCESS){
-			switch(chunk){
-				case DB_CHUNK_CFG:
-					if(db_version == 5){
-						if(persist__chunk_cfg_read_v5(fptr, &cfg_chunk)){
-							return 1;
-						}
-					}else{
-						if(persist__chunk_cfg_read_v234(fptr, &cfg_chunk)){
-							return 1;
-						}
-					}
-					if(cfg_chunk.dbid_size != sizeof(dbid_t)){
-						log__printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
-								cfg_chunk.dbid_size, (unsigned long)sizeof(dbid_t));
-						fclose(fptr);
-						return 1;
-					}
-					db->last_db_id = cfg_chunk.last_db_id;
-					break;
-
-				case DB_CHUNK_MSG_STORE:
-					if(persist__msg_store_chunk_restore(db, fptr, length)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT_MSG:
-					if(persist__client_msg_chunk_restore(db, fptr, length)) return 1;
-					break;
-
-				case DB_CHUNK_RETAIN:
-					if(persist__retain_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_SUB:
-					if(persist__sub_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT:
-					if(persist__client_chunk_restore(db, fptr)) return 1;
-					break;
-
-				default:
-					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
-					fseek(fptr, length, SEEK_CUR);
-					break;
-			}
+		if(db_version >= 6){
+			rc = persist__restore_indexed(db, &reader);
+		}else{
+			rc = persist__restore_chunks(db, &reader, reader.len, false);
+		}
+		if(rc){
+			persist__reader_cleanup(&reader);
+			return 1;
 		}
-		if(rlen < 0) goto error;
 	}else{
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
 		rc = 1;
 	}
 
-	fclose(fptr);
+	persist__reader_cleanup(&reader);
+
+	if(rc == 0 && db->config->persistence_journal){
+		/* The last chunk id of the snapshot identifies the journal that
+		 * belongs to it. */
+		snapshot_id = db->last_db_id;
+		rc = persist__journal_restore(db, snapshot_id, false, false, &replayed);
+		if(rc == 0){
+			rc = persist__journal_restore(db, snapshot_id, true, replayed, &replayed);
+		}
+	}
 
-	HASH_ITER(hh, db->msg_store_load, load, load_tmp){
-		HASH_DELETE(hh, db->msg_store_load, load);
-		mosquitto__free(load);
+	mosquitto__free(db->msg_store_load);
+	db->msg_store_load = NULL;
+	db->msg_store_load_count = 0;
+	db->msg_store_load_size = 0;
+	if(rc == 0){
+		db->persistence_restore_duration = persist__time_ms() - start;
+		log__printf(NULL, MOSQ_LOG_INFO, "Restored in-memory database in %ld ms.", db->persistence_restore_duration);
 	}
 	return rc;
 error:
-	err = strerror(errno);
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	if(fptr) fclose(fptr);
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
+	persist__reader_cleanup(&reader);
 	return 1;
 }
 
@@ -36,17 +36,13 @@ Contributors:
 #include "util_mosq.h"
 
 
-int persist__chunk_header_read_v234(FILE *db_fptr, int *chunk, int *length)
+int persist__chunk_header_read_v234(struct persist__reader *reader, int *chunk, int *length)
 {
-	size_t rlen;
 	uint16_t i16temp;
 	uint32_t i32temp;
 
-	rlen = fread(&i16temp, sizeof(uint16_t), 1, db_fptr);
-	if(rlen != 1) return 1;
-	
-	rlen = fread(&i32temp, sizeof(uint32_t), 1, db_fptr);
-	if(rlen != 1) return 1;
+	if(persist__read_bytes(reader, &i16temp, sizeof(uint16_t))) return 1;
+	if(persist__read_bytes(reader, &i32temp, sizeof(uint32_t))) return 1;
 	
 	*chunk = ntohs(i16temp);
 	*length = ntohl(i32temp);
@@ -55,149 +51,136 @@ int persist__chunk_header_read_v234(FILE *db_fptr, int *chunk, int *length)
 }
 
 
-int persist__chunk_cfg_read_v234(FILE *db_fptr, struct PF_cfg *chunk)
+int persist__chunk_cfg_read_v234(struct persist__reader *reader, struct PF_cfg *chunk)
 {
-	read_e(db_fptr, &chunk->shutdown, sizeof(uint8_t)); // shutdown
-	read_e(db_fptr, &chunk->dbid_size, sizeof(uint8_t)); // sizeof(dbid_t)
-	read_e(db_fptr, &chunk->last_db_id, sizeof(dbid_t));
+	read_mem_e(reader, &chunk->shutdown, sizeof(uint8_t)); // shutdown
+	read_mem_e(reader, &chunk->dbid_size, sizeof(uint8_t)); // sizeof(dbid_t)
+	read_mem_e(reader, &chunk->last_db_id, sizeof(dbid_t));
 
 	return MOSQ_ERR_SUCCESS;
 error:
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 	return 1;
 }
 
 
-int persist__chunk_client_read_v234(FILE *db_fptr, struct P_client *chunk, int db_version)
+int persist__chunk_client_read_v234(struct persist__reader *reader, struct P_client *chunk, int db_version)
 {
 	uint16_t i16temp;
 	int rc;
 	time_t temp;
 
-	rc = persist__read_string(db_fptr, &chunk->client_id);
+	rc = persist__read_string(reader, &chunk->client_id);
 	if(rc){
 		return rc;
 	}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	read_mem_e(reader, &i16temp, sizeof(uint16_t));
 	chunk->F.last_mid = ntohs(i16temp);
 	if(db_version != 2){
-		read_e(db_fptr, &temp, sizeof(time_t));
+		read_mem_e(reader, &temp, sizeof(time_t));
 	}
 
 	return MOSQ_ERR_SUCCESS;
 error:
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	mosquitto__free(chunk->client_id);
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 	return 1;
 }
 
 
-int persist__chunk_client_msg_read_v234(FILE *db_fptr, struct P_client_msg *chunk)
+int persist__chunk_client_msg_read_v234(struct persist__reader *reader, struct P_client_msg *chunk)
 {
 	uint16_t i16temp;
 	int rc;
-	char *err;
 	uint8_t retain, dup;
 
-	rc = persist__read_string(db_fptr, &chunk->client_id);
+	rc = persist__read_string(reader, &chunk->client_id);
 	if(rc){
 		return rc;
 	}
 
-	read_e(db_fptr, &chunk->F.store_id, sizeof(dbid_t));
+	read_mem_e(reader, &chunk->F.store_id, sizeof(dbid_t));
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	read_mem_e(reader, &i16temp, sizeof(uint16_t));
 	chunk->F.mid = ntohs(i16temp);
 
-	read_e(db_fptr, &chunk->F.qos, sizeof(uint8_t));
-	read_e(db_fptr, &retain, sizeof(uint8_t));
-	read_e(db_fptr, &chunk->F.direction, sizeof(uint8_t));
-	read_e(db_fptr, &chunk->F.state, sizeof(uint8_t));
-	read_e(db_fptr, &dup, sizeof(uint8_t));
+	read_mem_e(reader, &chunk->F.qos, sizeof(uint8_t));
+	read_mem_e(reader, &retain, sizeof(uint8_t));
+	read_mem_e(reader, &chunk->F.direction, sizeof(uint8_t));
+	read_mem_e(reader, &chunk->F.state, sizeof(uint8_t));
+	read_mem_e(reader, &dup, sizeof(uint8_t));
 
 	chunk->F.retain_dup = (retain&0x0F)<<4 | (dup&0x0F);
 
 	return MOSQ_ERR_SUCCESS;
 error:
-	err = strerror(errno);
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	mosquitto__free(chunk->client_id);
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 	return 1;
 }
 
 
-int persist__chunk_msg_store_read_v234(FILE *db_fptr, struct P_msg_store *chunk, int db_version)
+int persist__chunk_msg_store_read_v234(struct persist__reader *reader, struct P_msg_store *chunk, int db_version)
 {
 	uint32_t i32temp;
 	uint16_t i16temp;
 	int rc = 0;
-	char *err;
 
-	read_e(db_fptr, &chunk->F.store_id, sizeof(dbid_t));
+	read_mem_e(reader, &chunk->F.store_id, sizeof(dbid_t));
 
-	rc = persist__read_string(db_fptr, &chunk->source.id);
+	rc = persist__read_string(reader, &chunk->source.id);
 	if(rc){
 		return rc;
 	}
 	if(db_version == 4){
-		rc = persist__read_string(db_fptr, &chunk->source.username);
+		rc = persist__read_string(reader, &chunk->source.username);
 		if(rc){
-			mosquitto__free(chunk->source.id);
 			return rc;
 		}
-		read_e(db_fptr, &i16temp, sizeof(uint16_t));
+		read_mem_e(reader, &i16temp, sizeof(uint16_t));
 		chunk->F.source_port = ntohs(i16temp);
 	}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	read_mem_e(reader, &i16temp, sizeof(uint16_t));
 	chunk->F.source_mid = ntohs(i16temp);
 
 	/* This is the mid - don't need it */
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	read_mem_e(reader, &i16temp, sizeof(uint16_t));
 
-	rc = persist__read_string(db_fptr, &chunk->topic);
+	rc = persist__read_string(reader, &chunk->topic);
 	if(rc){
-		mosquitto__free(chunk->source.id);
-		mosquitto__free(chunk->source.username);
 		return rc;
 	}
 
-	read_e(db_fptr, &chunk->F.qos, sizeof(uint8_t));
-	read_e(db_fptr, &chunk->F.retain, sizeof(uint8_t));
+	read_mem_e(reader, &chunk->F.qos, sizeof(uint8_t));
+	read_mem_e(reader, &chunk->F.retain, sizeof(uint8_t));
 	
-	read_e(db_fptr, &i32temp, sizeof(uint32_t));
+	read_mem_e(reader, &i32temp, sizeof(uint32_t));
 	chunk->F.payloadlen = ntohl(i32temp);
 
 	if(chunk->F.payloadlen){
 		if(UHPA_ALLOC(chunk->payload, chunk->F.payloadlen) == 0){
-			mosquitto__free(chunk->source.id);
-			mosquitto__free(chunk->source.username);
-			mosquitto__free(chunk->topic);
 			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
-		read_e(db_fptr, UHPA_ACCESS(chunk->payload, chunk->F.payloadlen), chunk->F.payloadlen);
+		if(persist__read_bytes(reader, UHPA_ACCESS(chunk->payload, chunk->F.payloadlen), chunk->F.payloadlen)){
+			UHPA_FREE(chunk->payload, chunk->F.payloadlen);
+			goto error;
+		}
 	}
 
 	return MOSQ_ERR_SUCCESS;
 error:
-	err = strerror(errno);
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	mosquitto__free(chunk->source.id);
-	mosquitto__free(chunk->source.username);
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 	return 1;
 }
 
 
-int persist__chunk_retain_read_v234(FILE *db_fptr, struct P_retain *chunk)
+int persist__chunk_retain_read_v234(struct persist__reader *reader, struct P_retain *chunk)
 {
 	dbid_t i64temp;
-	char *err;
 
-	if(fread(&i64temp, sizeof(dbid_t), 1, db_fptr) != 1){
-		err = strerror(errno);
-		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
+	if(persist__read_bytes(reader, &i64temp, sizeof(dbid_t))){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 		return 1;
 	}
 	chunk->F.store_id = i64temp;
@@ -206,30 +189,25 @@ int persist__chunk_retain_read_v234(FILE *db_fptr, struct P_retain *chunk)
 }
 
 
-int persist__chunk_sub_read_v234(FILE *db_fptr, struct P_sub *chunk)
+int persist__chunk_sub_read_v234(struct persist__reader *reader, struct P_sub *chunk)
 {
 	int rc;
-	char *err;
 
-	rc = persist__read_string(db_fptr, &chunk->client_id);
+	rc = persist__read_string(reader, &chunk->client_id);
 	if(rc){
 		return rc;
 	}
 
-	rc = persist__read_string(db_fptr, &chunk->topic);
+	rc = persist__read_string(reader, &chunk->topic);
 	if(rc){
-		mosquitto__free(chunk->client_id);
 		return rc;
 	}
 
-	read_e(db_fptr, &chunk->F.qos, sizeof(uint8_t));
+	read_mem_e(reader, &chunk->F.qos, sizeof(uint8_t));
 
 	return MOSQ_ERR_SUCCESS;
 error:
-	err = strerror(errno);
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	mosquitto__free(chunk->client_id);
-	mosquitto__free(chunk->topic);
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 	return 1;
 }
 
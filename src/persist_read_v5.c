@@ -38,13 +38,11 @@ Contributors:
 #include "util_mosq.h"
 
 
-int persist__chunk_header_read_v5(FILE *db_fptr, int *chunk, int *length)
+int persist__chunk_header_read_v5(struct persist__reader *reader, int *chunk, int *length)
 {
-	size_t rlen;
 	struct PF_header header;
 
-	rlen = fread(&header, sizeof(struct PF_header), 1, db_fptr);
-	if(rlen != 1) return 1;
+	if(persist__read_bytes(reader, &header, sizeof(struct PF_header))) return 1;
 	
 	*chunk = ntohl(header.chunk);
 	*length = ntohl(header.length);
@@ -53,10 +51,10 @@ int persist__chunk_header_read_v5(FILE *db_fptr, int *chunk, int *length)
 }
 
 
-int persist__chunk_cfg_read_v5(FILE *db_fptr, struct PF_cfg *chunk)
+int persist__chunk_cfg_read_v5(struct persist__reader *reader, struct PF_cfg *chunk)
 {
-	if(fread(chunk, sizeof(struct PF_cfg), 1, db_fptr) != 1){
-		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	if(persist__read_bytes(reader, chunk, sizeof(struct PF_cfg))){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 		return 1;
 	}
 
@@ -64,54 +62,67 @@ int persist__chunk_cfg_read_v5(FILE *db_fptr, struct PF_cfg *chunk)
 }
 
 
-int persist__chunk_client_read_v5(FILE *db_fptr, struct P_client *chunk)
+int persist__chunk_client_read_v5(struct persist__reader *reader, struct P_client *chunk)
 {
 	int rc;
 
-	read_e(db_fptr, &chunk->F, sizeof(struct PF_client));
+	read_mem_e(reader, &chunk->F, sizeof(struct PF_client));
 	chunk->F.session_expiry_interval = ntohl(chunk->F.session_expiry_interval);
 	chunk->F.last_mid = ntohs(chunk->F.last_mid);
 	chunk->F.id_len = ntohs(chunk->F.id_len);
 
-	rc = persist__read_string_len(db_fptr, &chunk->client_id, chunk->F.id_len);
+	rc = persist__read_string_len(reader, &chunk->client_id, chunk->F.id_len);
 	if(rc || !chunk->client_id){
 		return 1;
 	}else{
 		return MOSQ_ERR_SUCCESS;
 	}
 error:
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 	return 1;
 }
 
 
-int persist__chunk_client_msg_read_v5(FILE *db_fptr, struct P_client_msg *chunk, uint32_t length)
+/* Properties are parsed straight from the file data rather than from a copy
+ * of it. */
+static int persist__properties_read(struct persist__reader *reader, mosquitto_property **properties, uint32_t length)
 {
-	mosquitto_property *properties = NULL;
 	struct mosquitto__packet prop_packet;
 	int rc;
 
-	read_e(db_fptr, &chunk->F, sizeof(struct PF_client_msg));
+	if(length > reader->len - reader->pos){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
+		return 1;
+	}
+
+	memset(&prop_packet, 0, sizeof(struct mosquitto__packet));
+	prop_packet.remaining_length = length;
+	prop_packet.payload = (uint8_t *)&reader->data[reader->pos];
+	rc = property__read_all(CMD_PUBLISH, &prop_packet, properties);
+	reader->pos += length;
+
+	return rc;
+}
+
+
+int persist__chunk_client_msg_read_v5(struct persist__reader *reader, struct P_client_msg *chunk, uint32_t length)
+{
+	mosquitto_property *properties = NULL;
+	int rc;
+
+	read_mem_e(reader, &chunk->F, sizeof(struct PF_client_msg));
 	chunk->F.mid = ntohs(chunk->F.mid);
 	chunk->F.id_len = ntohs(chunk->F.id_len);
 
 	length -= (sizeof(struct PF_client_msg) + chunk->F.id_len);
 
-	rc = persist__read_string_len(db_fptr, &chunk->client_id, chunk->F.id_len);
+	rc = persist__read_string_len(reader, &chunk->client_id, chunk->F.id_len);
 	if(rc){
 		return rc;
 	}
 
 	if(length > 0){
-		memset(&prop_packet, 0, sizeof(struct mosquitto__packet));
-		prop_packet.remaining_length = length;
-		prop_packet.payload = mosquitto__malloc(length);
-		if(!prop_packet.payload){
-			return MOSQ_ERR_NOMEM;
-		}
-		read_e(db_fptr, prop_packet.payload, length);
-		rc = property__read_all(CMD_PUBLISH, &prop_packet, &properties);
-		mosquitto__free(prop_packet.payload);
+		rc = persist__properties_read(reader, &properties, length);
 		if(rc){
 			return rc;
 		}
@@ -120,20 +131,17 @@ int persist__chunk_client_msg_read_v5(FILE *db_fptr, struct P_client_msg *chunk,
 
 	return MOSQ_ERR_SUCCESS;
 error:
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 	return 1;
 }
 
 
-int persist__chunk_msg_store_read_v5(FILE *db_fptr, struct P_msg_store *chunk, uint32_t length)
+int persist__chunk_msg_store_read_v5(struct persist__reader *reader, struct P_msg_store *chunk, uint32_t length)
 {
 	int rc = 0;
 	mosquitto_property *properties = NULL;
-	struct mosquitto__packet prop_packet;
-
-	memset(&prop_packet, 0, sizeof(struct mosquitto__packet));
 
-	read_e(db_fptr, &chunk->F, sizeof(struct PF_msg_store));
+	read_mem_e(reader, &chunk->F, sizeof(struct PF_msg_store));
 	chunk->F.payloadlen = ntohl(chunk->F.payloadlen);
 	if(chunk->F.payloadlen > MQTT_MAX_PAYLOAD){
 		return MOSQ_ERR_INVAL;
@@ -147,58 +155,43 @@ int persist__chunk_msg_store_read_v5(FILE *db_fptr, struct P_msg_store *chunk, u
 	length -= (sizeof(struct PF_msg_store) + chunk->F.payloadlen + chunk->F.source_id_len + chunk->F.source_username_len + chunk->F.topic_len);
 
 	if(chunk->F.source_id_len){
-		rc = persist__read_string_len(db_fptr, &chunk->source.id, chunk->F.source_id_len);
+		rc = persist__read_string_len(reader, &chunk->source.id, chunk->F.source_id_len);
 		if(rc){
 			return rc;
 		}
 	}
 	if(chunk->F.source_username_len){
-		rc = persist__read_string_len(db_fptr, &chunk->source.username, chunk->F.source_username_len);
+		rc = persist__read_string_len(reader, &chunk->source.username, chunk->F.source_username_len);
 		if(rc){
-			mosquitto__free(chunk->source.id);
-			chunk->source.id = NULL;
 			return rc;
 		}
 	}
-	rc = persist__read_string_len(db_fptr, &chunk->topic, chunk->F.topic_len);
+	rc = persist__read_string_len(reader, &chunk->topic, chunk->F.topic_len);
 	if(rc){
-		mosquitto__free(chunk->source.id);
-		mosquitto__free(chunk->source.username);
-		chunk->source.id = NULL;
-		chunk->source.username = NULL;
 		return rc;
 	}
 
-	if(chunk->F.payloadlen > 0){
+	if(reader->map_payloads && chunk->F.retain && chunk->F.payloadlen >= PERSIST_LAZY_PAYLOAD_MIN){
+		if(reader->len - reader->pos < chunk->F.payloadlen){
+			goto error;
+		}
+		chunk->payload.ptr = (void *)&reader->data[reader->pos];
+		chunk->payload_mapped = true;
+		reader->pos += chunk->F.payloadlen;
+	}else if(chunk->F.payloadlen > 0){
 		if(UHPA_ALLOC(chunk->payload, chunk->F.payloadlen) == 0){
-			mosquitto__free(chunk->source.id);
-			mosquitto__free(chunk->source.username);
-			mosquitto__free(chunk->topic);
-			chunk->source.id = NULL;
-			chunk->source.username = NULL;
-			chunk->topic = NULL;
 			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
-		read_e(db_fptr, UHPA_ACCESS(chunk->payload, chunk->F.payloadlen), chunk->F.payloadlen);
+		read_mem_e(reader, UHPA_ACCESS(chunk->payload, chunk->F.payloadlen), chunk->F.payloadlen);
 	}
 
 	if(length > 0){
-		prop_packet.remaining_length = length;
-		prop_packet.payload = mosquitto__malloc(length);
-		if(!prop_packet.payload){
-			mosquitto__free(chunk->source.id);
-			mosquitto__free(chunk->source.username);
-			mosquitto__free(chunk->topic);
-			return MOSQ_ERR_NOMEM;
-		}
-		read_e(db_fptr, prop_packet.payload, length);
-		rc = property__read_all(CMD_PUBLISH, &prop_packet, &properties);
-		mosquitto__free(prop_packet.payload);
+		rc = persist__properties_read(reader, &properties, length);
 		if(rc){
-			mosquitto__free(chunk->source.id);
-			mosquitto__free(chunk->source.username);
-			mosquitto__free(chunk->topic);
+			if(!chunk->payload_mapped){
+				UHPA_FREE(chunk->payload, chunk->F.payloadlen);
+			}
 			return rc;
 		}
 	}
@@ -206,49 +199,77 @@ int persist__chunk_msg_store_read_v5(FILE *db_fptr, struct P_msg_store *chunk, u
 
 	return MOSQ_ERR_SUCCESS;
 error:
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	mosquitto__free(chunk->source.id);
-	mosquitto__free(chunk->source.username);
-	mosquitto__free(chunk->topic);
-	mosquitto__free(prop_packet.payload);
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
+	if(!chunk->payload_mapped){
+		UHPA_FREE(chunk->payload, chunk->F.payloadlen);
+	}
 	return 1;
 }
 
 
-int persist__chunk_retain_read_v5(FILE *db_fptr, struct P_retain *chunk)
+int persist__chunk_retain_read_v5(struct persist__reader *reader, struct P_retain *chunk)
 {
-	if(fread(&chunk->F, sizeof(struct P_retain), 1, db_fptr) != 1){
-		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	if(persist__read_bytes(reader, &chunk->F, sizeof(struct P_retain))){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 		return 1;
 	}
 	return MOSQ_ERR_SUCCESS;
 }
 
 
-int persist__chunk_sub_read_v5(FILE *db_fptr, struct P_sub *chunk)
+int persist__chunk_sub_read_v5(struct persist__reader *reader, struct P_sub *chunk)
 {
 	int rc;
 
-	read_e(db_fptr, &chunk->F, sizeof(struct PF_sub));
+	read_mem_e(reader, &chunk->F, sizeof(struct PF_sub));
 	chunk->F.identifier = ntohl(chunk->F.identifier);
 	chunk->F.id_len = ntohs(chunk->F.id_len);
 	chunk->F.topic_len = ntohs(chunk->F.topic_len);
 
-	rc = persist__read_string_len(db_fptr, &chunk->client_id, chunk->F.id_len);
+	rc = persist__read_string_len(reader, &chunk->client_id, chunk->F.id_len);
 	if(rc){
 		return rc;
 	}
-	rc = persist__read_string_len(db_fptr, &chunk->topic, chunk->F.topic_len);
+	rc = persist__read_string_len(reader, &chunk->topic, chunk->F.topic_len);
 	if(rc){
-		mosquitto__free(chunk->client_id);
-		chunk->client_id = NULL;
 		return rc;
 	}
 
 	return MOSQ_ERR_SUCCESS;
 error:
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
 	return 1;
 }
 
+
+int persist__chunk_index_read_v5(struct persist__reader *reader, uint32_t length, struct PF_index_entry **entries, int *entry_count)
+{
+	struct PF_index_entry *e;
+	int count;
+	int i;
+
+	if(length < sizeof(uint64_t) || (length - sizeof(uint64_t)) % sizeof(struct PF_index_entry)){
+		return 1;
+	}
+	count = (length - sizeof(uint64_t)) / sizeof(struct PF_index_entry);
+
+	e = mosquitto__calloc(count+1, sizeof(struct PF_index_entry));
+	if(!e){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=0; i<count; i++){
+		if(persist__read_bytes(reader, &e[i], sizeof(struct PF_index_entry))){
+			mosquitto__free(e);
+			return 1;
+		}
+		e[i].chunk = ntohl(e[i].chunk);
+		e[i].count = ntohl(e[i].count);
+	}
+
+	*entries = e;
+	*entry_count = count;
+	return MOSQ_ERR_SUCCESS;
+}
+
 #endif
@@ -27,17 +27,79 @@ Contributors:
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 #include <time.h>
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
+#include "mqtt_protocol.h"
 #include "persist.h"
+#include "property_mosq.h"
+#include "send_mosq.h"
 #include "time_mosq.h"
 #include "util_mosq.h"
 
-static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *queue)
+/* A PUBACK, PUBREC or PUBCOMP held back until the journal records it is
+ * synced. */
+struct persist__durable_ack{
+	struct mosquitto *context;
+	uint16_t mid;
+	uint8_t command;
+	uint8_t reason_code;
+};
+
+static FILE *journal_fptr = NULL;
+static long journal_synced_pos = 0;
+static time_t journal_last_sync = 0;
+static struct persist__durable_ack *durable_acks = NULL;
+static int durable_ack_count = 0;
+static int durable_ack_size = 0;
+
+/* The last snapshot written in the foreground. Sessions whose messages
+ * haven't changed since then are copied from it rather than written again.
+ * The file identity is checked before copying, in case it was replaced. */
+static unsigned int snapshot_generation = 0;
+static dev_t snapshot_dev;
+static ino_t snapshot_ino;
+static off_t snapshot_size;
+static time_t snapshot_mtime;
+
+static int persist__client_msg_write(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *cmsg, int chunk_type)
 {
 	struct P_client_msg chunk;
+	mosquitto_property subid_prop;
+
+	memset(&chunk, 0, sizeof(struct P_client_msg));
+
+	chunk.F.store_id = cmsg->store->db_id;
+	chunk.F.mid = cmsg->mid;
+	chunk.F.id_len = strlen(context->id);
+	chunk.F.qos = cmsg->qos;
+	chunk.F.retain_dup = (cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F);
+	chunk.F.direction = cmsg->direction;
+	chunk.F.state = cmsg->state;
+	chunk.client_id = context->id;
+
+	switch(chunk_type){
+		case DB_CHUNK_CLIENT_MSG:
+			chunk.properties = db__message_properties(cmsg, &subid_prop);
+			return persist__chunk_client_msg_write_v5(db_fptr, &chunk);
+		case DB_CHUNK_CLIENT_MSG_UPDATE:
+			return persist__chunk_client_msg_update_write_v5(db_fptr, &chunk);
+		case DB_CHUNK_CLIENT_MSG_DELETE:
+			return persist__chunk_client_msg_delete_write_v5(db_fptr, &chunk);
+		default:
+			return MOSQ_ERR_INVAL;
+	}
+}
+
+
+static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *queue, uint32_t *count)
+{
 	struct mosquitto_client_msg *cmsg;
 	int rc;
 
@@ -45,8 +107,6 @@ static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr,
 	assert(db_fptr);
 	assert(context);
 
-	memset(&chunk, 0, sizeof(struct P_client_msg));
-
 	cmsg = queue;
 	while(cmsg){
 		if(!strncmp(cmsg->store->topic, "$SYS", 4)
@@ -59,20 +119,11 @@ static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr,
 			continue;
 		}
 
-		chunk.F.store_id = cmsg->store->db_id;
-		chunk.F.mid = cmsg->mid;
-		chunk.F.id_len = strlen(context->id);
-		chunk.F.qos = cmsg->qos;
-		chunk.F.retain_dup = (cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F);
-		chunk.F.direction = cmsg->direction;
-		chunk.F.state = cmsg->state;
-		chunk.client_id = context->id;
-		chunk.properties = cmsg->properties;
-
-		rc = persist__chunk_client_msg_write_v5(db_fptr, &chunk);
+		rc = persist__client_msg_write(db_fptr, context, cmsg, DB_CHUNK_CLIENT_MSG);
 		if(rc){
 			return rc;
 		}
+		(*count)++;
 
 		cmsg = cmsg->next;
 	}
@@ -81,116 +132,231 @@ static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr,
 }
 
 
-static int persist__message_store_save(struct mosquitto_db *db, FILE *db_fptr)
+static int persist__message_store_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
 {
 	struct P_msg_store chunk;
+
+	memset(&chunk, 0, sizeof(struct P_msg_store));
+
+	if(!strncmp(stored->topic, "$SYS", 4)){
+		/* Don't save $SYS messages as retained otherwise they can give
+		 * misleading information when reloaded. They should still be saved
+		 * because a disconnected durable client may have them in their
+		 * queue. */
+		chunk.F.retain = 0;
+	}else{
+		chunk.F.retain = (uint8_t)stored->retain;
+	}
+
+	chunk.F.store_id = stored->db_id;
+	chunk.F.expiry_time = stored->message_expiry_time;
+	chunk.F.payloadlen = stored->payloadlen;
+	chunk.F.source_mid = stored->source_mid;
+	if(stored->source_id){
+		chunk.F.source_id_len = strlen(stored->source_id);
+		chunk.source.id = stored->source_id;
+	}else{
+		chunk.F.source_id_len = 0;
+		chunk.source.id = NULL;
+	}
+	if(stored->source_username){
+		chunk.F.source_username_len = strlen(stored->source_username);
+		chunk.source.username = stored->source_username;
+	}else{
+		chunk.F.source_username_len = 0;
+		chunk.source.username = NULL;
+	}
+
+	chunk.F.topic_len = strlen(stored->topic);
+	chunk.topic = stored->topic;
+
+	if(stored->source_listener){
+		chunk.F.source_port = stored->source_listener->port;
+	}else{
+		chunk.F.source_port = 0;
+	}
+	chunk.F.qos = stored->qos;
+	chunk.payload = stored->payload;
+	chunk.properties = stored->properties;
+
+	return persist__chunk_message_store_write_v5(db_fptr, &chunk);
+}
+
+
+static bool persist__message_store_wanted(struct mosquitto_msg_store *stored)
+{
+	if(stored->ref_count < 1 || stored->topic == NULL){
+		return false;
+	}
+	if(!strncmp(stored->topic, "$SYS", 4)
+			&& stored->ref_count <= 1 && stored->dest_id_count == 0){
+
+		/* $SYS messages that are only retained shouldn't be persisted. */
+		return false;
+	}
+	return true;
+}
+
+
+static int persist__message_store_save(struct mosquitto_db *db, FILE *db_fptr, uint32_t *count)
+{
 	struct mosquitto_msg_store *stored;
 	int rc;
 
 	assert(db);
 	assert(db_fptr);
 
-	memset(&chunk, 0, sizeof(struct P_msg_store));
-
 	stored = db->msg_store;
 	while(stored){
-		if(stored->ref_count < 1 || stored->topic == NULL){
-			stored = stored->next;
-			continue;
-		}
-
-		if(!strncmp(stored->topic, "$SYS", 4)){
-			if(stored->ref_count <= 1 && stored->dest_id_count == 0){
-				/* $SYS messages that are only retained shouldn't be persisted. */
-				stored = stored->next;
-				continue;
+		if(persist__message_store_wanted(stored)){
+			rc = persist__message_store_write(db_fptr, stored);
+			if(rc){
+				return rc;
 			}
-			/* Don't save $SYS messages as retained otherwise they can give
-			 * misleading information when reloaded. They should still be saved
-			 * because a disconnected durable client may have them in their
-			 * queue. */
-			chunk.F.retain = 0;
-		}else{
-			chunk.F.retain = (uint8_t)stored->retain;
+			(*count)++;
 		}
+		stored = stored->next;
+	}
 
-		chunk.F.store_id = stored->db_id;
-		chunk.F.expiry_time = stored->message_expiry_time;
-		chunk.F.payloadlen = stored->payloadlen;
-		chunk.F.source_mid = stored->source_mid;
-		if(stored->source_id){
-			chunk.F.source_id_len = strlen(stored->source_id);
-			chunk.source.id = stored->source_id;
-		}else{
-			chunk.F.source_id_len = 0;
-			chunk.source.id = NULL;
-		}
-		if(stored->source_username){
-			chunk.F.source_username_len = strlen(stored->source_username);
-			chunk.source.username = stored->source_username;
-		}else{
-			chunk.F.source_username_len = 0;
-			chunk.source.username = NULL;
-		}
+	return MOSQ_ERR_SUCCESS;
+}
 
-		chunk.F.topic_len = strlen(stored->topic);
-		chunk.topic = stored->topic;
+static int persist__client_write(FILE *db_fptr, struct mosquitto *context, int chunk_type)
+{
+	struct P_client chunk;
 
-		if(stored->source_listener){
-			chunk.F.source_port = stored->source_listener->port;
-		}else{
-			chunk.F.source_port = 0;
-		}
-		chunk.F.qos = stored->qos;
-		chunk.payload = stored->payload;
-		chunk.properties = stored->properties;
+	memset(&chunk, 0, sizeof(struct P_client));
 
-		rc = persist__chunk_message_store_write_v5(db_fptr, &chunk);
-		if(rc){
-			return rc;
+	chunk.F.session_expiry_time = context->session_expiry_time;
+	chunk.F.session_expiry_interval = context->session_expiry_interval;
+	chunk.F.last_mid = context->last_mid;
+	chunk.F.id_len = strlen(context->id);
+	chunk.client_id = context->id;
+
+	if(chunk_type == DB_CHUNK_CLIENT_DELETE){
+		return persist__chunk_client_delete_write_v5(db_fptr, &chunk);
+	}else{
+		return persist__chunk_client_write_v5(db_fptr, &chunk);
+	}
+}
+
+
+static int persist__client_save(struct mosquitto_db *db, FILE *db_fptr, uint32_t *count)
+{
+	struct mosquitto *context, *ctxt_tmp;
+	int rc;
+
+	assert(db);
+	assert(db_fptr);
+
+	HASH_ITER(hh_id, db->contexts_by_id, context, ctxt_tmp){
+		if(context && context->clean_start == false){
+			rc = persist__client_write(db_fptr, context, DB_CHUNK_CLIENT);
+			if(rc){
+				return rc;
+			}
+			(*count)++;
 		}
-		stored = stored->next;
 	}
 
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int persist__client_save(struct mosquitto_db *db, FILE *db_fptr)
+
+/* Copy the messages of an unchanged session from the last snapshot. */
+static int persist__client_messages_copy(FILE *db_fptr, FILE *prev_fptr, struct mosquitto *context)
+{
+	uint8_t buf[4096];
+	uint32_t remaining = context->persist_msgs_length;
+	size_t len;
+
+	if(fseek(prev_fptr, (long)context->persist_msgs_offset, SEEK_SET)) return 1;
+
+	while(remaining > 0){
+		len = remaining < sizeof(buf) ? remaining : sizeof(buf);
+		if(fread(buf, 1, len, prev_fptr) != len) return 1;
+		if(fwrite(buf, 1, len, db_fptr) != len) return 1;
+		remaining -= len;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Each session's messages are written together, and where they went is
+ * recorded against generation, the snapshot being written. If prev_fptr is
+ * the last snapshot, sessions unchanged since it are copied from it. */
+static int persist__client_messages_save_all(struct mosquitto_db *db, FILE *db_fptr, FILE *prev_fptr, unsigned int generation, uint32_t *count)
 {
 	struct mosquitto *context, *ctxt_tmp;
-	struct P_client chunk;
-	int rc;
+	long start, end;
+	uint32_t msg_count;
+	long copied = 0, written = 0;
 
 	assert(db);
 	assert(db_fptr);
 
-	memset(&chunk, 0, sizeof(struct P_client));
-
 	HASH_ITER(hh_id, db->contexts_by_id, context, ctxt_tmp){
 		if(context && context->clean_start == false){
-			chunk.F.session_expiry_time = context->session_expiry_time;
-			chunk.F.session_expiry_interval = context->session_expiry_interval;
-			chunk.F.last_mid = context->last_mid;
-			chunk.F.id_len = strlen(context->id);
-			chunk.client_id = context->id;
+			start = ftell(db_fptr);
+			if(start < 0) return 1;
 
-			rc = persist__chunk_client_write_v5(db_fptr, &chunk);
-			if(rc){
-				return rc;
+			if(prev_fptr && context->persist_msgs_generation == snapshot_generation
+					&& context->persist_msgs_generation != 0){
+
+				if(persist__client_messages_copy(db_fptr, prev_fptr, context)) return 1;
+				msg_count = context->persist_msgs_count;
+				copied++;
+			}else{
+				msg_count = 0;
+				if(persist__client_messages_save(db, db_fptr, context, context->msgs_in.inflight, &msg_count)) return 1;
+				if(persist__client_messages_save(db, db_fptr, context, context->msgs_in.queued, &msg_count)) return 1;
+				if(persist__client_messages_save(db, db_fptr, context, context->msgs_out.inflight, &msg_count)) return 1;
+				if(persist__client_messages_save(db, db_fptr, context, context->msgs_out.queued, &msg_count)) return 1;
+				written++;
 			}
 
-			if(persist__client_messages_save(db, db_fptr, context, context->msgs_in.inflight)) return 1;
-			if(persist__client_messages_save(db, db_fptr, context, context->msgs_in.queued)) return 1;
-			if(persist__client_messages_save(db, db_fptr, context, context->msgs_out.inflight)) return 1;
-			if(persist__client_messages_save(db, db_fptr, context, context->msgs_out.queued)) return 1;
+			end = ftell(db_fptr);
+			if(end < 0) return 1;
+			context->persist_msgs_offset = (uint64_t)start;
+			context->persist_msgs_length = (uint32_t)(end - start);
+			context->persist_msgs_count = msg_count;
+			context->persist_msgs_generation = generation;
+			(*count) += msg_count;
 		}
 	}
+	if(prev_fptr){
+		log__printf(NULL, MOSQ_LOG_DEBUG, "Copied messages of %ld unchanged sessions, wrote %ld.", copied, written);
+	}
 
 	return MOSQ_ERR_SUCCESS;
 }
 
 
-static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto__subhier *node, const char *topic, int level)
+/* Open the last snapshot for copying unchanged sessions from, if it is still
+ * the file that was written. */
+static FILE *persist__snapshot_previous(struct mosquitto_db *db)
+{
+	FILE *fptr;
+	struct stat st;
+
+	if(snapshot_generation == 0) return NULL;
+
+	fptr = fopen(db->config->persistence_filepath, "rb");
+	if(!fptr) return NULL;
+
+	if(fstat(fileno(fptr), &st) || st.st_dev != snapshot_dev || st.st_ino != snapshot_ino
+			|| st.st_size != snapshot_size || st.st_mtime != snapshot_mtime){
+
+		fclose(fptr);
+		return NULL;
+	}
+	return fptr;
+}
+
+
+/* Write either the subscriptions (chunk_type DB_CHUNK_SUB) or the retained
+ * messages (DB_CHUNK_RETAIN) of node and its children. */
+static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto__subhier *node, const char *topic, int level, int chunk_type, uint32_t *count)
 {
 	struct mosquitto__subhier *subhier, *subhier_tmp;
 	struct mosquitto__subleaf *sub;
@@ -212,7 +378,7 @@ static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, str
 		snprintf(thistopic, slen, "%s", node->topic);
 	}
 
-	sub = node->subs;
+	sub = (chunk_type == DB_CHUNK_SUB) ? node->subs : NULL;
 	while(sub){
 		if(sub->context->clean_start == false && sub->context->id){
 			sub_chunk.F.identifier = sub->identifier;
@@ -228,10 +394,11 @@ static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, str
 				mosquitto__free(thistopic);
 				return rc;
 			}
+			(*count)++;
 		}
 		sub = sub->next;
 	}
-	if(node->retained){
+	if(chunk_type == DB_CHUNK_RETAIN && node->retained){
 		if(strncmp(node->retained->topic, "$SYS", 4)){
 			/* Don't save $SYS messages. */
 			retain_chunk.F.store_id = node->retained->db_id;
@@ -240,30 +407,421 @@ static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, str
 				mosquitto__free(thistopic);
 				return rc;
 			}
+			(*count)++;
 		}
 	}
 
 	HASH_ITER(hh, node->children, subhier, subhier_tmp){
-		persist__subs_retain_save(db, db_fptr, subhier, thistopic, level+1);
+		persist__subs_retain_save(db, db_fptr, subhier, thistopic, level+1, chunk_type, count);
 	}
 	mosquitto__free(thistopic);
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int persist__subs_retain_save_all(struct mosquitto_db *db, FILE *db_fptr)
+static int persist__subs_retain_save_all(struct mosquitto_db *db, FILE *db_fptr, int chunk_type, uint32_t *count)
 {
 	struct mosquitto__subhier *subhier, *subhier_tmp;
 
 	HASH_ITER(hh, db->subs, subhier, subhier_tmp){
 		if(subhier->children){
-			persist__subs_retain_save(db, db_fptr, subhier->children, "", 0);
+			persist__subs_retain_save(db, db_fptr, subhier->children, "", 0, chunk_type, count);
 		}
 	}
 	
 	return MOSQ_ERR_SUCCESS;
 }
 
-int persist__backup(struct mosquitto_db *db, bool shutdown)
+static void persist__journal_close(void)
+{
+	if(journal_fptr){
+		fclose(journal_fptr);
+		journal_fptr = NULL;
+	}
+}
+
+
+static void persist__journal_remove(struct mosquitto_db *db, bool next)
+{
+	char *path;
+
+	path = persist__journal_path(db, next);
+	if(path){
+		if(remove(path) != 0 && errno != ENOENT){
+			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to remove %s: %s.", path, strerror(errno));
+		}
+		mosquitto__free(path);
+	}
+}
+
+
+static void persist__journal_error(void)
+{
+	log__printf(NULL, MOSQ_LOG_ERR, "Error writing persistence journal: %s. Journal disabled until the next save.", strerror(errno));
+	persist__journal_close();
+}
+
+
+/* Start a new journal for the snapshot with id snapshot_id. If next is true,
+ * that snapshot is still being written in the background, and the journal
+ * continues on from the current one until it is complete. */
+static void persist__journal_open(struct mosquitto_db *db, dbid_t snapshot_id, bool next)
+{
+	uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
+	uint32_t crc = 0;
+	struct PF_cfg cfg_chunk;
+	char *path;
+	struct mosquitto_msg_store *stored;
+
+	path = persist__journal_path(db, next);
+	if(!path){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error opening persistence journal, out of memory.");
+		return;
+	}
+
+#ifndef WIN32
+	/* See persist__backup() for why this mustn't be opened in place. */
+	if(unlink(path) != 0 && errno != ENOENT){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error opening persistence journal, unable to remove %s.", path);
+		mosquitto__free(path);
+		return;
+	}
+#endif
+	journal_fptr = mosquitto__fopen(path, "wb", true);
+	if(journal_fptr == NULL){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error opening persistence journal, unable to open %s for writing.", path);
+		mosquitto__free(path);
+		return;
+	}
+	mosquitto__free(path);
+
+	memset(&cfg_chunk, 0, sizeof(struct PF_cfg));
+	cfg_chunk.last_db_id = snapshot_id;
+	cfg_chunk.dbid_size = sizeof(dbid_t);
+
+	if(fwrite(magic, 1, 15, journal_fptr) != 15
+			|| fwrite(&crc, 1, sizeof(uint32_t), journal_fptr) != sizeof(uint32_t)
+			|| fwrite(&db_version_w, 1, sizeof(uint32_t), journal_fptr) != sizeof(uint32_t)
+			|| persist__chunk_cfg_write_v5(journal_fptr, &cfg_chunk)
+			|| fflush(journal_fptr)){
+
+		persist__journal_error();
+		return;
+	}
+	/* A journal holding only its header has nothing that needs syncing. */
+	journal_synced_pos = ftell(journal_fptr);
+
+	if(next){
+		/* Messages that were only in the current journal must still be
+		 * written to the next one, in case the snapshot is never finished. */
+		return;
+	}
+
+	/* The snapshot holds every message that it needs, so records in the new
+	 * journal can refer to them without writing them again. */
+	for(stored = db->msg_store; stored; stored = stored->next){
+		stored->persisted = persist__message_store_wanted(stored);
+	}
+}
+
+
+static bool persist__journal_wanted(struct mosquitto *context)
+{
+	return journal_fptr && context->clean_start == false && context->id;
+}
+
+
+static int persist__journal_store(struct mosquitto_msg_store *stored)
+{
+	if(stored->persisted){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(persist__message_store_write(journal_fptr, stored)){
+		return 1;
+	}
+	stored->persisted = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void persist__journal_client(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(!persist__journal_wanted(context)) return;
+
+	if(persist__client_write(journal_fptr, context, DB_CHUNK_CLIENT)){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_client_delete(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(!persist__journal_wanted(context)) return;
+
+	if(persist__client_write(journal_fptr, context, DB_CHUNK_CLIENT_DELETE)){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_client_msg(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	if(!persist__journal_wanted(context)) return;
+
+	if(persist__journal_store(cmsg->store)
+			|| persist__client_msg_write(journal_fptr, context, cmsg, DB_CHUNK_CLIENT_MSG)){
+
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_client_msg_update(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	/* If the message store was never written, neither was this message. */
+	if(!persist__journal_wanted(context) || !cmsg->store->persisted) return;
+
+	if(persist__client_msg_write(journal_fptr, context, cmsg, DB_CHUNK_CLIENT_MSG_UPDATE)){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_client_msg_delete(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	if(!persist__journal_wanted(context) || !cmsg->store->persisted) return;
+
+	if(persist__client_msg_write(journal_fptr, context, cmsg, DB_CHUNK_CLIENT_MSG_DELETE)){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_sub(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, uint32_t identifier, int options)
+{
+	struct P_sub chunk;
+
+	if(!persist__journal_wanted(context)) return;
+
+	memset(&chunk, 0, sizeof(struct P_sub));
+	chunk.F.identifier = identifier;
+	chunk.F.id_len = strlen(context->id);
+	chunk.F.topic_len = strlen(sub);
+	chunk.F.qos = (uint8_t)qos;
+	chunk.F.options = (uint8_t)options;
+	chunk.client_id = context->id;
+	chunk.topic = (char *)sub;
+
+	if(persist__chunk_sub_write_v5(journal_fptr, &chunk)){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_unsub(struct mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	struct P_sub chunk;
+
+	if(!persist__journal_wanted(context)) return;
+
+	memset(&chunk, 0, sizeof(struct P_sub));
+	chunk.F.id_len = strlen(context->id);
+	chunk.F.topic_len = strlen(sub);
+	chunk.client_id = context->id;
+	chunk.topic = (char *)sub;
+
+	if(persist__chunk_unsub_write_v5(journal_fptr, &chunk)){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_retain(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	struct P_retain chunk;
+
+	if(!journal_fptr || !strncmp(stored->topic, "$SYS", 4)) return;
+
+	memset(&chunk, 0, sizeof(struct P_retain));
+	chunk.F.store_id = stored->db_id;
+
+	if(persist__journal_store(stored)
+			|| persist__chunk_retain_write_v5(journal_fptr, &chunk)){
+
+		persist__journal_error();
+	}
+}
+
+
+static int persist__journal_sync(void)
+{
+#ifdef __linux__
+	return fdatasync(fileno(journal_fptr));
+#else
+	return fsync(fileno(journal_fptr));
+#endif
+}
+
+
+static bool persist__journal_sync_periodic(struct mosquitto_db *db)
+{
+	int i;
+
+	for(i=0; i<db->config->listener_count; i++){
+		if(db->config->listeners[i].durability == mosq_dur_periodic){
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static int persist__ack_send(struct mosquitto *context, int command, uint16_t mid, uint8_t reason_code)
+{
+	switch(command){
+		case CMD_PUBACK:
+			return send__puback(context, mid, reason_code);
+		case CMD_PUBREC:
+			return send__pubrec(context, mid, reason_code);
+		default:
+			return send__pubcomp(context, mid);
+	}
+}
+
+
+static void persist__journal_acks_send(struct mosquitto_db *db)
+{
+	struct persist__durable_ack *ack;
+	int i;
+	int failed = 0;
+	int rc;
+
+	for(i=0; i<durable_ack_count; i++){
+		ack = &durable_acks[i];
+		if(ack->context == NULL) continue;
+
+		ack->context->durable_ack_count--;
+		rc = persist__ack_send(ack->context, ack->command, ack->mid, ack->reason_code);
+		if(rc){
+			/* Sent acks are finished with, so the clients to disconnect are
+			 * collected at the start of the array. */
+			durable_acks[failed].context = ack->context;
+			failed++;
+		}
+	}
+	durable_ack_count = 0;
+
+	/* Disconnecting is left until every ack has been sent, because it
+	 * removes the client's held acks from the array. */
+	for(i=0; i<failed; i++){
+		do_disconnect(db, durable_acks[i].context, MOSQ_ERR_CONN_LOST);
+	}
+}
+
+
+/* Called once per main loop iteration, so a burst of changes costs a single
+ * write. The journal is synced here too if a group-commit listener is waiting
+ * on it, which covers every message received in this iteration with a single
+ * sync, or once a second if a listener uses periodic durability. */
+void persist__journal_flush(struct mosquitto_db *db)
+{
+	time_t now;
+	long pos;
+
+	if(journal_fptr && fflush(journal_fptr)){
+		persist__journal_error();
+	}
+	if(journal_fptr){
+		now = mosquitto_time();
+		if(durable_ack_count > 0
+				|| (journal_last_sync != now && persist__journal_sync_periodic(db))){
+
+			pos = ftell(journal_fptr);
+			if(pos != journal_synced_pos){
+				if(persist__journal_sync()){
+					persist__journal_error();
+				}else{
+					journal_synced_pos = pos;
+				}
+			}
+			journal_last_sync = now;
+		}
+	}
+	/* If the journal has failed these can't be made durable, but holding
+	 * them back would only stall the publishers. */
+	persist__journal_acks_send(db);
+}
+
+
+int persist__journal_ack(struct mosquitto_db *db, struct mosquitto *context, int command, uint16_t mid, uint8_t reason_code)
+{
+	struct persist__durable_ack *acks_new;
+	int size_new;
+
+	if(!journal_fptr || !context->listener || context->listener->durability != mosq_dur_group_commit){
+		return persist__ack_send(context, command, mid, reason_code);
+	}
+
+	if(durable_ack_count == durable_ack_size){
+		size_new = durable_ack_size ? durable_ack_size*2 : 64;
+		acks_new = mosquitto__realloc(durable_acks, size_new*sizeof(struct persist__durable_ack));
+		if(!acks_new) return MOSQ_ERR_NOMEM;
+		durable_acks = acks_new;
+		durable_ack_size = size_new;
+	}
+	durable_acks[durable_ack_count].context = context;
+	durable_acks[durable_ack_count].mid = mid;
+	durable_acks[durable_ack_count].command = command;
+	durable_acks[durable_ack_count].reason_code = reason_code;
+	durable_ack_count++;
+	context->durable_ack_count++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void persist__journal_ack_remove(struct mosquitto_db *db, struct mosquitto *context)
+{
+	int i;
+
+	if(context->durable_ack_count == 0) return;
+
+	for(i=0; i<durable_ack_count; i++){
+		if(durable_acks[i].context == context){
+			durable_acks[i].context = NULL;
+		}
+	}
+	context->durable_ack_count = 0;
+}
+
+
+static int persist__section_begin(FILE *db_fptr, struct PF_index_entry *entry, uint32_t chunk)
+{
+	long offset;
+
+	offset = ftell(db_fptr);
+	if(offset < 0) return 1;
+
+	entry->chunk = chunk;
+	entry->count = 0;
+	entry->offset = (uint64_t)offset;
+	entry->length = 0;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__section_end(FILE *db_fptr, struct PF_index_entry *entry)
+{
+	long offset;
+
+	offset = ftell(db_fptr);
+	if(offset < 0) return 1;
+
+	entry->length = (uint64_t)offset - entry->offset;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__snapshot_write(struct mosquitto_db *db, bool shutdown, dbid_t snapshot_id)
 {
 	int rc = 0;
 	FILE *db_fptr = NULL;
@@ -273,11 +831,11 @@ int persist__backup(struct mosquitto_db *db, bool shutdown)
 	char *outfile = NULL;
 	int len;
 	struct PF_cfg cfg_chunk;
-
-	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
-	if(db->config->persistence == false) return MOSQ_ERR_SUCCESS;
-
-	log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
+	struct PF_index_entry index[5];
+	long index_offset;
+	FILE *prev_fptr = NULL;
+	unsigned int generation;
+	struct stat st;
 
 	len = strlen(db->config->persistence_filepath)+5;
 	outfile = mosquitto__malloc(len+1);
@@ -330,19 +888,47 @@ int persist__backup(struct mosquitto_db *db, bool shutdown)
 	write_e(db_fptr, &db_version_w, sizeof(uint32_t));
 
 	memset(&cfg_chunk, 0, sizeof(struct PF_cfg));
-	cfg_chunk.last_db_id = db->last_db_id;
+	cfg_chunk.last_db_id = snapshot_id;
 	cfg_chunk.shutdown = shutdown;
 	cfg_chunk.dbid_size = sizeof(dbid_t);
 	if(persist__chunk_cfg_write_v5(db_fptr, &cfg_chunk)){
 		goto error;
 	}
 
-	if(persist__message_store_save(db, db_fptr)){
+	generation = snapshot_generation + 1;
+	if(generation == 0) generation = 1;
+	prev_fptr = persist__snapshot_previous(db);
+
+	/* Sections, in the order they must be restored. Retained messages come
+	 * before subscriptions so that restoring them doesn't queue them for the
+	 * restored subscribers a second time. */
+	if(persist__section_begin(db_fptr, &index[0], DB_CHUNK_MSG_STORE)
+			|| persist__message_store_save(db, db_fptr, &index[0].count)
+			|| persist__section_end(db_fptr, &index[0])
+
+			|| persist__section_begin(db_fptr, &index[1], DB_CHUNK_CLIENT)
+			|| persist__client_save(db, db_fptr, &index[1].count)
+			|| persist__section_end(db_fptr, &index[1])
+
+			|| persist__section_begin(db_fptr, &index[2], DB_CHUNK_CLIENT_MSG)
+			|| persist__client_messages_save_all(db, db_fptr, prev_fptr, generation, &index[2].count)
+			|| persist__section_end(db_fptr, &index[2])
+
+			|| persist__section_begin(db_fptr, &index[3], DB_CHUNK_RETAIN)
+			|| persist__subs_retain_save_all(db, db_fptr, DB_CHUNK_RETAIN, &index[3].count)
+			|| persist__section_end(db_fptr, &index[3])
+
+			|| persist__section_begin(db_fptr, &index[4], DB_CHUNK_SUB)
+			|| persist__subs_retain_save_all(db, db_fptr, DB_CHUNK_SUB, &index[4].count)
+			|| persist__section_end(db_fptr, &index[4])){
+
 		goto error;
 	}
 
-	persist__client_save(db, db_fptr);
-	persist__subs_retain_save_all(db, db_fptr);
+	index_offset = ftell(db_fptr);
+	if(index_offset < 0 || persist__chunk_index_write_v5(db_fptr, index, 5, (uint64_t)index_offset)){
+		goto error;
+	}
 
 #ifndef WIN32
 	/**
@@ -370,7 +956,15 @@ int persist__backup(struct mosquitto_db *db, bool shutdown)
 	fflush(db_fptr);
 	fsync(fileno(db_fptr));
 #endif
+	if(prev_fptr){
+		fclose(prev_fptr);
+		prev_fptr = NULL;
+	}
+	if(fstat(fileno(db_fptr), &st)){
+		goto error;
+	}
 	fclose(db_fptr);
+	db_fptr = NULL;
 
 #ifdef WIN32
 	if(remove(db->config->persistence_filepath) != 0){
@@ -384,14 +978,183 @@ int persist__backup(struct mosquitto_db *db, bool shutdown)
 	}
 	mosquitto__free(outfile);
 	outfile = NULL;
+
+	snapshot_generation = generation;
+	snapshot_dev = st.st_dev;
+	snapshot_ino = st.st_ino;
+	snapshot_size = st.st_size;
+	snapshot_mtime = st.st_mtime;
 	return rc;
 error:
 	mosquitto__free(outfile);
 	err = strerror(errno);
 	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
+	if(prev_fptr) fclose(prev_fptr);
 	if(db_fptr) fclose(db_fptr);
 	return 1;
 }
 
 
+static dbid_t persist__snapshot_id(struct mosquitto_db *db)
+{
+	if(db->config->persistence_journal){
+		/* Every snapshot needs its own id, so that the journal written after
+		 * it can be matched to it on restore. */
+		db->last_db_id++;
+	}
+	return db->last_db_id;
+}
+
+
+static int persist__backup_foreground(struct mosquitto_db *db, bool shutdown)
+{
+	dbid_t snapshot_id;
+	long start;
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
+
+	start = persist__time_ms();
+	snapshot_id = persist__snapshot_id(db);
+	if(persist__snapshot_write(db, shutdown, snapshot_id)){
+		return 1;
+	}
+	db->persistence_save_duration = persist__time_ms() - start;
+
+	/* Everything in the old journal is now part of the snapshot. */
+	persist__journal_close();
+	persist__journal_remove(db, true);
+	if(db->config->persistence_journal && !shutdown){
+		persist__journal_open(db, snapshot_id, false);
+	}else{
+		persist__journal_remove(db, false);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+#ifndef WIN32
+static pid_t background_pid = 0;
+static long background_start;
+
+/* Write the snapshot from a child process, which has a copy-on-write view of
+ * the database as it is now, so the main loop can carry on while it is
+ * written. */
+static int persist__backup_background(struct mosquitto_db *db)
+{
+	dbid_t snapshot_id;
+	pid_t pid;
+	char *next_path;
+	struct stat st;
+
+	/* A next journal left by a background save that never finished holds
+	 * changes that are in neither the snapshot nor the current journal. It
+	 * would be replaced by the new next journal, so it has to be folded in to
+	 * a snapshot in the foreground instead. */
+	next_path = persist__journal_path(db, true);
+	if(!next_path) return MOSQ_ERR_NOMEM;
+	if(stat(next_path, &st) == 0){
+		mosquitto__free(next_path);
+		return persist__backup_foreground(db, false);
+	}
+	mosquitto__free(next_path);
+
+	snapshot_id = persist__snapshot_id(db);
+	background_start = persist__time_ms();
+
+	pid = fork();
+	if(pid == -1){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to save in-memory database in the background: %s.", strerror(errno));
+		return persist__backup_foreground(db, false);
+	}else if(pid == 0){
+		/* Child. Don't use exit(), the parent's stdio buffers must not be
+		 * flushed a second time. */
+		_exit(persist__snapshot_write(db, false, snapshot_id));
+	}
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s in the background.", db->config->persistence_filepath);
+	background_pid = pid;
+	db->persistence_saving = true;
+
+	if(db->config->persistence_journal){
+		persist__journal_close();
+		persist__journal_open(db, snapshot_id, true);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Collect the result of a background save. If wait is false, this returns
+ * immediately if the save hasn't finished. */
+static void persist__background_finish(struct mosquitto_db *db, bool wait)
+{
+	char *journal_path, *next_path;
+	int status;
+	pid_t rc;
+
+	if(background_pid == 0) return;
+
+	do{
+		rc = waitpid(background_pid, &status, wait?0:WNOHANG);
+	}while(rc == -1 && errno == EINTR);
+	if(rc == 0) return;
+
+	background_pid = 0;
+	db->persistence_saving = false;
+
+	if(rc == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error saving in-memory database in the background, saving in the foreground instead.");
+		persist__backup_foreground(db, false);
+		return;
+	}
+
+	db->persistence_save_duration = persist__time_ms() - background_start;
+	log__printf(NULL, MOSQ_LOG_INFO, "Saved in-memory database in %ld ms.", db->persistence_save_duration);
+
+	/* The snapshot is in place, so the next journal is the only one needed
+	 * to restore from it. */
+	if(journal_fptr){
+		journal_path = persist__journal_path(db, false);
+		next_path = persist__journal_path(db, true);
+		if(journal_path && next_path && rename(next_path, journal_path) != 0){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to rename %s: %s.", next_path, strerror(errno));
+		}
+		mosquitto__free(journal_path);
+		mosquitto__free(next_path);
+	}else{
+		persist__journal_remove(db, true);
+		persist__journal_remove(db, false);
+	}
+}
+#endif
+
+
+void persist__background_check(struct mosquitto_db *db)
+{
+#ifndef WIN32
+	persist__background_finish(db, false);
+#endif
+}
+
+
+int persist__backup(struct mosquitto_db *db, bool shutdown)
+{
+	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+	if(db->config->persistence == false) return MOSQ_ERR_SUCCESS;
+
+#ifndef WIN32
+	if(background_pid){
+		if(!shutdown){
+			/* The save that is already running is recent enough. */
+			return MOSQ_ERR_SUCCESS;
+		}
+		persist__background_finish(db, true);
+	}
+	if(db->config->persistence_background && !shutdown){
+		return persist__backup_background(db);
+	}
+#endif
+	return persist__backup_foreground(db, shutdown);
+}
+
+
 #endif
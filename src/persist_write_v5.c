@@ -53,7 +53,7 @@ error:
 }
 
 
-int persist__chunk_client_write_v5(FILE *db_fptr, struct P_client *chunk)
+static int persist__chunk_client_write_type(FILE *db_fptr, struct P_client *chunk, uint32_t chunk_type)
 {
 	struct PF_header header;
 	uint16_t id_len = chunk->F.id_len;
@@ -62,7 +62,7 @@ int persist__chunk_client_write_v5(FILE *db_fptr, struct P_client *chunk)
 	chunk->F.last_mid = htons(chunk->F.last_mid);
 	chunk->F.id_len = htons(chunk->F.id_len);
 
-	header.chunk = htonl(DB_CHUNK_CLIENT);
+	header.chunk = htonl(chunk_type);
 	header.length = htonl(sizeof(struct PF_client)+id_len);
 
 	write_e(db_fptr, &header, sizeof(struct PF_header));
@@ -77,7 +77,19 @@ error:
 }
 
 
-int persist__chunk_client_msg_write_v5(FILE *db_fptr, struct P_client_msg *chunk)
+int persist__chunk_client_write_v5(FILE *db_fptr, struct P_client *chunk)
+{
+	return persist__chunk_client_write_type(db_fptr, chunk, DB_CHUNK_CLIENT);
+}
+
+
+int persist__chunk_client_delete_write_v5(FILE *db_fptr, struct P_client *chunk)
+{
+	return persist__chunk_client_write_type(db_fptr, chunk, DB_CHUNK_CLIENT_DELETE);
+}
+
+
+static int persist__chunk_client_msg_write_type(FILE *db_fptr, struct P_client_msg *chunk, uint32_t chunk_type)
 {
 	struct PF_header header;
 	struct mosquitto__packet prop_packet;
@@ -94,7 +106,7 @@ int persist__chunk_client_msg_write_v5(FILE *db_fptr, struct P_client_msg *chunk
 	chunk->F.mid = htons(chunk->F.mid);
 	chunk->F.id_len = htons(chunk->F.id_len);
 
-	header.chunk = htonl(DB_CHUNK_CLIENT_MSG);
+	header.chunk = htonl(chunk_type);
 	header.length = htonl(sizeof(struct PF_client_msg) + id_len + proplen);
 
 	write_e(db_fptr, &header, sizeof(struct PF_header));
@@ -123,6 +135,24 @@ error:
 }
 
 
+int persist__chunk_client_msg_write_v5(FILE *db_fptr, struct P_client_msg *chunk)
+{
+	return persist__chunk_client_msg_write_type(db_fptr, chunk, DB_CHUNK_CLIENT_MSG);
+}
+
+
+int persist__chunk_client_msg_update_write_v5(FILE *db_fptr, struct P_client_msg *chunk)
+{
+	return persist__chunk_client_msg_write_type(db_fptr, chunk, DB_CHUNK_CLIENT_MSG_UPDATE);
+}
+
+
+int persist__chunk_client_msg_delete_write_v5(FILE *db_fptr, struct P_client_msg *chunk)
+{
+	return persist__chunk_client_msg_write_type(db_fptr, chunk, DB_CHUNK_CLIENT_MSG_DELETE);
+}
+
+
 int persist__chunk_message_store_write_v5(FILE *db_fptr, struct P_msg_store *chunk)
 {
 	struct PF_header header;
@@ -205,7 +235,7 @@ error:
 }
 
 
-int persist__chunk_sub_write_v5(FILE *db_fptr, struct P_sub *chunk)
+static int persist__chunk_sub_write_type(FILE *db_fptr, struct P_sub *chunk, uint32_t chunk_type)
 {
 	struct PF_header header;
 	uint16_t id_len = chunk->F.id_len;
@@ -215,7 +245,7 @@ int persist__chunk_sub_write_v5(FILE *db_fptr, struct P_sub *chunk)
 	chunk->F.id_len = htons(chunk->F.id_len);
 	chunk->F.topic_len = htons(chunk->F.topic_len);
 
-	header.chunk = htonl(DB_CHUNK_SUB);
+	header.chunk = htonl(chunk_type);
 	header.length = htonl(sizeof(struct PF_sub) +
 			id_len + topic_len);
 
@@ -229,4 +259,42 @@ error:
 	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
 	return 1;
 }
+
+
+int persist__chunk_sub_write_v5(FILE *db_fptr, struct P_sub *chunk)
+{
+	return persist__chunk_sub_write_type(db_fptr, chunk, DB_CHUNK_SUB);
+}
+
+
+int persist__chunk_unsub_write_v5(FILE *db_fptr, struct P_sub *chunk)
+{
+	return persist__chunk_sub_write_type(db_fptr, chunk, DB_CHUNK_UNSUB);
+}
+
+
+int persist__chunk_index_write_v5(FILE *db_fptr, struct PF_index_entry *entries, int entry_count, uint64_t offset)
+{
+	struct PF_header header;
+	struct PF_index_entry entry;
+	int i;
+
+	header.chunk = htonl(DB_CHUNK_INDEX);
+	header.length = htonl(sizeof(struct PF_index_entry)*entry_count + sizeof(uint64_t));
+	write_e(db_fptr, &header, sizeof(struct PF_header));
+
+	for(i=0; i<entry_count; i++){
+		entry.chunk = htonl(entries[i].chunk);
+		entry.count = htonl(entries[i].count);
+		entry.offset = entries[i].offset;
+		entry.length = entries[i].length;
+		write_e(db_fptr, &entry, sizeof(struct PF_index_entry));
+	}
+	write_e(db_fptr, &offset, sizeof(uint64_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
 #endif
@@ -112,7 +112,23 @@ int mosquitto_set_username(struct mosquitto *client, const char *username)
 		return rc;
 	}else{
 		mosquitto__free(old);
+		acl__cache_free(client);
+		sub__acl_reset(client);
 		return MOSQ_ERR_SUCCESS;
 	}
 }
 
+int mosquitto_acl_cache_clear(struct mosquitto *client)
+{
+	struct mosquitto_db *db;
+
+	if(client){
+		acl__cache_free(client);
+		sub__acl_reset(client);
+	}else{
+		db = mosquitto__get_db();
+		db->acl_generation++;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
@@ -0,0 +1,75 @@
+/*
+Copyright (c) 2019 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#ifndef PWFILE_H
+#define PWFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compiled password files, written by `mosquitto_passwd -C` and mapped into
+ * memory by the broker.
+ *
+ * The file is a PWF_header, followed by slot_count PWF_slot entries that form
+ * an open addressing hash table of usernames, followed by strings_len bytes
+ * of usernames that the slots point into. slot_count is a power of two and
+ * a username is found by starting at the slot given by its pwfile__hash()
+ * and moving forward until the username or an empty slot is found. An empty
+ * slot has a username_len of zero.
+ *
+ * All integers are in network byte order. The structs are written to disk as
+ * is, so they must not be rearranged without updating the version. */
+
+/* Starts with a zero byte so a text password file can never match. */
+#define PWFILE_MAGIC "\000mosqpwd"
+#define PWFILE_MAGIC_LEN 8
+#define PWFILE_VERSION 1
+
+#define PWFILE_SALT_LEN 12
+#define PWFILE_HASH_LEN 64
+
+struct PWF_header{
+	char magic[PWFILE_MAGIC_LEN];
+	uint32_t version;
+	uint32_t entry_count;
+	uint32_t slot_count;
+	uint32_t strings_len;
+};
+
+struct PWF_slot{
+	uint32_t hash;
+	uint32_t username_offset;
+	uint32_t username_len;
+	uint8_t salt[PWFILE_SALT_LEN];
+	uint8_t password[PWFILE_HASH_LEN];
+};
+
+
+/* FNV-1a, which is part of the file format so must not be changed without
+ * updating the version. */
+static inline uint32_t pwfile__hash(const char *username, size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for(i=0; i<len; i++){
+		hash ^= (uint8_t)username[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+#endif
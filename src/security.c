@@ -28,6 +28,25 @@ typedef int (*FUNC_auth_plugin_version)(void);
 
 static int security__cleanup_single(struct mosquitto__security_options *opts, bool reload);
 
+/* The check that a version 5 plugin may leave pending with
+ * mosquitto_auth_pending_new(). Only set while the password check for a
+ * CONNECT, or the ACL check for a PUBLISH, is being made. */
+static struct{
+	struct mosquitto *context;
+	const char *topic;
+	int access;
+	bool allowed;
+	struct mosquitto__auth_job *job;
+} pending_check;
+
+/* Scratch space for passing part of a batch of READ checks to a plugin. */
+static struct{
+	struct mosquitto **clients;
+	int *index;
+	int *results;
+	int size;
+} acl_batch;
+
 void LIB_ERROR(void)
 {
 #ifdef WIN32
@@ -250,6 +269,24 @@ int security__load_v4(struct mosquitto__auth_plugin *plugin, struct mosquitto_op
 				" ├── TLS-PSK checking not enabled.");
 	}
 
+	plugin->acl_sub_classify_v4 = (FUNC_auth_plugin_acl_sub_classify_v4)LIB_SYM(lib, "mosquitto_auth_acl_sub_classify");
+	if(plugin->acl_sub_classify_v4){
+		log__printf(NULL, MOSQ_LOG_INFO,
+				" ├── Subscription ACL classification enabled.");
+	}else{
+		log__printf(NULL, MOSQ_LOG_INFO,
+				" ├── Subscription ACL classification not enabled.");
+	}
+
+	plugin->acl_check_batch_v4 = (FUNC_auth_plugin_acl_check_batch_v4)LIB_SYM(lib, "mosquitto_auth_acl_check_batch");
+	if(plugin->acl_check_batch_v4){
+		log__printf(NULL, MOSQ_LOG_INFO,
+				" ├── Batch ACL checks enabled.");
+	}else{
+		log__printf(NULL, MOSQ_LOG_INFO,
+				" ├── Batch ACL checks not enabled.");
+	}
+
 	plugin->auth_start_v4 = (FUNC_auth_plugin_auth_start_v4)LIB_SYM(lib, "mosquitto_auth_start");
 	plugin->auth_continue_v4 = (FUNC_auth_plugin_auth_continue_v4)LIB_SYM(lib, "mosquitto_auth_continue");
 	
@@ -317,6 +354,12 @@ static int security__module_init_single(struct mosquitto__security_options *opts
 				return 1;
 			}
 			version = plugin_version();
+			if(version == 5){
+				/* Version 5 has the version 4 functions, which may also
+				 * leave checks pending. */
+				opts->auth_plugin_configs[i].plugin.async = true;
+				version = 4;
+			}
 			opts->auth_plugin_configs[i].plugin.version = version;
 			if(version == 4){
 				rc = security__load_v4(
@@ -363,18 +406,40 @@ static int security__module_init_single(struct mosquitto__security_options *opts
 }
 
 
+static bool security__has_batch(struct mosquitto__security_options *opts)
+{
+	int i;
+
+	for(i=0; i<opts->auth_plugin_config_count; i++){
+		if(opts->auth_plugin_configs[i].plugin.version == 4
+				&& opts->auth_plugin_configs[i].plugin.acl_check_batch_v4){
+
+			return true;
+		}
+	}
+	return false;
+}
+
+
 int mosquitto_security_module_init(struct mosquitto_db *db)
 {
 	int rc = MOSQ_ERR_SUCCESS;
 	int i;
 
+	db->acl_check_batch = false;
 	if(db->config->per_listener_settings){
 		for(i=0; i<db->config->listener_count; i++){
 			rc = security__module_init_single(&db->config->listeners[i].security_options);
 			if(rc) return rc;
+			if(security__has_batch(&db->config->listeners[i].security_options)){
+				db->acl_check_batch = true;
+			}
 		}
 	}else{
 		rc = security__module_init_single(&db->config->security_options);
+		if(security__has_batch(&db->config->security_options)){
+			db->acl_check_batch = true;
+		}
 	}
 	return rc;
 }
@@ -425,6 +490,11 @@ int mosquitto_security_module_cleanup(struct mosquitto_db *db)
 		security__module_cleanup_single(&db->config->listeners[i].security_options);
 	}
 
+	mosquitto__free(acl_batch.clients);
+	mosquitto__free(acl_batch.index);
+	mosquitto__free(acl_batch.results);
+	memset(&acl_batch, 0, sizeof(acl_batch));
+
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -466,6 +536,23 @@ static int security__init_single(struct mosquitto__security_options *opts, bool
 }
 
 
+static bool security__has_plugins(struct mosquitto_db *db)
+{
+	int i;
+
+	if(db->config->per_listener_settings){
+		for(i=0; i<db->config->listener_count; i++){
+			if(db->config->listeners[i].security_options.auth_plugin_config_count > 0){
+				return true;
+			}
+		}
+		return false;
+	}else{
+		return db->config->security_options.auth_plugin_config_count > 0;
+	}
+}
+
+
 int mosquitto_security_init(struct mosquitto_db *db, bool reload)
 {
 	int i;
@@ -480,6 +567,12 @@ int mosquitto_security_init(struct mosquitto_db *db, bool reload)
 		rc = security__init_single(&db->config->security_options, reload);
 		if(rc != MOSQ_ERR_SUCCESS) return rc;
 	}
+	if(security__has_plugins(db)){
+		/* A plugin may decide differently after being reloaded, so anything
+		 * checked before must be checked again. Changes to acl_file are
+		 * handled in mosquitto_security_init_default(). */
+		db->acl_generation++;
+	}
 	return mosquitto_security_init_default(db, reload);
 }
 
@@ -494,6 +587,13 @@ int mosquitto_security_apply(struct mosquitto_db *db)
 	return mosquitto_security_apply_default(db);
 }
 
+/* Carry on checking clients after a reload, a batch at a time. Called on
+ * each pass of the main loop. */
+void mosquitto_security_apply_continue(struct mosquitto_db *db)
+{
+	mosquitto_security_apply_continue_default(db);
+}
+
 
 static int security__cleanup_single(struct mosquitto__security_options *opts, bool reload)
 {
@@ -549,11 +649,9 @@ int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload)
 }
 
 
-//int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
-static int acl__check_single(struct mosquitto__auth_plugin_config *auth_plugin, struct mosquitto *context, struct mosquitto_acl_msg *msg, int access)
+static int acl__check_special_chars(struct mosquitto__auth_plugin_config *auth_plugin, struct mosquitto *context)
 {
 	const char *username;
-	const char *topic = msg->topic;
 
 	username = mosquitto_client_username(context);
 	if(auth_plugin->deny_special_chars == true){
@@ -572,7 +670,21 @@ static int acl__check_single(struct mosquitto__auth_plugin_config *auth_plugin,
 			return MOSQ_ERR_ACL_DENIED;
 		}
 	}
+	return MOSQ_ERR_SUCCESS;
+}
+
 
+//int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+static int acl__check_single(struct mosquitto__auth_plugin_config *auth_plugin, struct mosquitto *context, struct mosquitto_acl_msg *msg, int access)
+{
+	const char *username;
+	const char *topic = msg->topic;
+
+	if(acl__check_special_chars(auth_plugin, context)){
+		return MOSQ_ERR_ACL_DENIED;
+	}
+
+	username = mosquitto_client_username(context);
 	if(auth_plugin->plugin.version == 4){
 		return auth_plugin->plugin.acl_check_v4(auth_plugin->plugin.user_data, access, context, msg);
 	}else if(auth_plugin->plugin.version == 3){
@@ -622,19 +734,127 @@ static int acl__check_dollar(const char *topic, int access)
 }
 
 
-int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access)
+void acl__cache_free(struct mosquitto *context)
 {
-	int rc;
 	int i;
-	struct mosquitto__security_options *opts;
-	struct mosquitto_acl_msg msg;
 
-	if(!context->id){
-		return MOSQ_ERR_ACL_DENIED;
+	if(!context->acl_cache) return;
+
+	for(i=0; i<context->acl_cache->size; i++){
+		mosquitto__free(context->acl_cache->entries[i].topic);
+	}
+	mosquitto__free(context->acl_cache->entries);
+	mosquitto__free(context->acl_cache);
+	context->acl_cache = NULL;
+}
+
+
+static uint32_t acl__cache_hash(const char *topic, int access)
+{
+	uint32_t hash = 2166136261UL;
+
+	while(topic[0]){
+		hash ^= (uint8_t)topic[0];
+		hash *= 16777619UL;
+		topic++;
 	}
+	hash ^= (uint32_t)access;
+	hash *= 16777619UL;
+
+	return hash;
+}
+
+
+/* Find the cache slot for this topic and access type, creating the cache or
+ * discarding a stale one as needed. Returns NULL if the cache can't be used. */
+static struct mosquitto__acl_cache_entry *acl__cache_slot(struct mosquitto_db *db, struct mosquitto *context, uint32_t hash)
+{
+	struct mosquitto__acl_cache *cache;
+	int size;
+
+	cache = context->acl_cache;
+	if(cache && (cache->generation != db->acl_generation || cache->size < db->config->acl_cache_size)){
+		acl__cache_free(context);
+		cache = NULL;
+	}
+	if(!cache){
+		/* Round up to a power of two so the slot is a mask of the hash. */
+		size = 1;
+		while(size < db->config->acl_cache_size){
+			size <<= 1;
+		}
+		cache = mosquitto__calloc(1, sizeof(struct mosquitto__acl_cache));
+		if(!cache) return NULL;
+		cache->entries = mosquitto__calloc(size, sizeof(struct mosquitto__acl_cache_entry));
+		if(!cache->entries){
+			mosquitto__free(cache);
+			return NULL;
+		}
+		cache->size = size;
+		cache->generation = db->acl_generation;
+		context->acl_cache = cache;
+	}
+
+	return &cache->entries[hash & (cache->size-1)];
+}
+
+
+/* Return the cache slot for this check, or NULL if it isn't cached. Only the
+ * decisions for connected clients publishing or receiving are cached, that is
+ * where the repeated checks are. */
+static struct mosquitto__acl_cache_entry *acl__cache_entry(struct mosquitto_db *db, struct mosquitto *context, uint32_t hash, int access)
+{
+	if(db->config->acl_cache_size > 0
+			&& context->state == mosq_cs_active
+			&& (access == MOSQ_ACL_READ || access == MOSQ_ACL_WRITE)){
+
+		return acl__cache_slot(db, context, hash);
+	}
+	return NULL;
+}
+
+
+static bool acl__cache_matches(struct mosquitto__acl_cache_entry *entry, uint32_t hash, const char *topic, int access)
+{
+	return entry->topic && entry->hash == hash
+			&& entry->access == access && !strcmp(entry->topic, topic);
+}
+
+
+static bool acl__cache_lookup(struct mosquitto_db *db, struct mosquitto__acl_cache_entry *entry, uint32_t hash, const char *topic, int access, int *rc)
+{
+	if(!entry) return false;
+
+	if(acl__cache_matches(entry, hash, topic, access)){
+		db->acl_cache_hits++;
+		*rc = entry->rc;
+		return true;
+	}
+	db->acl_cache_misses++;
+	return false;
+}
 
-	rc = acl__check_dollar(topic, access);
-	if(rc) return rc;
+
+static void acl__cache_store(struct mosquitto__acl_cache_entry *entry, uint32_t hash, const char *topic, int access, int rc)
+{
+	if(entry && (rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_ACL_DENIED)){
+		mosquitto__free(entry->topic);
+		entry->topic = mosquitto__strdup(topic);
+		if(entry->topic){
+			entry->hash = hash;
+			entry->access = access;
+			entry->rc = rc;
+		}
+	}
+}
+
+
+static int acl__check_all(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access)
+{
+	int rc;
+	int i;
+	struct mosquitto__security_options *opts;
+	struct mosquitto_acl_msg msg;
 
 	rc = mosquitto_acl_check_default(db, context, topic, access);
 	if(rc != MOSQ_ERR_PLUGIN_DEFER){
@@ -659,7 +879,13 @@ int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, cons
 	msg.retain = retain;
 
 	for(i=0; i<opts->auth_plugin_config_count; i++){
+		pending_check.allowed = pending_check.context == context && opts->auth_plugin_configs[i].plugin.async;
 		rc = acl__check_single(&opts->auth_plugin_configs[i], context, &msg, access);
+		pending_check.allowed = false;
+		if(rc != MOSQ_ERR_AUTH_PENDING && pending_check.job){
+			auth_pool__job_abandon(pending_check.job);
+			pending_check.job = NULL;
+		}
 		if(rc != MOSQ_ERR_PLUGIN_DEFER){
 			return rc;
 		}
@@ -673,6 +899,313 @@ int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, cons
 	return rc;
 }
 
+
+int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access)
+{
+	int rc;
+	uint32_t hash = 0;
+	struct mosquitto__acl_cache_entry *entry = NULL;
+
+	if(!context->id){
+		return MOSQ_ERR_ACL_DENIED;
+	}
+
+	rc = acl__check_dollar(topic, access);
+	if(rc) return rc;
+
+	if(db->config->acl_cache_size > 0){
+		hash = acl__cache_hash(topic, access);
+		entry = acl__cache_entry(db, context, hash, access);
+		if(acl__cache_lookup(db, entry, hash, topic, access, &rc)){
+			return rc;
+		}
+	}
+
+	rc = acl__check_all(db, context, topic, payloadlen, payload, qos, retain, access);
+
+	acl__cache_store(entry, hash, topic, access, rc);
+	return rc;
+}
+
+
+/* Run the plugins in opts for the clients in the batch that are from
+ * listener, or all clients if listener is NULL, and whose result is still
+ * MOSQ_ERR_PLUGIN_DEFER. Plugins with mosquitto_auth_acl_check_batch() are
+ * passed all of those clients at once. */
+static int security__batch_grow(int count)
+{
+	struct mosquitto **clients;
+	int *index, *results;
+
+	clients = mosquitto__realloc(acl_batch.clients, count*sizeof(struct mosquitto *));
+	if(!clients) return MOSQ_ERR_NOMEM;
+	acl_batch.clients = clients;
+	index = mosquitto__realloc(acl_batch.index, count*sizeof(int));
+	if(!index) return MOSQ_ERR_NOMEM;
+	acl_batch.index = index;
+	results = mosquitto__realloc(acl_batch.results, count*sizeof(int));
+	if(!results) return MOSQ_ERR_NOMEM;
+	acl_batch.results = results;
+	acl_batch.size = count;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void acl__check_batch_plugins(struct mosquitto__security_options *opts, struct mosquitto__listener *listener, struct mosquitto **clients, int count, struct mosquitto_acl_msg *msg, int *results)
+{
+	struct mosquitto__auth_plugin_config *auth_plugin;
+	int i, j, n;
+
+	for(i=0; i<opts->auth_plugin_config_count; i++){
+		auth_plugin = &opts->auth_plugin_configs[i];
+		n = 0;
+		for(j=0; j<count; j++){
+			if(results[j] != MOSQ_ERR_PLUGIN_DEFER) continue;
+			if(listener && clients[j]->listener != listener) continue;
+
+			if(auth_plugin->plugin.version == 4 && auth_plugin->plugin.acl_check_batch_v4){
+				if(acl__check_special_chars(auth_plugin, clients[j])){
+					results[j] = MOSQ_ERR_ACL_DENIED;
+				}else{
+					acl_batch.clients[n] = clients[j];
+					acl_batch.index[n] = j;
+					acl_batch.results[n] = MOSQ_ERR_PLUGIN_DEFER;
+					n++;
+				}
+			}else{
+				results[j] = acl__check_single(auth_plugin, clients[j], msg, MOSQ_ACL_READ);
+			}
+		}
+		if(n == 0) continue;
+
+		if(auth_plugin->plugin.acl_check_batch_v4(auth_plugin->plugin.user_data, MOSQ_ACL_READ, acl_batch.clients, n, msg, acl_batch.results) == MOSQ_ERR_SUCCESS){
+			for(j=0; j<n; j++){
+				results[acl_batch.index[j]] = acl_batch.results[j];
+			}
+		}else{
+			/* The plugin didn't take the batch, check one at a time. */
+			for(j=0; j<n; j++){
+				results[acl_batch.index[j]] = acl__check_single(auth_plugin, acl_batch.clients[j], msg, MOSQ_ACL_READ);
+			}
+		}
+	}
+
+	/* As in acl__check_all(), every plugin deferring is a denial but no
+	 * plugins at all is not. */
+	for(j=0; j<count; j++){
+		if(results[j] == MOSQ_ERR_PLUGIN_DEFER
+				&& (!listener || clients[j]->listener == listener)){
+
+			if(opts->auth_plugin_config_count == 0){
+				results[j] = MOSQ_ERR_SUCCESS;
+			}else{
+				results[j] = MOSQ_ERR_ACL_DENIED;
+			}
+		}
+	}
+}
+
+
+int mosquitto_acl_check_read_batch(struct mosquitto_db *db, struct mosquitto **clients, int count, const char *topic, long payloadlen, void* payload, int qos, bool retain, int *results)
+{
+	struct mosquitto_acl_msg msg;
+	struct mosquitto__acl_cache_entry *entry;
+	uint32_t hash;
+	int rc;
+	int i;
+
+	if(count > acl_batch.size){
+		if(security__batch_grow(count)) return MOSQ_ERR_NOMEM;
+	}
+
+	rc = acl__check_dollar(topic, MOSQ_ACL_READ);
+	hash = acl__cache_hash(topic, MOSQ_ACL_READ);
+
+	/* Everything before the plugins, as in mosquitto_acl_check(). */
+	for(i=0; i<count; i++){
+		if(!clients[i]->id){
+			results[i] = MOSQ_ERR_ACL_DENIED;
+		}else if(rc){
+			results[i] = rc;
+		}else if(acl__cache_lookup(db, acl__cache_entry(db, clients[i], hash, MOSQ_ACL_READ), hash, topic, MOSQ_ACL_READ, &results[i])){
+			continue;
+		}else{
+			results[i] = mosquitto_acl_check_default(db, clients[i], topic, MOSQ_ACL_READ);
+		}
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.topic = topic;
+	msg.payloadlen = payloadlen;
+	msg.payload = payload;
+	msg.qos = qos;
+	msg.retain = retain;
+
+	if(db->config->per_listener_settings){
+		for(i=0; i<db->config->listener_count; i++){
+			acl__check_batch_plugins(&db->config->listeners[i].security_options, &db->config->listeners[i], clients, count, &msg, results);
+		}
+	}else{
+		acl__check_batch_plugins(&db->config->security_options, NULL, clients, count, &msg, results);
+	}
+
+	for(i=0; i<count; i++){
+		if(results[i] == MOSQ_ERR_PLUGIN_DEFER){
+			/* A client from a listener that isn't configured. */
+			results[i] = MOSQ_ERR_ACL_DENIED;
+		}
+		if(rc == MOSQ_ERR_SUCCESS && clients[i]->id){
+			entry = acl__cache_entry(db, clients[i], hash, MOSQ_ACL_READ);
+			if(entry && !acl__cache_matches(entry, hash, topic, MOSQ_ACL_READ)){
+				acl__cache_store(entry, hash, topic, MOSQ_ACL_READ, results[i]);
+			}
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Hand a check that a plugin has left pending over to the client. */
+static int security__pending_result(struct mosquitto_db *db, struct mosquitto *context, int rc)
+{
+	struct mosquitto__auth_job *job = pending_check.job;
+
+	pending_check.context = NULL;
+	pending_check.topic = NULL;
+	pending_check.job = NULL;
+
+	if(rc == MOSQ_ERR_AUTH_PENDING){
+		if(!job){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Auth plugin left a check pending without calling mosquitto_auth_pending_new().");
+			return MOSQ_ERR_UNKNOWN;
+		}
+		context->auth_job = job;
+		auth_pool__track(db, job);
+	}else{
+		auth_pool__job_abandon(job);
+	}
+	return rc;
+}
+
+
+struct mosquitto_auth_pending *mosquitto_auth_pending_new(struct mosquitto *client)
+{
+	struct mosquitto__auth_job *job;
+
+	if(!pending_check.allowed || client != pending_check.context){
+		return NULL;
+	}
+	if(!pending_check.job){
+		job = auth_pool__job_new(mosquitto__get_db(), client);
+		if(!job) return NULL;
+		job->access = pending_check.access;
+		if(pending_check.topic){
+			job->topic = mosquitto__strdup(pending_check.topic);
+			if(!job->topic){
+				auth_pool__job_free(job);
+				return NULL;
+			}
+		}
+		pending_check.job = job;
+	}
+	return (struct mosquitto_auth_pending *)pending_check.job->handle;
+}
+
+
+/* mosquitto_acl_check() for a PUBLISH from context, which a version 5 plugin
+ * may leave pending. When the check completes the PUBLISH is handled again
+ * and the result is returned here in place of a second check. */
+int mosquitto_acl_check_publish(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain)
+{
+	struct mosquitto__auth_job *resolved = context->auth_resolved;
+	int rc;
+
+	if(resolved && resolved->access == MOSQ_ACL_WRITE && !strcmp(resolved->topic, topic)){
+		context->auth_resolved = NULL;
+		return resolved->result;
+	}
+
+	if(context->state == mosq_cs_active && !context->auth_job){
+		pending_check.context = context;
+		pending_check.topic = topic;
+		pending_check.access = MOSQ_ACL_WRITE;
+	}
+	rc = mosquitto_acl_check(db, context, topic, payloadlen, payload, qos, retain, MOSQ_ACL_WRITE);
+	return security__pending_result(db, context, rc);
+}
+
+/* Classify a subscription for this client, see enum mosquitto__acl_class.
+ * This mirrors the order of checks in mosquitto_acl_check() for
+ * MOSQ_ACL_READ. */
+enum mosquitto__acl_class mosquitto_acl_classify(struct mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	int rc;
+	int i;
+	struct mosquitto__security_options *opts;
+	struct mosquitto__auth_plugin_config *auth_plugin;
+	const char *username;
+
+	if(!context->id){
+		return acl_class_deny;
+	}
+
+	/* Only a subscription starting with a literal $share can match a topic
+	 * that acl__check_dollar() would deny. */
+	if(!strncmp(sub, "$share", 6)){
+		return acl_class_check;
+	}
+
+	rc = mosquitto_acl_classify_default(db, context, sub);
+	if(rc == MOSQ_ERR_SUCCESS){
+		return acl_class_allow;
+	}else if(rc == MOSQ_ERR_ACL_DENIED){
+		return acl_class_deny;
+	}else if(rc != MOSQ_ERR_PLUGIN_DEFER){
+		return acl_class_check;
+	}
+
+	if(db->config->per_listener_settings){
+		if(!context->listener) return acl_class_check;
+		opts = &context->listener->security_options;
+	}else{
+		opts = &db->config->security_options;
+	}
+
+	username = mosquitto_client_username(context);
+	for(i=0; i<opts->auth_plugin_config_count; i++){
+		auth_plugin = &opts->auth_plugin_configs[i];
+
+		if(auth_plugin->deny_special_chars == true){
+			if((username && strpbrk(username, "+#"))
+					|| strpbrk(context->id, "+#")){
+
+				return acl_class_deny;
+			}
+		}
+		if(auth_plugin->plugin.version != 4 || !auth_plugin->plugin.acl_sub_classify_v4){
+			return acl_class_check;
+		}
+
+		rc = auth_plugin->plugin.acl_sub_classify_v4(auth_plugin->plugin.user_data, context, sub);
+		if(rc == MOSQ_ERR_SUCCESS){
+			return acl_class_allow;
+		}else if(rc == MOSQ_ERR_ACL_DENIED){
+			return acl_class_deny;
+		}else if(rc != MOSQ_ERR_PLUGIN_DEFER){
+			return acl_class_check;
+		}
+	}
+
+	/* No plugins means access is allowed, all plugins deferring means it
+	 * is denied. */
+	if(opts->auth_plugin_config_count == 0){
+		return acl_class_allow;
+	}else{
+		return acl_class_deny;
+	}
+}
+
 int mosquitto_unpwd_check(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password)
 {
 	int rc;
@@ -680,6 +1213,9 @@ int mosquitto_unpwd_check(struct mosquitto_db *db, struct mosquitto *context, co
 	struct mosquitto__security_options *opts;
 
 	rc = mosquitto_unpwd_check_default(db, context, username, password);
+	if(rc == MOSQ_ERR_AUTH_PENDING && context->auth_job){
+		auth_pool__track(db, context->auth_job);
+	}
 	if(rc != MOSQ_ERR_PLUGIN_DEFER){
 		return rc;
 	}
@@ -692,8 +1228,20 @@ int mosquitto_unpwd_check(struct mosquitto_db *db, struct mosquitto *context, co
 		opts = &db->config->security_options;
 	}
 
+	/* Only a CONNECT can wait for its password check. */
+	if(context->state == mosq_cs_new && !context->auth_job
+#ifdef WITH_WEBSOCKETS
+			&& !context->wsi
+#endif
+			){
+		pending_check.context = context;
+		pending_check.topic = NULL;
+		pending_check.access = 0;
+	}
+
 	rc = MOSQ_ERR_SUCCESS;
 	for(i=0; i<opts->auth_plugin_config_count; i++){
+		pending_check.allowed = pending_check.context == context && opts->auth_plugin_configs[i].plugin.async;
 		if(opts->auth_plugin_configs[i].plugin.version == 4 
 				&& opts->auth_plugin_configs[i].plugin.unpwd_check_v4){
 
@@ -718,10 +1266,16 @@ int mosquitto_unpwd_check(struct mosquitto_db *db, struct mosquitto *context, co
 		}else{
 			rc = MOSQ_ERR_INVAL;
 		}
+		pending_check.allowed = false;
+		if(rc != MOSQ_ERR_AUTH_PENDING && pending_check.job){
+			auth_pool__job_abandon(pending_check.job);
+			pending_check.job = NULL;
+		}
 		if(rc != MOSQ_ERR_PLUGIN_DEFER){
-			return rc;
+			return security__pending_result(db, context, rc);
 		}
 	}
+	pending_check.context = NULL;
 	/* If all plugins deferred, this is a denial. If rc == MOSQ_ERR_SUCCESS
 	 * here, then no plugins were configured. */
 	if(rc == MOSQ_ERR_PLUGIN_DEFER){
@@ -16,19 +16,49 @@ Contributors:
 
 #include "config.h"
 
+#ifndef WIN32
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#endif
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#include <sys/stat.h>
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
 #include "mqtt_protocol.h"
+#include "pwfile.h"
 #include "send_mosq.h"
 #include "util_mosq.h"
 
+struct mosquitto__pwfile{
+	const uint8_t *data;
+	size_t len;
+	const struct PWF_slot *slots;
+	uint32_t slot_count;
+	const char *strings;
+	uint32_t strings_len;
+	bool mapped;
+};
+
+/* The most clients to look at in one pass of the main loop after a reload. */
+#define SECURITY_APPLY_BATCH 1000
+
 static int aclfile__parse(struct mosquitto_db *db, struct mosquitto__security_options *security_opts);
-static int unpwd__file_parse(struct mosquitto__unpwd **unpwd, const char *password_file);
+static int aclfile__reload(struct mosquitto_db *db, struct mosquitto__security_options *security_opts, unsigned int generation, bool *changed);
+static int unpwd__reload(struct mosquitto_db *db, struct mosquitto__unpwd **unpwd, struct mosquitto__pwfile **pwfile, const char *password_file, bool reload);
+static int unpwd__file_parse(struct mosquitto__unpwd **unpwd, struct mosquitto__pwfile **pwfile, const char *password_file);
 static int acl__cleanup(struct mosquitto_db *db, bool reload);
+static int acl__expand_patterns(struct mosquitto__security_options *security_opts, struct mosquitto *context);
 static int unpwd__cleanup(struct mosquitto__unpwd **unpwd, bool reload);
+static void pwfile__cleanup(struct mosquitto__pwfile **pwfile);
+static void security__apply_record(struct mosquitto_db *db);
+static void security__apply_reset(struct mosquitto_db *db);
 static int psk__file_parse(struct mosquitto_db *db, struct mosquitto__unpwd **psk_id, const char *psk_file);
 #ifdef WITH_TLS
 static int pw__digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len);
@@ -42,55 +72,38 @@ int mosquitto_security_init_default(struct mosquitto_db *db, bool reload)
 {
 	int rc;
 	int i;
-	char *pwf;
 	char *pskf;
+	unsigned int acl_generation = db->acl_generation + 1;
+	bool acl_changed = false;
+
+	/* Load username/password and acl data if required. The options of
+	 * whichever of the listeners or the global settings aren't in use have no
+	 * files set, so anything left from before a reload is freed. On a reload,
+	 * the old data is compared with the new, so that only the clients
+	 * affected by a change need to be checked again. */
+	for(i=0; i<db->config->listener_count; i++){
+		rc = unpwd__reload(db, &db->config->listeners[i].unpwd, &db->config->listeners[i].pwfile,
+				db->config->listeners[i].security_options.password_file, reload);
+		if(rc) return rc;
+	}
+	rc = unpwd__reload(db, &db->unpwd, &db->pwfile, db->config->security_options.password_file, reload);
+	if(rc) return rc;
 
-	UNUSED(reload);
-
-	/* Load username/password data if required. */
-	if(db->config->per_listener_settings){
-		for(i=0; i<db->config->listener_count; i++){
-			pwf = db->config->listeners[i].security_options.password_file;
-			if(pwf){
-				rc = unpwd__file_parse(&db->config->listeners[i].unpwd, pwf);
-				if(rc){
-					log__printf(NULL, MOSQ_LOG_ERR, "Error opening password file \"%s\".", pwf);
-					return rc;
-				}
-			}
-		}
-	}else{
-		if(db->config->security_options.password_file){
-			pwf = db->config->security_options.password_file;
-			if(pwf){
-				rc = unpwd__file_parse(&db->unpwd, pwf);
-				if(rc){
-					log__printf(NULL, MOSQ_LOG_ERR, "Error opening password file \"%s\".", pwf);
-					return rc;
-				}
-			}
-		}
+	for(i=0; i<db->config->listener_count; i++){
+		rc = aclfile__reload(db, &db->config->listeners[i].security_options, acl_generation, &acl_changed);
+		if(rc) break;
 	}
+	if(rc == MOSQ_ERR_SUCCESS){
+		rc = aclfile__reload(db, &db->config->security_options, acl_generation, &acl_changed);
+	}
+	if(acl_changed){
+		/* Anything checked against the previous ACLs must be checked again. */
+		db->acl_generation = acl_generation;
+	}
+	if(rc) return rc;
 
-	/* Load acl data if required. */
-	if(db->config->per_listener_settings){
-		for(i=0; i<db->config->listener_count; i++){
-			if(db->config->listeners[i].security_options.acl_file){
-				rc = aclfile__parse(db, &db->config->listeners[i].security_options);
-				if(rc){
-					log__printf(NULL, MOSQ_LOG_ERR, "Error opening acl file \"%s\".", db->config->listeners[i].security_options.acl_file);
-					return rc;
-				}
-			}
-		}
-	}else{
-		if(db->config->security_options.acl_file){
-			rc = aclfile__parse(db, &db->config->security_options);
-			if(rc){
-				log__printf(NULL, MOSQ_LOG_ERR, "Error opening acl file \"%s\".", db->config->security_options.acl_file);
-				return rc;
-			}
-		}
+	if(!reload){
+		security__apply_record(db);
 	}
 
 	/* Load psk data if required. */
@@ -124,17 +137,24 @@ int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload)
 	int rc;
 	int i;
 
-	rc = acl__cleanup(db, reload);
-	if(rc != MOSQ_ERR_SUCCESS) return rc;
+	/* On a reload, the ACLs and passwords are kept until the new ones have
+	 * been loaded and compared with them. */
+	if(!reload){
+		rc = acl__cleanup(db, reload);
+		if(rc != MOSQ_ERR_SUCCESS) return rc;
 
-	rc = unpwd__cleanup(&db->unpwd, reload);
-	if(rc != MOSQ_ERR_SUCCESS) return rc;
+		rc = unpwd__cleanup(&db->unpwd, reload);
+		if(rc != MOSQ_ERR_SUCCESS) return rc;
+		pwfile__cleanup(&db->pwfile);
 
-	for(i=0; i<db->config->listener_count; i++){
-		if(db->config->listeners[i].unpwd){
-			rc = unpwd__cleanup(&db->config->listeners[i].unpwd, reload);
-			if(rc != MOSQ_ERR_SUCCESS) return rc;
+		for(i=0; i<db->config->listener_count; i++){
+			if(db->config->listeners[i].unpwd){
+				rc = unpwd__cleanup(&db->config->listeners[i].unpwd, reload);
+				if(rc != MOSQ_ERR_SUCCESS) return rc;
+			}
+			pwfile__cleanup(&db->config->listeners[i].pwfile);
 		}
+		security__apply_reset(db);
 	}
 
 	rc = unpwd__cleanup(&db->psk_id, reload);
@@ -151,9 +171,270 @@ int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload)
 }
 
 
+static struct mosquitto__acl_trie *acl_trie__node_new(const char *level, int level_len)
+{
+	struct mosquitto__acl_trie *node;
+
+	node = mosquitto__calloc(1, sizeof(struct mosquitto__acl_trie));
+	if(!node) return NULL;
+
+	node->level = mosquitto__malloc(level_len+1);
+	if(!node->level){
+		mosquitto__free(node);
+		return NULL;
+	}
+	memcpy(node->level, level, level_len);
+	node->level[level_len] = '\0';
+	node->level_len = level_len;
+
+	return node;
+}
+
+
+static void acl_trie__free(struct mosquitto__acl_trie *node)
+{
+	struct mosquitto__acl_trie *child, *child_tmp;
+
+	if(!node) return;
+
+	HASH_ITER(hh, node->children, child, child_tmp){
+		HASH_DELETE(hh, node->children, child);
+		acl_trie__free(child);
+	}
+	acl_trie__free(node->plus);
+	mosquitto__free(node->level);
+	mosquitto__free(node);
+}
+
+
+/* Topics that are not valid subscriptions can never match anything, so are
+ * left out of the trie altogether. */
+static bool acl_trie__topic_valid(const char *topic)
+{
+	return topic[0] != '\0' && mosquitto_sub_topic_check(topic) == MOSQ_ERR_SUCCESS;
+}
+
+
+/* Add a single, valid, ACL topic to a trie. */
+static int acl_trie__add(struct mosquitto__acl_trie **root, const char *topic, int access)
+{
+	struct mosquitto__acl_trie *node, *child;
+	const char *level, *end;
+	int level_len;
+
+	if(!(*root)){
+		*root = acl_trie__node_new("", 0);
+		if(!(*root)) return MOSQ_ERR_NOMEM;
+	}
+	node = *root;
+
+	level = topic;
+	while(level){
+		end = strchr(level, '/');
+		if(end){
+			level_len = end - level;
+		}else{
+			level_len = strlen(level);
+		}
+
+		if(level_len == 1 && level[0] == '#'){
+			node->hash_access |= access;
+			return MOSQ_ERR_SUCCESS;
+		}else if(level_len == 1 && level[0] == '+'){
+			if(!node->plus){
+				node->plus = acl_trie__node_new(level, level_len);
+				if(!node->plus) return MOSQ_ERR_NOMEM;
+			}
+			child = node->plus;
+		}else{
+			HASH_FIND(hh, node->children, level, level_len, child);
+			if(!child){
+				child = acl_trie__node_new(level, level_len);
+				if(!child) return MOSQ_ERR_NOMEM;
+				HASH_ADD_KEYPTR(hh, node->children, child->level, child->level_len, child);
+			}
+		}
+		node = child;
+
+		if(end){
+			level = end+1;
+		}else{
+			level = NULL;
+		}
+	}
+	node->access |= access;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Walk the trie for the topic level starting at topic, or for the end of the
+ * topic if topic is NULL. Topics beginning with $ are never matched by a
+ * wildcard in the first level. */
+static bool acl_trie__match(const struct mosquitto__acl_trie *node, const char *topic, bool root, int access)
+{
+	const struct mosquitto__acl_trie *child;
+	const char *end, *next;
+	int level_len;
+	bool wild_ok;
+
+	wild_ok = !(root && topic && topic[0] == '$');
+
+	if(wild_ok && (node->hash_access & access)){
+		return true;
+	}
+	if(!topic){
+		return (node->access & access) != 0;
+	}
+
+	end = strchr(topic, '/');
+	if(end){
+		level_len = end - topic;
+		next = end+1;
+	}else{
+		level_len = strlen(topic);
+		next = NULL;
+	}
+
+	HASH_FIND(hh, node->children, topic, level_len, child);
+	if(child && acl_trie__match(child, next, false, access)){
+		return true;
+	}
+	if(wild_ok && node->plus && acl_trie__match(node->plus, next, false, access)){
+		return true;
+	}
+	return false;
+}
+
+
+/* Does any topic below this node have access? At the root, levels beginning
+ * with $ are skipped as they can't be reached by a wildcard. */
+static bool acl_trie__subtree_access(const struct mosquitto__acl_trie *node, bool root, int access)
+{
+	const struct mosquitto__acl_trie *child, *child_tmp;
+
+	HASH_ITER(hh, node->children, child, child_tmp){
+		if(root && child->level[0] == '$') continue;
+		if((child->access | child->hash_access) & access) return true;
+		if(acl_trie__subtree_access(child, false, access)) return true;
+	}
+	if(node->plus){
+		if((node->plus->access | node->plus->hash_access) & access) return true;
+		if(acl_trie__subtree_access(node->plus, false, access)) return true;
+	}
+	return false;
+}
+
+
+/* Is every topic that matches the subscription sub, from this level on,
+ * matched by a single ACL in the trie? */
+static bool acl_trie__covers(const struct mosquitto__acl_trie *node, const char *sub, bool root, int access)
+{
+	const struct mosquitto__acl_trie *child;
+	const char *end, *next;
+	int level_len;
+	bool dollar;
+
+	dollar = root && sub && sub[0] == '$';
+
+	if(!dollar && (node->hash_access & access)){
+		return true;
+	}
+	if(!sub){
+		return (node->access & access) != 0;
+	}
+
+	end = strchr(sub, '/');
+	if(end){
+		level_len = end - sub;
+		next = end+1;
+	}else{
+		level_len = strlen(sub);
+		next = NULL;
+	}
+
+	if(level_len == 1 && sub[0] == '#'){
+		return false;
+	}else if(level_len == 1 && sub[0] == '+'){
+		return node->plus && acl_trie__covers(node->plus, next, false, access);
+	}
+
+	HASH_FIND(hh, node->children, sub, level_len, child);
+	if(child && acl_trie__covers(child, next, false, access)){
+		return true;
+	}
+	if(!dollar && node->plus && acl_trie__covers(node->plus, next, false, access)){
+		return true;
+	}
+	return false;
+}
+
+
+/* Could any topic that matches the subscription sub, from this level on, be
+ * matched by an ACL in the trie? */
+static bool acl_trie__intersects(const struct mosquitto__acl_trie *node, const char *sub, bool root, int access)
+{
+	const struct mosquitto__acl_trie *child, *child_tmp;
+	const char *end, *next;
+	int level_len;
+	bool dollar;
+
+	dollar = root && sub && sub[0] == '$';
+
+	if(!dollar && (node->hash_access & access)){
+		return true;
+	}
+	if(!sub){
+		return (node->access & access) != 0;
+	}
+
+	end = strchr(sub, '/');
+	if(end){
+		level_len = end - sub;
+		next = end+1;
+	}else{
+		level_len = strlen(sub);
+		next = NULL;
+	}
+
+	if(level_len == 1 && sub[0] == '#'){
+		/* "a/#" also matches "a" */
+		if(node->access & access) return true;
+		return acl_trie__subtree_access(node, root, access);
+	}else if(level_len == 1 && sub[0] == '+'){
+		HASH_ITER(hh, node->children, child, child_tmp){
+			if(root && child->level[0] == '$') continue;
+			if(acl_trie__intersects(child, next, false, access)) return true;
+		}
+		return node->plus && acl_trie__intersects(node->plus, next, false, access);
+	}
+
+	HASH_FIND(hh, node->children, sub, level_len, child);
+	if(child && acl_trie__intersects(child, next, false, access)){
+		return true;
+	}
+	if(!dollar && node->plus && acl_trie__intersects(node->plus, next, false, access)){
+		return true;
+	}
+	return false;
+}
+
+
+static struct mosquitto__acl_user *acl__user_find(struct mosquitto__security_options *security_opts, const char *username)
+{
+	struct mosquitto__acl_user *acl_user;
+
+	if(!username){
+		return security_opts->acl_anonymous;
+	}
+	HASH_FIND(hh, security_opts->acl_list, username, strlen(username), acl_user);
+	return acl_user;
+}
+
+
 int add__acl(struct mosquitto__security_options *security_opts, const char *user, const char *topic, int access)
 {
-	struct mosquitto__acl_user *acl_user=NULL, *user_tail;
+	struct mosquitto__acl_user *acl_user;
 	struct mosquitto__acl *acl, *acl_tail;
 	char *local_topic;
 	bool new_user = false;
@@ -165,21 +446,7 @@ int add__acl(struct mosquitto__security_options *security_opts, const char *user
 		return MOSQ_ERR_NOMEM;
 	}
 
-	if(security_opts->acl_list){
-		user_tail = security_opts->acl_list;
-		while(user_tail){
-			if(user == NULL){
-				if(user_tail->username == NULL){
-					acl_user = user_tail;
-					break;
-				}
-			}else if(user_tail->username && !strcmp(user_tail->username, user)){
-				acl_user = user_tail;
-				break;
-			}
-			user_tail = user_tail->next;
-		}
-	}
+	acl_user = acl__user_find(security_opts, user);
 	if(!acl_user){
 		acl_user = mosquitto__malloc(sizeof(struct mosquitto__acl_user));
 		if(!acl_user){
@@ -197,8 +464,8 @@ int add__acl(struct mosquitto__security_options *security_opts, const char *user
 		}else{
 			acl_user->username = NULL;
 		}
-		acl_user->next = NULL;
 		acl_user->acl = NULL;
+		acl_user->trie = NULL;
 	}
 
 	acl = mosquitto__malloc(sizeof(struct mosquitto__acl));
@@ -226,19 +493,18 @@ int add__acl(struct mosquitto__security_options *security_opts, const char *user
 	}
 
 	if(new_user){
-		/* Add to end of list */
-		if(security_opts->acl_list){
-			user_tail = security_opts->acl_list;
-			while(user_tail->next){
-				user_tail = user_tail->next;
-			}
-			user_tail->next = acl_user;
+		if(acl_user->username){
+			HASH_ADD_KEYPTR(hh, security_opts->acl_list, acl_user->username, strlen(acl_user->username), acl_user);
 		}else{
-			security_opts->acl_list = acl_user;
+			security_opts->acl_anonymous = acl_user;
 		}
 	}
 
-	return MOSQ_ERR_SUCCESS;
+	if(!acl_trie__topic_valid(topic)){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: ACL topic '%s' is not valid and will never match.", topic);
+		return MOSQ_ERR_SUCCESS;
+	}
+	return acl_trie__add(&acl_user->trie, topic, access);
 }
 
 int add__acl_pattern(struct mosquitto__security_options *security_opts, const char *topic, int access)
@@ -299,17 +565,33 @@ int add__acl_pattern(struct mosquitto__security_options *security_opts, const ch
 		security_opts->acl_patterns = acl;
 	}
 
+	if(!acl_trie__topic_valid(topic)){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: ACL pattern '%s' is not valid and will never match.", topic);
+	}
+
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Find the ACLs for a client again if they have changed in a reload since
+ * they were found. Only the part that changed is found again, so unless the
+ * pattern ACLs changed this is a single lookup. */
+static int acl__context_refresh(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__security_options *security_opts)
+{
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if(context->acl_list_generation < security_opts->acl_users_generation){
+		context->acl_list = acl__user_find(security_opts, context->username);
+	}
+	if(context->acl_list_generation < security_opts->acl_patterns_generation){
+		rc = acl__expand_patterns(security_opts, context);
+	}
+	context->acl_list_generation = db->acl_generation;
+	return rc;
+}
+
+
 int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
 {
-	char *local_acl;
-	struct mosquitto__acl *acl_root;
-	bool result;
-	int i;
-	int len, tlen, clen, ulen;
-	char *s;
 	struct mosquitto__security_options *security_opts = NULL;
 
 	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
@@ -321,112 +603,79 @@ int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *conte
 	}else{
 		security_opts = &db->config->security_options;
 	}
-	if(!security_opts->acl_file && !security_opts->acl_list && !security_opts->acl_patterns){
+	if(!security_opts->acl_file && !security_opts->acl_list && !security_opts->acl_anonymous && !security_opts->acl_patterns){
 			return MOSQ_ERR_PLUGIN_DEFER;
 	}
 
 	if(access == MOSQ_ACL_SUBSCRIBE) return MOSQ_ERR_SUCCESS; /* FIXME - implement ACL subscription strings. */
+	if(acl__context_refresh(db, context, security_opts)) return MOSQ_ERR_ACL_DENIED;
 	if(!context->acl_list && !security_opts->acl_patterns) return MOSQ_ERR_ACL_DENIED;
 
-	if(context->acl_list){
-		acl_root = context->acl_list->acl;
-	}else{
-		acl_root = NULL;
-	}
-
-	/* Loop through all ACLs for this client. */
-	while(acl_root){
-		/* Loop through the topic looking for matches to this ACL. */
+	/* Only valid topic names can match an ACL. */
+	if(topic[0] == '\0' || strpbrk(topic, "+#")) return MOSQ_ERR_ACL_DENIED;
 
-		/* If subscription starts with $, acl_root->topic must also start with $. */
-		if(topic[0] == '$' && acl_root->topic[0] != '$'){
-			acl_root = acl_root->next;
-			continue;
+	/* Check the ACLs for this client, then the pattern ACLs expanded for it
+	 * when it connected. */
+	if(context->acl_list && context->acl_list->trie){
+		if(acl_trie__match(context->acl_list->trie, topic, true, access)){
+			/* And access is allowed. */
+			return MOSQ_ERR_SUCCESS;
 		}
-		mosquitto_topic_matches_sub(acl_root->topic, topic, &result);
-		if(result){
-			if(access & acl_root->access){
-				/* And access is allowed. */
-				return MOSQ_ERR_SUCCESS;
-			}
+	}
+	if(context->acl_patterns){
+		if(acl_trie__match(context->acl_patterns, topic, true, access)){
+			/* And access is allowed. */
+			return MOSQ_ERR_SUCCESS;
 		}
-		acl_root = acl_root->next;
 	}
 
-	acl_root = security_opts->acl_patterns;
+	return MOSQ_ERR_ACL_DENIED;
+}
 
-	if(acl_root){
-		/* We are using pattern based acls. Check whether the username or
-		 * client id contains a + or # and if so deny access.
-		 *
-		 * Without this, a malicious client may configure its username/client
-		 * id to bypass ACL checks (or have a username/client id that cannot
-		 * publish or receive messages to its own place in the hierarchy).
-		 */
-		if(context->username && strpbrk(context->username, "+#")){
-			log__printf(NULL, MOSQ_LOG_NOTICE, "ACL denying access to client with dangerous username \"%s\"", context->username);
-			return MOSQ_ERR_ACL_DENIED;
-		}
 
-		if(context->id && strpbrk(context->id, "+#")){
-			log__printf(NULL, MOSQ_LOG_NOTICE, "ACL denying access to client with dangerous client id \"%s\"", context->id);
-			return MOSQ_ERR_ACL_DENIED;
-		}
-	}
+/* Decide whether every message matching the subscription sub would be
+ * allowed, or every one denied, for this client, so the READ check can be
+ * skipped when delivering. Returns MOSQ_ERR_NOT_SUPPORTED if each message
+ * must still be checked. */
+int mosquitto_acl_classify_default(struct mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	struct mosquitto__security_options *security_opts = NULL;
 
-	/* Loop through all pattern ACLs. */
-	if(!context->id) return MOSQ_ERR_ACL_DENIED;
-	clen = strlen(context->id);
+	if(!db || !context || !sub) return MOSQ_ERR_INVAL;
+	if(context->bridge) return MOSQ_ERR_SUCCESS;
 
-	while(acl_root){
-		tlen = strlen(acl_root->topic);
+	if(db->config->per_listener_settings){
+		if(!context->listener) return MOSQ_ERR_NOT_SUPPORTED;
+		security_opts = &context->listener->security_options;
+	}else{
+		security_opts = &db->config->security_options;
+	}
+	if(!security_opts->acl_file && !security_opts->acl_list && !security_opts->acl_anonymous && !security_opts->acl_patterns){
+		return MOSQ_ERR_PLUGIN_DEFER;
+	}
+	if(acl__context_refresh(db, context, security_opts)) return MOSQ_ERR_NOT_SUPPORTED;
 
-		if(acl_root->ucount && !context->username){
-			acl_root = acl_root->next;
-			continue;
-		}
+	if(context->acl_list && context->acl_list->trie
+			&& acl_trie__covers(context->acl_list->trie, sub, true, MOSQ_ACL_READ)){
 
-		if(context->username){
-			ulen = strlen(context->username);
-			len = tlen + acl_root->ccount*(clen-2) + acl_root->ucount*(ulen-2);
-		}else{
-			ulen = 0;
-			len = tlen + acl_root->ccount*(clen-2);
-		}
-		local_acl = mosquitto__malloc(len+1);
-		if(!local_acl) return 1; // FIXME
-		s = local_acl;
-		for(i=0; i<tlen; i++){
-			if(i<tlen-1 && acl_root->topic[i] == '%'){
-				if(acl_root->topic[i+1] == 'c'){
-					i++;
-					strncpy(s, context->id, clen);
-					s+=clen;
-					continue;
-				}else if(context->username && acl_root->topic[i+1] == 'u'){
-					i++;
-					strncpy(s, context->username, ulen);
-					s+=ulen;
-					continue;
-				}
-			}
-			s[0] = acl_root->topic[i];
-			s++;
-		}
-		local_acl[len] = '\0';
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(context->acl_patterns
+			&& acl_trie__covers(context->acl_patterns, sub, true, MOSQ_ACL_READ)){
 
-		mosquitto_topic_matches_sub(local_acl, topic, &result);
-		mosquitto__free(local_acl);
-		if(result){
-			if(access & acl_root->access){
-				/* And access is allowed. */
-				return MOSQ_ERR_SUCCESS;
-			}
-		}
+		return MOSQ_ERR_SUCCESS;
+	}
 
-		acl_root = acl_root->next;
+	if(context->acl_list && context->acl_list->trie
+			&& acl_trie__intersects(context->acl_list->trie, sub, true, MOSQ_ACL_READ)){
+
+		return MOSQ_ERR_NOT_SUPPORTED;
 	}
+	if(context->acl_patterns
+			&& acl_trie__intersects(context->acl_patterns, sub, true, MOSQ_ACL_READ)){
 
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
 	return MOSQ_ERR_ACL_DENIED;
 }
 
@@ -565,18 +814,26 @@ static void free__acl(struct mosquitto__acl *acl)
 }
 
 
-static void acl__cleanup_single(struct mosquitto__security_options *security_opts)
+static void acl__user_free(struct mosquitto__acl_user *acl_user)
 {
-	struct mosquitto__acl_user *user_tail;
+	free__acl(acl_user->acl);
+	acl_trie__free(acl_user->trie);
+	mosquitto__free(acl_user->username);
+	mosquitto__free(acl_user);
+}
 
-	while(security_opts->acl_list){
-		user_tail = security_opts->acl_list->next;
 
-		free__acl(security_opts->acl_list->acl);
-		mosquitto__free(security_opts->acl_list->username);
-		mosquitto__free(security_opts->acl_list);
+static void acl__cleanup_single(struct mosquitto__security_options *security_opts)
+{
+	struct mosquitto__acl_user *acl_user, *user_tmp;
 
-		security_opts->acl_list = user_tail;
+	HASH_ITER(hh, security_opts->acl_list, acl_user, user_tmp){
+		HASH_DELETE(hh, security_opts->acl_list, acl_user);
+		acl__user_free(acl_user);
+	}
+	if(security_opts->acl_anonymous){
+		acl__user_free(security_opts->acl_anonymous);
+		security_opts->acl_anonymous = NULL;
 	}
 
 	if(security_opts->acl_patterns){
@@ -586,23 +843,103 @@ static void acl__cleanup_single(struct mosquitto__security_options *security_opt
 }
 
 
-static int acl__cleanup(struct mosquitto_db *db, bool reload)
+static bool acl__list_same(const struct mosquitto__acl *a, const struct mosquitto__acl *b)
 {
-	struct mosquitto *context, *ctxt_tmp;
-	int i;
+	while(a && b){
+		if(a->access != b->access || strcmp(a->topic, b->topic)){
+			return false;
+		}
+		a = a->next;
+		b = b->next;
+	}
+	return a == b;
+}
 
-	UNUSED(reload);
 
-	if(!db) return MOSQ_ERR_INVAL;
+static bool acl__users_same(struct mosquitto__security_options *a, struct mosquitto__security_options *b)
+{
+	struct mosquitto__acl_user *user_a, *user_b, *user_tmp;
 
-	/* As we're freeing ACLs, we must clear context->acl_list to ensure no
-	 * invalid memory accesses take place later.
-	 * This *requires* the ACLs to be reapplied after acl__cleanup()
-	 * is called if we are reloading the config. If this is not done, all 
-	 * access will be denied to currently connected clients.
-	 */
+	if(!a->acl_anonymous != !b->acl_anonymous
+			|| (a->acl_anonymous && !acl__list_same(a->acl_anonymous->acl, b->acl_anonymous->acl))
+			|| HASH_COUNT(a->acl_list) != HASH_COUNT(b->acl_list)){
+
+		return false;
+	}
+	HASH_ITER(hh, a->acl_list, user_a, user_tmp){
+		HASH_FIND(hh, b->acl_list, user_a->username, strlen(user_a->username), user_b);
+		if(!user_b || !acl__list_same(user_a->acl, user_b->acl)){
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/* Load the acl file for one set of security options, replacing any ACLs
+ * loaded before. If the user or pattern ACLs are different from those they
+ * replace, their generation is set to generation and changed is set, so
+ * clients find their ACLs again when they are next checked, rather than all
+ * clients being visited here. */
+static int aclfile__reload(struct mosquitto_db *db, struct mosquitto__security_options *security_opts, unsigned int generation, bool *changed)
+{
+	struct mosquitto__security_options old;
+	struct mosquitto__acl_user *acl_user;
+	int rc;
+
+	memset(&old, 0, sizeof(struct mosquitto__security_options));
+	old.acl_list = security_opts->acl_list;
+	old.acl_anonymous = security_opts->acl_anonymous;
+	old.acl_patterns = security_opts->acl_patterns;
+	security_opts->acl_list = NULL;
+	security_opts->acl_anonymous = NULL;
+	security_opts->acl_patterns = NULL;
+
+	rc = aclfile__parse(db, security_opts);
+	if(rc){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error opening acl file \"%s\".", security_opts->acl_file);
+	}
+
+	if(acl__users_same(&old, security_opts)){
+		/* Clients still point at the old user ACLs, so keep them. */
+		acl_user = security_opts->acl_list;
+		security_opts->acl_list = old.acl_list;
+		old.acl_list = acl_user;
+		acl_user = security_opts->acl_anonymous;
+		security_opts->acl_anonymous = old.acl_anonymous;
+		old.acl_anonymous = acl_user;
+	}else{
+		security_opts->acl_users_generation = generation;
+		*changed = true;
+	}
+	if(!acl__list_same(old.acl_patterns, security_opts->acl_patterns)){
+		security_opts->acl_patterns_generation = generation;
+		*changed = true;
+	}
+	acl__cleanup_single(&old);
+
+	return rc;
+}
+
+
+static int acl__cleanup(struct mosquitto_db *db, bool reload)
+{
+	struct mosquitto *context, *ctxt_tmp;
+	int i;
+
+	UNUSED(reload);
+
+	if(!db) return MOSQ_ERR_INVAL;
+
+	/* As we're freeing ACLs, we must clear context->acl_list to ensure no
+	 * invalid memory accesses take place later.
+	 * This *requires* the ACLs to be reapplied after acl__cleanup()
+	 * is called if we are reloading the config. If this is not done, all 
+	 * access will be denied to currently connected clients.
+	 */
 	HASH_ITER(hh_id, db->contexts_by_id, context, ctxt_tmp){
 		context->acl_list = NULL;
+		acl__context_cleanup(context);
 	}
 
 	if(db->config->per_listener_settings){
@@ -617,9 +954,107 @@ static int acl__cleanup(struct mosquitto_db *db, bool reload)
 }
 
 
+void acl__context_cleanup(struct mosquitto *context)
+{
+	acl_trie__free(context->acl_patterns);
+	context->acl_patterns = NULL;
+}
+
+
+/* Substitute %c and %u in each pattern ACL for this client and compile the
+ * results, so no string building is needed when access is checked. */
+static int acl__expand_patterns(struct mosquitto__security_options *security_opts, struct mosquitto *context)
+{
+	struct mosquitto__acl *acl_root;
+	char *local_acl;
+	int i;
+	int len, tlen, clen, ulen;
+	char *s;
+	int rc;
+
+	acl__context_cleanup(context);
+
+	acl_root = security_opts->acl_patterns;
+	if(!acl_root || !context->id) return MOSQ_ERR_SUCCESS;
+
+	/* Check whether the username or client id contains a + or # and if so
+	 * deny access to all pattern ACLs.
+	 *
+	 * Without this, a malicious client may configure its username/client
+	 * id to bypass ACL checks (or have a username/client id that cannot
+	 * publish or receive messages to its own place in the hierarchy).
+	 */
+	if(context->username && strpbrk(context->username, "+#")){
+		log__printf(NULL, MOSQ_LOG_NOTICE, "ACL denying access to client with dangerous username \"%s\"", context->username);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(context->id && strpbrk(context->id, "+#")){
+		log__printf(NULL, MOSQ_LOG_NOTICE, "ACL denying access to client with dangerous client id \"%s\"", context->id);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	clen = strlen(context->id);
+
+	while(acl_root){
+		tlen = strlen(acl_root->topic);
+
+		if(acl_root->ucount && !context->username){
+			acl_root = acl_root->next;
+			continue;
+		}
+
+		if(context->username){
+			ulen = strlen(context->username);
+			len = tlen + acl_root->ccount*(clen-2) + acl_root->ucount*(ulen-2);
+		}else{
+			ulen = 0;
+			len = tlen + acl_root->ccount*(clen-2);
+		}
+		local_acl = mosquitto__malloc(len+1);
+		if(!local_acl){
+			acl__context_cleanup(context);
+			return MOSQ_ERR_NOMEM;
+		}
+		s = local_acl;
+		for(i=0; i<tlen; i++){
+			if(i<tlen-1 && acl_root->topic[i] == '%'){
+				if(acl_root->topic[i+1] == 'c'){
+					i++;
+					strncpy(s, context->id, clen);
+					s+=clen;
+					continue;
+				}else if(context->username && acl_root->topic[i+1] == 'u'){
+					i++;
+					strncpy(s, context->username, ulen);
+					s+=ulen;
+					continue;
+				}
+			}
+			s[0] = acl_root->topic[i];
+			s++;
+		}
+		local_acl[len] = '\0';
+
+		if(acl_trie__topic_valid(local_acl)){
+			rc = acl_trie__add(&context->acl_patterns, local_acl, acl_root->access);
+			if(rc){
+				mosquitto__free(local_acl);
+				acl__context_cleanup(context);
+				return rc;
+			}
+		}
+		mosquitto__free(local_acl);
+
+		acl_root = acl_root->next;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
 int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context)
 {
-	struct mosquitto__acl_user *acl_tail;
 	struct mosquitto__security_options *security_opts;
 
 	/* Associate user with its ACL, assuming we have ACLs loaded. */
@@ -632,34 +1067,17 @@ int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context)
 		security_opts = &db->config->security_options;
 	}
 
-	if(security_opts->acl_list){
-		acl_tail = security_opts->acl_list;
-		while(acl_tail){
-			if(context->username){
-				if(acl_tail->username && !strcmp(context->username, acl_tail->username)){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}else{
-				if(acl_tail->username == NULL){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}
-			acl_tail = acl_tail->next;
-		}
-	}else{
-		context->acl_list = NULL;
-	}
+	context->acl_list = acl__user_find(security_opts, context->username);
+	context->acl_list_generation = db->acl_generation;
 
-	return MOSQ_ERR_SUCCESS;
+	return acl__expand_patterns(security_opts, context);
 }
 
 
 static int pwfile__parse(const char *file, struct mosquitto__unpwd **root)
 {
 	FILE *pwfile;
-	struct mosquitto__unpwd *unpwd;
+	struct mosquitto__unpwd *unpwd, *found;
 	char buf[256];
 	char *username, *password;
 	int len;
@@ -709,7 +1127,15 @@ static int pwfile__parse(const char *file, struct mosquitto__unpwd **root)
 						len = strlen(unpwd->password);
 					}
 
-					HASH_ADD_KEYPTR(hh, *root, unpwd->username, strlen(unpwd->username), unpwd);
+					HASH_FIND(hh, *root, unpwd->username, strlen(unpwd->username), found);
+					if(found){
+						log__printf(NULL, MOSQ_LOG_NOTICE, "Warning: Duplicate username '%s' in password file '%s', ignoring.", unpwd->username, file);
+						mosquitto__free(unpwd->password);
+						mosquitto__free(unpwd->username);
+						mosquitto__free(unpwd);
+					}else{
+						HASH_ADD_KEYPTR(hh, *root, unpwd->username, strlen(unpwd->username), unpwd);
+					}
 				}else{
 					log__printf(NULL, MOSQ_LOG_NOTICE, "Warning: Invalid line in password file '%s': %s", file, buf);
 					mosquitto__free(unpwd->username);
@@ -795,13 +1221,169 @@ static int unpwd__decode_passwords(struct mosquitto__unpwd **unpwd)
 #endif
 
 
-static int unpwd__file_parse(struct mosquitto__unpwd **unpwd, const char *password_file)
+#ifdef WITH_TLS
+/* Map a compiled password file into memory, or read it in if mapping isn't
+ * available. The header is checked here, the slots as they are used. */
+static int pwfile__load(struct mosquitto__pwfile **pwfile, FILE *fptr, const char *password_file)
+{
+	struct mosquitto__pwfile *pwf;
+	struct PWF_header header;
+	struct stat st;
+	uint8_t *buf;
+	uint64_t expected_len;
+#ifndef WIN32
+	void *map;
+#endif
+
+	if(fstat(fileno(fptr), &st) < 0){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+		return 1;
+	}
+	if((uint64_t)st.st_size < sizeof(struct PWF_header) || (uint64_t)st.st_size > SIZE_MAX){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid compiled password file \"%s\".", password_file);
+		return 1;
+	}
+
+	pwf = mosquitto__calloc(1, sizeof(struct mosquitto__pwfile));
+	if(!pwf) return MOSQ_ERR_NOMEM;
+	pwf->len = (size_t)st.st_size;
+
+#ifndef WIN32
+	map = mmap(NULL, pwf->len, PROT_READ, MAP_SHARED, fileno(fptr), 0);
+	if(map != MAP_FAILED){
+		posix_madvise(map, pwf->len, POSIX_MADV_RANDOM);
+		pwf->data = map;
+		pwf->mapped = true;
+	}else
+#endif
+	{
+		buf = mosquitto__malloc(pwf->len);
+		if(!buf){
+			mosquitto__free(pwf);
+			return MOSQ_ERR_NOMEM;
+		}
+		rewind(fptr);
+		if(fread(buf, 1, pwf->len, fptr) != pwf->len){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+			mosquitto__free(buf);
+			mosquitto__free(pwf);
+			return 1;
+		}
+		pwf->data = buf;
+	}
+
+	memcpy(&header, pwf->data, sizeof(struct PWF_header));
+	header.version = ntohl(header.version);
+	header.entry_count = ntohl(header.entry_count);
+	header.slot_count = ntohl(header.slot_count);
+	header.strings_len = ntohl(header.strings_len);
+
+	expected_len = sizeof(struct PWF_header)
+			+ (uint64_t)header.slot_count*sizeof(struct PWF_slot)
+			+ header.strings_len;
+
+	if(header.version != PWFILE_VERSION){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported compiled password file version %u in \"%s\".",
+				header.version, password_file);
+		pwfile__cleanup(&pwf);
+		return 1;
+	}
+	if(header.slot_count == 0 || (header.slot_count & (header.slot_count-1))
+			|| header.entry_count > header.slot_count
+			|| expected_len != pwf->len){
+
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid compiled password file \"%s\".", password_file);
+		pwfile__cleanup(&pwf);
+		return 1;
+	}
+
+	pwf->slots = (const struct PWF_slot *)(pwf->data + sizeof(struct PWF_header));
+	pwf->slot_count = header.slot_count;
+	pwf->strings = (const char *)(pwf->slots + header.slot_count);
+	pwf->strings_len = header.strings_len;
+
+	*pwfile = pwf;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static const struct PWF_slot *pwfile__find(const struct mosquitto__pwfile *pwfile, const char *username, size_t username_len)
+{
+	const struct PWF_slot *slot;
+	uint32_t hash;
+	uint32_t offset, len;
+	uint32_t i, pos;
+
+	hash = pwfile__hash(username, username_len);
+
+	pos = hash & (pwfile->slot_count-1);
+	for(i=0; i<pwfile->slot_count; i++){
+		slot = &pwfile->slots[pos];
+		len = ntohl(slot->username_len);
+		if(len == 0){
+			return NULL;
+		}
+		offset = ntohl(slot->username_offset);
+		if(ntohl(slot->hash) == hash && len == username_len
+				&& offset <= pwfile->strings_len && len <= pwfile->strings_len - offset
+				&& !memcmp(&pwfile->strings[offset], username, len)){
+
+			return slot;
+		}
+		pos = (pos+1) & (pwfile->slot_count-1);
+	}
+	return NULL;
+}
+#endif
+
+
+static void pwfile__cleanup(struct mosquitto__pwfile **pwfile)
+{
+	if(!(*pwfile)) return;
+
+#ifndef WIN32
+	if((*pwfile)->mapped){
+		munmap((void *)(*pwfile)->data, (*pwfile)->len);
+	}else
+#endif
+	{
+		mosquitto__free((void *)(*pwfile)->data);
+	}
+	mosquitto__free(*pwfile);
+	*pwfile = NULL;
+}
+
+
+static int unpwd__file_parse(struct mosquitto__unpwd **unpwd, struct mosquitto__pwfile **pwfile, const char *password_file)
 {
+	FILE *fptr;
+	char magic[PWFILE_MAGIC_LEN];
+	bool compiled;
 	int rc;
-	if(!unpwd) return MOSQ_ERR_INVAL;
+	if(!unpwd || !pwfile) return MOSQ_ERR_INVAL;
 
 	if(!password_file) return MOSQ_ERR_SUCCESS;
 
+	/* A compiled password file is used in place rather than parsed. */
+	fptr = mosquitto__fopen(password_file, "rb", false);
+	if(!fptr){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open pwfile \"%s\".", password_file);
+		return 1;
+	}
+	compiled = fread(magic, 1, PWFILE_MAGIC_LEN, fptr) == PWFILE_MAGIC_LEN
+			&& !memcmp(magic, PWFILE_MAGIC, PWFILE_MAGIC_LEN);
+	if(compiled){
+#ifdef WITH_TLS
+		rc = pwfile__load(pwfile, fptr, password_file);
+#else
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Compiled password file \"%s\" needs a broker built with TLS support.", password_file);
+		rc = MOSQ_ERR_NOT_SUPPORTED;
+#endif
+		fclose(fptr);
+		return rc;
+	}
+	fclose(fptr);
+
 	rc = pwfile__parse(password_file, unpwd);
 
 #ifdef WITH_TLS
@@ -858,14 +1440,105 @@ static int mosquitto__memcmp_const(const void *a, const void *b, size_t len)
 #endif
 
 
-int mosquitto_unpwd_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password)
-{
-	struct mosquitto__unpwd *u, *tmp;
-	struct mosquitto__unpwd *unpwd_ref;
 #ifdef WITH_TLS
+/* Runs on an auth pool thread, so must only use the job. */
+static int unpwd__job_check(struct mosquitto__auth_job *job)
+{
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int hash_len;
+	int rc;
+
+	rc = pw__digest(job->password, job->salt, job->salt_len, hash, &hash_len);
+	if(rc == MOSQ_ERR_SUCCESS){
+		if(hash_len == job->hash_len && !mosquitto__memcmp_const(job->hash, hash, hash_len)){
+			return MOSQ_ERR_SUCCESS;
+		}else{
+			return MOSQ_ERR_AUTH;
+		}
+	}else{
+		return rc;
+	}
+}
+
+
+/* Pass the digest of a connecting client's password to the auth thread pool,
+ * if there is one. The salt and hash are copied so a reload can't free or
+ * unmap them while the check runs. Returns MOSQ_ERR_AUTH_PENDING if the check
+ * has been queued, or MOSQ_ERR_NOT_SUPPORTED if it should be made straight
+ * away. */
+static int unpwd__queue_check(struct mosquitto_db *db, struct mosquitto *context,
+		const unsigned char *salt, unsigned int salt_len,
+		const unsigned char *pw_hash, unsigned int pw_hash_len,
+		const char *password)
+{
+	struct mosquitto__auth_job *job;
+
+	if(auth_pool__thread_count(db) < 1 || context->state != mosq_cs_new || context->auth_job){
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+#ifdef WITH_WEBSOCKETS
+	if(context->wsi) return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+	if(pw_hash_len > sizeof(job->hash)) return MOSQ_ERR_NOT_SUPPORTED;
+
+	job = auth_pool__job_new(db, context);
+	if(!job) return MOSQ_ERR_NOT_SUPPORTED;
+
+	job->password = mosquitto__strdup(password);
+	job->salt = mosquitto__malloc(salt_len + 1);
+	if(!job->password || !job->salt){
+		auth_pool__job_free(job);
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+	memcpy(job->salt, salt, salt_len);
+	job->salt_len = salt_len;
+	memcpy(job->hash, pw_hash, pw_hash_len);
+	job->hash_len = pw_hash_len;
+	job->check = unpwd__job_check;
+
+	if(auth_pool__queue(db, job)){
+		auth_pool__job_free(job);
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+	context->auth_job = job;
+	return MOSQ_ERR_AUTH_PENDING;
+}
+
+
+static int unpwd__check_hash(struct mosquitto_db *db, struct mosquitto *context,
+		const unsigned char *salt, unsigned int salt_len,
+		const unsigned char *pw_hash, unsigned int pw_hash_len,
+		const char *password)
+{
 	unsigned char hash[EVP_MAX_MD_SIZE];
 	unsigned int hash_len;
 	int rc;
+
+	rc = unpwd__queue_check(db, context, salt, salt_len, pw_hash, pw_hash_len, password);
+	if(rc != MOSQ_ERR_NOT_SUPPORTED){
+		return rc;
+	}
+	rc = pw__digest(password, salt, salt_len, hash, &hash_len);
+	if(rc == MOSQ_ERR_SUCCESS){
+		if(hash_len == pw_hash_len && !mosquitto__memcmp_const(pw_hash, hash, hash_len)){
+			return MOSQ_ERR_SUCCESS;
+		}else{
+			return MOSQ_ERR_AUTH;
+		}
+	}else{
+		return rc;
+	}
+}
+#endif
+
+
+int mosquitto_unpwd_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password)
+{
+	struct mosquitto__unpwd *u;
+	struct mosquitto__unpwd *unpwd_ref;
+	struct mosquitto__pwfile *pwfile_ref;
+#ifdef WITH_TLS
+	const struct PWF_slot *slot;
 #endif
 
 	if(!db) return MOSQ_ERR_INVAL;
@@ -873,11 +1546,13 @@ int mosquitto_unpwd_check_default(struct mosquitto_db *db, struct mosquitto *con
 	if(db->config->per_listener_settings){
 		if(context->bridge) return MOSQ_ERR_SUCCESS;
 		if(!context->listener) return MOSQ_ERR_INVAL;
-		if(!context->listener->unpwd) return MOSQ_ERR_PLUGIN_DEFER;
+		if(!context->listener->unpwd && !context->listener->pwfile) return MOSQ_ERR_PLUGIN_DEFER;
 		unpwd_ref = context->listener->unpwd;
+		pwfile_ref = context->listener->pwfile;
 	}else{
-		if(!db->unpwd) return MOSQ_ERR_PLUGIN_DEFER;
+		if(!db->unpwd && !db->pwfile) return MOSQ_ERR_PLUGIN_DEFER;
 		unpwd_ref = db->unpwd;
+		pwfile_ref = db->pwfile;
 	}
 	if(!username){
 		/* Check must be made only after checking unpwd_ref.
@@ -886,32 +1561,40 @@ int mosquitto_unpwd_check_default(struct mosquitto_db *db, struct mosquitto *con
 		return MOSQ_ERR_AUTH;
 	}
 
-	HASH_ITER(hh, unpwd_ref, u, tmp){
-		if(!strcmp(u->username, username)){
-			if(u->password){
-				if(password){
 #ifdef WITH_TLS
-					rc = pw__digest(password, u->salt, u->salt_len, hash, &hash_len);
-					if(rc == MOSQ_ERR_SUCCESS){
-						if(hash_len == u->password_len && !mosquitto__memcmp_const(u->password, hash, hash_len)){
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							return MOSQ_ERR_AUTH;
-						}
-					}else{
-						return rc;
-					}
+	if(pwfile_ref){
+		slot = pwfile__find(pwfile_ref, username, strlen(username));
+		if(slot && password){
+			return unpwd__check_hash(db, context,
+					slot->salt, PWFILE_SALT_LEN,
+					slot->password, PWFILE_HASH_LEN,
+					password);
+		}
+		return MOSQ_ERR_AUTH;
+	}
 #else
-					if(!strcmp(u->password, password)){
-						return MOSQ_ERR_SUCCESS;
-					}
+	UNUSED(pwfile_ref);
 #endif
-				}else{
-					return MOSQ_ERR_AUTH;
+
+	HASH_FIND(hh, unpwd_ref, username, strlen(username), u);
+	if(u){
+		if(u->password){
+			if(password){
+#ifdef WITH_TLS
+				return unpwd__check_hash(db, context,
+						u->salt, u->salt_len,
+						(unsigned char *)u->password, u->password_len,
+						password);
+#else
+				if(!strcmp(u->password, password)){
+					return MOSQ_ERR_SUCCESS;
 				}
+#endif
 			}else{
-				return MOSQ_ERR_SUCCESS;
+				return MOSQ_ERR_AUTH;
 			}
+		}else{
+			return MOSQ_ERR_SUCCESS;
 		}
 	}
 
@@ -942,6 +1625,153 @@ static int unpwd__cleanup(struct mosquitto__unpwd **root, bool reload)
 }
 
 
+/* Add a user whose connected clients must have their password checked again
+ * after a reload. */
+static int security__apply_add_user(struct mosquitto_db *db, const char *username, size_t len)
+{
+	struct mosquitto__unpwd *u;
+
+	HASH_FIND(hh, db->security_apply.changed_users, username, len, u);
+	if(u) return MOSQ_ERR_SUCCESS;
+
+	u = mosquitto__calloc(1, sizeof(struct mosquitto__unpwd));
+	if(!u) return MOSQ_ERR_NOMEM;
+	u->username = mosquitto__malloc(len+1);
+	if(!u->username){
+		mosquitto__free(u);
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(u->username, username, len);
+	u->username[len] = '\0';
+	HASH_ADD_KEYPTR(hh, db->security_apply.changed_users, u->username, len, u);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Does username have the same password in both sets of password data? */
+static bool unpwd__same(const char *username, size_t len,
+		struct mosquitto__unpwd *old_unpwd, struct mosquitto__pwfile *old_pwfile,
+		struct mosquitto__unpwd *new_unpwd, struct mosquitto__pwfile *new_pwfile)
+{
+	struct mosquitto__unpwd *u;
+#ifdef WITH_TLS
+	const struct PWF_slot *slot;
+	const unsigned char *salt[2], *hash[2];
+	unsigned int salt_len[2], hash_len[2];
+	struct mosquitto__unpwd *unpwd[2];
+	struct mosquitto__pwfile *pwfile[2];
+	int i;
+
+	unpwd[0] = old_unpwd;
+	pwfile[0] = old_pwfile;
+	unpwd[1] = new_unpwd;
+	pwfile[1] = new_pwfile;
+	for(i=0; i<2; i++){
+		if(pwfile[i]){
+			slot = pwfile__find(pwfile[i], username, len);
+			if(!slot) return false;
+			salt[i] = slot->salt;
+			salt_len[i] = PWFILE_SALT_LEN;
+			hash[i] = slot->password;
+			hash_len[i] = PWFILE_HASH_LEN;
+		}else{
+			HASH_FIND(hh, unpwd[i], username, len, u);
+			if(!u) return false;
+			salt[i] = u->salt;
+			salt_len[i] = u->salt_len;
+			hash[i] = (unsigned char *)u->password;
+			hash_len[i] = u->password_len;
+		}
+	}
+	return salt_len[0] == salt_len[1] && hash_len[0] == hash_len[1]
+			&& !memcmp(salt[0], salt[1], salt_len[0])
+			&& !memcmp(hash[0], hash[1], hash_len[0]);
+#else
+	struct mosquitto__unpwd *old_u;
+
+	UNUSED(old_pwfile);
+	UNUSED(new_pwfile);
+
+	HASH_FIND(hh, old_unpwd, username, len, old_u);
+	HASH_FIND(hh, new_unpwd, username, len, u);
+	if(!old_u || !u) return false;
+	if(!old_u->password || !u->password){
+		return old_u->password == u->password;
+	}
+	return !strcmp(old_u->password, u->password);
+#endif
+}
+
+
+/* Compare the password data from before a reload with the new data, and note
+ * the users whose password changed or who were removed, so only their
+ * clients are checked again. If password checks were turned on or off, all
+ * clients are checked. */
+static int unpwd__diff(struct mosquitto_db *db,
+		struct mosquitto__unpwd *old_unpwd, struct mosquitto__pwfile *old_pwfile,
+		struct mosquitto__unpwd *new_unpwd, struct mosquitto__pwfile *new_pwfile)
+{
+	struct mosquitto__unpwd *u, *tmp;
+#ifdef WITH_TLS
+	const struct PWF_slot *slot;
+	uint32_t i, offset, len;
+#endif
+
+	if((old_unpwd || old_pwfile) != (new_unpwd || new_pwfile)){
+		db->security_apply.all = true;
+	}
+	if(db->security_apply.all) return MOSQ_ERR_SUCCESS;
+
+	HASH_ITER(hh, old_unpwd, u, tmp){
+		if(!unpwd__same(u->username, strlen(u->username), old_unpwd, old_pwfile, new_unpwd, new_pwfile)){
+			if(security__apply_add_user(db, u->username, strlen(u->username))) return MOSQ_ERR_NOMEM;
+		}
+	}
+#ifdef WITH_TLS
+	if(old_pwfile){
+		for(i=0; i<old_pwfile->slot_count; i++){
+			slot = &old_pwfile->slots[i];
+			len = ntohl(slot->username_len);
+			offset = ntohl(slot->username_offset);
+			if(len == 0 || offset > old_pwfile->strings_len || len > old_pwfile->strings_len - offset){
+				continue;
+			}
+			if(!unpwd__same(&old_pwfile->strings[offset], len, old_unpwd, old_pwfile, new_unpwd, new_pwfile)){
+				if(security__apply_add_user(db, &old_pwfile->strings[offset], len)) return MOSQ_ERR_NOMEM;
+			}
+		}
+	}
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Load the password file for the global settings or a listener, replacing
+ * any password data loaded before. */
+static int unpwd__reload(struct mosquitto_db *db, struct mosquitto__unpwd **unpwd, struct mosquitto__pwfile **pwfile, const char *password_file, bool reload)
+{
+	struct mosquitto__unpwd *old_unpwd = *unpwd;
+	struct mosquitto__pwfile *old_pwfile = *pwfile;
+	int rc;
+
+	*unpwd = NULL;
+	*pwfile = NULL;
+	rc = unpwd__file_parse(unpwd, pwfile, password_file);
+	if(rc){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error opening password file \"%s\".", password_file);
+	}
+	if(reload){
+		if(rc || unpwd__diff(db, old_unpwd, old_pwfile, *unpwd, *pwfile)){
+			db->security_apply.all = true;
+		}
+	}
+	unpwd__cleanup(&old_unpwd, reload);
+	pwfile__cleanup(&old_pwfile);
+
+	return rc;
+}
+
+
 #ifdef WITH_TLS
 static void security__disconnect_auth(struct mosquitto_db *db, struct mosquitto *context)
 {
@@ -953,219 +1783,287 @@ static void security__disconnect_auth(struct mosquitto_db *db, struct mosquitto
 }
 #endif
 
-/* Apply security settings after a reload.
+/* Check a client against the security settings after a reload.
  * Includes:
  * - Disconnecting anonymous users if appropriate
  * - Disconnecting users with invalid passwords
- * - Reapplying ACLs
- */
-int mosquitto_security_apply_default(struct mosquitto_db *db)
+ * ACLs are found again when they are next checked, see
+ * acl__context_refresh(). */
+static void security__apply_context(struct mosquitto_db *db, struct mosquitto *context)
 {
-	struct mosquitto *context, *ctxt_tmp;
-	struct mosquitto__acl_user *acl_user_tail;
 	bool allow_anonymous;
-	struct mosquitto__security_options *security_opts = NULL;
 #ifdef WITH_TLS
 	int i;
 	X509 *client_cert = NULL;
 	X509_NAME *name;
 	X509_NAME_ENTRY *name_entry;
 	ASN1_STRING *name_asn1 = NULL;
-	struct mosquitto__listener *listener;
 #endif
 
-	if(!db) return MOSQ_ERR_INVAL;
-
-#ifdef WITH_TLS
-	for(i=0; i<db->config->listener_count; i++){
-		listener = &db->config->listeners[i];
-		if(listener && listener->ssl_ctx && (listener->cafile || listener->capath) && listener->crlfile && listener->require_certificate){
-			if(net__tls_server_ctx(listener)){
-				return 1;
-			}
-
-			if(net__tls_load_verify(listener)){
-				return 1;
-			}
+	/* Check for anonymous clients when allow_anonymous is false */
+	if(db->config->per_listener_settings){
+		if(context->listener){
+			allow_anonymous = context->listener->security_options.allow_anonymous;
+		}else{
+			/* Client not currently connected, so defer judgement until it does connect */
+			allow_anonymous = true;
 		}
+	}else{
+		allow_anonymous = db->config->security_options.allow_anonymous;
 	}
-#endif
 
-	HASH_ITER(hh_id, db->contexts_by_id, context, ctxt_tmp){
-		/* Check for anonymous clients when allow_anonymous is false */
-		if(db->config->per_listener_settings){
-			if(context->listener){
-				allow_anonymous = context->listener->security_options.allow_anonymous;
-			}else{
-				/* Client not currently connected, so defer judgement until it does connect */
-				allow_anonymous = true;
-			}
-		}else{
-			allow_anonymous = db->config->security_options.allow_anonymous;
-		}
+	if(!allow_anonymous && !context->username){
+		mosquitto__set_state(context, mosq_cs_disconnecting);
+		do_disconnect(db, context, MOSQ_ERR_AUTH);
+		return;
+	}
 
-		if(!allow_anonymous && !context->username){
+	/* Check for connected clients that are no longer authorised */
+#ifdef WITH_TLS
+	if(context->listener && context->listener->ssl_ctx && (context->listener->use_identity_as_username || context->listener->use_subject_as_username)){
+		/* Client must have either a valid certificate, or valid PSK used as a username. */
+		if(!context->ssl){
+			if(context->protocol == mosq_p_mqtt5){
+				send__disconnect(context, MQTT_RC_ADMINISTRATIVE_ACTION, NULL);
+			}
 			mosquitto__set_state(context, mosq_cs_disconnecting);
 			do_disconnect(db, context, MOSQ_ERR_AUTH);
-			continue;
+			return;
 		}
-
-		/* Check for connected clients that are no longer authorised */
-#ifdef WITH_TLS
-		if(context->listener && context->listener->ssl_ctx && (context->listener->use_identity_as_username || context->listener->use_subject_as_username)){
-			/* Client must have either a valid certificate, or valid PSK used as a username. */
-			if(!context->ssl){
-				if(context->protocol == mosq_p_mqtt5){
-					send__disconnect(context, MQTT_RC_ADMINISTRATIVE_ACTION, NULL);
-				}
-				mosquitto__set_state(context, mosq_cs_disconnecting);
-				do_disconnect(db, context, MOSQ_ERR_AUTH);
-				continue;
-			}
 #ifdef FINAL_WITH_TLS_PSK
-			if(context->listener->psk_hint){
-				/* Client should have provided an identity to get this far. */
-				if(!context->username){
-					security__disconnect_auth(db, context);
-					continue;
-				}
-			}else
+		if(context->listener->psk_hint){
+			/* Client should have provided an identity to get this far. */
+			if(!context->username){
+				security__disconnect_auth(db, context);
+				return;
+			}
+		}else
 #endif /* FINAL_WITH_TLS_PSK */
-			{
-				/* Free existing credentials and then recover them. */
-				mosquitto__free(context->username);
-				context->username = NULL;
-				mosquitto__free(context->password);
-				context->password = NULL;
-
-				client_cert = SSL_get_peer_certificate(context->ssl);
-				if(!client_cert){
-					security__disconnect_auth(db, context);
-					continue;
-				}
-				name = X509_get_subject_name(client_cert);
-				if(!name){
+		{
+			/* Free existing credentials and then recover them. */
+			mosquitto__free(context->username);
+			context->username = NULL;
+			mosquitto__free(context->password);
+			context->password = NULL;
+
+			client_cert = SSL_get_peer_certificate(context->ssl);
+			if(!client_cert){
+				security__disconnect_auth(db, context);
+				return;
+			}
+			name = X509_get_subject_name(client_cert);
+			if(!name){
+				X509_free(client_cert);
+				client_cert = NULL;
+				security__disconnect_auth(db, context);
+				return;
+			}
+			if (context->listener->use_identity_as_username) { //use_identity_as_username
+				i = X509_NAME_get_index_by_NID(name, NID_commonName, -1);
+				if(i == -1){
 					X509_free(client_cert);
 					client_cert = NULL;
 					security__disconnect_auth(db, context);
-					continue;
+					return;
 				}
-				if (context->listener->use_identity_as_username) { //use_identity_as_username
-					i = X509_NAME_get_index_by_NID(name, NID_commonName, -1);
-					if(i == -1){
+				name_entry = X509_NAME_get_entry(name, i);
+				if(name_entry){
+					name_asn1 = X509_NAME_ENTRY_get_data(name_entry);
+					if (name_asn1 == NULL) {
 						X509_free(client_cert);
 						client_cert = NULL;
 						security__disconnect_auth(db, context);
-						continue;
+						return;
 					}
-					name_entry = X509_NAME_get_entry(name, i);
-					if(name_entry){
-						name_asn1 = X509_NAME_ENTRY_get_data(name_entry);
-						if (name_asn1 == NULL) {
-							X509_free(client_cert);
-							client_cert = NULL;
-							security__disconnect_auth(db, context);
-							continue;
-						}
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
-						context->username = mosquitto__strdup((char *) ASN1_STRING_data(name_asn1));
+					context->username = mosquitto__strdup((char *) ASN1_STRING_data(name_asn1));
 #else
-						context->username = mosquitto__strdup((char *) ASN1_STRING_get0_data(name_asn1));
+					context->username = mosquitto__strdup((char *) ASN1_STRING_get0_data(name_asn1));
 #endif
-						if(!context->username){
-							X509_free(client_cert);
-							client_cert = NULL;
-							security__disconnect_auth(db, context);
-							continue;
-						}
-						/* Make sure there isn't an embedded NUL character in the CN */
-						if ((size_t)ASN1_STRING_length(name_asn1) != strlen(context->username)) {
-							X509_free(client_cert);
-							client_cert = NULL;
-							security__disconnect_auth(db, context);
-							continue;
-						}
+					if(!context->username){
+						X509_free(client_cert);
+						client_cert = NULL;
+						security__disconnect_auth(db, context);
+						return;
 					}
-				} else { // use_subject_as_username
-					BIO *subject_bio = BIO_new(BIO_s_mem());
-					X509_NAME_print_ex(subject_bio, X509_get_subject_name(client_cert), 0, XN_FLAG_RFC2253);
-					char *data_start = NULL;
-					long name_length = BIO_get_mem_data(subject_bio, &data_start);
-					char *subject = mosquitto__malloc(sizeof(char)*name_length+1);
-					if(!subject){
-						BIO_free(subject_bio);
+					/* Make sure there isn't an embedded NUL character in the CN */
+					if ((size_t)ASN1_STRING_length(name_asn1) != strlen(context->username)) {
 						X509_free(client_cert);
 						client_cert = NULL;
 						security__disconnect_auth(db, context);
-						continue;
+						return;
 					}
-					memcpy(subject, data_start, name_length);
-					subject[name_length] = '\0';
-					BIO_free(subject_bio);
-					context->username = subject;
 				}
-				if(!context->username){
+			} else { // use_subject_as_username
+				BIO *subject_bio = BIO_new(BIO_s_mem());
+				X509_NAME_print_ex(subject_bio, X509_get_subject_name(client_cert), 0, XN_FLAG_RFC2253);
+				char *data_start = NULL;
+				long name_length = BIO_get_mem_data(subject_bio, &data_start);
+				char *subject = mosquitto__malloc(sizeof(char)*name_length+1);
+				if(!subject){
+					BIO_free(subject_bio);
 					X509_free(client_cert);
 					client_cert = NULL;
 					security__disconnect_auth(db, context);
-					continue;
+					return;
 				}
+				memcpy(subject, data_start, name_length);
+				subject[name_length] = '\0';
+				BIO_free(subject_bio);
+				context->username = subject;
+			}
+			if(!context->username){
 				X509_free(client_cert);
 				client_cert = NULL;
+				security__disconnect_auth(db, context);
+				return;
 			}
-		}else
+			X509_free(client_cert);
+			client_cert = NULL;
+		}
+	}else
 #endif
-		{
-			/* Username/password check only if the identity/subject check not used */
-			if(mosquitto_unpwd_check(db, context, context->username, context->password) != MOSQ_ERR_SUCCESS){
-				mosquitto__set_state(context, mosq_cs_disconnecting);
-				do_disconnect(db, context, MOSQ_ERR_AUTH);
-				continue;
-			}
+	{
+		/* Username/password check only if the identity/subject check not used */
+		if(mosquitto_unpwd_check(db, context, context->username, context->password) != MOSQ_ERR_SUCCESS){
+			mosquitto__set_state(context, mosq_cs_disconnecting);
+			do_disconnect(db, context, MOSQ_ERR_AUTH);
+			return;
 		}
+	}
+
+	if(db->config->per_listener_settings && !context->listener && context->state != mosq_cs_active){
+		mosquitto__set_state(context, mosq_cs_disconnecting);
+		do_disconnect(db, context, MOSQ_ERR_AUTH);
+	}
+}
 
 
-		/* Check for ACLs and apply to user. */
-		if(db->config->per_listener_settings){
-			if(context->listener){
-				security_opts = &context->listener->security_options;
-			}else{
-				if(context->state != mosq_cs_active){
-					mosquitto__set_state(context, mosq_cs_disconnecting);
-					do_disconnect(db, context, MOSQ_ERR_AUTH);
-					continue;
-				}
+/* Record the settings that decide which clients need checking on the next
+ * reload. */
+static void security__apply_record(struct mosquitto_db *db)
+{
+	int i;
+
+	db->security_apply.per_listener_settings = db->config->per_listener_settings;
+	db->config->security_options.applied_allow_anonymous = db->config->security_options.allow_anonymous;
+	for(i=0; i<db->config->listener_count; i++){
+		db->config->listeners[i].security_options.applied_allow_anonymous = db->config->listeners[i].security_options.allow_anonymous;
+	}
+}
+
+
+static void security__apply_reset(struct mosquitto_db *db)
+{
+	unpwd__cleanup(&db->security_apply.changed_users, false);
+	db->security_apply.next = NULL;
+	db->security_apply.all = false;
+}
+
+
+/* Does every client need checking, rather than only those with a changed
+ * password? Auth plugins may have changed anything. */
+static bool security__apply_all_needed(struct mosquitto_db *db, struct mosquitto__security_options *security_opts)
+{
+	return security_opts->auth_plugin_config_count > 0
+		|| (security_opts->allow_anonymous == false && security_opts->applied_allow_anonymous != false);
+}
+
+
+/* Apply security settings after a reload.
+ * The clients to check are worked out from what changed in the reload, and
+ * are checked by mosquitto_security_apply_continue_default() over the
+ * following passes of the main loop. */
+int mosquitto_security_apply_default(struct mosquitto_db *db)
+{
+	struct mosquitto__security_options *security_opts;
+	int i;
+#ifdef WITH_TLS
+	struct mosquitto__listener *listener;
+	struct stat st;
+#endif
+
+	if(!db) return MOSQ_ERR_INVAL;
+
+#ifdef WITH_TLS
+	for(i=0; i<db->config->listener_count; i++){
+		listener = &db->config->listeners[i];
+		if(listener && listener->ssl_ctx && (listener->cafile || listener->capath) && listener->crlfile && listener->require_certificate){
+			/* Only rebuild the TLS context if the CRL has changed. */
+			if(stat(listener->crlfile, &st) == 0 && st.st_mtime == listener->crlfile_mtime){
+				continue;
+			}
+			if(net__tls_server_ctx(listener)){
+				return 1;
+			}
+
+			if(net__tls_load_verify(listener)){
+				return 1;
 			}
-		}else{
-			security_opts = &db->config->security_options;
 		}
+	}
+#endif
 
-		if(security_opts && security_opts->acl_list){
-			acl_user_tail = security_opts->acl_list;
-			while(acl_user_tail){
-				if(acl_user_tail->username){
-					if(context->username){
-						if(!strcmp(acl_user_tail->username, context->username)){
-							context->acl_list = acl_user_tail;
-							break;
-						}
-					}
-				}else{
-					if(!context->username){
-						context->acl_list = acl_user_tail;
-						break;
-					}
-				}
-				acl_user_tail = acl_user_tail->next;
+	if(db->config->per_listener_settings != db->security_apply.per_listener_settings){
+		db->security_apply.all = true;
+	}
+	if(db->config->per_listener_settings){
+		for(i=0; i<db->config->listener_count; i++){
+			security_opts = &db->config->listeners[i].security_options;
+			if(security__apply_all_needed(db, security_opts)){
+				db->security_apply.all = true;
 			}
 		}
+	}else{
+		if(security__apply_all_needed(db, &db->config->security_options)){
+			db->security_apply.all = true;
+		}
+	}
+	security__apply_record(db);
+
+	if(db->security_apply.all || db->security_apply.changed_users){
+		/* Start again from the first client, in case the previous reload
+		 * hasn't finished being applied. */
+		db->security_apply.next = db->contexts_by_id;
+	}
+	if(!db->security_apply.next){
+		security__apply_reset(db);
 	}
 	return MOSQ_ERR_SUCCESS;
 }
 
+
+/* Check the next batch of clients after a reload. Clients whose password
+ * hasn't changed are skipped with a single lookup, but still count towards the
+ * batch so that one pass never walks every client. */
+void mosquitto_security_apply_continue_default(struct mosquitto_db *db)
+{
+	struct mosquitto *context;
+	struct mosquitto__unpwd *u;
+	int count = 0;
+
+	if(!db->security_apply.next) return;
+
+	while(db->security_apply.next && count < SECURITY_APPLY_BATCH){
+		context = db->security_apply.next;
+		db->security_apply.next = context->hh_id.next;
+		count++;
+
+		if(!db->security_apply.all){
+			if(!context->username) continue;
+			HASH_FIND(hh, db->security_apply.changed_users, context->username, strlen(context->username), u);
+			if(!u) continue;
+		}
+		security__apply_context(db, context);
+	}
+	if(!db->security_apply.next){
+		security__apply_reset(db);
+	}
+}
+
 int mosquitto_psk_key_get_default(struct mosquitto_db *db, struct mosquitto *context, const char *hint, const char *identity, char *key, int max_key_len)
 {
-	struct mosquitto__unpwd *u, *tmp;
+	struct mosquitto__unpwd *u;
 	struct mosquitto__unpwd *psk_id_ref = NULL;
 
 	if(!db || !hint || !identity || !key) return MOSQ_ERR_INVAL;
@@ -1180,18 +2078,17 @@ int mosquitto_psk_key_get_default(struct mosquitto_db *db, struct mosquitto *con
 	}
 	if(!psk_id_ref) return MOSQ_ERR_PLUGIN_DEFER;
 
-	HASH_ITER(hh, psk_id_ref, u, tmp){
-		if(!strcmp(u->username, identity)){
-			strncpy(key, u->password, max_key_len);
-			return MOSQ_ERR_SUCCESS;
-		}
+	HASH_FIND(hh, psk_id_ref, identity, strlen(identity), u);
+	if(u){
+		strncpy(key, u->password, max_key_len);
+		return MOSQ_ERR_SUCCESS;
 	}
 
 	return MOSQ_ERR_AUTH;
 }
 
 #ifdef WITH_TLS
-int pw__digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len)
+static int pw__digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len)
 {
 	const EVP_MD *digest;
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
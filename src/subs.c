@@ -65,50 +65,202 @@ struct sub__token {
 };
 
 
-static int subs__send(struct mosquitto_db *db, struct mosquitto__subleaf *leaf, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+/* Rebuild the subscription a hierarchy entry represents and classify it for
+ * the leaf's client. If that isn't possible the leaf is checked per message.
+ *
+ * Each top level entry is repeated as its own first child, and subscriptions
+ * that don't start with $ have an extra "" first level, so neither of those
+ * are part of the subscription. */
+static void subs__acl_classify(struct mosquitto_db *db, struct mosquitto__subhier *hier, struct mosquitto__subleaf *leaf)
+{
+	struct mosquitto__subhier *h;
+	char *sub;
+	int len = 0;
+	int pos;
+	bool first = true;
+
+	for(h=hier; h; h=h->parent){
+		len += h->topic_len + 1;
+	}
+
+	leaf->acl_class = acl_class_check;
+	leaf->acl_generation = db->acl_generation;
+
+	sub = mosquitto__malloc(len+1);
+	if(!sub) return;
+
+	/* Work back from the end. */
+	pos = len;
+	sub[pos] = '\0';
+	for(h=hier; h && h->parent; h=h->parent){
+		if(h->parent->parent == NULL && h->topic_len == 0) break;
+
+		if(!first){
+			pos--;
+			sub[pos] = '/';
+		}
+		first = false;
+		pos -= h->topic_len;
+		memcpy(&sub[pos], h->topic, h->topic_len);
+	}
+
+	leaf->acl_class = mosquitto_acl_classify(db, leaf->context, &sub[pos]);
+	mosquitto__free(sub);
+}
+
+
+void sub__acl_reset(struct mosquitto *context)
+{
+	struct mosquitto__subleaf *leaf;
+	int i;
+
+	for(i=0; i<context->sub_count; i++){
+		if(context->subs[i]){
+			for(leaf=context->subs[i]->subs; leaf; leaf=leaf->next){
+				if(leaf->context == context){
+					leaf->acl_class = acl_class_unknown;
+				}
+			}
+		}
+	}
+	for(i=0; i<context->shared_sub_count; i++){
+		if(context->shared_subs[i]){
+			for(leaf=context->shared_subs[i]->shared->subs; leaf; leaf=leaf->next){
+				if(leaf->context == context){
+					leaf->acl_class = acl_class_unknown;
+				}
+			}
+		}
+	}
+}
+
+
+/* Queue a message for a subscriber that has read access. */
+static int subs__deliver(struct mosquitto_db *db, struct mosquitto__subleaf *leaf, int qos, int retain, struct mosquitto_msg_store *stored)
 {
 	bool client_retain;
 	uint16_t mid;
 	int client_qos, msg_qos;
-	mosquitto_property *properties = NULL;
+
+	client_qos = leaf->qos;
+
+	if(db->config->upgrade_outgoing_qos){
+		msg_qos = client_qos;
+	}else{
+		if(qos > client_qos){
+			msg_qos = client_qos;
+		}else{
+			msg_qos = qos;
+		}
+	}
+	if(msg_qos){
+		mid = mosquitto__mid_generate(leaf->context);
+	}else{
+		mid = 0;
+	}
+	if(leaf->retain_as_published){
+		client_retain = retain;
+	}else{
+		client_retain = false;
+	}
+	if(db__message_insert(db, leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored, leaf->identifier) == 1){
+		return 1;
+	}
+	return 0;
+}
+
+
+static int subs__send(struct mosquitto_db *db, struct mosquitto__subhier *hier, struct mosquitto__subleaf *leaf, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
 	int rc2;
 
-	/* Check for ACL topic access. */
-	rc2 = mosquitto_acl_check(db, leaf->context, topic, stored->payloadlen, UHPA_ACCESS(stored->payload, stored->payloadlen), stored->qos, stored->retain, MOSQ_ACL_READ);
+	/* Check for ACL topic access, unless the subscription means it's always
+	 * allowed or always denied. */
+	if(leaf->acl_class == acl_class_unknown || leaf->acl_generation != db->acl_generation){
+		subs__acl_classify(db, hier, leaf);
+	}
+	if(leaf->acl_class == acl_class_allow){
+		rc2 = MOSQ_ERR_SUCCESS;
+	}else if(leaf->acl_class == acl_class_deny){
+		rc2 = MOSQ_ERR_ACL_DENIED;
+	}else{
+		rc2 = mosquitto_acl_check(db, leaf->context, topic, stored->payloadlen, UHPA_ACCESS(stored->payload, stored->payloadlen), stored->qos, stored->retain, MOSQ_ACL_READ);
+	}
 	if(rc2 == MOSQ_ERR_ACL_DENIED){
 		return MOSQ_ERR_SUCCESS;
 	}else if(rc2 == MOSQ_ERR_SUCCESS){
-		client_qos = leaf->qos;
+		return subs__deliver(db, leaf, qos, retain, stored);
+	}else{
+		return 1; /* Application error */
+	}
+}
 
-		if(db->config->upgrade_outgoing_qos){
-			msg_qos = client_qos;
-		}else{
-			if(qos > client_qos){
-				msg_qos = client_qos;
-			}else{
-				msg_qos = qos;
-			}
-		}
-		if(msg_qos){
-			mid = mosquitto__mid_generate(leaf->context);
-		}else{
-			mid = 0;
+
+static int subs__batch_grow(struct mosquitto__send_batch *batch, int size)
+{
+	struct mosquitto__subleaf **leaves;
+	struct mosquitto **clients;
+	int *results;
+
+	leaves = mosquitto__realloc(batch->leaves, size*sizeof(struct mosquitto__subleaf *));
+	if(!leaves) return MOSQ_ERR_NOMEM;
+	batch->leaves = leaves;
+	clients = mosquitto__realloc(batch->clients, size*sizeof(struct mosquitto *));
+	if(!clients) return MOSQ_ERR_NOMEM;
+	batch->clients = clients;
+	results = mosquitto__realloc(batch->results, size*sizeof(int));
+	if(!results) return MOSQ_ERR_NOMEM;
+	batch->results = results;
+	batch->size = size;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* subs__send() for each of the non-shared subscribers in hier, with the READ
+ * checks that can't be decided from the subscription passed to the auth
+ * plugins in one batch. */
+static int subs__send_batch(struct mosquitto_db *db, struct mosquitto__subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
+	struct mosquitto__send_batch *batch = &db->send_batch;
+	struct mosquitto__subleaf *leaf;
+	int count = 0;
+	int rc = 0;
+	int i;
+
+	for(leaf=hier->subs; leaf; leaf=leaf->next){
+		if(!leaf->context->id || (leaf->no_local && !strcmp(leaf->context->id, source_id))){
+			continue;
 		}
-		if(leaf->retain_as_published){
-			client_retain = retain;
-		}else{
-			client_retain = false;
+		if(leaf->acl_class == acl_class_unknown || leaf->acl_generation != db->acl_generation){
+			subs__acl_classify(db, hier, leaf);
 		}
-		if(leaf->identifier){
-			mosquitto_property_add_varint(&properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, leaf->identifier);
+		if(leaf->acl_class == acl_class_allow){
+			if(subs__deliver(db, leaf, qos, retain, stored)) rc = 1;
+		}else if(leaf->acl_class != acl_class_deny){
+			if(count == batch->size && subs__batch_grow(batch, count ? count*2 : 16)){
+				/* Check this one on its own instead. */
+				if(subs__send(db, hier, leaf, topic, qos, retain, stored)) rc = 1;
+				continue;
+			}
+			batch->leaves[count] = leaf;
+			batch->clients[count] = leaf->context;
+			count++;
 		}
-		if(db__message_insert(db, leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored, properties) == 1){
-			return 1;
+	}
+	if(count == 0) return rc;
+
+	if(mosquitto_acl_check_read_batch(db, batch->clients, count, topic, stored->payloadlen, UHPA_ACCESS(stored->payload, stored->payloadlen), stored->qos, stored->retain, batch->results)){
+		return 1;
+	}
+	for(i=0; i<count; i++){
+		if(batch->results[i] == MOSQ_ERR_SUCCESS){
+			if(subs__deliver(db, batch->leaves[i], qos, retain, stored)) rc = 1;
+		}else if(batch->results[i] != MOSQ_ERR_ACL_DENIED){
+			rc = 1; /* Application error */
 		}
-	}else{
-		return 1; /* Application error */
 	}
-	return 0;
+	return rc;
 }
 
 
@@ -120,7 +272,7 @@ static int subs__shared_process(struct mosquitto_db *db, struct mosquitto__subhi
 
 	HASH_ITER(hh, hier->shared, shared, shared_tmp){
 		leaf = shared->subs;
-		rc2 = subs__send(db, leaf, topic, qos, retain, stored);
+		rc2 = subs__send(db, hier, leaf, topic, qos, retain, stored);
 		/* Remove current from the top, add back to the bottom */
 		DL_DELETE(shared->subs, leaf);
 		DL_APPEND(shared->subs, leaf);
@@ -143,6 +295,7 @@ static int subs__process(struct mosquitto_db *db, struct mosquitto__subhier *hie
 			/* Retained messages count as a persistence change, but only if
 			 * they aren't for $SYS. */
 			db->persistence_changes++;
+			persist__journal_retain(db, stored);
 		}
 #endif
 		if(hier->retained){
@@ -164,17 +317,24 @@ static int subs__process(struct mosquitto_db *db, struct mosquitto__subhier *hie
 
 	rc = subs__shared_process(db, hier, topic, qos, retain, stored);
 
-	leaf = hier->subs;
-	while(source_id && leaf){
-		if(!leaf->context->id || (leaf->no_local && !strcmp(leaf->context->id, source_id))){
-			leaf = leaf->next;
-			continue;
-		}
-		rc2 = subs__send(db, leaf, topic, qos, retain, stored);
+	if(source_id && db->acl_check_batch){
+		rc2 = subs__send_batch(db, hier, source_id, topic, qos, retain, stored);
 		if(rc2){
 			rc = 1;
 		}
-		leaf = leaf->next;
+	}else{
+		leaf = hier->subs;
+		while(source_id && leaf){
+			if(!leaf->context->id || (leaf->no_local && !strcmp(leaf->context->id, source_id))){
+				leaf = leaf->next;
+				continue;
+			}
+			rc2 = subs__send(db, hier, leaf, topic, qos, retain, stored);
+			if(rc2){
+				rc = 1;
+			}
+			leaf = leaf->next;
+		}
 	}
 	if(hier->subs || hier->shared){
 		return rc;
@@ -806,6 +966,8 @@ int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const ch
 
 	if(sub__topic_tokenise(topic, &tokens)) return 1;
 
+	db->flow_hit_count = 0;
+
 	/* Protect this message until we have sent it to all
 	clients - this is required because websockets client calls
 	db__message_write(), which could remove the message if ref_count==0.
@@ -984,7 +1146,6 @@ static int retain__process(struct mosquitto_db *db, struct mosquitto__subhier *b
 	int rc = 0;
 	int qos;
 	uint16_t mid;
-	mosquitto_property *properties = NULL;
 	struct mosquitto_msg_store *retained;
 
 	if(branch->retained->message_expiry_time > 0 && now >= branch->retained->message_expiry_time){
@@ -1020,6 +1181,7 @@ static int retain__process(struct mosquitto_db *db, struct mosquitto__subhier *b
 
 		rc = mosquitto_acl_check(db, &retain_ctxt, retained->topic, retained->payloadlen, UHPA_ACCESS(retained->payload, retained->payloadlen),
 				retained->qos, retained->retain, MOSQ_ACL_WRITE);
+		acl__context_cleanup(&retain_ctxt);
 		if(rc == MOSQ_ERR_ACL_DENIED){
 			return MOSQ_ERR_SUCCESS;
 		}else if(rc != MOSQ_ERR_SUCCESS){
@@ -1038,10 +1200,7 @@ static int retain__process(struct mosquitto_db *db, struct mosquitto__subhier *b
 	}else{
 		mid = 0;
 	}
-	if(subscription_identifier > 0){
-		mosquitto_property_add_varint(&properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, subscription_identifier);
-	}
-	return db__message_insert(db, context, mid, mosq_md_out, qos, true, retained, properties);
+	return db__message_insert(db, context, mid, mosq_md_out, qos, true, retained, subscription_identifier);
 }
 
 static int retain__search(struct mosquitto_db *db, struct mosquitto__subhier *subhier, struct sub__token *tokens, struct mosquitto *context, const char *sub, int sub_qos, uint32_t subscription_identifier, time_t now, int level)
@@ -173,6 +173,13 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
 	static int subscription_count = -1;
 	static int shared_subscription_count = -1;
 	static int retained_count = -1;
+	static unsigned long acl_cache_hits = -1;
+	static unsigned long acl_cache_misses = -1;
+#ifdef WITH_PERSISTENCE
+	static int persistence_saving = -1;
+	static long persistence_save_duration = -1;
+	static long persistence_restore_duration = -1;
+#endif
 
 	static double msgs_received_load1 = 0;
 	static double msgs_received_load5 = 0;
@@ -320,6 +327,42 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
 		sys_tree__update_memory(db, buf);
 #endif
 
+		if(db->config->acl_cache_size > 0){
+			if(acl_cache_hits != db->acl_cache_hits){
+				acl_cache_hits = db->acl_cache_hits;
+				snprintf(buf, BUFLEN, "%lu", acl_cache_hits);
+				db__messages_easy_queue(db, NULL, "$SYS/broker/acl cache/hits", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+			}
+
+			if(acl_cache_misses != db->acl_cache_misses){
+				acl_cache_misses = db->acl_cache_misses;
+				snprintf(buf, BUFLEN, "%lu", acl_cache_misses);
+				db__messages_easy_queue(db, NULL, "$SYS/broker/acl cache/misses", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+			}
+		}
+
+#ifdef WITH_PERSISTENCE
+		if(db->config->persistence){
+			if(persistence_saving != db->persistence_saving){
+				persistence_saving = db->persistence_saving;
+				snprintf(buf, BUFLEN, "%d", persistence_saving);
+				db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/saving", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+			}
+
+			if(persistence_save_duration != db->persistence_save_duration){
+				persistence_save_duration = db->persistence_save_duration;
+				snprintf(buf, BUFLEN, "%ld milliseconds", persistence_save_duration);
+				db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/last save duration", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+			}
+
+			if(persistence_restore_duration != db->persistence_restore_duration){
+				persistence_restore_duration = db->persistence_restore_duration;
+				snprintf(buf, BUFLEN, "%ld milliseconds", persistence_restore_duration);
+				db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/last restore duration", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+			}
+		}
+#endif
+
 		if(msgs_received != g_msgs_received){
 			msgs_received = g_msgs_received;
 			snprintf(buf, BUFLEN, "%lu", msgs_received);
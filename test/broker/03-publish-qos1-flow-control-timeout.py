@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+
+# Test that publisher_flow_control_timeout resumes a publisher paused by a
+# subscriber that never acknowledges its messages, and that messages for that
+# subscriber are then dropped rather than queued without limit.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("max_inflight_messages 1\n")
+        f.write("max_queued_messages 1\n")
+        f.write("publisher_flow_control true\n")
+        f.write("publisher_flow_control_timeout 1\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+sub_connect_packet = mosq_test.gen_connect("flow-timeout-sub", keepalive=keepalive)
+pub_connect_packet = mosq_test.gen_connect("flow-timeout-pub", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(1, "flow/timeout", 1)
+suback_packet = mosq_test.gen_suback(1, 1)
+
+pub_packets = []
+puback_packets = []
+for i in range(1, 6):
+    pub_packets.append(mosq_test.gen_publish("flow/timeout", qos=1, mid=100+i, payload="message%d" % (i)))
+    puback_packets.append(mosq_test.gen_puback(100+i))
+sub_publish_packet = mosq_test.gen_publish("flow/timeout", qos=1, mid=1, payload="message1")
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sub_sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet, port=port, timeout=10)
+    mosq_test.do_send_receive(sub_sock, subscribe_packet, suback_packet, "suback")
+
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port, timeout=10)
+
+    # Message 1 goes in flight, message 2 is queued, message 3 overflows the
+    # queue and the publisher is paused.
+    for i in range(0, 3):
+        mosq_test.do_send_receive(pub_sock, pub_packets[i], puback_packets[i], "puback%d" % (i+1))
+    mosq_test.expect_packet(sub_sock, "publish1", sub_publish_packet)
+
+    # The subscriber never acknowledges, but keeps its connection alive. Once
+    # the timeout has passed the publisher is read from again.
+    pub_sock.send(pub_packets[3])
+    pub_sock.settimeout(1)
+    try:
+        data = pub_sock.recv(10)
+        if len(data) > 0:
+            raise ValueError("publisher not paused")
+    except socket.timeout:
+        pass
+    mosq_test.do_send_receive(sub_sock, pingreq_packet, pingresp_packet, "sub pingresp")
+
+    pub_sock.settimeout(10)
+    mosq_test.expect_packet(pub_sock, "puback4", puback_packets[3])
+
+    # The subscriber's queue is still full, so this is dropped rather than
+    # pausing the publisher again.
+    mosq_test.do_send_receive(pub_sock, pub_packets[4], puback_packets[4], "puback5")
+    mosq_test.do_send_receive(pub_sock, pingreq_packet, pingresp_packet, "pingresp")
+
+    rc = 0
+
+    sub_sock.close()
+    pub_sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
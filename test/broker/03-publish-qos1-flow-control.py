@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+
+# Test whether publisher_flow_control stops the broker reading from a publisher
+# when a subscriber queue is full, rather than dropping messages, and resumes
+# once the subscriber has caught up. A publisher on an unrelated topic must
+# not be paused.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("max_inflight_messages 1\n")
+        f.write("max_queued_messages 1\n")
+        f.write("publisher_flow_control true\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+sub_connect_packet = mosq_test.gen_connect("flow-control-sub", keepalive=keepalive)
+pub_connect_packet = mosq_test.gen_connect("flow-control-pub", keepalive=keepalive)
+other_connect_packet = mosq_test.gen_connect("flow-control-other", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(1, "flow/control", 1)
+suback_packet = mosq_test.gen_suback(1, 1)
+
+pub_packets = []
+puback_packets = []
+sub_packets = []
+sub_puback_packets = []
+for i in range(1, 5):
+    pub_packets.append(mosq_test.gen_publish("flow/control", qos=1, mid=100+i, payload="message%d" % (i)))
+    puback_packets.append(mosq_test.gen_puback(100+i))
+    sub_packets.append(mosq_test.gen_publish("flow/control", qos=1, mid=i, payload="message%d" % (i)))
+    sub_puback_packets.append(mosq_test.gen_puback(i))
+
+other_publish_packet = mosq_test.gen_publish("flow/other", qos=1, mid=200, payload="other")
+other_puback_packet = mosq_test.gen_puback(200)
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sub_sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet, port=port, timeout=10)
+    mosq_test.do_send_receive(sub_sock, subscribe_packet, suback_packet, "suback")
+
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port, timeout=10)
+    other_sock = mosq_test.do_client_connect(other_connect_packet, connack_packet, port=port, timeout=10)
+
+    # Message 1 goes in flight, message 2 is queued, message 3 overflows the
+    # queue but is kept, and the publisher is paused.
+    for i in range(0, 3):
+        mosq_test.do_send_receive(pub_sock, pub_packets[i], puback_packets[i], "puback%d" % (i+1))
+    mosq_test.expect_packet(sub_sock, "publish1", sub_packets[0])
+
+    # Message 4 must not be read whilst the subscriber is backlogged.
+    pub_sock.send(pub_packets[3])
+    pub_sock.settimeout(1)
+    try:
+        data = pub_sock.recv(10)
+        if len(data) > 0:
+            raise ValueError("publisher not paused")
+    except socket.timeout:
+        pass
+    pub_sock.settimeout(10)
+
+    # A publisher whose messages don't reach the subscriber carries on.
+    mosq_test.do_send_receive(other_sock, other_publish_packet, other_puback_packet, "other puback")
+    mosq_test.do_send_receive(other_sock, pingreq_packet, pingresp_packet, "other pingresp")
+
+    # Subscriber catches up, nothing has been dropped.
+    sub_sock.send(sub_puback_packets[0])
+    mosq_test.expect_packet(sub_sock, "publish2", sub_packets[1])
+    sub_sock.send(sub_puback_packets[1])
+    mosq_test.expect_packet(sub_sock, "publish3", sub_packets[2])
+
+    # Queue has drained, so the publisher is read from again.
+    mosq_test.expect_packet(pub_sock, "puback4", puback_packets[3])
+    mosq_test.do_send_receive(pub_sock, pingreq_packet, pingresp_packet, "pingresp")
+
+    sub_sock.send(sub_puback_packets[2])
+    mosq_test.expect_packet(sub_sock, "publish4", sub_packets[3])
+    sub_sock.send(sub_puback_packets[3])
+    mosq_test.do_send_receive(sub_sock, pingreq_packet, pingresp_packet, "pingresp")
+
+    rc = 0
+
+    sub_sock.close()
+    pub_sock.close()
+    other_sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+# Check that cached access decisions are used for repeated publishes and are
+# discarded when the ACL file is reloaded.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+        f.write("acl_cache_size 16\n")
+
+def write_acl(filename, en):
+    with open(filename, 'w') as f:
+        f.write('user username\n')
+        f.write('topic readwrite topic/two\n')
+        if en:
+            f.write('topic readwrite topic/one\n')
+
+keepalive = 60
+connect_packet = mosq_test.gen_connect("acl-check", keepalive=keepalive, username="username")
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid=mid, topic="topic/#", qos=0)
+suback_packet = mosq_test.gen_suback(mid=mid, qos=0)
+
+publish1_packet = mosq_test.gen_publish(topic="topic/one", qos=0, payload="message1")
+publish2_packet = mosq_test.gen_publish(topic="topic/two", qos=0, payload="message2")
+
+rc = 1
+
+port = mosq_test.get_port()
+
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+acl_file = os.path.basename(__file__).replace('.py', '.acl')
+write_acl(acl_file, True)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    for i in range(0, 3):
+        sock.send(publish1_packet)
+        mosq_test.expect_packet(sock, "publish1", publish1_packet)
+        sock.send(publish2_packet)
+        mosq_test.expect_packet(sock, "publish2", publish2_packet)
+
+    # Reload ACLs with topic/one now disabled
+    write_acl(acl_file, False)
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+
+    # Cached decision must not be used
+    sock.send(publish1_packet)
+    mosq_test.do_ping(sock)
+
+    sock.send(publish2_packet)
+    mosq_test.expect_packet(sock, "publish2", publish2_packet)
+
+    sock.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    os.remove(acl_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+        exit(rc)
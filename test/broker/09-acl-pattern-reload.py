@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+
+# Check that pattern ACLs expanded for a connected client are expanded again
+# when the ACL file is reloaded.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+
+def write_acl(filename, en):
+    with open(filename, 'w') as f:
+        f.write('pattern readwrite pattern/%c/one\n')
+        if en:
+            f.write('pattern readwrite pattern/%u/two\n')
+
+keepalive = 60
+connect_packet = mosq_test.gen_connect("acl-check", keepalive=keepalive, username="username")
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid=mid, topic="pattern/#", qos=1)
+suback_packet = mosq_test.gen_suback(mid=mid, qos=1)
+
+mid = 2
+publish1s_packet = mosq_test.gen_publish(topic="pattern/acl-check/one", mid=mid, qos=1, payload="message1")
+puback1s_packet = mosq_test.gen_puback(mid)
+publish1r_packet = mosq_test.gen_publish(topic="pattern/acl-check/one", mid=1, qos=1, payload="message1")
+
+mid = 3
+publish2s_packet = mosq_test.gen_publish(topic="pattern/username/two", mid=mid, qos=1, payload="message2")
+puback2s_packet = mosq_test.gen_puback(mid)
+
+mid = 4
+publish3s_packet = mosq_test.gen_publish(topic="pattern/username/two", mid=mid, qos=1, payload="message3")
+puback3s_packet = mosq_test.gen_puback(mid)
+publish3r_packet = mosq_test.gen_publish(topic="pattern/username/two", mid=2, qos=1, payload="message3")
+
+rc = 1
+
+port = mosq_test.get_port()
+
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+acl_file = os.path.basename(__file__).replace('.py', '.acl')
+write_acl(acl_file, False)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    mosq_test.do_send_receive(sock, publish1s_packet, puback1s_packet, "puback1")
+    mosq_test.expect_packet(sock, "publish1r", publish1r_packet)
+
+    # Not allowed yet, so not delivered
+    mosq_test.do_send_receive(sock, publish2s_packet, puback2s_packet, "puback2")
+    mosq_test.do_ping(sock)
+
+    # Reload ACLs with pattern/%u/two now enabled
+    write_acl(acl_file, True)
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+
+    mosq_test.do_send_receive(sock, publish3s_packet, puback3s_packet, "puback3")
+    mosq_test.expect_packet(sock, "publish3r", publish3r_packet)
+
+    sock.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    os.remove(acl_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+        exit(rc)
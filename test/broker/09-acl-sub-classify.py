@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+
+# Check that subscriptions are classified against the ACL file correctly.
+# A subscription fully covered by a read rule is delivered without per message
+# checks, a partially covered subscription still has each message checked, and
+# a subscription with no matching rule receives nothing.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+
+def write_acl(filename):
+    with open(filename, 'w') as f:
+        f.write('user username\n')
+        f.write('topic read tenant/+/temp\n')
+        f.write('topic write tenant/#\n')
+        f.write('topic write other/#\n')
+
+keepalive = 60
+connect_packet = mosq_test.gen_connect("acl-sub-classify", keepalive=keepalive, username="username")
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe1_packet = mosq_test.gen_subscribe(mid=mid, topic="tenant/42/temp", qos=0)
+suback1_packet = mosq_test.gen_suback(mid=mid, qos=0)
+
+mid = 2
+subscribe2_packet = mosq_test.gen_subscribe(mid=mid, topic="tenant/+/+", qos=0)
+suback2_packet = mosq_test.gen_suback(mid=mid, qos=0)
+
+mid = 3
+subscribe3_packet = mosq_test.gen_subscribe(mid=mid, topic="other/#", qos=0)
+suback3_packet = mosq_test.gen_suback(mid=mid, qos=0)
+
+unsubscribe_packet = mosq_test.gen_unsubscribe(mid=4, topic="tenant/+/+")
+unsuback_packet = mosq_test.gen_unsuback(mid=4)
+
+publish1_packet = mosq_test.gen_publish(topic="tenant/42/temp", qos=0, payload="message1")
+publish2_packet = mosq_test.gen_publish(topic="tenant/42/humidity", qos=0, payload="message2")
+publish3_packet = mosq_test.gen_publish(topic="tenant/7/temp", qos=0, payload="message3")
+publish4_packet = mosq_test.gen_publish(topic="other/topic", qos=0, payload="message4")
+
+rc = 1
+
+port = mosq_test.get_port()
+
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+acl_file = os.path.basename(__file__).replace('.py', '.acl')
+write_acl(acl_file)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+
+    # Fully covered
+    mosq_test.do_send_receive(sock, subscribe1_packet, suback1_packet, "suback1")
+    sock.send(publish1_packet)
+    mosq_test.expect_packet(sock, "publish1", publish1_packet)
+
+    # Partially covered, only tenant/+/temp may be delivered
+    mosq_test.do_send_receive(sock, subscribe2_packet, suback2_packet, "suback2")
+    sock.send(publish2_packet)
+    sock.send(publish3_packet)
+    mosq_test.expect_packet(sock, "publish3", publish3_packet)
+    mosq_test.do_send_receive(sock, unsubscribe_packet, unsuback_packet, "unsuback")
+
+    # Not covered at all
+    mosq_test.do_send_receive(sock, subscribe3_packet, suback3_packet, "suback3")
+    sock.send(publish4_packet)
+    mosq_test.do_ping(sock)
+
+    sock.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    os.remove(acl_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+        exit(rc)
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+
+# Check that wildcard and pattern ACLs allow and deny access correctly.
+
+from mosq_test_helper import *
+
+def write_config(filename, port, per_listener):
+    with open(filename, 'w') as f:
+        f.write("per_listener_settings %s\n" % (per_listener))
+        f.write("port %d\n" % (port))
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+
+def write_acl(filename):
+    with open(filename, 'w') as f:
+        f.write('user username\n')
+        f.write('topic readwrite wild/+/level\n')
+        f.write('topic readwrite tree/#\n')
+        f.write('topic read readonly/#\n')
+        f.write('user catchall\n')
+        f.write('topic readwrite #\n')
+        f.write('pattern readwrite clients/%c/#\n')
+        f.write('pattern readwrite users/%u/+\n')
+
+def single_test(port, client_id, username, topic, expect_deny):
+    keepalive = 60
+    connect_packet = mosq_test.gen_connect(client_id, keepalive=keepalive, username=username)
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    mid = 1
+    subscribe_packet = mosq_test.gen_subscribe(mid=mid, topic=topic, qos=1)
+    suback_packet = mosq_test.gen_suback(mid=mid, qos=1)
+
+    mid = 2
+    publish1s_packet = mosq_test.gen_publish(topic=topic, mid=mid, qos=1, payload="message")
+    puback1s_packet = mosq_test.gen_puback(mid)
+
+    mid=1
+    publish1r_packet = mosq_test.gen_publish(topic=topic, mid=mid, qos=1, payload="message")
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    mosq_test.do_send_receive(sock, publish1s_packet, puback1s_packet, "puback")
+    if expect_deny:
+        mosq_test.do_ping(sock)
+    else:
+        mosq_test.expect_packet(sock, "publish1r", publish1r_packet)
+    sock.close()
+
+def do_test(port, per_listener):
+    rc = 1
+
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    acl_file = os.path.basename(__file__).replace('.py', '.acl')
+    write_config(conf_file, port, per_listener)
+    write_acl(acl_file)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        single_test(port, "acl-check", "username", "wild/a/level", expect_deny=False)
+        single_test(port, "acl-check", "username", "wild//level", expect_deny=False)
+        single_test(port, "acl-check", "username", "wild/a/b/level", expect_deny=True)
+        single_test(port, "acl-check", "username", "wild/level", expect_deny=True)
+        single_test(port, "acl-check", "username", "tree", expect_deny=False)
+        single_test(port, "acl-check", "username", "tree/a/b", expect_deny=False)
+        single_test(port, "acl-check", "username", "treetop", expect_deny=True)
+        single_test(port, "acl-check", "username", "readonly/a", expect_deny=True)
+        single_test(port, "acl-check", "catchall", "any/topic", expect_deny=False)
+        single_test(port, "acl-check", "catchall", "$dollar/topic", expect_deny=True)
+        single_test(port, "acl/check", "username", "clients/acl/check/a", expect_deny=False)
+        single_test(port, "acl/check", "username", "clients/acl/a", expect_deny=True)
+        single_test(port, "acl-check", None, "clients/acl-check", expect_deny=False)
+        single_test(port, "acl-check", "username", "users/username/a", expect_deny=False)
+        single_test(port, "acl-check", "username", "users/username/a/b", expect_deny=True)
+        single_test(port, "acl-check", "username", "users/other/a", expect_deny=True)
+        single_test(port, "acl-check", None, "users//a", expect_deny=True)
+
+        rc = 0
+    finally:
+        os.remove(conf_file)
+        os.remove(acl_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+port = mosq_test.get_port()
+
+do_test(port, "true")
+do_test(port, "false")
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+
+# Check password checks made on the auth thread pool. Several clients connect
+# at once with good and bad passwords, and one client sends a SUBSCRIBE straight
+# after its CONNECT, which must be handled once the CONNECT has completed.
+
+from mosq_test_helper import *
+import base64
+import hashlib
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("password_file %s\n" % (filename.replace('.conf', '.pwfile')))
+        f.write("allow_anonymous false\n")
+        f.write("auth_threads 2\n")
+
+def write_pwfile(filename):
+    with open(filename, 'w') as f:
+        for i in range(5):
+            salt = bytes([i]*12)
+            password = ("password%d" % (i)).encode('utf-8')
+            pw_hash = hashlib.sha512(password + salt).digest()
+            f.write("user%d:$6$%s$%s\n" % (i,
+                base64.b64encode(salt).decode('utf-8'),
+                base64.b64encode(pw_hash).decode('utf-8')))
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+pw_file = os.path.basename(__file__).replace('.py', '.pwfile')
+write_pwfile(pw_file)
+
+rc = 1
+keepalive = 10
+good_connack_packet = mosq_test.gen_connack(rc=0)
+bad_connack_packet = mosq_test.gen_connack(rc=5)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "auth/threads", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    socks = []
+    for i in range(5):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.settimeout(10)
+        sock.connect(("localhost", port))
+        if i % 2 == 0:
+            password = "password%d" % (i)
+        else:
+            password = "wrong%d" % (i)
+        connect_packet = mosq_test.gen_connect("auth-threads-%d" % (i), keepalive=keepalive, username="user%d" % (i), password=password)
+        if i == 0:
+            connect_packet = connect_packet + subscribe_packet
+        sock.send(connect_packet)
+        socks.append(sock)
+
+    for i in range(5):
+        if i % 2 == 0:
+            mosq_test.expect_packet(socks[i], "connack%d" % (i), good_connack_packet)
+        else:
+            mosq_test.expect_packet(socks[i], "connack%d" % (i), bad_connack_packet)
+
+    mosq_test.expect_packet(socks[0], "suback", suback_packet)
+    mosq_test.do_ping(socks[0])
+
+    for sock in socks:
+        sock.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    os.remove(pw_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+
+# Check that a plugin subscription classification is used in place of per
+# message read checks. The plugin denies every per message read on
+# classified/, but allows subscriptions there outright, so messages must still
+# be delivered. Subscriptions elsewhere fall back to per message checks.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("auth_plugin c/auth_plugin_acl_sub_classify.so\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 10
+connect_packet = mosq_test.gen_connect("acl-sub-classify", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe1_packet = mosq_test.gen_subscribe(mid, "classified/#", 0)
+suback1_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 2
+subscribe2_packet = mosq_test.gen_subscribe(mid, "other/#", 0)
+suback2_packet = mosq_test.gen_suback(mid, 0)
+
+publish1_packet = mosq_test.gen_publish("classified/topic", qos=0, payload="message1")
+publish2_packet = mosq_test.gen_publish("other/topic", qos=0, payload="message2")
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, subscribe1_packet, suback1_packet, "suback1")
+    mosq_test.do_send_receive(sock, subscribe2_packet, suback2_packet, "suback2")
+
+    for i in range(0, 2):
+        sock.send(publish1_packet)
+        mosq_test.expect_packet(sock, "publish1", publish1_packet)
+        sock.send(publish2_packet)
+        mosq_test.expect_packet(sock, "publish2", publish2_packet)
+
+    rc = 0
+
+    sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+
+exit(rc)
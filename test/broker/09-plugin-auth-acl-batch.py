@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+
+# Check that read access for the subscribers to a message is checked with the
+# plugin's batch function, which is the only way the test plugin allows reads.
+# The message is published twice, so the second time the decisions come from
+# the ACL cache.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("auth_plugin c/auth_plugin_acl_batch.so\n")
+        f.write("acl_cache_size 16\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 10
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "batch/topic", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish_packet = mosq_test.gen_publish("batch/topic", qos=0, payload="message")
+
+usernames = ["allowed1", "denied", "allowed2", "deferred"]
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    socks = []
+    for username in usernames:
+        connect_packet = mosq_test.gen_connect("acl-batch-%s" % (username), keepalive=keepalive, username=username)
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+        socks.append(sock)
+
+    connect_packet = mosq_test.gen_connect("acl-batch-pub", keepalive=keepalive, username="publisher")
+    pub_sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+
+    for i in range(2):
+        pub_sock.send(publish_packet)
+        mosq_test.do_ping(pub_sock)
+
+        for j in range(len(usernames)):
+            if usernames[j].startswith("allowed"):
+                mosq_test.expect_packet(socks[j], "publish", publish_packet)
+            mosq_test.do_ping(socks[j])
+
+    pub_sock.close()
+    for sock in socks:
+        sock.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+
+# Check password and publish ACL checks that a version 5 plugin leaves pending
+# and completes later from another thread. Packets sent after a pending check
+# must be held back until it completes, and handled in order. A check that is
+# never completed must time out, and completing a check twice must fail.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("auth_plugin c/auth_plugin_async.so\n")
+        f.write("allow_anonymous false\n")
+        f.write("auth_check_timeout 1\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 10
+connack_packet = mosq_test.gen_connack(rc=0)
+
+sub_connect_packet = mosq_test.gen_connect("plugin-async-sub", keepalive=keepalive, username="async-good", password="good")
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "async/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+pub_connect_packet = mosq_test.gen_connect("plugin-async-pub", keepalive=keepalive, username="async-good", password="good")
+publish1_packet = mosq_test.gen_publish("async/deny", qos=1, mid=1, payload="1")
+puback1_packet = mosq_test.gen_puback(1)
+publish2_packet = mosq_test.gen_publish("async/allow", qos=1, mid=2, payload="2")
+puback2_packet = mosq_test.gen_puback(2)
+publish3_packet = mosq_test.gen_publish("async/allow/3", qos=0, payload="3")
+
+publish2_recv_packet = mosq_test.gen_publish("async/allow", qos=0, payload="2")
+publish3_recv_packet = mosq_test.gen_publish("async/allow/3", qos=0, payload="3")
+
+bad_connect_packet = mosq_test.gen_connect("plugin-async-bad", keepalive=keepalive, username="async-bad", password="bad")
+bad_connack_packet = mosq_test.gen_connack(rc=5)
+
+never_connect_packet = mosq_test.gen_connect("plugin-async-never", keepalive=keepalive, username="async-never", password="never")
+never_connack_packet = mosq_test.gen_connack(rc=3)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    # SUBSCRIBE straight after CONNECT, handled once the CONNECT completes.
+    sub_sock = mosq_test.do_client_connect(sub_connect_packet + subscribe_packet, connack_packet, port=port)
+    mosq_test.expect_packet(sub_sock, "suback", suback_packet)
+
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port)
+    pub_sock.send(publish1_packet + publish2_packet + publish3_packet)
+    mosq_test.expect_packet(pub_sock, "puback1", puback1_packet)
+    mosq_test.expect_packet(pub_sock, "puback2", puback2_packet)
+    mosq_test.do_ping(pub_sock)
+
+    mosq_test.expect_packet(sub_sock, "publish2", publish2_recv_packet)
+    mosq_test.expect_packet(sub_sock, "publish3", publish3_recv_packet)
+    mosq_test.do_ping(sub_sock)
+
+    bad_sock = mosq_test.do_client_connect(bad_connect_packet, bad_connack_packet, port=port)
+    bad_sock.close()
+
+    never_sock = mosq_test.do_client_connect(never_connect_packet, never_connack_packet, port=port)
+    never_sock.close()
+
+    pub_sock.close()
+    sub_sock.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if b"auth_plugin_async:" in stde:
+        rc = 1
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+# Check a password file compiled with `mosquitto_passwd -C`. Good and bad
+# passwords and an unknown user are tried, then the file is recompiled with a
+# changed password and reloaded, and a client that connected before the reload
+# must still be connected.
+
+from mosq_test_helper import *
+import base64
+import hashlib
+import signal
+import subprocess
+
+def write_config(filename, port, pw_file):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("password_file %s\n" % (pw_file))
+        f.write("allow_anonymous false\n")
+
+def write_pwfile(filename, compiled_file, passwords):
+    with open(filename, 'w') as f:
+        f.write("# Comment\n")
+        for i in range(len(passwords)):
+            salt = bytes([i]*12)
+            pw_hash = hashlib.sha512(passwords[i].encode('utf-8') + salt).digest()
+            f.write("user%d:$6$%s$%s\n" % (i,
+                base64.b64encode(salt).decode('utf-8'),
+                base64.b64encode(pw_hash).decode('utf-8')))
+        # Duplicates are ignored, the first entry is used.
+        f.write("user0:$6$%s$%s\n" % (
+            base64.b64encode(bytes(12)).decode('utf-8'),
+            base64.b64encode(bytes(64)).decode('utf-8')))
+    subprocess.run(['../../src/mosquitto_passwd', '-C', filename, compiled_file],
+            check=True, stderr=subprocess.DEVNULL)
+
+def do_connect(port, username, password, connack_rc):
+    connect_packet = mosq_test.gen_connect("pwfile-compiled-%s" % (username), keepalive=10, username=username, password=password)
+    connack_packet = mosq_test.gen_connack(rc=connack_rc)
+    return mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+text_file = os.path.basename(__file__).replace('.py', '.pwfile')
+compiled_file = os.path.basename(__file__).replace('.py', '.pwdb')
+write_config(conf_file, port, compiled_file)
+write_pwfile(text_file, compiled_file, ["password0", "password1", "password2"])
+
+rc = 1
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock0 = do_connect(port, "user0", "password0", 0)
+    do_connect(port, "user1", "password1", 0).close()
+    do_connect(port, "user2", "wrong", 5).close()
+    do_connect(port, "unknown", "password0", 5).close()
+
+    write_pwfile(text_file, compiled_file, ["password0", "changed", "password2"])
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+
+    do_connect(port, "user1", "password1", 5).close()
+    do_connect(port, "user1", "changed", 0).close()
+    mosq_test.do_ping(sock0)
+
+    sock0.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    os.remove(text_file)
+    os.remove(compiled_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+
+# Check that reloading the password and ACL files only disconnects clients
+# whose credentials have changed, and that connected clients pick up ACL
+# changes.
+
+from mosq_test_helper import *
+import base64
+import hashlib
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("password_file %s\n" % (filename.replace('.conf', '.pwfile')))
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+        f.write("allow_anonymous false\n")
+
+def write_pwfile(filename, passwords):
+    with open(filename, 'w') as f:
+        for i in range(len(passwords)):
+            salt = bytes([i]*12)
+            pw_hash = hashlib.sha512(passwords[i].encode('utf-8') + salt).digest()
+            f.write("user%d:$6$%s$%s\n" % (i,
+                base64.b64encode(salt).decode('utf-8'),
+                base64.b64encode(pw_hash).decode('utf-8')))
+
+def write_acl(filename, access):
+    with open(filename, 'w') as f:
+        f.write("user user0\n")
+        f.write("topic %s reload/#\n" % (access))
+        f.write("user user1\n")
+        f.write("topic readwrite reload/#\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+pw_file = os.path.basename(__file__).replace('.py', '.pwfile')
+write_pwfile(pw_file, ["password0", "password1"])
+acl_file = os.path.basename(__file__).replace('.py', '.acl')
+write_acl(acl_file, "readwrite")
+
+rc = 1
+keepalive = 60
+connect0_packet = mosq_test.gen_connect("reload-0", keepalive=keepalive, username="user0", password="password0")
+connect1_packet = mosq_test.gen_connect("reload-1", keepalive=keepalive, username="user1", password="password1")
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "reload/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish1_packet = mosq_test.gen_publish("reload/one", qos=0, payload="message1")
+publish2_packet = mosq_test.gen_publish("reload/two", qos=0, payload="message2")
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock0 = mosq_test.do_client_connect(connect0_packet, connack_packet, port=port)
+    sock1 = mosq_test.do_client_connect(connect1_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock0, subscribe_packet, suback_packet, "suback")
+
+    sock0.send(publish1_packet)
+    mosq_test.expect_packet(sock0, "publish1", publish1_packet)
+
+    # user1 gets a new password, user0 keeps its password but loses write access
+    write_pwfile(pw_file, ["password0", "changed1"])
+    write_acl(acl_file, "read")
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+
+    # The client with changed credentials is disconnected
+    sock1.settimeout(5)
+    if sock1.recv(1) != b"":
+        raise ValueError("user1 not disconnected")
+
+    # The unchanged client stays connected, but can no longer publish
+    sock0.send(publish2_packet)
+    mosq_test.do_ping(sock0)
+
+    sock0.close()
+    sock1.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    os.remove(pw_file)
+    os.remove(acl_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+
+# Test whether QoS 1 and 2 messages are acknowledged on a listener using
+# group-commit durability, and are recovered from the journal when the broker
+# is killed as soon as the acknowledgements have been received.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("persistence_durability group-commit\n")
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("persistence_journal true\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect(
+    "persistent-durability-test", keepalive=keepalive, clean_session=False,
+)
+connack_packet = mosq_test.gen_connack(rc=0)
+connack_packet2 = mosq_test.gen_connack(rc=0, flags=1)  # session present
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 530
+subscribe_packet = mosq_test.gen_subscribe(mid, "durability/qos1", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+pub_connect_packet = mosq_test.gen_connect("persistent-durability-pub", keepalive=keepalive)
+
+mid = 300
+publish_packet = mosq_test.gen_publish("durability/qos1", qos=1, mid=mid, payload="queued")
+puback_packet = mosq_test.gen_puback(mid)
+
+mid = 301
+retain_packet = mosq_test.gen_publish("durability/retain", qos=1, mid=mid, payload="retained", retain=True)
+retain_puback_packet = mosq_test.gen_puback(mid)
+
+mid = 302
+publish2_packet = mosq_test.gen_publish("durability/qos1", qos=2, mid=mid, payload="queued2")
+pubrec_packet = mosq_test.gen_pubrec(mid)
+pubrel_packet = mosq_test.gen_pubrel(mid)
+pubcomp_packet = mosq_test.gen_pubcomp(mid)
+
+mid = 1
+publish_packet2 = mosq_test.gen_publish("durability/qos1", qos=1, mid=mid, payload="queued")
+mid = 2
+publish2_packet2 = mosq_test.gen_publish("durability/qos1", qos=1, mid=mid, payload="queued2")
+
+mid = 3
+subscribe_retain_packet = mosq_test.gen_subscribe(mid, "durability/retain", 0)
+suback_retain_packet = mosq_test.gen_suback(mid, 0)
+retain_packet2 = mosq_test.gen_publish("durability/retain", qos=0, payload="retained", retain=True)
+
+def cleanup(port):
+    for f in ['mosquitto-%d.db' % (port), 'mosquitto-%d.db.journal' % (port)]:
+        if os.path.exists(f):
+            os.unlink(f)
+
+cleanup(port)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    sock.send(disconnect_packet)
+    sock.close()
+
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(pub_sock, publish_packet, puback_packet, "puback")
+    mosq_test.do_send_receive(pub_sock, retain_packet, retain_puback_packet, "puback retain")
+    mosq_test.do_send_receive(pub_sock, publish2_packet, pubrec_packet, "pubrec")
+    mosq_test.do_send_receive(pub_sock, pubrel_packet, pubcomp_packet, "pubcomp")
+    pub_sock.close()
+
+    # The acknowledgements mean the messages are in the journal, so stop the
+    # broker straight away without letting it save.
+    broker.send_signal(signal.SIGKILL)
+    broker.wait()
+    broker.communicate()
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet2, timeout=20, port=port)
+    if mosq_test.expect_packet(sock, "publish2", publish_packet2) \
+            and mosq_test.expect_packet(sock, "publish2 qos2", publish2_packet2):
+        mosq_test.do_send_receive(sock, subscribe_retain_packet, suback_retain_packet, "suback retain")
+        if mosq_test.expect_packet(sock, "retain2", retain_packet2):
+            rc = 0
+
+    sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+    cleanup(port)
+
+
+exit(rc)
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+
+# Test whether queued messages are restored correctly after several saves of
+# the persistent database in which some sessions are unchanged and so are
+# copied from the previous save.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+
+def save(broker):
+    broker.send_signal(signal.SIGUSR1)
+    time.sleep(0.5)
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+connack_packet2 = mosq_test.gen_connack(rc=0, flags=1)  # session present
+disconnect_packet = mosq_test.gen_disconnect()
+
+connect_a_packet = mosq_test.gen_connect("persistent-incr-a", keepalive=keepalive, clean_session=False)
+connect_b_packet = mosq_test.gen_connect("persistent-incr-b", keepalive=keepalive, clean_session=False)
+pub_connect_packet = mosq_test.gen_connect("persistent-incr-pub", keepalive=keepalive)
+
+mid = 1
+subscribe_a_packet = mosq_test.gen_subscribe(mid, "incr/a", 1)
+subscribe_b_packet = mosq_test.gen_subscribe(mid, "incr/b", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+mid = 300
+publish_a1_packet = mosq_test.gen_publish("incr/a", qos=1, mid=mid, payload="a1")
+puback_a1_packet = mosq_test.gen_puback(mid)
+mid = 301
+publish_b1_packet = mosq_test.gen_publish("incr/b", qos=1, mid=mid, payload="b1")
+puback_b1_packet = mosq_test.gen_puback(mid)
+mid = 302
+publish_b2_packet = mosq_test.gen_publish("incr/b", qos=1, mid=mid, payload="b2")
+puback_b2_packet = mosq_test.gen_puback(mid)
+
+queued_a1_packet = mosq_test.gen_publish("incr/a", qos=1, mid=1, payload="a1")
+queued_b1_packet = mosq_test.gen_publish("incr/b", qos=1, mid=1, payload="b1")
+queued_b2_packet = mosq_test.gen_publish("incr/b", qos=1, mid=2, payload="b2")
+
+if os.path.exists('mosquitto-%d.db' % (port)):
+    os.unlink('mosquitto-%d.db' % (port))
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    for (connect_packet, subscribe_packet) in [(connect_a_packet, subscribe_a_packet), (connect_b_packet, subscribe_b_packet)]:
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+        sock.send(disconnect_packet)
+        sock.close()
+
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(pub_sock, publish_a1_packet, puback_a1_packet, "puback a1")
+    mosq_test.do_send_receive(pub_sock, publish_b1_packet, puback_b1_packet, "puback b1")
+    save(broker)
+
+    # Only the session of b changes, a is copied from the last save.
+    mosq_test.do_send_receive(pub_sock, publish_b2_packet, puback_b2_packet, "puback b2")
+    save(broker)
+
+    # Neither changes.
+    save(broker)
+    pub_sock.close()
+
+    # Restore from the last save only.
+    broker.send_signal(signal.SIGKILL)
+    broker.wait()
+    broker.communicate()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    sock_a = mosq_test.do_client_connect(connect_a_packet, connack_packet2, timeout=20, port=port)
+    sock_b = mosq_test.do_client_connect(connect_b_packet, connack_packet2, timeout=20, port=port)
+    if mosq_test.expect_packet(sock_a, "a1", queued_a1_packet) \
+            and mosq_test.expect_packet(sock_b, "b1", queued_b1_packet) \
+            and mosq_test.expect_packet(sock_b, "b2", queued_b2_packet):
+        rc = 0
+
+    sock_a.close()
+    sock_b.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+    if os.path.exists('mosquitto-%d.db' % (port)):
+        os.unlink('mosquitto-%d.db' % (port))
+
+
+exit(rc)
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+
+# Test whether changes made since the last save of the persistent database are
+# recovered from the journal when the broker is killed rather than stopped
+# cleanly.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("persistence_journal true\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect(
+    "persistent-journal-test", keepalive=keepalive, clean_session=False,
+)
+connack_packet = mosq_test.gen_connack(rc=0)
+connack_packet2 = mosq_test.gen_connack(rc=0, flags=1)  # session present
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 530
+subscribe_packet = mosq_test.gen_subscribe(mid, "journal/qos1", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+pub_connect_packet = mosq_test.gen_connect("persistent-journal-pub", keepalive=keepalive)
+
+mid = 300
+publish_packet = mosq_test.gen_publish("journal/qos1", qos=1, mid=mid, payload="queued")
+puback_packet = mosq_test.gen_puback(mid)
+
+mid = 301
+retain_packet = mosq_test.gen_publish("journal/retain", qos=1, mid=mid, payload="retained", retain=True)
+retain_puback_packet = mosq_test.gen_puback(mid)
+
+mid = 1
+publish_packet2 = mosq_test.gen_publish("journal/qos1", qos=1, mid=mid, payload="queued")
+
+mid = 2
+subscribe_retain_packet = mosq_test.gen_subscribe(mid, "journal/retain", 0)
+suback_retain_packet = mosq_test.gen_suback(mid, 0)
+retain_packet2 = mosq_test.gen_publish("journal/retain", qos=0, payload="retained", retain=True)
+
+def cleanup(port):
+    for f in ['mosquitto-%d.db' % (port), 'mosquitto-%d.db.journal' % (port)]:
+        if os.path.exists(f):
+            os.unlink(f)
+
+cleanup(port)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    sock.send(disconnect_packet)
+    sock.close()
+
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(pub_sock, publish_packet, puback_packet, "puback")
+    mosq_test.do_send_receive(pub_sock, retain_packet, retain_puback_packet, "puback retain")
+    pub_sock.close()
+
+    # Give the broker a chance to pass the journal to the OS, then stop it
+    # without letting it save.
+    time.sleep(0.5)
+    broker.send_signal(signal.SIGKILL)
+    broker.wait()
+    broker.communicate()
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet2, timeout=20, port=port)
+    if mosq_test.expect_packet(sock, "publish2", publish_packet2):
+        mosq_test.do_send_receive(sock, subscribe_retain_packet, suback_retain_packet, "suback retain")
+        if mosq_test.expect_packet(sock, "retain2", retain_packet2):
+            rc = 0
+
+    sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+    cleanup(port)
+
+
+exit(rc)
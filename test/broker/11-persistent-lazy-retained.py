@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+
+# Test whether large retained messages restored with persistence_lazy_retained
+# are delivered correctly, and can be replaced and saved again.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("persistence_lazy_retained true\n")
+
+def restart_broker(broker, port):
+    broker.terminate()
+    broker.wait()
+    broker.communicate()
+    return mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistent-lazy-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+large_payload = "L" * 1000
+replaced_payload = "R" * 2000
+
+mid = 300
+large_packet = mosq_test.gen_publish("lazy/large", qos=1, mid=mid, payload=large_payload, retain=True)
+large_puback_packet = mosq_test.gen_puback(mid)
+
+mid = 301
+small_packet = mosq_test.gen_publish("lazy/small", qos=1, mid=mid, payload="small", retain=True)
+small_puback_packet = mosq_test.gen_puback(mid)
+
+mid = 302
+replace_packet = mosq_test.gen_publish("lazy/large", qos=1, mid=mid, payload=replaced_payload, retain=True)
+replace_puback_packet = mosq_test.gen_puback(mid)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "lazy/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+large_retained_packet = mosq_test.gen_publish("lazy/large", qos=0, payload=large_payload, retain=True)
+small_retained_packet = mosq_test.gen_publish("lazy/small", qos=0, payload="small", retain=True)
+replaced_retained_packet = mosq_test.gen_publish("lazy/large", qos=0, payload=replaced_payload, retain=True)
+
+if os.path.exists('mosquitto-%d.db' % (port)):
+    os.unlink('mosquitto-%d.db' % (port))
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, large_packet, large_puback_packet, "puback large")
+    mosq_test.do_send_receive(sock, small_packet, small_puback_packet, "puback small")
+    sock.close()
+
+    broker = restart_broker(broker, port)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    if mosq_test.expect_packet(sock, "large", large_retained_packet) \
+            and mosq_test.expect_packet(sock, "small", small_retained_packet):
+
+        # Replace the payload that is held in the mapped file.
+        sock.close()
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_send_receive(sock, replace_packet, replace_puback_packet, "puback replace")
+        sock.close()
+
+        broker = restart_broker(broker, port)
+
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback 2")
+        if mosq_test.expect_packet(sock, "replaced", replaced_retained_packet) \
+                and mosq_test.expect_packet(sock, "small 2", small_retained_packet):
+            rc = 0
+
+    sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+    if os.path.exists('mosquitto-%d.db' % (port)):
+        os.unlink('mosquitto-%d.db' % (port))
+
+
+exit(rc)
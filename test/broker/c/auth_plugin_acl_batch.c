@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <string.h>
+#include <mosquitto.h>
+#include <mosquitto_broker.h>
+#include <mosquitto_plugin.h>
+
+int mosquitto_auth_plugin_version(void)
+{
+	return MOSQ_AUTH_PLUGIN_VERSION;
+}
+
+int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_init(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Reads are only allowed through the batch check, so a message that is
+ * delivered shows the batch was used. */
+int mosquitto_auth_acl_check(void *user_data, int access, struct mosquitto *client, const struct mosquitto_acl_msg *msg)
+{
+	if(access == MOSQ_ACL_READ){
+		return MOSQ_ERR_ACL_DENIED;
+	}else{
+		return MOSQ_ERR_SUCCESS;
+	}
+}
+
+int mosquitto_auth_acl_check_batch(void *user_data, int access, struct mosquitto **clients, int client_count, const struct mosquitto_acl_msg *msg, int *results)
+{
+	const char *username;
+	int i;
+
+	if(access != MOSQ_ACL_READ || client_count < 1) return MOSQ_ERR_INVAL;
+
+	for(i=0; i<client_count; i++){
+		username = mosquitto_client_username(clients[i]);
+		if(username && !strcmp(username, "denied")){
+			results[i] = MOSQ_ERR_ACL_DENIED;
+		}else if(username && !strcmp(username, "deferred")){
+			results[i] = MOSQ_ERR_PLUGIN_DEFER;
+		}else{
+			results[i] = MOSQ_ERR_SUCCESS;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_unpwd_check(void *user_data, struct mosquitto *client, const char *username, const char *password)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_psk_key_get(void *user_data, struct mosquitto *client, const char *hint, const char *identity, char *key, int max_key_len)
+{
+	return MOSQ_ERR_AUTH;
+}
@@ -0,0 +1,108 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mosquitto.h>
+#include <mosquitto_broker.h>
+#include <mosquitto_plugin.h>
+
+struct completion{
+	struct mosquitto_auth_pending *handle;
+	int result;
+};
+
+static void *complete_later(void *userdata)
+{
+	struct completion *c = userdata;
+
+	usleep(100000);
+	mosquitto_auth_pending_complete(c->handle, c->result);
+	/* A handle can only be completed once. */
+	if(mosquitto_auth_pending_complete(c->handle, c->result) != MOSQ_ERR_INVAL){
+		fprintf(stderr, "auth_plugin_async: handle completed twice\n");
+	}
+	free(c);
+	return NULL;
+}
+
+/* Complete the check being made for client with result from another thread,
+ * or return result straight away if it can't be left pending. */
+static int pending(struct mosquitto *client, int result, int complete)
+{
+	struct completion *c;
+	pthread_t thread;
+
+	c = malloc(sizeof(struct completion));
+	if(!c) return MOSQ_ERR_NOMEM;
+	c->handle = mosquitto_auth_pending_new(client);
+	c->result = result;
+	if(!c->handle){
+		free(c);
+		return result;
+	}
+	if(!complete){
+		free(c);
+		return MOSQ_ERR_AUTH_PENDING;
+	}
+	if(pthread_create(&thread, NULL, complete_later, c)){
+		free(c);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	pthread_detach(thread);
+	return MOSQ_ERR_AUTH_PENDING;
+}
+
+int mosquitto_auth_plugin_version(void)
+{
+	return MOSQ_AUTH_PLUGIN_VERSION;
+}
+
+int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_init(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_acl_check(void *user_data, int access, struct mosquitto *client, const struct mosquitto_acl_msg *msg)
+{
+	if(access == MOSQ_ACL_WRITE && !strncmp(msg->topic, "async/allow", strlen("async/allow"))){
+		return pending(client, MOSQ_ERR_SUCCESS, 1);
+	}else if(access == MOSQ_ACL_WRITE && !strcmp(msg->topic, "async/deny")){
+		return pending(client, MOSQ_ERR_ACL_DENIED, 1);
+	}else{
+		return MOSQ_ERR_SUCCESS;
+	}
+}
+
+int mosquitto_auth_unpwd_check(void *user_data, struct mosquitto *client, const char *username, const char *password)
+{
+	if(!username){
+		return MOSQ_ERR_AUTH;
+	}else if(!strcmp(username, "async-good") && password && !strcmp(password, "good")){
+		return pending(client, MOSQ_ERR_SUCCESS, 1);
+	}else if(!strcmp(username, "async-never")){
+		return pending(client, MOSQ_ERR_SUCCESS, 0);
+	}else{
+		return pending(client, MOSQ_ERR_AUTH, 1);
+	}
+}
+
+int mosquitto_auth_psk_key_get(void *user_data, struct mosquitto *client, const char *hint, const char *identity, char *key, int max_key_len)
+{
+	return MOSQ_ERR_AUTH;
+}
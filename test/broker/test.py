@@ -81,6 +81,8 @@ tests = [
     (1, './03-publish-dollar.py'),
     (1, './03-publish-invalid-utf8.py'),
     (1, './03-publish-long-topic.py'),
+    (1, './03-publish-qos1-flow-control-timeout.py'),
+    (1, './03-publish-qos1-flow-control.py'),
     (1, './03-publish-qos1-no-subscribers-v5.py'),
     (1, './03-publish-qos1-retain-disabled.py'),
     (1, './03-publish-qos1.py'),
@@ -143,17 +145,24 @@ tests = [
     (3, './08-tls-psk-bridge.py'),
 
     (1, './09-acl-access-variants.py'),
+    (1, './09-acl-cache.py'),
     (1, './09-acl-change.py'),
     (1, './09-acl-empty-file.py'),
+    (1, './09-acl-pattern-reload.py'),
+    (1, './09-acl-sub-classify.py'),
+    (1, './09-acl-wildcards.py'),
     (1, './09-auth-bad-method.py'),
+    (1, './09-auth-threads.py'),
     (1, './09-extended-auth-change-username.py'),
     (1, './09-extended-auth-multistep-reauth.py'),
     (1, './09-extended-auth-multistep.py'),
     (1, './09-extended-auth-single.py'),
     (1, './09-extended-auth-unsupported.py'),
+    (1, './09-plugin-auth-acl-batch.py'),
     (1, './09-plugin-auth-acl-pub.py'),
     (1, './09-plugin-auth-acl-sub-denied.py'),
     (1, './09-plugin-auth-acl-sub.py'),
+    (1, './09-plugin-auth-async.py'),
     (1, './09-plugin-auth-context-params.py'),
     (1, './09-plugin-auth-defer-unpwd-fail.py'),
     (1, './09-plugin-auth-defer-unpwd-success.py'),
@@ -162,11 +171,19 @@ tests = [
     (1, './09-plugin-auth-unpwd-success.py'),
     (1, './09-plugin-auth-v2-unpwd-fail.py'),
     (1, './09-plugin-auth-v2-unpwd-success.py'),
+    (1, './09-plugin-acl-sub-classify.py'),
+    (1, './09-pwfile-compiled.py'),
     (1, './09-pwfile-parse-invalid.py'),
+    (1, './09-pwfile-reload.py'),
 
     (2, './10-listener-mount-point.py'),
 
     (1, './11-message-expiry.py'),
+    (1, './11-persistent-background.py'),
+    (1, './11-persistent-durability.py'),
+    (1, './11-persistent-incremental.py'),
+    (1, './11-persistent-journal.py'),
+    (1, './11-persistent-lazy-retained.py'),
     (1, './11-persistent-subscription.py'),
     (1, './11-persistent-subscription-v5.py'),
     (1, './11-persistent-subscription-no-local.py'),
@@ -0,0 +1,277 @@
+/* Benchmark for the built in authentication and ACL lookups.
+ *
+ * Generates a password file, a PSK file and an ACL file with a given number
+ * of users, loads them with mosquitto_security_init_default(), then times
+ * the lookups a broker makes when a client connects:
+ * mosquitto_unpwd_check_default() followed by acl__find_acls(). PSK identity
+ * lookups with mosquitto_psk_key_get_default() are timed separately. Clients
+ * are picked from the whole user list in a fixed pseudo random order, so each
+ * run makes the same lookups.
+ *
+ * Run with no arguments for the defaults, or see print_usage(). With --csv
+ * the output can be kept and compared between builds. */
+
+#define WITH_BROKER
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "mosquitto_broker_internal.h"
+
+static int connects = 100000;
+static bool per_listener = false;
+static bool csv = false;
+static uint32_t user_seed = 1;
+
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+
+static int next_user(int users)
+{
+	user_seed = user_seed*1103515245 + 12345;
+	return (user_seed>>8) % users;
+}
+
+
+/* Write a password in the same format as mosquitto_passwd. */
+static int write_password(FILE *fptr, int user)
+{
+	unsigned char salt[12];
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int hash_len;
+	char salt64[64], hash64[128];
+	char password[64];
+	EVP_MD_CTX *context;
+	int i;
+
+	for(i=0; i<12; i++){
+		salt[i] = (unsigned char)(user*31 + i);
+	}
+	snprintf(password, sizeof(password), "password%d", user);
+
+	context = EVP_MD_CTX_new();
+	if(!context) return 1;
+	EVP_DigestInit_ex(context, EVP_sha512(), NULL);
+	EVP_DigestUpdate(context, password, strlen(password));
+	EVP_DigestUpdate(context, salt, sizeof(salt));
+	EVP_DigestFinal_ex(context, hash, &hash_len);
+	EVP_MD_CTX_free(context);
+
+	EVP_EncodeBlock((unsigned char *)salt64, salt, sizeof(salt));
+	EVP_EncodeBlock((unsigned char *)hash64, hash, hash_len);
+	return fprintf(fptr, "user%d:$6$%s$%s\n", user, salt64, hash64) < 0;
+}
+
+
+static int gen_files(const char *pwfile, const char *pskfile, const char *aclfile, int users)
+{
+	FILE *pw, *psk, *acl;
+	int i;
+	int rc = 0;
+
+	pw = fopen(pwfile, "wt");
+	psk = fopen(pskfile, "wt");
+	acl = fopen(aclfile, "wt");
+	if(!pw || !psk || !acl){
+		rc = 1;
+	}
+	for(i=0; i<users && rc == 0; i++){
+		if(write_password(pw, i)
+				|| fprintf(psk, "user%d:%08x%08x\n", i, i, ~i) < 0
+				|| fprintf(acl, "user user%d\ntopic readwrite user%d/#\n\n", i, i) < 0){
+
+			rc = 1;
+		}
+	}
+	if(pw) fclose(pw);
+	if(psk) fclose(psk);
+	if(acl) fclose(acl);
+	return rc;
+}
+
+
+static int bench_run(const char *pwfile, const char *pskfile, const char *aclfile, int users)
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	struct mosquitto__listener listener;
+	struct mosquitto__security_options *opts;
+	struct mosquitto context;
+	char username[64], password[64];
+	char key[100];
+	double start, load_ms, connect_ms, psk_ms;
+	int failures = 0;
+	int i, user;
+
+	memset(&db, 0, sizeof(db));
+	memset(&config, 0, sizeof(config));
+	memset(&listener, 0, sizeof(listener));
+	memset(&context, 0, sizeof(context));
+	db.config = &config;
+
+	if(per_listener){
+		config.per_listener_settings = true;
+		config.listeners = &listener;
+		config.listener_count = 1;
+		context.listener = &listener;
+		opts = &listener.security_options;
+	}else{
+		opts = &config.security_options;
+	}
+	opts->password_file = (char *)pwfile;
+	opts->psk_file = (char *)pskfile;
+	opts->acl_file = (char *)aclfile;
+
+	start = now_ms();
+	if(mosquitto_security_init_default(&db, false)) return 1;
+	load_ms = now_ms() - start;
+
+	context.id = "client";
+	context.username = username;
+	user_seed = 1;
+	start = now_ms();
+	for(i=0; i<connects; i++){
+		user = next_user(users);
+		snprintf(username, sizeof(username), "user%d", user);
+		snprintf(password, sizeof(password), "password%d", user);
+		if(mosquitto_unpwd_check_default(&db, &context, username, password) != MOSQ_ERR_SUCCESS
+				|| acl__find_acls(&db, &context) != MOSQ_ERR_SUCCESS
+				|| !context.acl_list){
+
+			failures++;
+		}
+	}
+	connect_ms = now_ms() - start;
+
+	user_seed = 1;
+	start = now_ms();
+	for(i=0; i<connects; i++){
+		snprintf(username, sizeof(username), "user%d", next_user(users));
+		if(mosquitto_psk_key_get_default(&db, &context, "hint", username, key, sizeof(key)) != MOSQ_ERR_SUCCESS){
+			failures++;
+		}
+	}
+	psk_ms = now_ms() - start;
+
+	context.username = NULL;
+	context.acl_list = NULL;
+	acl__context_cleanup(&context);
+	mosquitto_security_cleanup_default(&db, false);
+
+	if(failures){
+		fprintf(stderr, "Error: %d lookups failed with %d users.\n", failures, users);
+		return 1;
+	}
+
+	if(csv){
+		printf("%d,%d,%d,%.3f,%.3f,%.3f,%.0f,%.0f\n",
+				users, connects, per_listener, load_ms, connect_ms, psk_ms,
+				connects/(connect_ms/1000.0), connects/(psk_ms/1000.0));
+	}else{
+		printf("%d users: load %.3f ms, %d connects %.3f ms (%.0f/s), "
+				"%d psk lookups %.3f ms (%.0f/s)\n",
+				users, load_ms, connects, connect_ms, connects/(connect_ms/1000.0),
+				connects, psk_ms, connects/(psk_ms/1000.0));
+	}
+	fflush(stdout);
+	return 0;
+}
+
+
+static void print_usage(void)
+{
+	printf("Usage: auth_bench [options]\n");
+	printf(" -u <count>    users in the generated files. May be repeated, the\n");
+	printf("               default is 1000, 10000 and 100000.\n");
+	printf(" -c <count>    connects to time for each user count (default %d)\n", connects);
+	printf(" -d <dir>      directory for the generated files (default .)\n");
+	printf(" -l            load the files into a listener with per_listener_settings\n");
+	printf(" --csv         print one comma separated line per run\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int user_counts[16];
+	int user_count_count = 0;
+	const char *dir = ".";
+	char pwfile[4096], pskfile[4096], aclfile[4096];
+	int i;
+	int rc = 0;
+
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "-l")){
+			per_listener = true;
+		}else if(!strcmp(argv[i], "--csv")){
+			csv = true;
+		}else if(i+1 < argc && argv[i][0] == '-' && strlen(argv[i]) == 2){
+			switch(argv[i][1]){
+				case 'u':
+					if(user_count_count == 16){
+						print_usage();
+						return 1;
+					}
+					user_counts[user_count_count++] = atoi(argv[i+1]);
+					break;
+				case 'c': connects = atoi(argv[i+1]); break;
+				case 'd': dir = argv[i+1]; break;
+				default:
+					print_usage();
+					return 1;
+			}
+			i++;
+		}else{
+			print_usage();
+			return 1;
+		}
+	}
+	if(connects < 1){
+		print_usage();
+		return 1;
+	}
+	if(user_count_count == 0){
+		user_counts[user_count_count++] = 1000;
+		user_counts[user_count_count++] = 10000;
+		user_counts[user_count_count++] = 100000;
+	}
+	for(i=0; i<user_count_count; i++){
+		if(user_counts[i] < 1){
+			print_usage();
+			return 1;
+		}
+	}
+
+	snprintf(pwfile, sizeof(pwfile), "%s/auth_bench.pw", dir);
+	snprintf(pskfile, sizeof(pskfile), "%s/auth_bench.psk", dir);
+	snprintf(aclfile, sizeof(aclfile), "%s/auth_bench.acl", dir);
+
+	if(csv){
+		printf("users,connects,per_listener,load_ms,connect_ms,psk_ms,connects_per_s,psk_per_s\n");
+	}
+	for(i=0; i<user_count_count && rc == 0; i++){
+		if(gen_files(pwfile, pskfile, aclfile, user_counts[i])){
+			fprintf(stderr, "Error: Unable to write files in %s: %s.\n", dir, strerror(errno));
+			rc = 1;
+			break;
+		}
+		rc = bench_run(pwfile, pskfile, aclfile, user_counts[i]);
+	}
+	unlink(pwfile);
+	unlink(pskfile);
+	unlink(aclfile);
+
+	return rc;
+}
@@ -0,0 +1,75 @@
+#include <time.h>
+
+#define WITH_BROKER
+
+#include <logging_mosq.h>
+#include <memory_mosq.h>
+#include <mosquitto_broker_internal.h>
+#include <net_mosq.h>
+#include <send_mosq.h>
+#include <time_mosq.h>
+
+int log__printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
+{
+	return 0;
+}
+
+time_t mosquitto_time(void)
+{
+	return 123;
+}
+
+int net__socket_close(struct mosquitto_db *db, struct mosquitto *mosq)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int send__pingreq(struct mosquitto *mosq)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int send__disconnect(struct mosquitto *mosq, uint8_t reason_code, const mosquitto_property *properties)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+void do_disconnect(struct mosquitto_db *db, struct mosquitto *context, int reason)
+{
+}
+
+int mosquitto_unpwd_check(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password)
+{
+	return mosquitto_unpwd_check_default(db, context, username, password);
+}
+
+int auth_pool__thread_count(struct mosquitto_db *db)
+{
+	return 0;
+}
+
+struct mosquitto__auth_job *auth_pool__job_new(struct mosquitto_db *db, struct mosquitto *context)
+{
+	return NULL;
+}
+
+int auth_pool__queue(struct mosquitto_db *db, struct mosquitto__auth_job *job)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void auth_pool__job_free(struct mosquitto__auth_job *job)
+{
+}
+
+#ifdef WITH_TLS
+int net__tls_server_ctx(struct mosquitto__listener *listener)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int net__tls_load_verify(struct mosquitto__listener *listener)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
@@ -0,0 +1,504 @@
+/* Benchmark for persistence.
+ *
+ * Generates a synthetic persistence file of a given shape, restores it with
+ * db__open(), which calls persist__restore(), then saves it again with
+ * persist__backup(). Reports the time taken, the bytes written and the heap
+ * used. Each measurement runs in its own process so they don't affect one
+ * another.
+ *
+ * Run with no arguments for the defaults, or see print_usage(). With --csv
+ * the output can be kept and compared between builds. */
+
+#define WITH_BROKER
+#define WITH_PERSISTENCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "persist.h"
+
+uint64_t last_retained;
+char *last_sub = NULL;
+int last_qos;
+
+struct bench_shape{
+	int clients;
+	int subs;
+	int queued;
+	int retained;
+	uint32_t payload_min;
+	uint32_t payload_max;
+};
+
+struct bench_result{
+	double restore_ms;
+	double backup_ms;
+	long file_bytes;
+	long written_bytes;
+	unsigned long heap_restored;
+	unsigned long heap_peak;
+};
+
+static struct bench_shape shape = {
+	.clients = 1000,
+	.subs = 5,
+	.queued = 10,
+	.retained = 1000,
+	.payload_min = 10,
+	.payload_max = 1000,
+};
+static bool lazy_retained = false;
+static bool csv = false;
+static uint8_t *payload_buf = NULL;
+static uint32_t payload_seed = 1;
+
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+
+/* Payload sizes come from a fixed sequence, so every run and every version
+ * of the file has the same content. */
+static uint32_t payload_len(void)
+{
+	if(shape.payload_max <= shape.payload_min) return shape.payload_min;
+
+	payload_seed = payload_seed*1103515245 + 12345;
+	return shape.payload_min + (payload_seed>>8) % (shape.payload_max - shape.payload_min + 1);
+}
+
+
+static int gen_msg_store(FILE *fptr, dbid_t store_id, const char *topic, bool retain)
+{
+	struct P_msg_store chunk;
+
+	memset(&chunk, 0, sizeof(struct P_msg_store));
+	chunk.F.store_id = store_id;
+	chunk.F.payloadlen = payload_len();
+	chunk.F.source_id_len = strlen("bench-publisher");
+	chunk.F.topic_len = strlen(topic);
+	chunk.F.qos = 1;
+	chunk.F.retain = retain;
+	chunk.source.id = "bench-publisher";
+	chunk.topic = (char *)topic;
+	if(chunk.F.payloadlen > sizeof(chunk.payload.array)){
+		chunk.payload.ptr = payload_buf;
+	}else{
+		memcpy(chunk.payload.array, payload_buf, chunk.F.payloadlen);
+	}
+	return persist__chunk_message_store_write_v5(fptr, &chunk);
+}
+
+
+static int gen_msg_stores(FILE *fptr, uint32_t *count)
+{
+	char topic[100];
+	dbid_t store_id = 1;
+	int i, j;
+
+	for(i=0; i<shape.clients; i++){
+		snprintf(topic, sizeof(topic), "bench/%d/0", i);
+		for(j=0; j<shape.queued; j++){
+			if(gen_msg_store(fptr, store_id++, topic, false)) return 1;
+			(*count)++;
+		}
+	}
+	for(i=0; i<shape.retained; i++){
+		snprintf(topic, sizeof(topic), "bench/retained/%d", i);
+		if(gen_msg_store(fptr, store_id++, topic, true)) return 1;
+		(*count)++;
+	}
+	return 0;
+}
+
+
+static int gen_client(FILE *fptr, int client)
+{
+	struct P_client chunk;
+	char id[30];
+
+	snprintf(id, sizeof(id), "bench-client-%d", client);
+	memset(&chunk, 0, sizeof(struct P_client));
+	chunk.F.session_expiry_interval = UINT32_MAX;
+	chunk.F.last_mid = shape.queued;
+	chunk.F.id_len = strlen(id);
+	chunk.client_id = id;
+	return persist__chunk_client_write_v5(fptr, &chunk);
+}
+
+
+static int gen_client_msgs(FILE *fptr, int client, uint32_t *count)
+{
+	struct P_client_msg chunk;
+	char id[30];
+	int j;
+
+	snprintf(id, sizeof(id), "bench-client-%d", client);
+	for(j=0; j<shape.queued; j++){
+		memset(&chunk, 0, sizeof(struct P_client_msg));
+		chunk.F.store_id = (dbid_t)client*shape.queued + j + 1;
+		chunk.F.mid = j+1;
+		chunk.F.id_len = strlen(id);
+		chunk.F.qos = 1;
+		chunk.F.state = mosq_ms_queued;
+		chunk.F.direction = mosq_md_out;
+		chunk.client_id = id;
+		if(persist__chunk_client_msg_write_v5(fptr, &chunk)) return 1;
+		(*count)++;
+	}
+	return 0;
+}
+
+
+static int gen_subs(FILE *fptr, int client, uint32_t *count)
+{
+	struct P_sub chunk;
+	char id[30];
+	char topic[100];
+	int j;
+
+	snprintf(id, sizeof(id), "bench-client-%d", client);
+	for(j=0; j<shape.subs; j++){
+		snprintf(topic, sizeof(topic), "bench/%d/%d", client, j);
+		memset(&chunk, 0, sizeof(struct P_sub));
+		chunk.F.id_len = strlen(id);
+		chunk.F.topic_len = strlen(topic);
+		chunk.F.qos = 1;
+		chunk.client_id = id;
+		chunk.topic = topic;
+		if(persist__chunk_sub_write_v5(fptr, &chunk)) return 1;
+		(*count)++;
+	}
+	return 0;
+}
+
+
+static int gen_retains(FILE *fptr, uint32_t *count)
+{
+	struct P_retain chunk;
+	int i;
+
+	for(i=0; i<shape.retained; i++){
+		chunk.F.store_id = (dbid_t)shape.clients*shape.queued + i + 1;
+		if(persist__chunk_retain_write_v5(fptr, &chunk)) return 1;
+		(*count)++;
+	}
+	return 0;
+}
+
+
+static int gen_section_begin(FILE *fptr, struct PF_index_entry *entry, uint32_t chunk)
+{
+	long offset = ftell(fptr);
+
+	if(offset < 0) return 1;
+	entry->chunk = chunk;
+	entry->count = 0;
+	entry->offset = (uint64_t)offset;
+	return 0;
+}
+
+
+static int gen_section_end(FILE *fptr, struct PF_index_entry *entry)
+{
+	long offset = ftell(fptr);
+
+	if(offset < 0) return 1;
+	entry->length = (uint64_t)offset - entry->offset;
+	return 0;
+}
+
+
+/* Version 5 files hold each client with its messages and subscriptions,
+ * version 6 files hold each type of chunk in its own indexed section. */
+static int gen_file(const char *filename, int version)
+{
+	FILE *fptr;
+	uint32_t version_w = htonl(version);
+	uint32_t crc = 0;
+	uint32_t count = 0;
+	struct PF_cfg cfg;
+	struct PF_index_entry index[5];
+	long index_offset;
+	int i, rc = 1;
+
+	fptr = fopen(filename, "wb");
+	if(!fptr) return 1;
+
+	if(fwrite(magic, 1, 15, fptr) != 15
+			|| fwrite(&crc, 1, sizeof(uint32_t), fptr) != sizeof(uint32_t)
+			|| fwrite(&version_w, 1, sizeof(uint32_t), fptr) != sizeof(uint32_t)){
+
+		goto cleanup;
+	}
+
+	memset(&cfg, 0, sizeof(struct PF_cfg));
+	cfg.last_db_id = (dbid_t)shape.clients*shape.queued + shape.retained;
+	cfg.shutdown = true;
+	cfg.dbid_size = sizeof(dbid_t);
+	if(persist__chunk_cfg_write_v5(fptr, &cfg)) goto cleanup;
+
+	if(version == 5){
+		if(gen_msg_stores(fptr, &count)) goto cleanup;
+		for(i=0; i<shape.clients; i++){
+			if(gen_client(fptr, i)
+					|| gen_client_msgs(fptr, i, &count)
+					|| gen_subs(fptr, i, &count)){
+
+				goto cleanup;
+			}
+		}
+		if(gen_retains(fptr, &count)) goto cleanup;
+	}else{
+		if(gen_section_begin(fptr, &index[0], DB_CHUNK_MSG_STORE)
+				|| gen_msg_stores(fptr, &index[0].count)
+				|| gen_section_end(fptr, &index[0])){
+			goto cleanup;
+		}
+
+		if(gen_section_begin(fptr, &index[1], DB_CHUNK_CLIENT)) goto cleanup;
+		for(i=0; i<shape.clients; i++){
+			if(gen_client(fptr, i)) goto cleanup;
+			index[1].count++;
+		}
+		if(gen_section_end(fptr, &index[1])) goto cleanup;
+
+		if(gen_section_begin(fptr, &index[2], DB_CHUNK_CLIENT_MSG)) goto cleanup;
+		for(i=0; i<shape.clients; i++){
+			if(gen_client_msgs(fptr, i, &index[2].count)) goto cleanup;
+		}
+		if(gen_section_end(fptr, &index[2])) goto cleanup;
+
+		if(gen_section_begin(fptr, &index[3], DB_CHUNK_RETAIN)
+				|| gen_retains(fptr, &index[3].count)
+				|| gen_section_end(fptr, &index[3])){
+			goto cleanup;
+		}
+
+		if(gen_section_begin(fptr, &index[4], DB_CHUNK_SUB)) goto cleanup;
+		for(i=0; i<shape.clients; i++){
+			if(gen_subs(fptr, i, &index[4].count)) goto cleanup;
+		}
+		if(gen_section_end(fptr, &index[4])) goto cleanup;
+
+		index_offset = ftell(fptr);
+		if(index_offset < 0
+				|| persist__chunk_index_write_v5(fptr, index, 5, (uint64_t)index_offset)){
+			goto cleanup;
+		}
+	}
+	rc = 0;
+cleanup:
+	if(fclose(fptr)) rc = 1;
+	return rc;
+}
+
+
+static long file_size(const char *filename)
+{
+	struct stat st;
+
+	if(stat(filename, &st)) return -1;
+	return st.st_size;
+}
+
+
+/* Runs in a child process, so the heap counters start from nothing. */
+static int bench_run(const char *infile, const char *outfile, struct bench_result *result)
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	double start;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	db.config = &config;
+	config.persistence = true;
+	config.persistence_lazy_retained = lazy_retained;
+
+	config.persistence_filepath = (char *)infile;
+	start = now_ms();
+	if(db__open(&config, &db)) return 1;
+	result->restore_ms = now_ms() - start;
+	result->heap_restored = mosquitto__memory_used();
+
+	config.persistence_filepath = (char *)outfile;
+	start = now_ms();
+	if(persist__backup(&db, true)) return 1;
+	result->backup_ms = now_ms() - start;
+	result->heap_peak = mosquitto__max_memory_used();
+
+	result->file_bytes = file_size(infile);
+	result->written_bytes = file_size(outfile);
+	return 0;
+}
+
+
+static int bench_version(int version, int run, const char *dir)
+{
+	char infile[4096], outfile[4096];
+	struct bench_result result;
+	struct rusage usage;
+	int status;
+	int fds[2];
+	pid_t pid;
+
+	snprintf(infile, sizeof(infile), "%s/persist_bench_v%d.db", dir, version);
+	snprintf(outfile, sizeof(outfile), "%s/persist_bench_out.db", dir);
+	if(run == 0 && gen_file(infile, version)){
+		fprintf(stderr, "Error: Unable to write %s: %s.\n", infile, strerror(errno));
+		return 1;
+	}
+
+	if(pipe(fds)) return 1;
+	pid = fork();
+	if(pid < 0) return 1;
+	if(pid == 0){
+		close(fds[0]);
+		memset(&result, 0, sizeof(result));
+		if(bench_run(infile, outfile, &result)) _exit(1);
+		if(write(fds[1], &result, sizeof(result)) != sizeof(result)) _exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+	memset(&result, 0, sizeof(result));
+	if(read(fds[0], &result, sizeof(result)) != sizeof(result)){
+		memset(&result, 0, sizeof(result));
+	}
+	close(fds[0]);
+	if(wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)){
+		fprintf(stderr, "Error: Version %d benchmark failed.\n", version);
+		return 1;
+	}
+	unlink(outfile);
+
+	if(csv){
+		printf("%d,%d,%d,%d,%d,%d,%u,%u,%d,%ld,%.3f,%.3f,%ld,%lu,%lu,%ld\n",
+				version, run, shape.clients, shape.subs, shape.queued, shape.retained,
+				shape.payload_min, shape.payload_max, lazy_retained,
+				result.file_bytes, result.restore_ms, result.backup_ms,
+				result.written_bytes, result.heap_restored, result.heap_peak,
+				usage.ru_maxrss);
+	}else{
+		printf("v%d run %d: file %ld bytes, restore %.3f ms, backup %.3f ms, "
+				"wrote %ld bytes, heap %lu bytes restored / %lu peak, max rss %ld kB\n",
+				version, run, result.file_bytes, result.restore_ms, result.backup_ms,
+				result.written_bytes, result.heap_restored, result.heap_peak,
+				usage.ru_maxrss);
+	}
+	fflush(stdout);
+	return 0;
+}
+
+
+static void print_usage(void)
+{
+	printf("Usage: persist_bench [options]\n");
+	printf(" -c <count>    clients (default %d)\n", shape.clients);
+	printf(" -s <count>    subscriptions per client (default %d)\n", shape.subs);
+	printf(" -q <count>    queued messages per client (default %d)\n", shape.queued);
+	printf(" -r <count>    retained messages (default %d)\n", shape.retained);
+	printf(" -p <min>      smallest payload in bytes (default %u)\n", shape.payload_min);
+	printf(" -P <max>      largest payload in bytes (default %u)\n", shape.payload_max);
+	printf(" -V <version>  file format version to generate, 5 or 6. May be repeated,\n");
+	printf("               the default is both.\n");
+	printf(" -n <count>    runs of each version (default 1)\n");
+	printf(" -d <dir>      directory for the generated files (default .)\n");
+	printf(" -l            leave large retained payloads in the mapped file\n");
+	printf(" --csv         print one comma separated line per run\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int versions[2];
+	int version_count = 0;
+	int runs = 1;
+	const char *dir = ".";
+	char infile[4096];
+	int i, v, run;
+	int rc = 0;
+
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "-l")){
+			lazy_retained = true;
+		}else if(!strcmp(argv[i], "--csv")){
+			csv = true;
+		}else if(i+1 < argc && argv[i][0] == '-' && strlen(argv[i]) == 2){
+			switch(argv[i][1]){
+				case 'c': shape.clients = atoi(argv[i+1]); break;
+				case 's': shape.subs = atoi(argv[i+1]); break;
+				case 'q': shape.queued = atoi(argv[i+1]); break;
+				case 'r': shape.retained = atoi(argv[i+1]); break;
+				case 'p': shape.payload_min = atoi(argv[i+1]); break;
+				case 'P': shape.payload_max = atoi(argv[i+1]); break;
+				case 'n': runs = atoi(argv[i+1]); break;
+				case 'd': dir = argv[i+1]; break;
+				case 'V':
+					v = atoi(argv[i+1]);
+					if((v != 5 && v != 6) || version_count == 2){
+						print_usage();
+						return 1;
+					}
+					versions[version_count++] = v;
+					break;
+				default:
+					print_usage();
+					return 1;
+			}
+			i++;
+		}else{
+			print_usage();
+			return 1;
+		}
+	}
+	if(shape.clients < 0 || shape.subs < 0 || shape.queued < 0 || shape.retained < 0
+			|| shape.queued > UINT16_MAX || runs < 1){
+
+		print_usage();
+		return 1;
+	}
+	if(shape.payload_max < shape.payload_min) shape.payload_max = shape.payload_min;
+	if(version_count == 0){
+		versions[version_count++] = 5;
+		versions[version_count++] = 6;
+	}
+
+	payload_buf = calloc(1, shape.payload_max + 1);
+	if(!payload_buf){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	if(csv){
+		printf("version,run,clients,subs,queued,retained,payload_min,payload_max,lazy_retained,"
+				"file_bytes,restore_ms,backup_ms,written_bytes,heap_restored,heap_peak,max_rss_kb\n");
+	}
+	for(i=0; i<version_count && rc == 0; i++){
+		payload_seed = 1;
+		for(run=0; run<runs && rc == 0; run++){
+			rc = bench_version(versions[i], run, dir);
+		}
+		snprintf(infile, sizeof(infile), "%s/persist_bench_v%d.db", dir, versions[i]);
+		unlink(infile);
+	}
+
+	free(payload_buf);
+	return rc;
+}
@@ -148,3 +148,32 @@ void db__msg_store_ref_inc(struct mosquitto_msg_store *store)
 	store->ref_count++;
 }
 
+
+void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+	(*store)->ref_count--;
+	*store = NULL;
+}
+
+int db__messages_delete(struct mosquitto_db *db, struct mosquitto *context)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct mosquitto__subhier *root, uint8_t *reason)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+void context__remove_from_by_id(struct mosquitto_db *db, struct mosquitto *context)
+{
+}
+
+void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool do_free)
+{
+}
@@ -745,6 +745,71 @@ static void TEST_v5_sub(void)
 	}
 }
 
+static void TEST_v6_client_message(void)
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	struct mosquitto *context;
+	int rc;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	db.config = &config;
+
+	config.persistence = true;
+	config.persistence_filepath = "files/persist_read/v6-client-message.test-db";
+
+	rc = persist__restore(&db);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(db.last_db_id, 0x7856341200000000);
+
+	CU_ASSERT_PTR_NOT_NULL(db.contexts_by_id);
+	HASH_FIND(hh_id, db.contexts_by_id, "client-id", strlen("client-id"), context);
+	CU_ASSERT_PTR_NOT_NULL(context);
+	if(context){
+		CU_ASSERT_PTR_NOT_NULL(context->msgs_out.inflight);
+		if(context->msgs_out.inflight){
+			CU_ASSERT_PTR_NULL(context->msgs_out.inflight->next);
+			CU_ASSERT_PTR_NOT_NULL(context->msgs_out.inflight->store);
+			if(context->msgs_out.inflight->store){
+				CU_ASSERT_EQUAL(context->msgs_out.inflight->store->ref_count, 1);
+				CU_ASSERT_STRING_EQUAL(context->msgs_out.inflight->store->topic, "topic");
+				CU_ASSERT_EQUAL(context->msgs_out.inflight->store->payloadlen, 7);
+			}
+			CU_ASSERT_EQUAL(context->msgs_out.inflight->mid, 0x73);
+			CU_ASSERT_EQUAL(context->msgs_out.inflight->state, mosq_ms_wait_for_puback);
+		}
+	}
+}
+
+/* The index is only an aid, so a file with a damaged index is still read. */
+static void TEST_v6_bad_index(void)
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	struct mosquitto *context;
+	int rc;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	db.config = &config;
+
+	config.persistence = true;
+	config.persistence_filepath = "files/persist_read/v6-bad-index.test-db";
+
+	rc = persist__restore(&db);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+
+	HASH_FIND(hh_id, db.contexts_by_id, "client-id", strlen("client-id"), context);
+	CU_ASSERT_PTR_NOT_NULL(context);
+	if(context){
+		CU_ASSERT_PTR_NOT_NULL(context->msgs_out.inflight);
+		if(context->msgs_out.inflight){
+			CU_ASSERT_PTR_NOT_NULL(context->msgs_out.inflight->store);
+		}
+	}
+}
+
 /* ========================================================================
  * TEST SUITE SETUP
  * ======================================================================== */
@@ -785,6 +850,8 @@ int init_persist_read_tests(void)
 			|| !CU_add_test(test_suite, "v5 client message+props", TEST_v5_client_message_props)
 			|| !CU_add_test(test_suite, "v5 retain", TEST_v5_retain)
 			|| !CU_add_test(test_suite, "v5 sub", TEST_v5_sub)
+			|| !CU_add_test(test_suite, "v6 client message", TEST_v6_client_message)
+			|| !CU_add_test(test_suite, "v6 bad index", TEST_v6_bad_index)
 			){
 
 		printf("Error adding persist CUnit tests.\n");
@@ -129,7 +129,7 @@ static void TEST_v5_config_ok(void)
 	rc = persist__backup(&db, true);
 	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
 
-	CU_ASSERT_EQUAL(0, file_diff("files/persist_read/v5-cfg.test-db", "v5-cfg.db"));
+	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v6-cfg.test-db", "v5-cfg.db"));
 	unlink("v5-cfg.db");
 }
 
@@ -153,7 +153,7 @@ static void TEST_v5_message_store_no_ref(void)
 	rc = persist__backup(&db, true);
 	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
 
-	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v5-message-store-no-ref.test-db", "v5-message-store-no-ref.db"));
+	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v6-message-store-no-ref.test-db", "v5-message-store-no-ref.db"));
 	unlink("v5-message-store-no-ref.db");
 }
 
@@ -182,7 +182,7 @@ static void TEST_v5_message_store_props(void)
 	rc = persist__backup(&db, true);
 	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
 
-	CU_ASSERT_EQUAL(0, file_diff("files/persist_read/v5-message-store-props.test-db", "v5-message-store-props.db"));
+	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v6-message-store-props.test-db", "v5-message-store-props.db"));
 	unlink("v5-message-store-props.db");
 }
 
@@ -206,7 +206,7 @@ static void TEST_v5_client(void)
 	rc = persist__backup(&db, true);
 	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
 
-	CU_ASSERT_EQUAL(0, file_diff("files/persist_read/v5-client.test-db", "v5-client.db"));
+	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v6-client.test-db", "v5-client.db"));
 	unlink("v5-client.db");
 }
 
@@ -235,11 +235,61 @@ static void TEST_v5_client_message(void)
 	rc = persist__backup(&db, true);
 	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
 
-	CU_ASSERT_EQUAL(0, file_diff("files/persist_read/v5-client-message.test-db", "v5-client-message.db"));
+	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v6-client-message.test-db", "v5-client-message.db"));
 	unlink("v5-client-message.db");
 }
 
 
+/* A session whose messages haven't changed is copied from the last snapshot,
+ * so an in-memory change that isn't marked only shows once it is. */
+static void TEST_v5_client_message_unchanged(void)
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	struct mosquitto__listener listener;
+	struct mosquitto *context, *ctxt_tmp;
+	struct mosquitto_client_msg *cmsg;
+	int rc;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	memset(&listener, 0, sizeof(struct mosquitto__listener));
+	db.config = &config;
+	listener.port = 1883;
+	config.listeners = &listener;
+	config.listener_count = 1;
+
+	config.persistence = true;
+	config.persistence_filepath = "files/persist_read/v5-client-message.test-db";
+	rc = persist__restore(&db);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+
+	config.persistence_filepath = "v5-client-message-unchanged.db";
+	rc = persist__backup(&db, true);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v6-client-message.test-db", "v5-client-message-unchanged.db"));
+
+	HASH_ITER(hh_id, db.contexts_by_id, context, ctxt_tmp){
+		cmsg = context->msgs_out.inflight ? context->msgs_out.inflight : context->msgs_out.queued;
+		CU_ASSERT_PTR_NOT_NULL(cmsg);
+		if(cmsg){
+			cmsg->mid++;
+		}
+	}
+	rc = persist__backup(&db, true);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v6-client-message.test-db", "v5-client-message-unchanged.db"));
+
+	HASH_ITER(hh_id, db.contexts_by_id, context, ctxt_tmp){
+		context->persist_msgs_generation = 0;
+	}
+	rc = persist__backup(&db, true);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_NOT_EQUAL(0, file_diff("files/persist_write/v6-client-message.test-db", "v5-client-message-unchanged.db"));
+	unlink("v5-client-message-unchanged.db");
+}
+
+
 static void TEST_v5_client_message_props(void)
 {
 	struct mosquitto_db db;
@@ -272,7 +322,7 @@ static void TEST_v5_client_message_props(void)
 	rc = persist__backup(&db, true);
 	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
 
-	CU_ASSERT_EQUAL(0, file_diff("files/persist_read/v5-client-message-props.test-db", "v5-client-message-props.db"));
+	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v6-client-message-props.test-db", "v5-client-message-props.db"));
 	unlink("v5-client-message-props.db");
 }
 
@@ -303,7 +353,7 @@ static void TEST_v5_sub(void)
 	rc = persist__backup(&db, true);
 	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
 
-	CU_ASSERT_EQUAL(0, file_diff("files/persist_read/v5-sub.test-db", "v5-sub.db"));
+	CU_ASSERT_EQUAL(0, file_diff("files/persist_write/v6-sub.test-db", "v5-sub.db"));
 	unlink("v5-sub.db");
 }
 
@@ -367,6 +417,7 @@ int main(int argc, char *argv[])
 			|| !CU_add_test(test_suite, "v5 message store + props", TEST_v5_message_store_props)
 			|| !CU_add_test(test_suite, "v5 client", TEST_v5_client)
 			|| !CU_add_test(test_suite, "v5 client message", TEST_v5_client_message)
+			|| !CU_add_test(test_suite, "v5 client message unchanged", TEST_v5_client_message_unchanged)
 			|| !CU_add_test(test_suite, "v5 client message+props", TEST_v5_client_message_props)
 			|| !CU_add_test(test_suite, "v5 sub", TEST_v5_sub)
 			//|| !CU_add_test(test_suite, "v5 full", TEST_v5_full)